@@ -144,7 +144,7 @@ int main(int argc, char **argv)
 
     /* Open the cvm-etree */
 
-    cvm = etree_open(cvmetree, O_RDONLY, CVMBUFFERSIZE, 0, 0);
+    cvm = etree_open(cvmetree, O_RDONLY | O_MMAP, CVMBUFFERSIZE, 0, 0);
     if ( !cvm ) {
         fprintf(stderr, "Cannot open CVM etree %s\n", cvmetree);
         exit(1);
@@ -0,0 +1,51 @@
+/**
+ * compressetree.c: Write a compressed copy of an etree (e.g., a CVM 
+ *                  database); the copy is read-only and is opened by 
+ *                  etree_open like any other etree.
+ *
+ * Copyright (c) 2005 Tiankai Tu
+ * All rights reserved.  May not be used, modified, or copied 
+ * without permission.
+ *
+ * Contact:
+ * Tiankai Tu
+ * Computer Science Department
+ * Carnegie Mellon University
+ * 5000 Forbes Avenue
+ * Pittsburgh, PA 15213
+ * tutk@cs.cmu.edu
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "etree.h"
+
+int main(int argc, char **argv)
+{
+    char *srcetree, *destetree;
+    struct stat srcstat, deststat;
+
+    if (argc != 3) {
+        printf("\nusage: compressetree etree compressedetree\n");
+        printf("etree: pathname to the etree to compress\n");
+        printf("compressedetree: pathname to the compressed copy\n\n");
+        exit(1);
+    }
+
+    srcetree = argv[1];
+    destetree = argv[2];
+
+    if (etree_compress(srcetree, destetree) != 0) {
+        fprintf(stderr, "Cannot compress %s into %s\n", srcetree, destetree);
+        exit(1);
+    }
+
+    if ((stat(srcetree, &srcstat) == 0) && (stat(destetree, &deststat) == 0))
+        printf("Compressed %lld bytes into %lld bytes (%.2f:1)\n", 
+               (long long)srcstat.st_size, (long long)deststat.st_size,
+               (double)srcstat.st_size / deststat.st_size);
+
+    return 0;
+}
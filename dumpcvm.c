@@ -27,6 +27,9 @@
 
 #define KEYSIZE 13
 
+/* buffer size (MB) of a -d scan */
+#define DIRECTBUFSIZE 64
+
 int main(int argc, char **argv)
 {
     char *cvmetree, *outputfile, *outformat;
@@ -39,9 +42,28 @@ int main(int argc, char **argv)
     endian_t myformat, targetformat;
     float outVp, outVs, outrho;
     int outi, outj, outk;
+    int printstat = 0;
+    int openflags = O_RDONLY | O_MMAP, bufsize = 0;
+
+    while (argc > 1) {
+        if (strcmp(argv[1], "-s") == 0) {
+            /* print the buffer statistics (JSON) to stderr on exit */
+            printstat = 1;
+        } else if (strcmp(argv[1], "-d") == 0) {
+            /* read around the page cache through a buffer of our own */
+            openflags = O_RDONLY | O_DIRECTIO;
+            bufsize = DIRECTBUFSIZE;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
 
     if (argc != 4) {
-        printf("\nusage: dumpcvm cvmetree output format\n");
+        printf("\nusage: dumpcvm [-s] [-d] cvmetree output format\n");
+        printf("-s: print buffer and I/O statistics (JSON) to stderr\n");
+        printf("-d: bypass the kernel page cache (O_DIRECT) instead of mmap\n");
         printf("cvmetree: pathname to the CVM etree\n");
         printf("output: pathname to the flat output file\n");
         printf("format: little or big\n");
@@ -49,7 +71,7 @@ int main(int argc, char **argv)
     }
 
     cvmetree = argv[1];
-    cvmEp = etree_open(cvmetree, O_RDONLY, 0, 0, 0);
+    cvmEp = etree_open(cvmetree, openflags, bufsize, 0, 0);
     if (!cvmEp) {
         fprintf(stderr, "Cannot open CVM material database %s\n", cvmetree);
         exit(1);
@@ -134,6 +156,8 @@ int main(int argc, char **argv)
         perror("fclose");
         exit(1);
     }
+    if (printstat) 
+        etree_printbufstat(cvmEp, stderr);
     etree_close(cvmEp);
 
 
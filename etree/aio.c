@@ -0,0 +1,622 @@
+/*
+ * aio.c - asynchronous page reads: io_uring, or a pool of reader threads
+ *
+ * Copyright (c) 2003 Tiankai Tu
+ * All rights reserved.  May not be used, modified, or copied
+ * without permission.
+ *
+ * Tiankai Tu
+ * Computer Science Department
+ * Carnegie Mellon University
+ * 5000 Forbes Avenue
+ * Pittsburgh, PA 15213
+ * tutk@cs.cmu.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#ifdef ALPHA
+#include "etree_inttypes.h"
+#else
+#include <inttypes.h>
+#endif
+
+#include "aio.h"
+
+/*
+ * USE_URING - build the io_uring engine; it needs a kernel header that
+ * knows IORING_OP_READ (Linux 5.6, the release that also introduced
+ * IORING_FEAT_RW_CUR_POS); define NOURING to leave it out
+ *
+ */
+#if defined(__linux__) && !defined(NOURING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define USE_URING
+#endif
+#endif
+
+/*
+ * AIO_THREADS - number of reader threads of the fallback engine
+ *
+ */
+#define AIO_THREADS 8
+
+
+/*
+ * aioreq_t - a read request (or, once done, its completion)
+ *
+ */
+typedef struct aioreq_t {
+    void *dest;
+    size_t size;
+    off_t offset;
+    void *tag;
+    ssize_t res;
+} aioreq_t;
+
+
+/*
+ * aioring_t - fixed size FIFO of requests
+ *
+ */
+typedef struct aioring_t {
+    aioreq_t *reqs;
+    unsigned size, head, count;
+} aioring_t;
+
+
+#ifdef USE_URING
+/*
+ * uring_t - the rings shared with the kernel
+ *
+ */
+typedef struct uring_t {
+    int ringfd;
+
+    void *sqmap, *cqmap;
+    size_t sqmapsize, cqmapsize;
+    struct io_uring_sqe *sqes;
+    size_t sqesmapsize;
+
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+
+    unsigned tosubmit;
+} uring_t;
+#endif
+
+
+/*
+ * aio_t - runtime handle
+ *
+ * - depth bounds the number of reads in flight (submitted or queued, and
+ *   not yet reaped by aio_wait)
+ * - the thread engine hands requests to the readers through the pending
+ *   ring and gets them back through the done ring
+ *
+ */
+struct aio_t {
+    int fd;
+    unsigned depth;
+    unsigned inflight;
+
+#ifdef USE_URING
+    uring_t *uring;
+#endif
+
+    pthread_t *threads;
+    int threadcount;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t pendingcond, donecond;
+    aioring_t pending, done;
+};
+
+
+#ifdef USE_URING
+static uring_t *uring_init(unsigned depth);
+static void uring_destroy(uring_t *uring);
+static int uring_submit(uring_t *uring, int fd, aioreq_t *req);
+static int uring_flush(uring_t *uring);
+static int uring_wait(uring_t *uring, void **tagptr, ssize_t *resptr);
+#endif
+
+static void *reader(void *arg);
+static int ring_init(aioring_t *ring, unsigned size);
+static void ring_put(aioring_t *ring, const aioreq_t *req);
+static void ring_get(aioring_t *ring, aioreq_t *req);
+
+
+/*
+ * aio_init - create an asynchronous reader of file fd with at most depth
+ *            reads in flight
+ *
+ * - try io_uring first, fall back to reader threads
+ * - return a pointer to the handle if OK, NULL on error
+ *
+ */
+aio_t *aio_init(int fd, unsigned depth)
+{
+    aio_t *aio;
+    int i;
+
+    if ((aio = (aio_t *)malloc(sizeof(aio_t))) == NULL)
+        return NULL;
+
+    aio->fd = fd;
+    aio->depth = (depth > 0) ? depth : 1;
+    aio->inflight = 0;
+    aio->threads = NULL;
+    aio->threadcount = 0;
+
+#ifdef USE_URING
+    if ((aio->uring = uring_init(aio->depth)) != NULL)
+        return aio;
+#endif
+
+    /* thread engine */
+    aio->stop = 0;
+    aio->pending.reqs = aio->done.reqs = NULL;
+    if ((ring_init(&aio->pending, aio->depth) != 0) ||
+        (ring_init(&aio->done, aio->depth) != 0) ||
+        ((aio->threads = (pthread_t *)
+          malloc(AIO_THREADS * sizeof(pthread_t))) == NULL)) {
+        free(aio->pending.reqs);
+        free(aio->done.reqs);
+        free(aio);
+        return NULL;
+    }
+
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->pendingcond, NULL);
+    pthread_cond_init(&aio->donecond, NULL);
+
+    for (i = 0; i < AIO_THREADS; i++) {
+        if (pthread_create(&aio->threads[i], NULL, reader, aio) != 0)
+            break;
+        aio->threadcount++;
+    }
+    if (aio->threadcount == 0) {
+        aio_destroy(aio);
+        return NULL;
+    }
+
+    return aio;
+}
+
+
+/*
+ * aio_destroy - wait for the reads in flight and release the handle
+ *
+ */
+void aio_destroy(aio_t *aio)
+{
+    int i;
+
+    while (aio->inflight > 0)
+        if (aio_wait(aio, NULL, NULL) != 0)
+            break;
+
+#ifdef USE_URING
+    if (aio->uring != NULL) {
+        uring_destroy(aio->uring);
+        free(aio);
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = 1;
+    pthread_cond_broadcast(&aio->pendingcond);
+    pthread_mutex_unlock(&aio->lock);
+
+    for (i = 0; i < aio->threadcount; i++)
+        pthread_join(aio->threads[i], NULL);
+
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->pendingcond);
+    pthread_cond_destroy(&aio->donecond);
+
+    free(aio->threads);
+    free(aio->pending.reqs);
+    free(aio->done.reqs);
+    free(aio);
+    return;
+}
+
+
+/*
+ * aio_submit - queue a read of size bytes at offset into dest
+ *
+ * - tag is handed back by aio_wait when the read completes
+ * - the read may not be issued before aio_flush (or a later aio_wait)
+ * - return 0 if OK, -1 if depth reads are already in flight
+ *
+ */
+int aio_submit(aio_t *aio, void *dest, size_t size, off_t offset, void *tag)
+{
+    aioreq_t req;
+
+    if (aio->inflight >= aio->depth)
+        return -1;
+
+    req.dest = dest;
+    req.size = size;
+    req.offset = offset;
+    req.tag = tag;
+    req.res = 0;
+
+#ifdef USE_URING
+    if (aio->uring != NULL) {
+        if (uring_submit(aio->uring, aio->fd, &req) != 0)
+            return -1;
+        aio->inflight++;
+        return 0;
+    }
+#endif
+
+    pthread_mutex_lock(&aio->lock);
+    ring_put(&aio->pending, &req);
+    pthread_cond_signal(&aio->pendingcond);
+    pthread_mutex_unlock(&aio->lock);
+
+    aio->inflight++;
+    return 0;
+}
+
+
+/*
+ * aio_flush - issue the reads queued by aio_submit
+ *
+ * - return 0 if OK, -1 on error
+ *
+ */
+int aio_flush(aio_t *aio)
+{
+#ifdef USE_URING
+    if (aio->uring != NULL)
+        return uring_flush(aio->uring);
+#endif
+    /* the reader threads pick up requests as they are queued */
+    return 0;
+}
+
+
+/*
+ * aio_wait - wait for the completion of one of the reads in flight
+ *
+ * - store the tag of the read and its result (bytes read, or -errno)
+ * - return 0 if OK, -1 if no read is in flight or on error
+ *
+ */
+int aio_wait(aio_t *aio, void **tagptr, ssize_t *resptr)
+{
+    aioreq_t req;
+
+    if (aio->inflight == 0)
+        return -1;
+
+#ifdef USE_URING
+    if (aio->uring != NULL) {
+        void *tag;
+        ssize_t res;
+
+        if (uring_flush(aio->uring) != 0)
+            return -1;
+        if (uring_wait(aio->uring, &tag, &res) != 0)
+            return -1;
+        req.tag = tag;
+        req.res = res;
+    } else
+#endif
+    {
+        pthread_mutex_lock(&aio->lock);
+        while (aio->done.count == 0)
+            pthread_cond_wait(&aio->donecond, &aio->lock);
+        ring_get(&aio->done, &req);
+        pthread_mutex_unlock(&aio->lock);
+    }
+
+    aio->inflight--;
+    if (tagptr != NULL) *tagptr = req.tag;
+    if (resptr != NULL) *resptr = req.res;
+    return 0;
+}
+
+
+/*
+ * aio_inflight, aio_depth, aio_engine - query the handle
+ *
+ */
+unsigned aio_inflight(aio_t *aio)
+{
+    return aio->inflight;
+}
+
+unsigned aio_depth(aio_t *aio)
+{
+    return aio->depth;
+}
+
+const char *aio_engine(aio_t *aio)
+{
+#ifdef USE_URING
+    if (aio->uring != NULL)
+        return "io_uring";
+#endif
+    return "threads";
+}
+
+
+/*
+ * reader - body of a reader thread of the fallback engine
+ *
+ */
+void *reader(void *arg)
+{
+    aio_t *aio = (aio_t *)arg;
+    aioreq_t req;
+
+    pthread_mutex_lock(&aio->lock);
+    while (1) {
+        while ((aio->pending.count == 0) && (!aio->stop))
+            pthread_cond_wait(&aio->pendingcond, &aio->lock);
+        if (aio->pending.count == 0)
+            break;
+
+        ring_get(&aio->pending, &req);
+        pthread_mutex_unlock(&aio->lock);
+
+        req.res = pread(aio->fd, req.dest, req.size, req.offset);
+        if (req.res < 0)
+            req.res = -errno;
+
+        pthread_mutex_lock(&aio->lock);
+        ring_put(&aio->done, &req);
+        pthread_cond_signal(&aio->donecond);
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    return NULL;
+}
+
+
+/*
+ * ring_init, ring_put, ring_get - FIFO of requests; the ring is sized to
+ *                                 the depth, so it never overflows
+ *
+ */
+int ring_init(aioring_t *ring, unsigned size)
+{
+    ring->size = size;
+    ring->head = ring->count = 0;
+    ring->reqs = (aioreq_t *)malloc(size * sizeof(aioreq_t));
+    return (ring->reqs == NULL) ? -1 : 0;
+}
+
+void ring_put(aioring_t *ring, const aioreq_t *req)
+{
+    ring->reqs[(ring->head + ring->count) % ring->size] = *req;
+    ring->count++;
+}
+
+void ring_get(aioring_t *ring, aioreq_t *req)
+{
+    *req = ring->reqs[ring->head];
+    ring->head = (ring->head + 1) % ring->size;
+    ring->count--;
+}
+
+
+#ifdef USE_URING
+
+/*
+ * io_uring without liburing: the submission and completion rings are
+ * mapped from the ring file descriptor and driven with io_uring_enter
+ *
+ */
+#define LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/*
+ * uring_init - set up a ring of (at least) depth entries
+ *
+ * - return a pointer to the ring if OK, NULL if io_uring is unavailable
+ *
+ */
+uring_t *uring_init(unsigned depth)
+{
+    struct io_uring_params params;
+    uring_t *uring;
+
+    if ((uring = (uring_t *)malloc(sizeof(uring_t))) == NULL)
+        return NULL;
+
+    memset(&params, 0, sizeof(params));
+    uring->ringfd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (uring->ringfd < 0) {
+        free(uring);
+        return NULL;
+    }
+
+    uring->sqmapsize = params.sq_off.array + 
+        params.sq_entries * sizeof(unsigned);
+    uring->cqmapsize = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cqmapsize > uring->sqmapsize)
+            uring->sqmapsize = uring->cqmapsize;
+        uring->cqmapsize = uring->sqmapsize;
+    }
+
+    uring->sqmap = mmap(NULL, uring->sqmapsize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->ringfd,
+                        IORING_OFF_SQ_RING);
+    if (uring->sqmap == MAP_FAILED) {
+        close(uring->ringfd);
+        free(uring);
+        return NULL;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        uring->cqmap = uring->sqmap;
+    else {
+        uring->cqmap = mmap(NULL, uring->cqmapsize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, uring->ringfd,
+                            IORING_OFF_CQ_RING);
+        if (uring->cqmap == MAP_FAILED) {
+            munmap(uring->sqmap, uring->sqmapsize);
+            close(uring->ringfd);
+            free(uring);
+            return NULL;
+        }
+    }
+
+    uring->sqesmapsize = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = (struct io_uring_sqe *)
+        mmap(NULL, uring->sqesmapsize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, uring->ringfd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        if (uring->cqmap != uring->sqmap)
+            munmap(uring->cqmap, uring->cqmapsize);
+        munmap(uring->sqmap, uring->sqmapsize);
+        close(uring->ringfd);
+        free(uring);
+        return NULL;
+    }
+
+    uring->sqhead = (unsigned *)((char *)uring->sqmap + params.sq_off.head);
+    uring->sqtail = (unsigned *)((char *)uring->sqmap + params.sq_off.tail);
+    uring->sqmask = (unsigned *)((char *)uring->sqmap +
+                                 params.sq_off.ring_mask);
+    uring->sqarray = (unsigned *)((char *)uring->sqmap + params.sq_off.array);
+    uring->cqhead = (unsigned *)((char *)uring->cqmap + params.cq_off.head);
+    uring->cqtail = (unsigned *)((char *)uring->cqmap + params.cq_off.tail);
+    uring->cqmask = (unsigned *)((char *)uring->cqmap +
+                                 params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)
+        ((char *)uring->cqmap + params.cq_off.cqes);
+
+    uring->tosubmit = 0;
+    return uring;
+}
+
+
+/*
+ * uring_destroy - unmap the rings and close the ring file descriptor
+ *
+ */
+void uring_destroy(uring_t *uring)
+{
+    munmap(uring->sqes, uring->sqesmapsize);
+    if (uring->cqmap != uring->sqmap)
+        munmap(uring->cqmap, uring->cqmapsize);
+    munmap(uring->sqmap, uring->sqmapsize);
+    close(uring->ringfd);
+    free(uring);
+    return;
+}
+
+
+/*
+ * uring_submit - fill a submission queue entry with a read request
+ *
+ * - the caller bounds the reads in flight by the ring size, so a full
+ *   submission queue only needs to be flushed
+ * - return 0 if OK, -1 on error
+ *
+ */
+int uring_submit(uring_t *uring, int fd, aioreq_t *req)
+{
+    unsigned tail, index;
+    struct io_uring_sqe *sqe;
+
+    tail = *uring->sqtail;
+    if (tail - LOAD_ACQUIRE(uring->sqhead) > *uring->sqmask) {
+        if (uring_flush(uring) != 0)
+            return -1;
+    }
+
+    index = tail & *uring->sqmask;
+    sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)req->dest;
+    sqe->len = (uint32_t)req->size;
+    sqe->off = (uint64_t)req->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)req->tag;
+
+    uring->sqarray[index] = index;
+    STORE_RELEASE(uring->sqtail, tail + 1);
+    uring->tosubmit++;
+
+    return 0;
+}
+
+
+/*
+ * uring_flush - hand the queued submission entries to the kernel
+ *
+ * - a kernel that takes none of the entries would keep the loop going 
+ *   for ever; that is an error
+ * - return 0 if OK, -1 on error
+ *
+ */
+int uring_flush(uring_t *uring)
+{
+    while (uring->tosubmit > 0) {
+        int res = (int)syscall(__NR_io_uring_enter, uring->ringfd,
+                               uring->tosubmit, 0, 0, NULL, 0);
+        if (res < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if (res == 0) 
+            return -1;
+        uring->tosubmit -= res;
+    }
+    return 0;
+}
+
+
+/*
+ * uring_wait - reap one completion, blocking until there is one
+ *
+ * - return 0 if OK, -1 on error
+ *
+ */
+int uring_wait(uring_t *uring, void **tagptr, ssize_t *resptr)
+{
+    unsigned head;
+    struct io_uring_cqe *cqe;
+
+    head = *uring->cqhead;
+    while (head == LOAD_ACQUIRE(uring->cqtail)) {
+        int res = (int)syscall(__NR_io_uring_enter, uring->ringfd, 0, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if ((res < 0) && (errno != EINTR))
+            return -1;
+    }
+
+    cqe = &uring->cqes[head & *uring->cqmask];
+    *tagptr = (void *)(uintptr_t)cqe->user_data;
+    *resptr = cqe->res;
+    STORE_RELEASE(uring->cqhead, head + 1);
+
+    return 0;
+}
+
+#endif /* USE_URING */
@@ -0,0 +1,43 @@
+/*
+ * aio.h - asynchronous page reads for the buffer manager
+ *
+ * Copyright (c) 2003 Tiankai Tu
+ * All rights reserved.  May not be used, modified, or copied
+ * without permission.
+ *
+ * Tiankai Tu
+ * Computer Science Department
+ * Carnegie Mellon University
+ * 5000 Forbes Avenue
+ * Pittsburgh, PA 15213
+ * tutk@cs.cmu.edu
+ *
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/types.h>
+
+/*
+ * aio_t - runtime handle of an asynchronous reader on one file
+ *
+ * - reads are submitted through io_uring where the kernel supports it,
+ *   otherwise they are carried out by a small pool of threads
+ * - a handle is used by one thread at a time
+ *
+ */
+typedef struct aio_t aio_t;
+
+aio_t *aio_init(int fd, unsigned depth);
+void aio_destroy(aio_t *aio);
+
+int aio_submit(aio_t *aio, void *dest, size_t size, off_t offset, void *tag);
+int aio_flush(aio_t *aio);
+int aio_wait(aio_t *aio, void **tagptr, ssize_t *resptr);
+
+unsigned aio_inflight(aio_t *aio);
+unsigned aio_depth(aio_t *aio);
+const char *aio_engine(aio_t *aio);
+
+#endif /* AIO_H */
@@ -23,6 +23,8 @@
 #include <fcntl.h>
 #include <math.h>
 #include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "btree.h"
 #include "buffer.h"
@@ -30,6 +32,13 @@
 #include "schema.h"
 
 
+/*
+ * MAXDEPTH - bound on the depth of a btree, for the paths recorded by a
+ *            range delete and the pages latched by a writer
+ *
+ */
+#define MAXDEPTH 64
+
 /*
  * mybtree_t - internal control structure of a btree
  *
@@ -51,12 +60,15 @@ typedef struct mybtree_t {     /* internal control block for the btree      */
     uint32_t valuesize;        /* payload size of each record               */
 
     uint32_t asciischemasize;  /* set when open'n btree or register'n schema */
+    uint32_t format;           /* page format flags (BTREE_SEARCHINDEX, ...)*/
 
     /************************************************************************/
     /*      Control fields initialized when opening a btree                 */
     /************************************************************************/
     char *pathname;            /* the path name of the btree                */
     int flags;                 /* flags for opening the btree               */
+    int noswap;                /* count/rightsibnum/payload in host order   */
+    int noswapkey;             /* keys in host order (or not numerals)      */
     
     off_t startoffset;         /* where to write the meta data and schema   */
 
@@ -69,13 +81,31 @@ typedef struct mybtree_t {     /* internal control block for the btree      */
     int32_t fieldind;          /* field index of the last accessed field    */
 
     btree_compare_t *compare;  /* handler to application comparison function*/
+    uint32_t layout;           /* format flags that shape the pages, fixed  */
+                               /* once open (format gains BTREE_FREEPAGES) */
     int32_t leafentrysize;     /* leaf node entry size                      */
     int32_t leafcapacity;      /* maximum number of entries in a leaf node  */
     int32_t indexentrysize;    /* index node entry size                     */
     int32_t indexfanout;       /* maximum number of entries in an index node*/
+    int32_t leaffences;        /* room for fence keys on a leaf page        */
+    int32_t indexfences;       /* room for fence keys on an index page      */
+    int32_t entryoffset;       /* where the entries of a page start         */
+    int32_t pageroom;          /* bytes for the entries of a page           */
+    int32_t leafplain;         /* leaf entries that fit with no key shared  */
+    int32_t indexplain;        /* index entries that fit with no key shared */
     pagenum_t nextpage;        /* next free page number                     */
+    pagenum_t freehead;        /* first page of the free list, -1 if none   */
     
     buffer_t *buf;             /* handler to the buffer manager             */
+    int pinindex;              /* pin index pages in the buffer (O_PININDEX)*/
+
+    /************************************************************************/
+    /*      Control fields of the search finger                             */
+    /************************************************************************/
+
+    void *fingerpage;          /* leaf of the last search, path kept fixed  */
+    int64_t fingersearches;    /* searches that started from the finger     */
+    int64_t fingerhits;        /* ... and found the key on the finger leaf  */
 
     /************************************************************************/
     /*      Control fields initialized for cursor operations                */
@@ -84,6 +114,12 @@ typedef struct mybtree_t {     /* internal control block for the btree      */
     void *cursorpage;          /* pointer to the cursor page in the buffer  */
     int32_t cursoroffset;      /* entry offset in the current cursorpage    */
     void *cursorptr;           /* pointer to the current cursor             */
+    pagenum_t cursorpagenum;   /* page number of the cursor page            */
+    pagenum_t raend;           /* first page beyond the readahead issued    */
+    int32_t rawindow;          /* readahead window in pages, 0 if random    */
+    int cursorend;             /* the cursor ran off the end of its range   */
+    int cursorbounded;         /* the cursor stops before cursorstop        */
+    void *cursorstop;          /* stop key of a range cursor, as given      */
 
     /************************************************************************/
     /*      Control fields initialized for append operations                */
@@ -93,6 +129,15 @@ typedef struct mybtree_t {     /* internal control block for the btree      */
     void *appendpage;          /* pointer to the current append leaf page   */
     int32_t appendleafmax;     /* maximum number of appends on leaf page    */
     int32_t appendindexmax;    /* maximum number of appends on index page   */
+    int32_t appendroom;        /* bytes of a page filled by appends         */
+
+    /************************************************************************/
+    /*      Control fields of concurrent readers (O_CONCURRENT)             */
+    /************************************************************************/
+
+    int concurrent;            /* reader threads share the btree            */
+    int32_t xcount;            /* pages the writer has latched exclusive    */
+    void *xpages[MAXDEPTH];    /* ... kept fixed until they are released    */
     
 }mybtree_t;
 
@@ -102,49 +147,96 @@ typedef struct mybtree_t {     /* internal control block for the btree      */
  *               before the root page; the size does NOT include the
  *               size for the ASCII schema if such a schema exists.
  *
- * sizeof(endian) = 1; either "L" or "B"
+ * sizeof(endian) = 1; either "L" or "B", "l" or "b" if the format flags
+ *                   follow asciischemasize
  * sizeof(pagesize) = 4 ; 
  * sizeof(rootpagenum) = sizeof(pagecount) = 8; 
  * sizeof(keysize) = sizeof(valuesize) = 4;
  * sizeof(asciischemasize) = 4; 
+ * sizeof(format) = 4, only if format is not 0
  *
  */
-static int32_t metahdrsize = 1 + 4 + 8 + 8 + 4 + 4 + 4;
+static const int32_t metahdrsize = 1 + 4 + 8 + 8 + 4 + 4 + 4;
 
 /*
- * noswap - we need a static variable to indicate whether we need to
- *          swap the count/rightsibnum; 
+ * fencestep - with BTREE_SEARCHINDEX, the key of every fencestep'th entry
+ *             of a page is copied to a dense fence array at the end of the
+ *             page; a search picks the block of fencestep entries from 
+ *             the fences (a couple of cache lines) before it searches the
+ *             block, instead of probing entries all over the page
+ *
  */
-static int noswap = 1;  
+static const int32_t fencestep = 16;
 
-/* 
- * noswapkey - decide whether we need to swap the key for comparison/store
+/*
+ * buildrun - number of pages a bulk build packs in memory before it writes
+ *            them to the file with one pwrite
+ *
+ */
+static const int32_t buildrun = 256;
+
+
+/*
+ * buildctl_t - state shared by the threads of a bulk build
  *
- * - only useful when keys are numerals
  */
-static int noswapkey = 1;
+typedef struct buildctl_t {
+    mybtree_t *mybp;           /* the btree being built                     */
+    int fd;                    /* descriptor the pages are written through  */
+    pthread_mutex_t lock;      /* protects nextpage and failed              */
+    pagenum_t nextpage;        /* next page to hand out                     */
+    int failed;                /* set when a stream fails, others stop      */
+    int32_t leafmax;           /* number of records packed on a leaf        */
+    int32_t leafroom;          /* bytes of a leaf filled with records       */
+    int32_t indexmax;          /* number of entries packed on an index page */
+} buildctl_t;
 
 
 /*
- * keytype - record the key type if the key is numeral; 
+ * buildstream_t - one sorted input stream of a bulk build and the leaves
+ *                 packed from it
  *
  */
-static char keytype[16];
+typedef struct buildstream_t {
+    buildctl_t *ctl;           /* shared state                              */
+    btree_stream_t *stream;    /* the application's stream routine          */
+    void *arg;                 /* ... and its argument                      */
+
+    char *run;                 /* buildrun pages packed in memory           */
+    char *lastkey;             /* last key packed, in storage format        */
+    pagenum_t lastleaf;        /* last leaf written to the file, -1 if none */
+
+    int64_t leafcount;         /* number of leaves packed from the stream   */
+    int64_t leafalloc;         /* room in firstkeys and leafnums            */
+    char *firstkeys;           /* first key of each leaf, as given          */
+    pagenum_t *leafnums;       /* page number of each leaf                  */
+
+    int res;                   /* 0 if OK, else a btree_bulkbuild error     */
+} buildstream_t;
+
 
 /*
- * platformkey - convenience variable to hold the key in platform-specific
- *               format
+ * freezestream_t - the records of a btree, read a batch at a time by its
+ *                  cursor, as the stream of the bulk build of its frozen
+ *                  copy
  *
  */
-static char platformkey[8];
-static char *platformkeyptr = (char *)&platformkey;
+typedef struct freezestream_t {
+    btree_t *bp;               /* the btree being frozen                    */
+    int32_t max;               /* room for max records in a batch           */
+    int32_t count;             /* number of records in the batch            */
+    int32_t next;              /* next record of the batch to hand out      */
+    char *keys;                /* the keys of the batch, back to back       */
+    void **values;             /* the payload of each record                */
+} freezestream_t;
 
 /*
- * numeral_compare - default numeral comparison function
+ * numeral_compare - default numeral comparison function, resolved at open
+ *                   from the key type, size and byte order
  *
  */
-static int 
-numeral_compare(const void *key1, const void *key2, int size);
+static btree_compare_t *
+numeral_compare(const char *ktype, uint32_t ksize, int swap);
 
 
 /* 
@@ -158,12 +250,12 @@ static int readheader(mybtree_t *mybp);
 static int
 whichfield(mybtree_t *mybp, const char *fieldname);
 
-static void 
-extractfield(mybtree_t *mybp, void *value, const void *src, int32_t fieldind);
+static void
+extractbatch(mybtree_t *mybp, void *values[], const void *pageaddr, 
+             int32_t first, int32_t count, int32_t fieldind);
 
 static void 
-populatefield(mybtree_t *mybp, void *dest, const void *value, 
-              int32_t fieldind);
+storevalue(mybtree_t *mybp, void *pageaddr, int32_t entry, const void *value);
 
 
 /* 
@@ -181,7 +273,8 @@ typedef struct hdr_t {
     char *typeptr;              /* 'l': leaf; 'i': index                     */
 
     /* these two entries need to be initialized when the 
-       page is first read in; runtime variables , a hack */
+       page is first read in; runtime variables kept in the page's buffer 
+       control block (see setlinks), never in the page image itself */
     void **ppageaddrptr;        /* parent page's location in the buffer      */
     int32_t *pentryptr;        /* which entry in the parent page points to me*/
 } hdr_t;
@@ -189,12 +282,109 @@ typedef struct hdr_t {
 
 /*
  * hdrsize - the size of the compact header, we force the pointer type to be
- *           8 bytes (for 64 bit machine)
+ *           8 bytes (for 64 bit machine); the bytes that used to hold the
+ *           runtime parent link are kept for format compatibility
  * 
  */
 static const int32_t hdrsize = 4 + 8 + 1 + 8 + 4;
 
+/*
+ * MAXSHAREDKEY - with BTREE_PREFIXKEYS, the header of a page is followed
+ *                by the lengths of the head and the tail shared by the keys
+ *                of the page (one byte each) and a template key holding the
+ *                shared bytes:
+ *
+ *   | header | head | tail | template | entry 0 | entry 1 | ...
+ *
+ * - an entry keeps the key bytes [head, keysize - tail) and the value; if 
+ *   head + tail reaches keysize (a single key), it keeps the value only
+ * - an empty page shares every byte
+ * - a page is full at 2 * p - 1 entries, p being the number of entries 
+ *   that fit if no key byte is shared, so that either half of a split 
+ *   fits whatever its keys 
+ *
+ */
+#define MAXSHAREDKEY 255
+
+/*
+ * free list - with BTREE_FREEPAGES, the pages dropped by a range delete 
+ *             are kept on trunk pages of type 'f' chained by their right
+ *             sibling numbers:
+ *
+ *   | header | page number 0 | page number 1 | ...
+ *
+ * - the count of the header is the number of page numbers on the trunk
+ * - the first trunk is kept in the root page, in the 8 bytes that follow
+ *   the right sibling number (unused by the other pages)
+ * - a page is allocated from the last trunk entry, or the trunk itself 
+ *   once it is empty
+ *
+ */
+#define FREEHEADOFFSET 8
+
+/*
+ * LOWEDGE, HIGHEDGE - a page visited by a range delete lies on the search
+ *                     path of the low key, of the high key, or both
+ *
+ */
+#define LOWEDGE  0x1
+#define HIGHEDGE 0x2
+
+/*
+ * rangedel_t - state of a range delete 
+ *
+ */
+typedef struct rangedel_t {
+    const void *lowkey;        /* first key removed, NULL from the start    */
+    const void *highkey;       /* first key kept, NULL to the end           */
+    btree_visit_t *visit;      /* called with each key removed, or NULL     */
+    void *arg;                 /* ... and its argument                      */
+    int32_t leafdepth;         /* depth of the leaves, 0 if the root is one */
+    pagenum_t lowpath[MAXDEPTH];   /* pages on the path of lowkey, by depth */
+    pagenum_t highpath[MAXDEPTH];  /* pages on the path of highkey         */
+} rangedel_t;
+
+
+/*
+ * cursorrun - number of pages staged with one vectored read when the
+ *             cursor crosses to a right sibling that is not cached
+ *
+ * - leaves built by append are laid out in key order, so the pages
+ *   following the right sibling are most likely the next leaves
+ */
+static const int cursorrun = 8;
+
+/*
+ * raminwindow, ramaxwindow - bounds of the cursor readahead window
+ *
+ * - the window starts at raminwindow once the cursor has crossed to a
+ *   physically adjacent sibling, doubles on every further refill while
+ *   the scan stays sequential, and collapses back to 0 on a jump
+ */
+static const int32_t raminwindow = 16;
+static const int32_t ramaxwindow = 1024;
+
+static void readahead(mybtree_t *mybp, pagenum_t rightsibnum);
+
+static int crosscursor(mybtree_t *mybp);
+
+static int 
+pastcursorstop(mybtree_t *mybp, const void *pageaddr, int32_t entry);
+
+static void *fixnode(mybtree_t *mybp, pagenum_t pagenum);
+
+static void xlatch(mybtree_t *mybp, void *pageaddr);
+static void xlatchpath(mybtree_t *mybp, void *pageaddr, int32_t newcount,
+                       const void *keys[]);
+static void xrelease(mybtree_t *mybp);
+
+static size_t budgetframes(int32_t bufsize, uint32_t pagesize,
+                           const char *envname);
+
+static int pageclass(const void *pageaddr);
+
 void setheader(hdr_t *hdrptr, const void *pageaddr);
+static void setlinks(mybtree_t *mybp, hdr_t *hdrptr, const void *pageaddr);
 
 /*
  * search routines 
@@ -215,6 +405,87 @@ binarysearch(mybtree_t *mybp, const void *pageaddr, const void *key);
 static void *
 sink(mybtree_t *mybp, void *pageaddr, int where);
 
+static void *
+relocateleaf(mybtree_t *mybp, void *pageaddr, const void *key);
+
+static int 
+covers(mybtree_t *mybp, const void *pageaddr, const void *key);
+
+static int32_t 
+fingerentrypoint(mybtree_t *mybp, const void *key, void **pageaddrptr);
+
+static void dropfinger(mybtree_t *mybp);
+
+static int 
+sortprobes(mybtree_t *mybp, int count, const void *keys[], int *order);
+
+static const char *
+fencebase(mybtree_t *mybp, const void *pageaddr);
+
+static int validformat(mybtree_t *mybp, uint32_t format);
+
+/*
+ * entry layout routines
+ *
+ */
+static char *entrybase(mybtree_t *mybp, const void *pageaddr);
+
+static int32_t keypart(mybtree_t *mybp, const void *pageaddr);
+
+static int32_t entrysize(mybtree_t *mybp, const void *pageaddr);
+
+static const char *
+entrykey(mybtree_t *mybp, const void *pageaddr, int32_t entry, char *keybuf);
+
+static char *entryvalue(mybtree_t *mybp, const void *pageaddr, int32_t entry);
+
+static int columnar(mybtree_t *mybp, const void *pageaddr);
+
+static char *
+valueslot(mybtree_t *mybp, const void *pageaddr, int32_t entry, 
+          int32_t offset, int32_t size, int32_t *strideptr);
+
+static void
+shiftcolumns(mybtree_t *mybp, void *destaddr, int32_t destentry,
+             const void *srcaddr, int32_t srcentry, int32_t count);
+
+static void 
+sharebytes(mybtree_t *mybp, const char *template, const char *key, 
+           int *headptr, int *tailptr);
+
+static int 
+fits(mybtree_t *mybp, const void *pageaddr, int32_t newcount, 
+     const void *keys[], int32_t maxcount, int32_t room);
+
+static void reshape(mybtree_t *mybp, void *pageaddr, int head, int tail);
+
+static void compact(mybtree_t *mybp, void *pageaddr);
+
+static void shareall(mybtree_t *mybp, void *pageaddr);
+
+static void 
+moveentries(mybtree_t *mybp, void *destaddr, const void *srcaddr, 
+            int32_t first, int32_t count);
+
+static int32_t 
+splitpoint(mybtree_t *mybp, const void *pageaddr, int32_t entry,
+           int32_t newcount, const void *keys[], int32_t count1);
+
+static int 
+sidefits(mybtree_t *mybp, const void *pageaddr, int32_t entry, 
+         int32_t newcount, const void *keys[], int32_t from, int32_t to);
+
+static const char *
+mergedkey(mybtree_t *mybp, const void *pageaddr, int32_t entry,
+          int32_t newcount, const void *keys[], int32_t index, char *keybuf);
+
+static void 
+markpage(mybtree_t *mybp, void *pageaddr);
+
+static void setcapacity(mybtree_t *mybp);
+
+static void setrootpagenum(mybtree_t *mybp);
+
 
 /*
  * insert/split routines 
@@ -254,8 +525,41 @@ inorder(mybtree_t *mybp, void *pageaddr, int32_t entry, int32_t count,
  * delete routines 
  *
  */
-static 
-void unplug(mybtree_t *mybp, void *pageaddr, int32_t entry);
+static void 
+unplug(mybtree_t *mybp, void *pageaddr, int32_t entry, int32_t count);
+
+static int 
+droprange(mybtree_t *mybp, rangedel_t *rd, void *pageaddr, int32_t depth,
+          int edges);
+
+static int 
+dropsubtree(mybtree_t *mybp, rangedel_t *rd, pagenum_t pagenum, 
+            int32_t depth);
+
+static int relink(mybtree_t *mybp, rangedel_t *rd);
+
+static int32_t 
+lowerbound(mybtree_t *mybp, const void *pageaddr, const void *key);
+
+static void 
+visitrange(mybtree_t *mybp, rangedel_t *rd, const void *pageaddr, 
+           int32_t first, int32_t count);
+
+static pagenum_t entrychild(mybtree_t *mybp, const void *pageaddr, 
+                            int32_t entry);
+
+
+/*
+ * free list routines 
+ *
+ */
+static void *allocpage(mybtree_t *mybp, pagenum_t *pagenumptr);
+
+static int freepage(mybtree_t *mybp, pagenum_t pagenum);
+
+static int loadfreehead(mybtree_t *mybp);
+
+static int storefreehead(mybtree_t *mybp);
 
 
 /*
@@ -271,6 +575,35 @@ splitappend(mybtree_t *mybp, void *pageaddr, const void *key,
             const void *value, int *pcode);
 
 
+/*
+ * bulk build routines 
+ *
+ */
+static void buildfences(mybtree_t *mybp, void *pageaddr);
+
+static void *buildstream(void *arg);
+
+static int packleaves(buildstream_t *bs);
+
+static int flushrun(buildstream_t *bs, int32_t runpages);
+
+static int
+packindex(buildctl_t *ctl, int64_t count, char *keys, pagenum_t *pagenums);
+
+static void
+packnode(mybtree_t *mybp, void *pageaddr, int32_t count, const char *keys,
+         const pagenum_t *pagenums, pagenum_t rightsibnum);
+
+static int
+writeat(buildctl_t *ctl, const void *src, size_t size, off_t offset);
+
+static int freezestream(void *arg, const void **keyptr, const void **valueptr);
+
+static int32_t appvaluesize(mybtree_t *mybp);
+
+static int linkleaf(buildctl_t *ctl, pagenum_t pagenum, pagenum_t rightsibnum);
+
+
 
 /*
  * return value conventions:
@@ -295,6 +628,11 @@ splitappend(mybtree_t *mybp, void *pageaddr, const void *key,
  * -13: no schema defined
  * -14: unknown member name
  * -15: structure control block create fails
+ * -16: out of memory
+ * -17: format change disallowed
+ * -18: unknown format
+ * -19: bulk build into a non-empty btree
+ * -20: a bulk build input stream failed
  * 
  */
 
@@ -315,12 +653,9 @@ btree_t *btree_open(const char *pathname, int flags, uint32_t ksize,
                     btree_compare_t *compare, off_t startoffset)
 {
     mybtree_t *mybp;
-    uint32_t payloadsize;
     struct stat statbuf;
     int32_t existed;
-    size_t framecount;
-    off_t rootstart;
-    double blksizeK;
+    size_t framecount, pincount;
 
     /* make sure that current platform support large file system, i.e.
        sizeof(off_t) == 8 */
@@ -388,19 +723,14 @@ btree_t *btree_open(const char *pathname, int flags, uint32_t ksize,
         mybp->endian = xplatform_testendian();
         mybp->pagesize = pagesize;
 
-        rootstart = startoffset + metahdrsize;
-
-        if ((rootstart % mybp->pagesize) == 0)
-            mybp->rootpagenum = (pagenum_t)(rootstart / mybp->pagesize);
-        else
-            mybp->rootpagenum = (pagenum_t)(rootstart / mybp->pagesize) + 1;
-
         mybp->pagecount = 0; /* empty btree */
 
         mybp->keysize = ksize;
         mybp->valuesize = vsize;
 
         mybp->asciischemasize = 0;  
+        mybp->format = 0;
+        setrootpagenum(mybp);
 
         /* allow applicatin to define a schmea */
         mybp->schema = NULL;
@@ -414,6 +744,19 @@ btree_t *btree_open(const char *pathname, int flags, uint32_t ksize,
             fprintf(stderr, "btree_open: corrupted meta data\n");
             return NULL;
         }
+
+        /* a frozen btree is never modified: serve its pages from a map */
+        if ((mybp->format & BTREE_FROZEN) != 0) {
+            if ((flags & O_ACCMODE) != O_RDONLY) {
+                fprintf(stderr, "btree_open: the frozen btree %s can only ",
+                        pathname);
+                fprintf(stderr, "be opened O_RDONLY.\n");
+                errno = EROFS;
+                return NULL;
+            }
+            flags |= O_MMAP;
+            mybp->flags = flags;
+        }
     }
 
     /* no ascii schema is created yet */
@@ -422,54 +765,55 @@ btree_t *btree_open(const char *pathname, int flags, uint32_t ksize,
     /* determine whether the system endianness is compatible with that of
        the btree */
     if (mybp->endian == xplatform_testendian()) 
-        noswap = 1;
+        mybp->noswap = 1;
     else
-        noswap = 0;
+        mybp->noswap = 0;
 
     /* install comparison function */
     if (compare == NULL) {
         /* this error would never occur in etree library */
-        if ((strcmp(ktype, "int32_t") && (ksize == 4)) ||
-            (strcmp(ktype, "int64_t") && (ksize == 8)) ||
-            (strcmp(ktype, "uint32_t") && (ksize == 4)) ||
-            (strcmp(ktype, "uint64_t") && (ksize == 8)) ||
-            (strcmp(ktype, "float") && (ksize == 4)) || 
-            (strcmp(ktype, "double") && (ksize == 8)) ||
-            (strcmp(ktype, "float32_t") && (ksize == 4)) || 
-            (strcmp(ktype, "float64_t") && (ksize == 8))) {
-
-            /* install the numeral comparison function */
-            mybp->compare = numeral_compare;
-            strcpy(keytype, ktype);
-
+        if ((mybp->compare = numeral_compare(ktype, ksize, !mybp->noswap)) != NULL){
             /* we only need to swap key if it's of numeral type;
                set noswapkey to be the same flag as that for value */
-            noswapkey = noswap;
+            mybp->noswapkey = mybp->noswap;
         }
         else {
             fprintf(stderr, "btree_open: unknown numerical key type\n");
             fprintf(stderr, "btree_open: check the data type and its size\n");
             return NULL;
         }
-    } else
+    } else {
+        /* keys of other types are stored as given */
         mybp->compare = compare;
+        mybp->noswapkey = 1;
+    }
     
     /* init index structure information */
-    payloadsize = mybp->pagesize - hdrsize;
-    mybp->leafentrysize = mybp->keysize + mybp->valuesize;
-    mybp->leafcapacity = payloadsize / mybp->leafentrysize;
-    mybp->indexentrysize = mybp->keysize + sizeof(pagenum_t);
-    mybp->indexfanout = payloadsize / mybp->indexentrysize;
+    setcapacity(mybp);
     mybp->nextpage = mybp->rootpagenum + mybp->pagecount;
 
     /* buffer_init open the file for I/O */
-    blksizeK = 1.0 * mybp->pagesize / 1024;
-    framecount = (size_t)(bufsize * 1024 / blksizeK);
-
-    if ((mybp->buf = buffer_init(pathname, flags, framecount, mybp->pagesize)) 
-        == NULL)
+    framecount = budgetframes(bufsize, mybp->pagesize, "ETREE_BUFFERSIZE");
+
+    /* the pinned region for the index pages is as large as the pool unless
+       sized on its own; pinning moves pages, which threads sharing the 
+       buffer cannot allow */
+    mybp->concurrent = ((flags & O_CONCURRENT) != 0);
+    mybp->pinindex = ((flags & O_PININDEX) != 0) && (!mybp->concurrent);
+    pincount = (mybp->pinindex) 
+        ? budgetframes(bufsize, mybp->pagesize, "ETREE_PININDEXSIZE") : 0;
+    if ((mybp->buf = buffer_init(pathname, flags, framecount, pincount,
+                                 mybp->pagesize)) == NULL)
         /* cannot allocate buffer space */
         return NULL;
+    buffer_setpageclass(mybp->buf, pageclass);
+
+    /* the free list head is kept in the root page */
+    mybp->freehead = -1;
+    if (((mybp->format & BTREE_FREEPAGES) != 0) && (loadfreehead(mybp) != 0)){
+        fprintf(stderr, "btree_open: cannot load the free list\n");
+        return NULL;
+    }
 
     /* no cursor in effect */
     mybp->cursoroffset = -1; 
@@ -495,8 +839,6 @@ int btree_registerschema(btree_t *bp, const char *defstring)
 {
     mybtree_t *mybp;
     int32_t fieldind, compactsize;
-    uint32_t payloadsize;
-    off_t rootstart;
 
     mybp = (mybtree_t *)bp;
     if (mybp->allowschema == 0) 
@@ -518,9 +860,7 @@ int btree_registerschema(btree_t *bp, const char *defstring)
     mybp->valuesize = compactsize;
     
     /* adjust fields that are affected by valuesize */
-    payloadsize = mybp->pagesize - hdrsize;
-    mybp->leafentrysize = mybp->keysize + mybp->valuesize;
-    mybp->leafcapacity = payloadsize / mybp->leafentrysize;
+    setcapacity(mybp);
 
     /* ascii schema only needs to be produced once, when the schema is
        registered for the first time */
@@ -528,11 +868,7 @@ int btree_registerschema(btree_t *bp, const char *defstring)
                                        &mybp->asciischemasize);
 
     /* adjust rootpagenum */
-    rootstart = mybp->startoffset + metahdrsize + mybp->asciischemasize;
-    if (rootstart % mybp->pagesize == 0) 
-        mybp->rootpagenum = (pagenum_t)(rootstart / mybp->pagesize);
-    else
-        mybp->rootpagenum = (pagenum_t)(rootstart / mybp->pagesize) + 1;
+    setrootpagenum(mybp);
 
     mybp->nextpage = mybp->rootpagenum + mybp->pagecount;
 
@@ -585,6 +921,52 @@ char *btree_getschema(btree_t *bp)
         return schema_getdefstring(mybp->schema);
 }
         
+/*
+ * btree_setformat - select the page format of a TRUNC'ed or newly 
+ *                   CREAT'ed btree
+ *
+ * - format is 0 (the original format) or BTREE_SEARCHINDEX, 
+ *   BTREE_PREFIXKEYS and BTREE_COLUMNS as they go together; BTREE_FROZEN
+ *   and BTREE_FREEPAGES are set by the btree itself
+ * - leaf and index capacity and the root page number are recomputed; the
+ *   format is recorded in the meta data when the btree is closed
+ * - return 0 if OK, -17 if the btree is not writable or not empty, -18 if
+ *   the format is unknown
+ *
+ */
+int btree_setformat(btree_t *bp, uint32_t format)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    if (((mybp->flags & O_ACCMODE) == O_RDONLY) || 
+        (mybp->nextpage != mybp->rootpagenum) || (mybp->enableappend))
+        return -17;
+
+    if ((!validformat(mybp, format)) || 
+        ((format & (BTREE_FROZEN | BTREE_FREEPAGES)) != 0)) 
+        return -18;
+
+    mybp->format = format;
+    setcapacity(mybp);
+    setrootpagenum(mybp);
+    mybp->nextpage = mybp->rootpagenum + mybp->pagecount;
+
+    return 0;
+}
+
+
+/*
+ * btree_getformat - return the page format flags of the btree
+ *
+ */
+uint32_t btree_getformat(btree_t *bp)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    return mybp->format;
+}
+
+
 /*
  * btree_close  - release resource
  *
@@ -598,9 +980,17 @@ int btree_close(btree_t *bp)
 
     mybtree_t *mybp = (mybtree_t *)bp;
 
+    dropfinger(mybp);
+    if (((mybp->format & BTREE_FREEPAGES) != 0) &&
+        ((mybp->flags & O_RDWR) || (mybp->flags & O_WRONLY)) &&
+        (storefreehead(mybp) != 0))
+        res = -9;
     if (buffer_destroy(mybp->buf) != 0)
         res = -9;
 
+    if (mybp->cursorstop != NULL) 
+        free(mybp->cursorstop);
+
     if (((mybp->flags & O_INCORE) == 0) &&
         ((mybp->flags & O_RDWR) || (mybp->flags & O_WRONLY))) 
         if (writeheader(mybp) != 0)
@@ -632,20 +1022,22 @@ int btree_close(btree_t *bp)
 int writeheader(mybtree_t *mybp)
 {
     int btreefd;
-    uint32_t pagesize, keysize, valuesize, asciischemasize;
+    uint32_t pagesize, keysize, valuesize, asciischemasize, format;
     pagenum_t pagecount, rootpagenum;
+    char endianchar;
 
     /* update the pagecount */
     mybp->pagecount = mybp->nextpage - mybp->rootpagenum;
 
     /* convert the meta data if byte swapping is necessary */
-    if (!noswap) {
+    if (!mybp->noswap) {
         xplatform_swapbytes(&pagesize, &mybp->pagesize, 4);
         xplatform_swapbytes(&pagecount, &mybp->pagecount, 8);
         xplatform_swapbytes(&rootpagenum, &mybp->rootpagenum, 8);
         xplatform_swapbytes(&keysize, &mybp->keysize, 4);
         xplatform_swapbytes(&valuesize, &mybp->valuesize, 4);
         xplatform_swapbytes(&asciischemasize, &mybp->asciischemasize, 4);
+        xplatform_swapbytes(&format, &mybp->format, 4);
     } else {
         pagesize = mybp->pagesize;
         pagecount = mybp->pagecount;
@@ -653,6 +1045,7 @@ int writeheader(mybtree_t *mybp)
         keysize = mybp->keysize;
         valuesize = mybp->valuesize;
         asciischemasize = mybp->asciischemasize;
+        format = mybp->format;
     }
     
     /*
@@ -670,7 +1063,11 @@ int writeheader(mybtree_t *mybp)
         return -1;
     }
 
-    if (write(btreefd, (mybp->endian == little) ? "L" : "B", 1) != 1) {
+    endianchar = (mybp->endian == little) ? 'L' : 'B';
+    if (mybp->format != 0)
+        /* lower case: the format flags follow asciischemasize */
+        endianchar = tolower(endianchar);
+    if (write(btreefd, &endianchar, 1) != 1) {
         perror("writeheader: write meta(endian)");
         return -1;
     }
@@ -709,7 +1106,19 @@ int writeheader(mybtree_t *mybp)
             perror("writeheader: write meta(asciischemasize)");
             return -1;
         }
+    }
+
+    if (mybp->format != 0) {
+        off_t formatoffset = mybp->startoffset + metahdrsize;
+
+        if ((lseek(btreefd, formatoffset, SEEK_SET) != formatoffset) ||
+            (write(btreefd, &format, 4) != 4)) {
+            perror("writeheader: write meta(format)");
+            return -1;
+        }
+    }
 
+    if (mybp->asciischema != NULL) {
         if (write(btreefd, mybp->asciischema, mybp->asciischemasize) != 
             mybp->asciischemasize) {
             perror("writeheader: write ASCII schema");
@@ -737,7 +1146,7 @@ int readheader(mybtree_t *mybp)
 {
     int btreefd;
     char endianchar;
-    uint32_t pagesize, keysize, valuesize, asciischemasize;
+    uint32_t pagesize, keysize, valuesize, asciischemasize, format;
     pagenum_t pagecount, rootpagenum;
 
     btreefd = open(mybp->pathname, O_RDONLY);
@@ -779,11 +1188,16 @@ int readheader(mybtree_t *mybp)
         perror("readheader: read meta(asciischemasize)");
         return -1;
     }
+    format = 0;
+    if ((islower(endianchar)) && (read(btreefd, &format, 4) != 4)) {
+        perror("readheader: read meta(format)");
+        return -1;
+    }
 
     /* load the data into the runtime control structure */
-    if (endianchar == 'L') 
+    if (toupper(endianchar) == 'L') 
         mybp->endian = little;
-    else if (endianchar == 'B')
+    else if (toupper(endianchar) == 'B')
         mybp->endian = big;
     else {
         fprintf(stderr, "readheader: corrupted meta(endian) : %c\n", endianchar);
@@ -798,6 +1212,7 @@ int readheader(mybtree_t *mybp)
         xplatform_swapbytes(&mybp->keysize, &keysize, 4);
         xplatform_swapbytes(&mybp->valuesize, &valuesize, 4);
         xplatform_swapbytes(&mybp->asciischemasize, &asciischemasize, 4);
+        xplatform_swapbytes(&mybp->format, &format, 4);
     } else {
         mybp->pagesize = pagesize;
         mybp->pagecount = pagecount;
@@ -805,6 +1220,13 @@ int readheader(mybtree_t *mybp)
         mybp->keysize = keysize;
         mybp->valuesize = valuesize;
         mybp->asciischemasize = asciischemasize;
+        mybp->format = format;
+    }
+
+    if (!validformat(mybp, mybp->format)) {
+        fprintf(stderr, "readheader: unknown page format 0x%x\n", 
+                mybp->format);
+        return -1;
     }
 
     if (mybp->asciischemasize != 0) {
@@ -923,6 +1345,7 @@ int btree_insert(btree_t *bp, const void *key, const void *value, int *insed)
     }
 
     mybp->allowschema = 0;
+    dropfinger(mybp);
 
     if ((mybp->nextpage == mybp->rootpagenum) &&       /* empty B-tree */
         ((pageaddr = buffer_emptyfix(mybp->buf, mybp->rootpagenum)) != NULL)) {
@@ -930,11 +1353,15 @@ int btree_insert(btree_t *bp, const void *key, const void *value, int *insed)
         int32_t count = 0;
         pagenum_t rightsibnum = -1;
 
-        mybp->nextpage++;
+        /* readers find the root once the page count says it exists */
+        xlatch(mybp, pageaddr);
+        __atomic_store_n(&mybp->nextpage, mybp->nextpage + 1, 
+                         __ATOMIC_RELEASE);
 
         setheader(&hdr, pageaddr);
+        setlinks(mybp, &hdr, pageaddr);
 
-        if (noswap) {
+        if (mybp->noswap) {
             *(hdr.countptr) = count;
             *(hdr.rightsibnumptr) = rightsibnum;
         } else {
@@ -956,16 +1383,18 @@ int btree_insert(btree_t *bp, const void *key, const void *value, int *insed)
     if (entry == -9) 
         return -9;
 
+    xlatchpath(mybp, pageaddr, 1, &key);
+
     if (insed != NULL) {
 
         if (entry != -1) {
             /* We found an entry to compare against */
-            const void *entrykey;
+            char keybuf[MAXSHAREDKEY];
+            const void *hitkey;
 
-            entrykey = (char *)pageaddr +
-                hdrsize + mybp->leafentrysize * entry;
+            hitkey = entrykey(mybp, pageaddr, entry, keybuf);
             
-            if (mybp->compare(key, entrykey, mybp->keysize) == 0) {
+            if (mybp->compare(key, hitkey, mybp->keysize) == 0) {
                 /* 
                    Don't insert duplicate, but the operation is correct.
                    Don't forget to unref the search path.
@@ -987,6 +1416,7 @@ int btree_insert(btree_t *bp, const void *key, const void *value, int *insed)
         res = insert(mybp, pageaddr, entry, 1, &key, &value);
     }
 
+    xrelease(mybp);
     return res;
 }
 
@@ -1021,6 +1451,7 @@ int btree_bulkinsert(btree_t *bp, int count, const void *keys[],
     }
 
     mybp->allowschema = 0;
+    dropfinger(mybp);
 
     entry = findentrypoint(mybp, keys[0], &pageaddr);
     if (entry == -9) 
@@ -1034,7 +1465,9 @@ int btree_bulkinsert(btree_t *bp, int count, const void *keys[],
         return res;
     }
     
+    xlatchpath(mybp, pageaddr, count, keys);
     res = insert(mybp, pageaddr, entry, count, keys, values);
+    xrelease(mybp);
 
     return res;
 
@@ -1055,7 +1488,8 @@ int btree_bulkinsert(btree_t *bp, int count, const void *keys[],
 int btree_delete(btree_t *bp, const void *key)
 {
     mybtree_t *mybp = (mybtree_t *)bp;
-    void *pageaddr, *hitptr;
+    void *pageaddr;
+    char keybuf[MAXSHAREDKEY];
     int32_t entry;
     int res;
 
@@ -1072,20 +1506,103 @@ int btree_delete(btree_t *bp, const void *key)
         /* emptry B-tree */
         return -2;
     } 
+
+    dropfinger(mybp);
         
     entry = findentrypoint(mybp, key, &pageaddr);
     if (entry == -9) 
         return -9;
 
-    hitptr = (char *)pageaddr + hdrsize + entry * mybp->leafentrysize;
-    if ((entry < 0) || (memcmp(key, hitptr, mybp->keysize) != 0)) 
+    if ((entry < 0) || 
+        (memcmp(key, entrykey(mybp, pageaddr, entry, keybuf), 
+                mybp->keysize) != 0)) 
         res = -3;
     else {
-        unplug(mybp, pageaddr, entry);
+        xlatch(mybp, pageaddr);
+        unplug(mybp, pageaddr, entry, 1);
         res = 0;
     }
 
     cascadeunref(mybp, pageaddr);
+    xrelease(mybp);
+    return res;
+}
+
+
+/*
+ * btree_deleterange - remove the records with keys in [lowkey, highkey)
+ *
+ * - a NULL lowkey starts at the first record, a NULL highkey runs to the
+ *   end of the btree
+ * - the pages between the search paths of the two keys are dropped whole
+ *   and their entries removed from the index in one pass; only the pages
+ *   on the two paths are trimmed, and the leaves and index pages on 
+ *   either side are relinked
+ * - the leaves dropped are not read unless visit is given; visit is then
+ *   called with each key removed, in key order
+ * - the pages dropped are put on the free list (BTREE_FREEPAGES), from 
+ *   which splits take pages before they extend the file; the list is 
+ *   kept in the file unless the format flags do not fit before the root
+ * - lazy method like btree_delete: trimmed pages are not merged
+ * - return 0 if OK, -1 if in conflict mode, -2 if empty btree, -9 if low
+ *   level IO error occurs
+ *
+ */
+int btree_deleterange(btree_t *bp, const void *lowkey, const void *highkey,
+                      btree_visit_t *visit, void *arg)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+    rangedel_t rd;
+    void *pageaddr;
+    hdr_t header;
+    int res;
+
+    if ((mybp->enableappend == 1) || (mybp->cursoroffset != -1)) {
+        /* append or cursor mode in effect */
+        return -1;
+    }
+
+    if (mybp->nextpage == mybp->rootpagenum) {
+        /* empty B-tree */
+        return -2;
+    } 
+
+    if ((lowkey != NULL) && (highkey != NULL) &&
+        (mybp->compare(lowkey, highkey, mybp->keysize) >= 0))
+        /* nothing in the range */
+        return 0;
+
+    dropfinger(mybp);
+
+    rd.lowkey = lowkey;
+    rd.highkey = highkey;
+    rd.visit = visit;
+    rd.arg = arg;
+
+    /* the leaves are all at the depth of the leftmost one */
+    rd.leafdepth = 0;
+    if ((pageaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) 
+        return -9;
+    setheader(&header, pageaddr);
+    while (*(header.typeptr) != 'l') {
+        pagenum_t pagenum = entrychild(mybp, pageaddr, 0);
+
+        buffer_unref(mybp->buf, pageaddr);
+        if ((++rd.leafdepth == MAXDEPTH) || 
+            ((pageaddr = fixnode(mybp, pagenum)) == NULL))
+            return -9;
+        setheader(&header, pageaddr);
+    }
+    buffer_unref(mybp->buf, pageaddr);
+
+    if ((pageaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) 
+        return -9;
+
+    res = droprange(mybp, &rd, pageaddr, 0, 
+                    (highkey == NULL) ? LOWEDGE : (LOWEDGE | HIGHEDGE));
+    if (res == 0) 
+        res = relink(mybp, &rd);
+
     return res;
 }
 
@@ -1100,7 +1617,8 @@ int btree_delete(btree_t *bp, const void *key)
 int btree_update(btree_t *bp, const void *key, const void *value)
 {
     mybtree_t *mybp = (mybtree_t *)bp;
-    void *pageaddr, *hitptr;
+    void *pageaddr;
+    char keybuf[MAXSHAREDKEY];
     int32_t entry;
     int res;
 
@@ -1113,24 +1631,19 @@ int btree_update(btree_t *bp, const void *key, const void *value)
     if (entry == -9) 
         return -9;
 
-    hitptr = (char *)pageaddr + hdrsize + entry * mybp->leafentrysize;
-    if ((entry < 0) || (memcmp(key, hitptr, mybp->keysize) != 0)) 
+    if ((entry < 0) || 
+        (memcmp(key, entrykey(mybp, pageaddr, entry, keybuf), 
+                mybp->keysize) != 0)) 
         res = -3;
     else {
-        char *dest;
-        
-        dest = (char *)hitptr + mybp->keysize;
-
-        if (mybp->schema == NULL) 
-            memcpy(dest, value, mybp->leafentrysize - mybp->keysize);
-        else
-            populatefield(mybp, dest, value, mybp->schema->fieldnum);
-
-        buffer_mark(mybp->buf, pageaddr);        
+        xlatch(mybp, pageaddr);
+        storevalue(mybp, pageaddr, entry, value);
+        markpage(mybp, pageaddr);        
         res = 0;
     }
 
     cascadeunref(mybp, pageaddr);
+    xrelease(mybp);
     return res;
 }
 
@@ -1155,6 +1668,8 @@ int btree_bulkupdate(btree_t *bp, const void *anchorkey, int count,
     mybtree_t *mybp = (mybtree_t *)bp;
     void *pageaddr, *dest;
     int32_t entry;
+    char keybuf[MAXSHAREDKEY];
+    int res = 0;
 
     /* sanity check */
     if (mybp->enableappend == 1) {
@@ -1170,14 +1685,16 @@ int btree_bulkupdate(btree_t *bp, const void *anchorkey, int count,
         return -2;
     } 
 
+    /* inserting the new keys may split the pages of the finger's path */
+    dropfinger(mybp);
+
     entry = findentrypoint(mybp, anchorkey, &pageaddr);
     if (entry == -9) 
         return -9;
 
-    dest = (char *)pageaddr + hdrsize + entry * mybp->leafentrysize;
-
     if ((entry == -1) ||
-        (memcmp(dest, anchorkey, mybp->keysize) != 0)) {
+        (memcmp(entrykey(mybp, pageaddr, entry, keybuf), anchorkey, 
+                mybp->keysize) != 0)) {
         /* Cannot find anchor */
         /* Don't forget to unref the search path */
         cascadeunref(mybp, pageaddr);
@@ -1191,25 +1708,38 @@ int btree_bulkupdate(btree_t *bp, const void *anchorkey, int count,
         cascadeunref(mybp, pageaddr);
         return -4;
     }
+
+    /* the anchor counts as one more key, as it is with prefix keys */
+    xlatchpath(mybp, pageaddr, count, keys);
     
+    if ((mybp->layout & BTREE_PREFIXKEYS) != 0) {
+        /* the new keys may share fewer bytes with the page than the 
+           anchor: take the anchor out and insert all of them */
+        unplug(mybp, pageaddr, entry, 1);
+        res = insert(mybp, pageaddr, entry - 1, count, keys, values);
+        xrelease(mybp);
+        return res;
+    }
+
     /* overwrite the anchor */
-    if (noswapkey) 
+    dest = entrybase(mybp, pageaddr) + entry * entrysize(mybp, pageaddr);
+    if (mybp->noswapkey) 
         memcpy(dest, keys[0], mybp->keysize);
     else
         xplatform_swapbytes(dest, keys[0], mybp->keysize);
 
-    dest = (char *)dest + mybp->keysize;
-    if (mybp->schema == NULL) 
-        memcpy(dest, values[0], mybp->valuesize);
-    else
-        populatefield(mybp, dest, values[0], mybp->schema->fieldnum);
+    storevalue(mybp, pageaddr, entry, values[0]);
     
     /* bulk insert the remaing keys */
     if (count - 1 > 0) 
-        return insert(mybp, pageaddr, entry, count - 1, &keys[1], &values[1]);
-    else
-        return 0;
+        res = insert(mybp, pageaddr, entry, count - 1, &keys[1], &values[1]);
+    else {
+        markpage(mybp, pageaddr);
+        cascadeunref(mybp, pageaddr);
+    }
 
+    xrelease(mybp);
+    return res;
 }
 
 /**
@@ -1262,7 +1792,8 @@ int btree_search(btree_t *bp, const void *key, void *hitkey,
 {
     mybtree_t *mybp = (mybtree_t *)bp;
     void *pageaddr;
-    char *base, *src;
+    const char *src;
+    char keybuf[MAXSHAREDKEY];
     int32_t entry, fieldind;
     int res; 
     
@@ -1275,43 +1806,197 @@ int btree_search(btree_t *bp, const void *key, void *hitkey,
     if ((fieldind = whichfield(mybp, fieldname)) < 0) 
         return fieldind;
 
-    entry = findentrypoint(mybp, key, &pageaddr);
+    entry = fingerentrypoint(mybp, key, &pageaddr);
     if (entry == -9) return -9;
 
     if (entry < 0) 
         res = -3;
     else {
         res = 0;
-        base = (char *)pageaddr + hdrsize;
-        src = base + mybp->leafentrysize * entry ;
+        src = entrykey(mybp, pageaddr, entry, keybuf);
 
-        if (noswapkey)
+        if (mybp->noswapkey)
             memcpy(hitkey, src, mybp->keysize);
         else
             xplatform_swapbytes(hitkey, src, mybp->keysize);
         
-        src += mybp->keysize;
-        if (value != NULL) {
-            if (mybp->schema == NULL) 
-                memcpy(value, src, mybp->valuesize);
-            else
-                extractfield(mybp, value, src, fieldind);
-        }
+        if (value != NULL) 
+            extractbatch(mybp, &value, pageaddr, entry, 1, fieldind);
     }
 
-    cascadeunref(mybp, pageaddr);
+    /* keep the leaf (and its path) as the finger of the next search */
+    mybp->fingerpage = pageaddr;
 
     return res;
 }
 
 
+/*
+ * btree_concurrentsearch - btree_search on behalf of one of the reader 
+ *                          threads of a btree opened with O_CONCURRENT
+ *
+ * - one writer thread may insert, update and delete records (single, 
+ *   bulk or range) at the same time; the other operations of the handle
+ *   (cursors, appends, bulk builds, btree_search ...) are only for the 
+ *   writer thread and must not be used by the readers
+ * - the descent couples shared latches: the child is latched before the
+ *   parent is released, and the writer latches the pages it changes from 
+ *   the top down, so a reader sees each page either before or after a 
+ *   change of the writer and never waits for a writer working in another
+ *   subtree
+ * - every search starts from the root; neither the finger nor the field
+ *   name cache of the handle is used
+ * - return as btree_search
+ *
+ */
+int btree_concurrentsearch(btree_t *bp, const void *key, void *hitkey, 
+                           const char *fieldname, void *value)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+    void *pageaddr, *childaddr;
+    const char *src;
+    char keybuf[MAXSHAREDKEY];
+    hdr_t header;
+    int32_t entry, fieldind;
+
+    if (__atomic_load_n(&mybp->nextpage, __ATOMIC_ACQUIRE) == 
+        mybp->rootpagenum) {
+        /* empty B-tree */
+        return -2;
+    } 
+
+    if ((fieldind = schema_getfieldidx(mybp->schema, fieldname)) < 0) 
+        return fieldind;
+
+    if ((pageaddr = buffer_concurrentfix(mybp->buf, mybp->rootpagenum)) 
+        == NULL) 
+        return -9;
+    buffer_latch(mybp->buf, pageaddr, 0);
+
+    setheader(&header, pageaddr);
+    while (*(header.typeptr) != 'l') {
+        entry = binarysearch(mybp, pageaddr, key);
+        childaddr = buffer_concurrentfix(mybp->buf, 
+                                         entrychild(mybp, pageaddr, entry));
+        if (childaddr != NULL) 
+            buffer_latch(mybp->buf, childaddr, 0);
+
+        buffer_unlatch(mybp->buf, pageaddr);
+        buffer_concurrentunref(mybp->buf, pageaddr);
+        if ((pageaddr = childaddr) == NULL) 
+            return -9;
+        setheader(&header, pageaddr);
+    }
+
+    entry = binarysearch(mybp, pageaddr, key);
+    if (entry >= 0) {
+        src = entrykey(mybp, pageaddr, entry, keybuf);
+
+        if (mybp->noswapkey)
+            memcpy(hitkey, src, mybp->keysize);
+        else
+            xplatform_swapbytes(hitkey, src, mybp->keysize);
+        
+        if (value != NULL) 
+            extractbatch(mybp, &value, pageaddr, entry, 1, fieldind);
+    }
+
+    buffer_unlatch(mybp->buf, pageaddr);
+    buffer_concurrentunref(mybp->buf, pageaddr);
+
+    return (entry < 0) ? -3 : 0;
+}
+
+
+/*
+ * btree_searchbatch - search count keys at once
+ *
+ * - the keys are sorted (in a private order array) and searched in 
+ *   ascending order; each search starts from the leaf of the previous one
+ *   (the first from the finger) and climbs only as high as the key range 
+ *   requires, so keys that fall on the same leaf or subtree do not fix 
+ *   the root and index pages again
+ * - hitkeys[i] and values[i] (values may be NULL) receive the result of 
+ *   keys[i] as btree_search would; hitkeys[i] is set to NULL if keys[i] 
+ *   precedes every key in the btree (not found)
+ * - return the number of keys found, -2 if empty B-tree, -9 if lowlevel 
+ *   IO error occurs, -13/-14 as btree_search, -16 if out of memory
+ *
+ */
+int btree_searchbatch(btree_t *bp, int count, const void *keys[], 
+                      void *hitkeys[], const char *fieldname, void *values[])
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+    void *pageaddr;
+    const char *src;
+    char keybuf[MAXSHAREDKEY];
+    int32_t entry, fieldind;
+    int *order, i, found;
+    
+    if (mybp->nextpage == mybp->rootpagenum) {
+        /* empty B-tree */
+        return -2;
+    } 
+
+    if ((fieldind = whichfield(mybp, fieldname)) < 0) 
+        return fieldind;
+
+    if (count <= 0) 
+        return 0;
+
+    if ((order = (int *)malloc(sizeof(int) * count)) == NULL) 
+        return -16;
+
+    if (sortprobes(mybp, count, keys, order) != 0) {
+        free(order);
+        return -16;
+    }
+
+    found = 0;
+    for (i = 0; i < count; i++) {
+        int k = order[i];
+
+        entry = fingerentrypoint(mybp, keys[k], &pageaddr);
+        if (entry == -9) {
+            free(order);
+            return -9;
+        }
+
+        if (entry < 0) {
+            hitkeys[k] = NULL;
+            mybp->fingerpage = pageaddr;
+            continue;
+        }
+
+        found++;
+        src = entrykey(mybp, pageaddr, entry, keybuf);
+
+        if (mybp->noswapkey)
+            memcpy(hitkeys[k], src, mybp->keysize);
+        else
+            xplatform_swapbytes(hitkeys[k], src, mybp->keysize);
+
+        if ((values != NULL) && (values[k] != NULL)) 
+            extractbatch(mybp, &values[k], pageaddr, entry, 1, fieldind);
+        mybp->fingerpage = pageaddr;
+    }
+
+    free(order);
+
+    return found;
+}
+
+
 /*
  * btree_initcursor - set the cursor at the specified key
  *
  * - if the curosr is set to the position before the first record, treat 
  *   this as a special case and set the cursor to the first record
+ * - a leaf emptied by deletes holds no position: the cursor moves on to
+ *   the first record of the next leaves that have any
  * - record the leaf page in the cursorpage
- * - return 0 if OK, -2 if empty btree,  -9 if lowlevel IO error occurs
+ * - return 0 if OK, -2 if empty btree (no record is left from the 
+ *   cursor position on),  -9 if lowlevel IO error occurs
  *
  */
 int btree_initcursor(btree_t *bp, const void *key)
@@ -1319,7 +2004,8 @@ int btree_initcursor(btree_t *bp, const void *key)
     mybtree_t *mybp = (mybtree_t *)bp;
     void *pageaddr;
     hdr_t header;
-    int32_t entry;
+    int32_t entry, count;
+    int res;
 
     if (mybp->enableappend == 1) {
         /* append mode already in effect */
@@ -1333,169 +2019,668 @@ int btree_initcursor(btree_t *bp, const void *key)
 
     if (mybp->cursoroffset != -1)  /* terminate current cursor */
         btree_stopcursor(bp);
+    mybp->cursorend = 0;
+    mybp->cursorbounded = 0;
 
     entry = findentrypoint(mybp, key, &pageaddr);
     if (entry == -9) return -9;
 
     setheader(&header, pageaddr);
+    setlinks(mybp, &header, pageaddr);
 
     mybp->cursorpage = pageaddr;
     mybp->cursoroffset = (entry < 0) ? 0 : entry;
-    mybp->cursorptr = (char *)pageaddr + hdrsize +
-        mybp->cursoroffset * mybp->leafentrysize;
+    mybp->cursorptr = entrybase(mybp, pageaddr) +
+        mybp->cursoroffset * entrysize(mybp, pageaddr);
+
+    mybp->cursorpagenum = buffer_pagenum(mybp->buf, pageaddr);
+    mybp->raend = mybp->cursorpagenum + 1;
+    mybp->rawindow = 0;
 
     cascadeunref(mybp, *(header.ppageaddrptr));
+
+    if (mybp->noswap) 
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    if ((count == 0) && ((res = crosscursor(mybp)) != 0)) 
+        return (res == 1) ? -2 : res;
+
     return 0;
 }
 
 
 /*
- * btree_getcursor - retrieve the content of the object pointed by 
- *                   the current cursor
+ * btree_initrangecursor - set a cursor on the records with keys in 
+ *                         [startkey, stopkey)
  *
- * - return 0 if OK, -5 if no cursor in effect, 
- *   -13 if no schema defined but request a particular field 
- *   -14 if schema is defined but cannot find the particular field
+ * - a NULL startkey starts at the first record, a NULL stopkey runs to 
+ *   the end of the btree
+ * - unlike btree_initcursor, the cursor is set to the first record whose
+ *   key is not below startkey; the stop key is checked as the cursor 
+ *   advances, so that cursors on adjacent ranges never see the same 
+ *   record
+ * - return 0 if OK, 1 if no record lies in the range, -1 if in append
+ *   mode, -2 if empty btree, -9 if lowlevel IO error occurs, -16 if out
+ *   of memory
  *
  */
-int btree_getcursor(btree_t *bp, void *key, const char *fieldname, void *value)
+int btree_initrangecursor(btree_t *bp, const void *startkey, 
+                          const void *stopkey)
 {
     mybtree_t *mybp = (mybtree_t *)bp;
-    void *src;
-    int32_t fieldind;
+    void *pageaddr;
+    hdr_t header;
+    int32_t entry, count;
+    char keybuf[MAXSHAREDKEY];
+    int res;
 
-    if (mybp->cursoroffset == -1) return -5;
+    if (mybp->enableappend == 1) {
+        /* append mode already in effect */
+        return -1;
+    }
 
-    /* determine what to do with the payload */
-    if ((fieldind = whichfield(mybp, fieldname)) < 0) 
-        return fieldind;
+    if (mybp->nextpage == mybp->rootpagenum) {
+        /* emptry B-tree */
+        return -2;
+    }      
+
+    if ((mybp->cursorstop == NULL) &&
+        ((mybp->cursorstop = malloc(mybp->keysize)) == NULL)) 
+        return -16;
+
+    if (mybp->cursoroffset != -1)  /* terminate current cursor */
+        btree_stopcursor(bp);
+    mybp->cursorend = 0;
+    mybp->cursorbounded = (stopkey != NULL);
+    if (stopkey != NULL) 
+        memcpy(mybp->cursorstop, stopkey, mybp->keysize);
+
+    if (startkey != NULL) {
+        entry = findentrypoint(mybp, startkey, &pageaddr);
+        if (entry == -9) return -9;
+    } else {
+        void *rootaddr;
+
+        if ((rootaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) 
+            return -9;
+        setheader(&header, rootaddr);
+        setlinks(mybp, &header, rootaddr);
+        *(header.ppageaddrptr) = NULL;
+
+        if ((pageaddr = sink(mybp, rootaddr, 0)) == NULL) 
+            return -9;
+        entry = -1;
+    }
 
-    if (noswapkey)
-        memcpy(key, mybp->cursorptr, mybp->keysize);
+    setheader(&header, pageaddr);
+    setlinks(mybp, &header, pageaddr);
+
+    /* step over the record below startkey */
+    if ((entry >= 0) && 
+        (mybp->compare(startkey, entrykey(mybp, pageaddr, entry, keybuf),
+                       mybp->keysize) != 0))
+        entry++;
+    else if (entry < 0) 
+        entry = 0;
+
+    mybp->cursorpage = pageaddr;
+    mybp->cursoroffset = entry;
+    mybp->cursorptr = entrybase(mybp, pageaddr) +
+        mybp->cursoroffset * entrysize(mybp, pageaddr);
+
+    mybp->cursorpagenum = buffer_pagenum(mybp->buf, pageaddr);
+    mybp->raend = mybp->cursorpagenum + 1;
+    mybp->rawindow = 0;
+
+    cascadeunref(mybp, *(header.ppageaddrptr));
+
+    if (mybp->noswap) 
+        count = *(header.countptr);
     else
-        xplatform_swapbytes(key, mybp->cursorptr, mybp->keysize);
+        xplatform_swapbytes(&count, header.countptr, 4);
 
-    if (value != NULL) {
-        src = (char *)mybp->cursorptr + mybp->keysize;
+    if ((entry >= count) && ((res = crosscursor(mybp)) != 0)) 
+        return res;
 
-        if (mybp->schema == NULL) 
-            memcpy(value, src, mybp->valuesize);
-        else
-            extractfield(mybp, value, src, fieldind);
+    if (pastcursorstop(mybp, mybp->cursorpage, mybp->cursoroffset)) {
+        btree_stopcursor(bp);
+        mybp->cursorend = 1;
+        return 1;
     }
 
     return 0;
 }
 
-    
 
 /*
- * btree_advcusor - move the curosr one step forward
+ * btree_partition - split the key space into at most nparts ranges of
+ *                   about the same number of records
  *
- * - when reaching the end of the etree, invalidate the cursor 
- * - return 0 if OK, 1 if end of btree is reached,
- *   -5 if no cursor in effect, -9 if low level IO error
+ * - the ranges follow the subtrees of the index pages one level below the
+ *   root or, if those are leaves or the root has many entries, of the 
+ *   root page; the separator keys of the chosen subtrees are stored back
+ *   to back in bounds (room for nparts - 1 keys)
+ * - range i is [bounds[i - 1], bounds[i]), the first range starting at 
+ *   the first record and the last one running to the end of the btree;
+ *   each can be scanned by btree_initrangecursor on a handle of its own
+ * - return the number of ranges (1 if the btree has a single leaf), -2
+ *   if empty btree, -9 if lowlevel IO error occurs, -16 if out of memory
  *
  */
-int btree_advcursor(btree_t *bp)
+int btree_partition(btree_t *bp, int nparts, void *bounds)
 {
     mybtree_t *mybp = (mybtree_t *)bp;
+    void *rootaddr;
     hdr_t header;
-    int32_t count;
+    int32_t rootcount, count, entry, keysize = mybp->keysize;
+    char *keys, keybuf[MAXSHAREDKEY];
+    int64_t subtrees, part;
+    int res = 0, onelevel;
 
-    setheader(&header, mybp->cursorpage);
+    if (mybp->nextpage == mybp->rootpagenum) {
+        /* emptry B-tree */
+        return -2;
+    }      
 
-    if (mybp->cursoroffset == -1) 
-        return -5;
+    if (nparts <= 1) 
+        return 1;
 
-    if (noswap) 
-        count = *(header.countptr);
-    else
-        xplatform_swapbytes(&count, header.countptr, 4);
+    if ((rootaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) 
+        return -9;
 
+    setheader(&header, rootaddr);
+    if (*(header.typeptr) == 'l') {
+        buffer_unref(mybp->buf, rootaddr);
+        return 1;
+    }
 
-    if (mybp->cursoroffset < (count - 1)) {      /* same cursor page */
-        mybp->cursoroffset++;
-        mybp->cursorptr = (char *)mybp->cursorptr + mybp->leafentrysize;
-        return 0;
-    } else {
-        pagenum_t rightsibnum;
+    if (mybp->noswap) 
+        rootcount = *(header.countptr);
+    else
+        xplatform_swapbytes(&rootcount, header.countptr, 4);
+
+    /* the root subtrees may differ much in size (an appended btree fills 
+       its right edge last), so go one level down unless it holds leaves
+       or the root alone has plenty of entries */
+    onelevel = (rootcount >= nparts * 16);
+
+    if ((keys = (char *)malloc((size_t)rootcount * 
+                               (onelevel ? 1 : mybp->indexfanout) * 
+                               keysize)) == NULL) {
+        buffer_unref(mybp->buf, rootaddr);
+        return -16;
+    }
 
-        if (noswap) 
-            rightsibnum = *(header.rightsibnumptr);
+    /* the first key of every subtree; the first is the zero key */
+    subtrees = 0;
+    for (entry = 0; entry < rootcount; entry++) {
+        const char *entryptr = entrykey(mybp, rootaddr, entry, keybuf);
+        const char *valueptr = entryvalue(mybp, rootaddr, entry);
+        pagenum_t childpagenum;
+        void *childaddr;
+        hdr_t childheader;
+        int32_t childentry;
+
+        if (onelevel) {
+            memcpy(keys + subtrees * keysize, entryptr, keysize);
+            subtrees++;
+            continue;
+        }
+
+        if (mybp->noswap) 
+            memcpy(&childpagenum, valueptr, 8);
         else
-            xplatform_swapbytes(&rightsibnum, header.rightsibnumptr, 8);
+            xplatform_swapbytes(&childpagenum, valueptr, 8);
 
-        if (rightsibnum == -1) { /* already at the last leaf page */
-            btree_stopcursor(bp);
-            return 1;
-        }  else {             /* cross over */
-            void *nextpage;
-            
-            if ((nextpage = buffer_fix(mybp->buf, rightsibnum)) == NULL) {
-                /* cannot fix next page */
-                return -9;
-            }
+        if ((childaddr = fixnode(mybp, childpagenum)) == NULL) {
+            res = -9;
+            break;
+        }
 
-            buffer_unref(mybp->buf, mybp->cursorpage);
-            mybp->cursorpage = nextpage;
-            mybp->cursoroffset = 0;
-            mybp->cursorptr = (char *)mybp->cursorpage + hdrsize;
-            return 0;
+        setheader(&childheader, childaddr);
+        if (*(childheader.typeptr) == 'l') {
+            /* the children are leaves: partition the root entries */
+            buffer_unref(mybp->buf, childaddr);
+            onelevel = 1;
+            memcpy(keys + subtrees * keysize, entryptr, keysize);
+            subtrees++;
+            continue;
         }
+
+        if (mybp->noswap) 
+            count = *(childheader.countptr);
+        else
+            xplatform_swapbytes(&count, childheader.countptr, 4);
+
+        for (childentry = 0; childentry < count; childentry++) {
+            memcpy(keys + subtrees * keysize, 
+                   entrykey(mybp, childaddr, childentry, keybuf), keysize);
+            subtrees++;
+        }
+
+        buffer_unref(mybp->buf, childaddr);
+    }
+
+    buffer_unref(mybp->buf, rootaddr);
+
+    if (res != 0) {
+        free(keys);
+        return res;
+    }
+
+    /* range j starts at subtree j * subtrees / nparts */
+    if (nparts > subtrees) 
+        nparts = (int)subtrees;
+
+    for (part = 1; part < nparts; part++) {
+        const char *key = keys + (part * subtrees / nparts) * keysize;
+        char *dest = (char *)bounds + (part - 1) * keysize;
+
+        if (mybp->noswapkey)
+            memcpy(dest, key, keysize);
+        else
+            xplatform_swapbytes(dest, key, keysize);
     }
+
+    free(keys);
+    return nparts;
 }
 
 
 /*
- * btree_stopcursor - stop the cursor and release resources
+ * btree_getcursor - retrieve the content of the object pointed by 
+ *                   the current cursor
+ *
+ * - return 0 if OK, -5 if no cursor in effect, 
+ *   -13 if no schema defined but request a particular field 
+ *   -14 if schema is defined but cannot find the particular field
  *
- * return 0 if OK, -5 if no cursor in effect
  */
-int btree_stopcursor(btree_t *bp)
+int btree_getcursor(btree_t *bp, void *key, const char *fieldname, void *value)
 {
     mybtree_t *mybp = (mybtree_t *)bp;
+    const void *src;
+    char keybuf[MAXSHAREDKEY];
+    int32_t fieldind;
 
     if (mybp->cursoroffset == -1) return -5;
 
-    mybp->cursoroffset = -1;
-    buffer_unref(mybp->buf, mybp->cursorpage);
+    /* determine what to do with the payload */
+    if ((fieldind = whichfield(mybp, fieldname)) < 0) 
+        return fieldind;
+
+    src = entrykey(mybp, mybp->cursorpage, mybp->cursoroffset, keybuf);
+    if (mybp->noswapkey)
+        memcpy(key, src, mybp->keysize);
+    else
+        xplatform_swapbytes(key, src, mybp->keysize);
+
+    if (value != NULL) 
+        extractbatch(mybp, &value, mybp->cursorpage, mybp->cursoroffset, 1,
+                     fieldind);
+
     return 0;
 }
 
+    
 
 /*
- * btree_beginappend - start a transaction to append records 
+ * btree_getcursorbatch - retrieve up to max objects from the cursor to the
+ *                        end of the cursor page, and move the cursor past
+ *                        them
  *
- * - locate the right most leaf page and fix the rightmost path from 
- *   the B-tree root page to this leaf page
- * - return 0 if OK, -6 if illegal fillratio, -9 if low level IO error
- *   occurs, -1 if in conflict mode
+ * - the keys are stored back to back in keys (max * keysize bytes); the
+ *   payloads (or the field) in values[i], unless values is NULL
+ * - the keys, then each field, are copied in one pass over the entries
+ * - a cursor left on a leaf emptied by deletes moves on to the next 
+ *   records first
+ * - when the batch drains the last leaf (or reaches the stop key of a 
+ *   range cursor), the cursor is stopped and the next call returns 0
+ * - return the number of objects retrieved, 0 if the cursor has passed 
+ *   the end of the btree, -5 if no cursor in effect, -9 if low level IO 
+ *   error, -13 if no schema defined but request a particular field,
+ *   -14 if schema is defined but cannot find the particular field
  *
  */
-int btree_beginappend(btree_t *bp, double fillratio)
+int btree_getcursorbatch(btree_t *bp, int max, void *keys, 
+                         const char *fieldname, void *values[])
 {
     mybtree_t *mybp = (mybtree_t *)bp;
-    void *pageaddr;
     hdr_t header;
+    int32_t fieldind, count, batch, index, keysize, recordsize, part;
+    const char *src;
+    char *dest;
+    int hitstop, res;
 
+    if (mybp->cursoroffset == -1) 
+        return (mybp->cursorend) ? 0 : -5;
 
-    if (mybp->enableappend == 1) {
-        /* append mode already in effect */
-        return 0;
-    }
+    /* determine what to do with the payload */
+    if ((fieldind = whichfield(mybp, fieldname)) < 0) 
+        return fieldind;
 
-    if (mybp->cursoroffset != -1) {
-        /* curosr mode in effect */
-        return -1;
-    }
+    setheader(&header, mybp->cursorpage);
+    if (mybp->noswap) 
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
 
-    if ((fillratio <= 0) || (fillratio > 1)) {
-        /* invalid fillratio */
-        return -6;
+    if (mybp->cursoroffset >= count) {
+        /* a leaf emptied by deletes: the records go on in the next ones */
+        if ((res = crosscursor(mybp)) != 0) 
+            return (res == 1) ? 0 : res;
+        if (pastcursorstop(mybp, mybp->cursorpage, mybp->cursoroffset)) {
+            btree_stopcursor(bp);
+            mybp->cursorend = 1;
+            return 0;
+        }
+
+        setheader(&header, mybp->cursorpage);
+        if (mybp->noswap) 
+            count = *(header.countptr);
+        else
+            xplatform_swapbytes(&count, header.countptr, 4);
     }
 
-    mybp->allowschema = 0;
+    batch = count - mybp->cursoroffset;
+    if (batch > max) 
+        batch = max;
+    if (batch <= 0) 
+        return 0;
+
+    keysize = mybp->keysize;
+    recordsize = entrysize(mybp, mybp->cursorpage);
+    part = keypart(mybp, mybp->cursorpage);
+
+    /* a range cursor stops at the first entry not below the stop key */
+    hitstop = pastcursorstop(mybp, mybp->cursorpage, 
+                             mybp->cursoroffset + batch - 1);
+    if (hitstop) {
+        int32_t low = 0, high = batch - 1;
+
+        /* the cursor entry itself is below the stop key */
+        while (high - low > 1) {
+            int32_t middle = (low + high) / 2;
+
+            if (pastcursorstop(mybp, mybp->cursorpage, 
+                               mybp->cursoroffset + middle)) 
+                high = middle;
+            else 
+                low = middle;
+        }
+        batch = high;
+    }
+    src = (const char *)mybp->cursorptr;
+    dest = (char *)keys;
+    if ((mybp->layout & BTREE_PREFIXKEYS) != 0) {
+        const unsigned char *shared = 
+            (const unsigned char *)mybp->cursorpage + hdrsize;
+        char keybuf[MAXSHAREDKEY];
+
+        /* each key is the template with the entry's own bytes laid over */
+        memcpy(keybuf, shared + 2, keysize);
+        for (index = 0; index < batch; index++) {
+            memcpy(keybuf + shared[0], src, part);
+            if (mybp->noswapkey)
+                memcpy(dest, keybuf, keysize);
+            else
+                xplatform_swapbytes(dest, keybuf, keysize);
+            dest += keysize;
+            src += recordsize;
+        }
+    } else if (mybp->noswapkey) {
+        for (index = 0; index < batch; index++) {
+            memcpy(dest, src, keysize);
+            dest += keysize;
+            src += recordsize;
+        }
+    } else {
+        for (index = 0; index < batch; index++) {
+            xplatform_swapbytes(dest, src, keysize);
+            dest += keysize;
+            src += recordsize;
+        }
+    }
+
+    if (values != NULL) 
+        extractbatch(mybp, values, mybp->cursorpage, mybp->cursoroffset,
+                     batch, fieldind);
+
+    if (hitstop) {
+        btree_stopcursor(bp);
+        mybp->cursorend = 1;
+    } else if (mybp->cursoroffset + batch < count) {
+        mybp->cursoroffset += batch;
+        mybp->cursorptr = (char *)mybp->cursorptr + batch * recordsize;
+    } else {
+        /* step onto the last entry and cross over as advcursor does */
+        mybp->cursoroffset = count - 1;
+        mybp->cursorptr = entrybase(mybp, mybp->cursorpage) +
+            (count - 1) * recordsize;
+        if (btree_advcursor(bp) == -9) 
+            return -9;
+    }
+
+    return batch;
+}
+
+    
+
+/*
+ * btree_advcusor - move the curosr one step forward
+ *
+ * - when reaching the end of the etree (or the stop key of a range 
+ *   cursor), invalidate the cursor 
+ * - when crossing to the next leaf, keep the readahead window going
+ * - return 0 if OK, 1 if end of btree is reached,
+ *   -5 if no cursor in effect, -9 if low level IO error
+ *
+ */
+int btree_advcursor(btree_t *bp)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+    hdr_t header;
+    int32_t count;
+    int res;
+
+    if (mybp->cursoroffset == -1) 
+        return -5;
+
+    setheader(&header, mybp->cursorpage);
+    if (mybp->noswap) 
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+
+    if (mybp->cursoroffset < (count - 1)) {      /* same cursor page */
+        mybp->cursoroffset++;
+        mybp->cursorptr = (char *)mybp->cursorptr + 
+            entrysize(mybp, mybp->cursorpage);
+    } else if ((res = crosscursor(mybp)) != 0) 
+        /* 1 at the last leaf page, or -9 */
+        return res;
+
+    if (pastcursorstop(mybp, mybp->cursorpage, mybp->cursoroffset)) {
+        btree_stopcursor(bp);
+        mybp->cursorend = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * crosscursor - move the cursor to the first entry of the next non-empty
+ *               leaf page
+ *
+ * - at the last leaf page, stop the cursor
+ * - return 0 if OK, 1 if end of btree is reached, -9 if low level IO error
+ *
+ */
+int crosscursor(mybtree_t *mybp)
+{
+    hdr_t header;
+    pagenum_t rightsibnum;
+    int32_t count;
+
+    do {
+        void *nextpage;
+
+        setheader(&header, mybp->cursorpage);
+        if (mybp->noswap) 
+            rightsibnum = *(header.rightsibnumptr);
+        else
+            xplatform_swapbytes(&rightsibnum, header.rightsibnumptr, 8);
+
+        if (rightsibnum == -1) { /* already at the last leaf page */
+            btree_stopcursor((btree_t *)mybp);
+            mybp->cursorend = 1;
+            return 1;
+        }
+
+        readahead(mybp, rightsibnum);
+        buffer_readrun(mybp->buf, rightsibnum, cursorrun);
+
+        if ((nextpage = buffer_fix(mybp->buf, rightsibnum)) == NULL) {
+            /* cannot fix next page */
+            return -9;
+        }
+
+        buffer_unref(mybp->buf, mybp->cursorpage);
+        mybp->cursorpage = nextpage;
+        mybp->cursorpagenum = rightsibnum;
+        mybp->cursoroffset = 0;
+        mybp->cursorptr = entrybase(mybp, mybp->cursorpage);
+
+        /* leaves emptied by deletes are skipped */
+        setheader(&header, nextpage);
+        if (mybp->noswap) 
+            count = *(header.countptr);
+        else
+            xplatform_swapbytes(&count, header.countptr, 4);
+    } while (count == 0);
+
+    return 0;
+}
+
+
+/*
+ * pastcursorstop - whether the leaf entry is at or beyond the stop key of
+ *                  a range cursor
+ *
+ */
+int pastcursorstop(mybtree_t *mybp, const void *pageaddr, int32_t entry)
+{
+    char keybuf[MAXSHAREDKEY];
+
+    return (mybp->cursorbounded && 
+            (mybp->compare(mybp->cursorstop, 
+                           entrykey(mybp, pageaddr, entry, keybuf), 
+                           mybp->keysize) <= 0));
+}
+
+
+/*
+ * readahead - maintain the readahead window of the cursor as it crosses
+ *             to the right sibling page
+ *
+ * - a crossing to the physically next page keeps the scan sequential;
+ *   once half of the window has been consumed, the window is doubled 
+ *   (up to ramaxwindow) and the pages beyond what has already been 
+ *   requested are hinted to the kernel
+ * - any other crossing resets the window 
+ *
+ */
+void readahead(mybtree_t *mybp, pagenum_t rightsibnum)
+{
+    pagenum_t wantend;
+
+    if (rightsibnum != mybp->cursorpagenum + 1) {
+        /* the scan jumped; start over from the new position */
+        mybp->rawindow = 0;
+        mybp->raend = rightsibnum + 1;
+        return;
+    }
+
+    if (mybp->rawindow == 0) 
+        mybp->rawindow = raminwindow;
+    else if (rightsibnum + mybp->rawindow / 2 < mybp->raend) 
+        /* enough requested ahead of the cursor */
+        return;
+    else if (mybp->rawindow < ramaxwindow) 
+        mybp->rawindow *= 2;
+
+    wantend = rightsibnum + mybp->rawindow;
+    if (wantend > mybp->nextpage) 
+        wantend = mybp->nextpage;
+
+    if (mybp->raend < rightsibnum) 
+        mybp->raend = rightsibnum;
+
+    if (wantend > mybp->raend) {
+        buffer_readahead(mybp->buf, mybp->raend, 
+                         (int)(wantend - mybp->raend));
+        mybp->raend = wantend;
+    }
+    return;
+}
+
+
+/*
+ * btree_stopcursor - stop the cursor and release resources
+ *
+ * return 0 if OK, -5 if no cursor in effect
+ */
+int btree_stopcursor(btree_t *bp)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    if (mybp->cursoroffset == -1) return -5;
+
+    mybp->cursoroffset = -1;
+    mybp->cursorend = 0;
+    buffer_unref(mybp->buf, mybp->cursorpage);
+    return 0;
+}
+
+
+/*
+ * btree_beginappend - start a transaction to append records 
+ *
+ * - locate the right most leaf page and fix the rightmost path from 
+ *   the B-tree root page to this leaf page
+ * - return 0 if OK, -6 if illegal fillratio, -9 if low level IO error
+ *   occurs, -1 if in conflict mode
+ *
+ */
+int btree_beginappend(btree_t *bp, double fillratio)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+    void *pageaddr;
+    hdr_t header;
+
+
+    if (mybp->enableappend == 1) {
+        /* append mode already in effect */
+        return 0;
+    }
+
+    if (mybp->cursoroffset != -1) {
+        /* curosr mode in effect */
+        return -1;
+    }
+
+    if ((fillratio <= 0) || (fillratio > 1)) {
+        /* invalid fillratio */
+        return -6;
+    }
+
+    mybp->allowschema = 0;
+    dropfinger(mybp);
 
     if ((mybp->nextpage == mybp->rootpagenum) &&     /* empty B-tree */
         ((pageaddr = buffer_emptyfix(mybp->buf, mybp->rootpagenum)) != NULL)) {
@@ -1505,8 +2690,9 @@ int btree_beginappend(btree_t *bp, double fillratio)
         mybp->nextpage = mybp->rootpagenum + 1; 
 
         setheader(&header, pageaddr);
+        setlinks(mybp, &header, pageaddr);
 
-        if (noswap) {
+        if (mybp->noswap) {
             *(header.countptr) = count;
             *(header.rightsibnumptr) = rightsibnum;
         } else {
@@ -1520,12 +2706,13 @@ int btree_beginappend(btree_t *bp, double fillratio)
     } else {
         void *ppageaddr;
 
-        if ((ppageaddr = buffer_fix(mybp->buf, mybp->rootpagenum)) == NULL) {
+        if ((ppageaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) {
             /*cannot fix root page */
             return -9;
         }
 
         setheader(&header, ppageaddr);
+        setlinks(mybp, &header, ppageaddr);
         *(header.ppageaddrptr) = NULL;
         pageaddr = sink(mybp, ppageaddr, 1);
     }
@@ -1539,6 +2726,7 @@ int btree_beginappend(btree_t *bp, double fillratio)
     mybp->appendpage = pageaddr;
     mybp->appendleafmax = (int32_t)(mybp->leafcapacity * fillratio);
     mybp->appendindexmax = (int32_t)(mybp->indexfanout * fillratio);
+    mybp->appendroom = (int32_t)(mybp->pageroom * fillratio);
 
     return 0;
 }
@@ -1588,6 +2776,9 @@ int btree_append(btree_t *bp, const void *key, const void *value)
     } else /* part of a bulk append */
         intx = 1;
 
+    /* a search in between appends may have set the finger */
+    dropfinger(mybp);
+
     if ((mybp->appendpage = append(mybp, mybp->appendpage, key, value, &res))
         == NULL) {
         /* either -8 (out of order key) or -9 (IO error) */
@@ -1602,103 +2793,453 @@ int btree_append(btree_t *bp, const void *key, const void *value)
 
 
 /*
- * btree_stat - printout btree statistics
+ * btree_bulkbuild - build an empty btree from one or more sorted streams
+ *                   of records
+ *
+ * - stream i is drained by streams[i](args[i], &key, &value); the streams
+ *   partition the key space in order: every key of stream i sorts before
+ *   the keys of stream i + 1
+ * - each stream is packed into leaves of fillratio * capacity records by
+ *   its own thread and the leaves are written buildrun pages at a time;
+ *   the index levels are then built bottom-up from the first key of each
+ *   leaf, the top level on the root page
+ * - the pages are written through a descriptor of their own, not through
+ *   the buffer, which holds no page of an empty btree
+ * - on failure the btree is left empty
+ * - return 0 if OK, -1 if in conflict mode, -6 if illegal fillratio, -8 if
+ *   a key is out of order, -9 if low level IO error occurs, -16 if out of
+ *   memory, -19 if the btree is not empty, -20 if a stream fails
  *
- * - find max/min/avg fanout for index pages
- * - find max/min/avg utilization on leafpages
- * - return 0 if OK, and other error code if applicable
- * 
  */
-int btree_printstat(btree_t *bp, FILE *fp)
+int btree_bulkbuild(btree_t *bp, int nstreams, btree_stream_t *streams[],
+                    void *args[], double fillratio)
 {
     mybtree_t *mybp = (mybtree_t *)bp;
-    void *pageaddr, *ppageaddr, *nextpageaddr;
-    hdr_t header;
-    pagenum_t leafpagecount, indexpagecount;
-    int leafcapmax, leafcapmin, leafcaptotal;
-    int indexcapmax, indexcapmin, indexcaptotal;
-    int depth, rootcap;
-    int count;
-    pagenum_t rightsibnum;
+    buildctl_t ctl;
+    buildstream_t *bs, *prevbs;
+    pthread_t *threads;
+    int64_t total, s;
+    int res = 0;
 
+    if ((mybp->enableappend == 1) || (mybp->cursoroffset != -1)) {
+        /* append or cursor mode in effect */
+        return -1;
+    }
 
-    if (mybp->nextpage == mybp->rootpagenum) {        /* empty B-tree */
-        return -2;
-    } 
+    if ((fillratio <= 0) || (fillratio > 1)) {
+        /* invalid fillratio */
+        return -6;
+    }
 
-    if ((ppageaddr = buffer_fix(mybp->buf, mybp->rootpagenum)) == NULL) {
-        /* cannot fix root page */
-        return -9;
+    if (mybp->nextpage != mybp->rootpagenum) {
+        /* not an empty btree */
+        return -19;
     }
-    depth = 1;
 
-    setheader(&header, ppageaddr);
+    if (nstreams <= 0) 
+        return 0;
 
-    *(header.ppageaddrptr) = NULL;
-    pageaddr = sink(mybp, ppageaddr, 0);
-    if (pageaddr == NULL) {
-        /* cannot fix the leaf page */
+    mybp->allowschema = 0;
+    dropfinger(mybp);
+
+    ctl.mybp = mybp;
+    ctl.nextpage = mybp->rootpagenum + 1;
+    ctl.failed = 0;
+    ctl.leafmax = (int32_t)(mybp->leafcapacity * fillratio);
+    if (ctl.leafmax < 1) 
+        ctl.leafmax = 1;
+    ctl.leafroom = (int32_t)(mybp->pageroom * fillratio);
+    ctl.indexmax = (int32_t)(mybp->indexplain * fillratio);
+    if (ctl.indexmax < 2) 
+        ctl.indexmax = 2;
+
+    if ((ctl.fd = open(mybp->pathname, O_WRONLY)) == -1) {
+        perror("btree_bulkbuild: open");
         return -9;
-    } 
-
-    /* record the parent location */
-    setheader(&header, pageaddr);
-    ppageaddr = *(header.ppageaddrptr);
-
-    /* process leaf pages first */
-    leafpagecount = 0;
-    leafcapmax = 0; leafcapmin = mybp->leafcapacity;
-    leafcaptotal = 0;
-    do {
+    }
 
-        setheader(&header, pageaddr);
-        leafpagecount++;
+    bs = (buildstream_t *)calloc(nstreams, sizeof(buildstream_t));
+    threads = (pthread_t *)malloc(nstreams * sizeof(pthread_t));
+    if ((bs == NULL) || (threads == NULL)) {
+        free(bs);
+        free(threads);
+        close(ctl.fd);
+        return -16;
+    }
+    pthread_mutex_init(&ctl.lock, NULL);
+
+    for (s = 0; s < nstreams; s++) {
+        bs[s].ctl = &ctl;
+        bs[s].stream = streams[s];
+        bs[s].arg = args[s];
+        bs[s].lastleaf = -1;
+        bs[s].run = (char *)malloc((size_t)buildrun * mybp->pagesize);
+        bs[s].lastkey = (char *)malloc(mybp->keysize);
+        if ((bs[s].run == NULL) || (bs[s].lastkey == NULL)) 
+            res = -16;
+    }
 
-        if (noswap) {
-            count = *(header.countptr);
-            rightsibnum = *(header.rightsibnumptr);
-        } else {
-            xplatform_swapbytes(&count, header.countptr, 4);
-            xplatform_swapbytes(&rightsibnum, header.rightsibnumptr, 8);
+    /* pack the leaves, one thread per stream; a stream that cannot get a
+       thread is drained by the caller */
+    if (res == 0) {
+        if (nstreams == 1) 
+            buildstream(&bs[0]);
+        else {
+            for (s = 0; s < nstreams; s++) {
+                if (pthread_create(&threads[s], NULL, buildstream, &bs[s])
+                    != 0) {
+                    buildstream(&bs[s]);
+                    bs[s].stream = NULL;
+                }
+            }
+            for (s = 0; s < nstreams; s++) {
+                if (bs[s].stream != NULL) 
+                    pthread_join(threads[s], NULL);
+            }
         }
 
+        for (s = 0; (s < nstreams) && (res == 0); s++) 
+            res = bs[s].res;
+    }
 
-        leafcapmax = (leafcapmax > count) ? leafcapmax : count;
-        leafcapmin = (leafcapmin < count) ? leafcapmin : count;
-        leafcaptotal += count;
-        
-        if (rightsibnum != -1 ){
-            if ((nextpageaddr = buffer_fix(mybp->buf, rightsibnum)) == NULL) {
-                /* cannot fix next leaf page */
-                return -9;
+    /* check the order across the streams and chain their leaves; gather
+       the leaves of all streams in bs[0] */
+    prevbs = NULL;
+    total = 0;
+    for (s = 0; (s < nstreams) && (res == 0); s++) {
+        if (bs[s].leafcount == 0) 
+            continue;
+
+        if (prevbs != NULL) {
+            if (mybp->compare(bs[s].firstkeys, prevbs->lastkey, 
+                              mybp->keysize) < 0) {
+                res = -8;
+                break;
+            }
+            if (linkleaf(&ctl, prevbs->lastleaf, bs[s].leafnums[0]) != 0) {
+                res = -9;
+                break;
+            }
+        }
+        prevbs = &bs[s];
+
+        if (s > 0) {
+            char *firstkeys;
+            pagenum_t *leafnums;
+
+            firstkeys = (char *)realloc(bs[0].firstkeys, (size_t)
+                                        (total + bs[s].leafcount) * 
+                                        mybp->keysize);
+            if (firstkeys != NULL) 
+                bs[0].firstkeys = firstkeys;
+            leafnums = (pagenum_t *)realloc(bs[0].leafnums, (size_t)
+                                            (total + bs[s].leafcount) * 
+                                            sizeof(pagenum_t));
+            if (leafnums != NULL) 
+                bs[0].leafnums = leafnums;
+            if ((firstkeys == NULL) || (leafnums == NULL)) {
+                res = -16;
+                break;
             }
-        } else nextpageaddr = NULL;
 
+            memcpy(bs[0].firstkeys + total * mybp->keysize, bs[s].firstkeys,
+                   (size_t)bs[s].leafcount * mybp->keysize);
+            memcpy(bs[0].leafnums + total, bs[s].leafnums,
+                   (size_t)bs[s].leafcount * sizeof(pagenum_t));
+            free(bs[s].firstkeys);
+            free(bs[s].leafnums);
+            bs[s].firstkeys = NULL;
+            bs[s].leafnums = NULL;
+        }
+        total += bs[s].leafcount;
+    }
 
-        buffer_unref(mybp->buf, pageaddr);
-        pageaddr = nextpageaddr;
+    /* build the index levels bottom-up */
+    if ((res == 0) && (total > 0)) 
+        res = packindex(&ctl, total, bs[0].firstkeys, bs[0].leafnums);
 
-    } while (pageaddr != NULL);
+    if ((res == 0) && (total > 0)) 
+        mybp->nextpage = ctl.nextpage;
+    else if (ftruncate(ctl.fd, (off_t)mybp->rootpagenum * mybp->pagesize)
+             != 0) 
+        perror("btree_bulkbuild: ftruncate");
 
-    /* recursively process index pages */
-    rootcap = -1;
-    indexpagecount = 0;
-    indexcapmax = 0; indexcapmin = mybp->indexfanout;
-    indexcaptotal = 0;
+    if ((close(ctl.fd) != 0) && (res == 0)) 
+        res = -9;
+    pthread_mutex_destroy(&ctl.lock);
 
-    while (ppageaddr != NULL) {
-        depth++;
-        pageaddr = ppageaddr;
+    for (s = 0; s < nstreams; s++) {
+        free(bs[s].run);
+        free(bs[s].lastkey);
+        free(bs[s].firstkeys);
+        free(bs[s].leafnums);
+    }
+    free(bs);
+    free(threads);
 
-        setheader(&header, pageaddr);
-        ppageaddr = *(header.ppageaddrptr);;
+    return res;
+}
 
-        do {
+
+/*
+ * btree_readbytes - read size bytes of the file at offset, which lie 
+ *                   before the root page or past the last page
+ *
+ * - return 0 if OK, -1 on error
+ *
+ */
+int btree_readbytes(btree_t *bp, void *dest, size_t size, off_t offset)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    return buffer_readbytes(mybp->buf, dest, size, offset);
+}
+
+
+/*
+ * btree_compress - write a compressed copy of the btree file
+ *
+ * - the pages before the root page (headers and schema) are copied as 
+ *   they are, the btree pages are compressed one by one and the bytes 
+ *   past the last page are kept
+ * - the btree must be opened O_RDONLY so that the file is up to date
+ * - return 0 if OK, -1 on error
+ *
+ */
+int btree_compress(btree_t *bp, const char *destpath)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    if ((mybp->flags & O_ACCMODE) != O_RDONLY) 
+        return -1;
+
+    return buffer_compress(mybp->buf, destpath, mybp->rootpagenum, 
+                           mybp->nextpage);
+}
+
+
+/*
+ * btree_freeze - rebuild the records of the btree into the empty btree 
+ *                destbp, in the frozen format
+ *
+ * - destbp takes the schema and the page format of the btree, with 
+ *   BTREE_FROZEN; it must be opened for write with the same key and value
+ *   size
+ * - the records are read by a cursor and bulk built into full leaves in
+ *   key order, followed by the index levels bottom-up, each level on 
+ *   consecutive pages
+ * - return 0 if OK, -1 if a cursor or append is in effect on either 
+ *   btree, -9 if low level IO error occurs, -11, -12 or -15 if the schema
+ *   cannot be registered, -16 if out of memory, -17 if destbp is not 
+ *   writable or not empty, -20 if the records cannot be read
+ *
+ */
+int btree_freeze(btree_t *bp, btree_t *destbp)
+{
+    mybtree_t *mybp = (mybtree_t *)bp, *destmybp = (mybtree_t *)destbp;
+    freezestream_t fs;
+    btree_stream_t *streams[1];
+    void *args[1];
+    char *valuebuf;
+    int32_t index, valuesize;
+    int res;
+
+    if ((mybp->enableappend) || (mybp->cursoroffset != -1)) 
+        return -1;
+
+    if (((destmybp->flags & O_ACCMODE) == O_RDONLY) ||
+        (destmybp->nextpage != destmybp->rootpagenum) || 
+        (destmybp->enableappend))
+        return -17;
+
+    if (mybp->schema != NULL) {
+        char *defstring;
+
+        if ((defstring = schema_getdefstring(mybp->schema)) == NULL) 
+            return -16;
+        res = btree_registerschema(destbp, defstring);
+        free(defstring);
+        if (res != 0) 
+            return res;
+    }
+
+    destmybp->format = mybp->layout | BTREE_FROZEN;
+    setcapacity(destmybp);
+    setrootpagenum(destmybp);
+    destmybp->nextpage = destmybp->rootpagenum + destmybp->pagecount;
+
+    switch (btree_initrangecursor(bp, NULL, NULL)) {
+    case(0) : 
+        break;
+    case(1) :
+    case(-2) :
+        /* an empty btree freezes into an empty btree */
+        return 0;
+    case(-16) :
+        return -16;
+    default :
+        return -9;
+    }
+
+    /* a batch never extends past the cursor page */
+    fs.bp = bp;
+    fs.max = mybp->leafcapacity;
+    fs.count = fs.next = 0;
+    valuesize = appvaluesize(mybp);
+    fs.keys = (char *)malloc((size_t)fs.max * mybp->keysize);
+    fs.values = (void **)malloc(fs.max * sizeof(void *));
+    valuebuf = (char *)malloc((size_t)fs.max * valuesize);
+    if ((fs.keys == NULL) || (fs.values == NULL) || (valuebuf == NULL)) 
+        res = -16;
+    else {
+        for (index = 0; index < fs.max; index++) 
+            fs.values[index] = valuebuf + index * valuesize;
+
+        streams[0] = freezestream;
+        args[0] = &fs;
+        res = btree_bulkbuild(destbp, 1, streams, args, 1.0);
+    }
+
+    btree_stopcursor(bp);
+    free(fs.keys);
+    free(fs.values);
+    free(valuebuf);
+
+    return res;
+}
+
+
+/*
+ * btree_getbufstat - copy the buffer pool and I/O statistics into *stat
+ *
+ * - return 0 if OK
+ *
+ */
+int btree_getbufstat(btree_t *bp, bufstat_t *stat)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    buffer_getstat(mybp->buf, stat);
+    return 0;
+}
+
+
+/*
+ * btree_printbufstat - print the buffer pool and I/O statistics as JSON
+ *
+ * - return 0 if OK
+ *
+ */
+int btree_printbufstat(btree_t *bp, FILE *fp)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+
+    buffer_printstat(mybp->buf, fp);
+    return 0;
+}
+
+
+/*
+ * btree_stat - printout btree statistics
+ *
+ * - find max/min/avg fanout for index pages
+ * - find max/min/avg utilization on leafpages
+ * - return 0 if OK, and other error code if applicable
+ * 
+ */
+int btree_printstat(btree_t *bp, FILE *fp)
+{
+    mybtree_t *mybp = (mybtree_t *)bp;
+    void *pageaddr, *ppageaddr, *nextpageaddr;
+    hdr_t header;
+    pagenum_t leafpagecount, indexpagecount;
+    int leafcapmax, leafcapmin, leafcaptotal;
+    int indexcapmax, indexcapmin, indexcaptotal;
+    int depth, rootcap;
+    int count;
+    pagenum_t rightsibnum;
+
+
+    if (mybp->nextpage == mybp->rootpagenum) {        /* empty B-tree */
+        return -2;
+    } 
+
+    if ((ppageaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) {
+        /* cannot fix root page */
+        return -9;
+    }
+    depth = 1;
+
+    setheader(&header, ppageaddr);
+    setlinks(mybp, &header, ppageaddr);
+
+    *(header.ppageaddrptr) = NULL;
+    pageaddr = sink(mybp, ppageaddr, 0);
+    if (pageaddr == NULL) {
+        /* cannot fix the leaf page */
+        return -9;
+    } 
+
+    /* record the parent location */
+    setheader(&header, pageaddr);
+    setlinks(mybp, &header, pageaddr);
+    ppageaddr = *(header.ppageaddrptr);
+
+    /* process leaf pages first */
+    leafpagecount = 0;
+    leafcapmax = 0; leafcapmin = mybp->leafcapacity;
+    leafcaptotal = 0;
+    do {
+
+        setheader(&header, pageaddr);
+        leafpagecount++;
+
+        if (mybp->noswap) {
+            count = *(header.countptr);
+            rightsibnum = *(header.rightsibnumptr);
+        } else {
+            xplatform_swapbytes(&count, header.countptr, 4);
+            xplatform_swapbytes(&rightsibnum, header.rightsibnumptr, 8);
+        }
+
+
+        leafcapmax = (leafcapmax > count) ? leafcapmax : count;
+        leafcapmin = (leafcapmin < count) ? leafcapmin : count;
+        leafcaptotal += count;
+        
+        if (rightsibnum != -1 ){
+            if ((nextpageaddr = buffer_fix(mybp->buf, rightsibnum)) == NULL) {
+                /* cannot fix next leaf page */
+                return -9;
+            }
+        } else nextpageaddr = NULL;
+
+
+        buffer_unref(mybp->buf, pageaddr);
+        pageaddr = nextpageaddr;
+
+    } while (pageaddr != NULL);
+
+    /* recursively process index pages */
+    rootcap = -1;
+    indexpagecount = 0;
+    indexcapmax = 0; indexcapmin = mybp->indexfanout;
+    indexcaptotal = 0;
+
+    while (ppageaddr != NULL) {
+        depth++;
+        pageaddr = ppageaddr;
+
+        setheader(&header, pageaddr);
+        setlinks(mybp, &header, pageaddr);
+        ppageaddr = *(header.ppageaddrptr);;
+
+        do {
             setheader(&header, pageaddr);
 
             indexpagecount++;
             
-            if (noswap) {
+            if (mybp->noswap) {
                 count = *(header.countptr);
                 rightsibnum = *(header.rightsibnumptr);
             } else {
@@ -1711,7 +3252,7 @@ int btree_printstat(btree_t *bp, FILE *fp)
                 indexcapmin = (indexcapmin < count) ? indexcapmin : count;
                 indexcaptotal += count;
             } else {
-                if (noswap) 
+                if (mybp->noswap) 
                     rootcap = *(header.countptr);
                 else 
                     xplatform_swapbytes(&rootcap, header.countptr, 4);
@@ -1775,8 +3316,13 @@ int btree_printstat(btree_t *bp, FILE *fp)
             indexcapmax * 100.0 / mybp->indexfanout);
     fprintf(fp, "  min utilization:\t\t%.2f%%\n",
            indexcapmin * 100.0 / mybp->indexfanout);
-    fprintf(fp, "  avg utilization:\t\t%.2f%%\n", 
+    fprintf(fp, "  avg utilization:\t\t%.2f%%\n\n", 
            indexcaptotal * 100.0 / (mybp->indexfanout * indexpagecount));
+
+    fprintf(fp, "Finger searches:\t\t%lld\n", 
+            (long long int)mybp->fingersearches);
+    fprintf(fp, "  hit rate:\t\t\t%.2f%%\n", (mybp->fingersearches == 0) ?
+            0.0 : mybp->fingerhits * 100.0 / mybp->fingersearches);
     fprintf(fp, "--------------------------------------------------------\n\n");
     return 0;
 }
@@ -1791,6 +3337,179 @@ int btree_printstat(btree_t *bp, FILE *fp)
  */
 
 
+/*
+ * budgetframes - return the number of frames of the buffer
+ *
+ * - the buffer takes bufsize megabytes, unless the environment variable
+ *   envname (ETREE_BUFFERSIZE for the pool, ETREE_PININDEXSIZE for the 
+ *   pinned region) sets a budget in bytes; the budget may end with
+ *   K, M or G (units of 1024)
+ * - there is at least one frame
+ *
+ */
+size_t budgetframes(int32_t bufsize, uint32_t pagesize, const char *envname)
+{
+    const char *budgetstr;
+    uint64_t budget;
+
+    budget = (uint64_t)bufsize * 1024 * 1024;
+
+    if ((budgetstr = getenv(envname)) != NULL) {
+        char *endptr;
+        uint64_t bytes = (uint64_t)strtoull(budgetstr, &endptr, 10);
+
+        switch (*endptr) {
+        case 'g': case 'G': bytes <<= 10;
+        case 'm': case 'M': bytes <<= 10;
+        case 'k': case 'K': bytes <<= 10; endptr++;
+        }
+
+        if ((endptr == budgetstr) || (*endptr != '\0') || (bytes == 0)) 
+            fprintf(stderr, "btree_open: ignore %s=%s\n", envname, 
+                    budgetstr);
+        else
+            budget = bytes;
+    }
+
+    return (budget / pagesize > 0) ? (size_t)(budget / pagesize) : 1;
+}
+
+
+/*
+ * pageclass - tell the buffer whether a fixed page is an index or a leaf
+ *             page, for its statistics
+ *
+ */
+int pageclass(const void *pageaddr)
+{
+    hdr_t header;
+
+    setheader(&header, pageaddr);
+    switch (*(header.typeptr)) {
+    case 'i': return BUF_INDEXPAGE;
+    case 'l': return BUF_LEAFPAGE;
+    default: return BUF_OTHERPAGE;
+    }
+}
+
+
+/*
+ * fixnode - fix a page met while descending the B-tree 
+ *
+ * - with O_PININDEX, index pages are moved to the pinned region of the 
+ *   buffer, so a descent only ever misses on the leaf
+ * - return the pointer to the page, NULL on error
+ *
+ */
+void *fixnode(mybtree_t *mybp, pagenum_t pagenum)
+{
+    void *pageaddr;
+    hdr_t header;
+
+    if ((pageaddr = buffer_fix(mybp->buf, pagenum)) == NULL) 
+        return NULL;
+
+    setheader(&header, pageaddr);
+    if ((mybp->pinindex) && (*(header.typeptr) != 'l'))
+        pageaddr = buffer_pin(mybp->buf, pageaddr);
+
+    return pageaddr;
+}
+
+
+/*
+ * xlatch - latch a page exclusive on behalf of the writer of a btree
+ *          shared with reader threads (O_CONCURRENT), until xrelease
+ *
+ * - the writer changes a page only under its exclusive latch; it reads
+ *   pages without latching them, since it is the only one to change them
+ * - the page is fixed once more, so that it keeps its frame (and latch)
+ *   while the operation unfixes its path
+ * - a page the writer has latched already is left alone
+ *
+ */
+void xlatch(mybtree_t *mybp, void *pageaddr)
+{
+    int32_t index;
+
+    if (!mybp->concurrent) 
+        return;
+
+    for (index = 0; index < mybp->xcount; index++) 
+        if (mybp->xpages[index] == pageaddr) 
+            return;
+
+    buffer_ref(mybp->buf, pageaddr);
+    buffer_latch(mybp->buf, pageaddr, 1);
+    mybp->xpages[mybp->xcount++] = pageaddr;
+    return;
+}
+
+
+/*
+ * xlatchpath - latch the pages that an insert of newcount keys into a 
+ *              leaf (fixed with its path) may change
+ *
+ * - the leaf, and if it may split, the ancestors up to the first one that
+ *   takes the separator of a split child without splitting itself (it 
+ *   has room for one more entry that shares no key byte)
+ * - the latches are taken from the top down, in the order readers take
+ *   theirs; readers that are not inside the subtree of the topmost page 
+ *   are never held up, and none can be inside it once the leaf is latched
+ *
+ */
+void xlatchpath(mybtree_t *mybp, void *pageaddr, int32_t newcount,
+                const void *keys[])
+{
+    void *path[MAXDEPTH];
+    int32_t depth = 0, count;
+    hdr_t header;
+
+    if (!mybp->concurrent) 
+        return;
+
+    path[depth++] = pageaddr;
+    if (!fits(mybp, pageaddr, newcount, keys, mybp->leafcapacity, 
+              mybp->pageroom)) {
+        setheader(&header, pageaddr);
+        setlinks(mybp, &header, pageaddr);
+        while ((depth < MAXDEPTH) && 
+               ((pageaddr = *(header.ppageaddrptr)) != NULL)) {
+            path[depth++] = pageaddr;
+
+            setheader(&header, pageaddr);
+            setlinks(mybp, &header, pageaddr);
+            if (mybp->noswap)
+                count = *(header.countptr);
+            else
+                xplatform_swapbytes(&count, header.countptr, 4);
+            if (count + 1 <= mybp->indexplain) 
+                break;
+        }
+    }
+
+    while (depth > 0) 
+        xlatch(mybp, path[--depth]);
+    return;
+}
+
+
+/*
+ * xrelease - release the pages latched by the writer
+ *
+ */
+void xrelease(mybtree_t *mybp)
+{
+    while (mybp->xcount > 0) {
+        void *pageaddr = mybp->xpages[--mybp->xcount];
+
+        buffer_unlatch(mybp->buf, pageaddr);
+        buffer_unref(mybp->buf, pageaddr);
+    }
+    return;
+}
+
+
 /*
  * locateleaf - traverse down the B-tree to find the page whose key 
  *              range cover the insert key value
@@ -1811,10 +3530,9 @@ void *locateleaf(mybtree_t *mybp, void * pageaddr, const void *key)
         return pageaddr; 
 
     entry = binarysearch(mybp, pageaddr, key);
-    hitptr = (char *)pageaddr + hdrsize + mybp->indexentrysize * entry 
-        + mybp->keysize;
+    hitptr = entryvalue(mybp, pageaddr, entry);
 
-    if (noswap)
+    if (mybp->noswap)
         /* childpagenum = *(pagenum_t *)hitptr; */
         /* hitptr may be not properly aligned, some platform (e.g. ALPHA)
            complains about this, though it can still run; to be safe
@@ -1824,12 +3542,13 @@ void *locateleaf(mybtree_t *mybp, void * pageaddr, const void *key)
     else
         xplatform_swapbytes(&childpagenum, hitptr, 8);
 
-    if ((childpageaddr = buffer_fix(mybp->buf, childpagenum)) == NULL) {
+    if ((childpageaddr = fixnode(mybp, childpagenum)) == NULL) {
         fprintf(stderr, "(DEBUG)locateleaf: cannot fix child page.\n");
         return NULL;
     }
 
     setheader(&childheader, childpageaddr);
+    setlinks(mybp, &childheader, childpageaddr);
 
     *(childheader.ppageaddrptr) = pageaddr;
     *(childheader.pentryptr) = entry;
@@ -1861,7 +3580,7 @@ void *sink(mybtree_t *mybp, void * pageaddr, int where)
     if (where == 0) 
         entry = 0;
     else {
-        if (noswap)
+        if (mybp->noswap)
             count = *(header.countptr);
         else
             xplatform_swapbytes(&count, header.countptr, 4);
@@ -1869,21 +3588,21 @@ void *sink(mybtree_t *mybp, void * pageaddr, int where)
         entry = count - 1;
     }
 
-    hitptr = (char *)pageaddr + hdrsize + mybp->indexentrysize * entry 
-        + mybp->keysize;
+    hitptr = entryvalue(mybp, pageaddr, entry);
 
-    if (noswap)
+    if (mybp->noswap)
         /* childpagenum = *(pagenum_t *)hitptr; */
         memcpy(&childpagenum, hitptr, 8);
     else
         xplatform_swapbytes(&childpagenum, hitptr, 8);
 
-    if ((childpageaddr = buffer_fix(mybp->buf, childpagenum)) == NULL) {
+    if ((childpageaddr = fixnode(mybp, childpagenum)) == NULL) {
         fprintf(stderr, "(DEBUG)sink: cannot fix child page.\n");
         return NULL;
     }
 
     setheader(&childheader, childpageaddr);
+    setlinks(mybp, &childheader, childpageaddr);
     *(childheader.ppageaddrptr) = pageaddr;
     *(childheader.pentryptr) = entry;
 
@@ -1892,13 +3611,1306 @@ void *sink(mybtree_t *mybp, void * pageaddr, int where)
 
 
 /*
- * cascadeunref - release all the fixes (references) on the path to the root
+ * relocateleaf - find the leaf page of key, given a fixed page (and path)
+ *
+ * - unfix the page and move to its parent until the page covers key, up
+ *   to the root; then descend from there 
+ * - a leaf that covers key is returned as is, without a descent
+ * - return the pointer to the leaf page, NULL on error
  *
  */
-
-void cascadeunref(mybtree_t *mybp, void *pageaddr)
+void *relocateleaf(mybtree_t *mybp, void *pageaddr, const void *key)
 {
-    void *addr;
+    hdr_t header;
+    void *ppageaddr;
+
+    while (!covers(mybp, pageaddr, key)) {
+        setheader(&header, pageaddr);
+        setlinks(mybp, &header, pageaddr);
+        ppageaddr = *(header.ppageaddrptr);
+
+        buffer_unref(mybp->buf, pageaddr);
+        pageaddr = ppageaddr;
+    }
+
+    return locateleaf(mybp, pageaddr, key);
+}
+
+
+/*
+ * covers - tell whether the key range of a fixed page holds key
+ *
+ * - the range of a page is bounded by the separators of its entry in the
+ *   parent, the entry's own key below (unless it is the first entry) and
+ *   the next entry's key above (unless it is the last); a missing bound 
+ *   is that of the parent, so look further up for it
+ * - the root covers all keys
+ * - return 1 if the page covers key, 0 if not
+ *
+ */
+int covers(mybtree_t *mybp, const void *pageaddr, const void *key)
+{
+    hdr_t header, pheader;
+    const void *ppageaddr;
+    char keybuf[MAXSHAREDKEY];
+    int32_t pcount, pentry;
+    int needlow = 1, needhigh = 1;
+
+    while (needlow || needhigh) {
+        setheader(&header, pageaddr);
+        setlinks(mybp, &header, pageaddr);
+        if ((ppageaddr = *(header.ppageaddrptr)) == NULL) 
+            break;
+
+        setheader(&pheader, ppageaddr);
+        if (mybp->noswap)
+            pcount = *(pheader.countptr);
+        else
+            xplatform_swapbytes(&pcount, pheader.countptr, 4);
+
+        pentry = *(header.pentryptr);
+
+        if ((needlow) && (pentry > 0)) {
+            if (mybp->compare(key, entrykey(mybp, ppageaddr, pentry, keybuf),
+                              mybp->keysize) < 0) 
+                return 0;
+            needlow = 0;
+        }
+        if ((needhigh) && (pentry < pcount - 1)) {
+            if (mybp->compare(key, 
+                              entrykey(mybp, ppageaddr, pentry + 1, keybuf),
+                              mybp->keysize) >= 0) 
+                return 0;
+            needhigh = 0;
+        }
+
+        pageaddr = ppageaddr;
+    }
+
+    return 1;
+}
+
+
+/*
+ * fingerentrypoint - findentrypoint, starting from the finger if one is
+ *                    set; the finger is handed over to the caller
+ *
+ */
+int32_t fingerentrypoint(mybtree_t *mybp, const void *key, void **pageaddrptr)
+{
+    void *pageaddr;
+
+    if ((pageaddr = mybp->fingerpage) == NULL) 
+        return findentrypoint(mybp, key, pageaddrptr);
+
+    mybp->fingerpage = NULL;
+    mybp->fingersearches++;
+    if (covers(mybp, pageaddr, key)) 
+        mybp->fingerhits++;
+    else if ((pageaddr = relocateleaf(mybp, pageaddr, key)) == NULL) {
+        fprintf(stderr, "(DEBUG)fingerentrypoint: cannot fix leaf page.\n");
+        return -9;
+    }
+
+    *pageaddrptr = pageaddr;
+    return binarysearch(mybp, pageaddr, key);
+}
+
+
+/*
+ * dropfinger - release the path held by the finger
+ *
+ * - done before the btree is modified (insert, bulk insert, bulk update,
+ *   delete, delete range, append, bulk build), which may move entries
+ *   between the pages of the path
+ *
+ */
+void dropfinger(mybtree_t *mybp)
+{
+    if (mybp->fingerpage != NULL) {
+        cascadeunref(mybp, mybp->fingerpage);
+        mybp->fingerpage = NULL;
+    }
+    return;
+}
+
+
+/*
+ * sortprobes - sort the indices of the keys by key
+ *
+ * - bottom-up merge sort, stable; keys already in order cost one pass
+ * - return 0 if OK, -1 if out of memory
+ *
+ */
+int sortprobes(mybtree_t *mybp, int count, const void *keys[], int *order)
+{
+    int *from, *to, *tmp, width, i;
+
+    for (i = 0; i < count; i++) 
+        order[i] = i;
+
+    /* skip the sort if the keys are in order */
+    for (i = 1; i < count; i++) 
+        if (mybp->compare(keys[i - 1], keys[i], mybp->keysize) > 0) 
+            break;
+    if (i == count) 
+        return 0;
+
+    if ((tmp = (int *)malloc(sizeof(int) * count)) == NULL) 
+        return -1;
+
+    from = order;
+    to = tmp;
+    for (width = 1; width < count; width *= 2) {
+        for (i = 0; i < count; i += 2 * width) {
+            int left = i, mid, right, end, j;
+
+            mid = (i + width < count) ? i + width : count;
+            end = (i + 2 * width < count) ? i + 2 * width : count;
+            right = mid;
+            for (j = i; j < end; j++) {
+                if ((left < mid) && 
+                    ((right >= end) || 
+                     (mybp->compare(keys[from[left]], keys[from[right]],
+                                    mybp->keysize) <= 0)))
+                    to[j] = from[left++];
+                else
+                    to[j] = from[right++];
+            }
+        }
+        tmp = from;
+        from = to;
+        to = tmp;
+    }
+
+    if (from != order) 
+        memcpy(order, from, sizeof(int) * count);
+    free((from == order) ? to : from);
+
+    return 0;
+}
+
+
+/*
+ * fencebase - return the start of the fence array of a page
+ *
+ */
+const char *fencebase(mybtree_t *mybp, const void *pageaddr)
+{
+    hdr_t header;
+    int32_t fences;
+
+    setheader(&header, pageaddr);
+    fences = (*(header.typeptr) == 'l') ? 
+        mybp->leaffences : mybp->indexfences;
+
+    return (const char *)pageaddr + mybp->pagesize - fences * mybp->keysize;
+}
+
+
+/*
+ * markpage - mark a page modified and, with BTREE_SEARCHINDEX, rebuild its
+ *            fence array from the entries
+ *
+ * - every change to a page is followed by markpage
+ *
+ */
+void markpage(mybtree_t *mybp, void *pageaddr)
+{
+    buffer_mark(mybp->buf, pageaddr);
+    buildfences(mybp, pageaddr);
+
+    return;
+}
+
+
+/*
+ * buildfences - with BTREE_SEARCHINDEX, rebuild the fence array of a page
+ *               from its entries
+ *
+ * - fence i holds the key of entry (i + 1) * fencestep
+ *
+ */
+void buildfences(mybtree_t *mybp, void *pageaddr)
+{
+    hdr_t header;
+    int32_t count, recordsize, fences, i;
+    const char *entry;
+    char *fence;
+
+    if ((mybp->layout & BTREE_SEARCHINDEX) == 0) 
+        return;
+
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    recordsize = entrysize(mybp, pageaddr);
+    fences = (count > 0) ? (count - 1) / fencestep : 0;
+
+    fence = (char *)fencebase(mybp, pageaddr);
+    entry = entrybase(mybp, pageaddr) + fencestep * recordsize;
+    for (i = 0; i < fences; i++) {
+        memcpy(fence, entry, mybp->keysize);
+        fence += mybp->keysize;
+        entry += fencestep * recordsize;
+    }
+
+    return;
+}
+
+
+/*
+ * setcapacity - compute the entry sizes, the leaf capacity and the index
+ *               fanout from the page size and the format
+ *
+ * - with BTREE_SEARCHINDEX, a page of capacity c keeps (c - 1) / fencestep
+ *   fence keys at its end
+ * - with BTREE_PREFIXKEYS, the entry sizes are those of unshared keys and
+ *   the capacity is that of a full page (see MAXSHAREDKEY)
+ * - the flags that shape the pages are copied to layout, which the page
+ *   routines read: a writer sets BTREE_FREEPAGES in format while the 
+ *   readers of an O_CONCURRENT btree are searching
+ *
+ */
+void setcapacity(mybtree_t *mybp)
+{
+    uint32_t payloadsize = mybp->pagesize - hdrsize;
+
+    mybp->layout = mybp->format & ~BTREE_FREEPAGES;
+    mybp->leafentrysize = mybp->keysize + mybp->valuesize;
+    mybp->leafcapacity = payloadsize / mybp->leafentrysize;
+    mybp->indexentrysize = mybp->keysize + sizeof(pagenum_t);
+    mybp->indexfanout = payloadsize / mybp->indexentrysize;
+    mybp->leaffences = mybp->indexfences = 0;
+    mybp->entryoffset = hdrsize;
+    mybp->pageroom = payloadsize;
+
+    if ((mybp->layout & BTREE_PREFIXKEYS) != 0) {
+        mybp->entryoffset = hdrsize + 2 + mybp->keysize;
+        mybp->pageroom = mybp->pagesize - mybp->entryoffset;
+        mybp->leafplain = mybp->pageroom / mybp->leafentrysize;
+        mybp->indexplain = mybp->pageroom / mybp->indexentrysize;
+        mybp->leafcapacity = 2 * mybp->leafplain - 1;
+        mybp->indexfanout = 2 * mybp->indexplain - 1;
+        return;
+    }
+
+    if ((mybp->layout & BTREE_SEARCHINDEX) != 0) {
+        while (mybp->leafcapacity * mybp->leafentrysize + 
+               (mybp->leafcapacity - 1) / fencestep * mybp->keysize > 
+               payloadsize)
+            mybp->leafcapacity--;
+        mybp->leaffences = (mybp->leafcapacity - 1) / fencestep;
+
+        while (mybp->indexfanout * mybp->indexentrysize + 
+               (mybp->indexfanout - 1) / fencestep * mybp->keysize > 
+               payloadsize)
+            mybp->indexfanout--;
+        mybp->indexfences = (mybp->indexfanout - 1) / fencestep;
+    }
+
+    mybp->leafplain = mybp->leafcapacity;
+    mybp->indexplain = mybp->indexfanout;
+
+    return;
+}
+
+
+/*
+ * validformat - whether the page format flags are known and go together
+ *
+ * - BTREE_PREFIXKEYS keeps the shared lengths in one byte each and has no
+ *   room for fences; its entries change size, so leaves cannot be laid
+ *   out by columns either
+ *
+ */
+int validformat(mybtree_t *mybp, uint32_t format)
+{
+    if ((format & ~(BTREE_SEARCHINDEX | BTREE_PREFIXKEYS | BTREE_FROZEN |
+                    BTREE_FREEPAGES | BTREE_COLUMNS)) != 0)
+        return 0;
+
+    if (((format & BTREE_PREFIXKEYS) != 0) &&
+        (((format & (BTREE_SEARCHINDEX | BTREE_COLUMNS)) != 0) || 
+         (mybp->keysize > MAXSHAREDKEY)))
+        return 0;
+
+    return 1;
+}
+
+
+/*
+ * setrootpagenum - place the root page after the meta data and schema
+ *
+ */
+void setrootpagenum(mybtree_t *mybp)
+{
+    off_t rootstart;
+
+    rootstart = mybp->startoffset + metahdrsize + mybp->asciischemasize;
+    if (mybp->format != 0) 
+        rootstart += 4;
+
+    if (rootstart % mybp->pagesize == 0) 
+        mybp->rootpagenum = (pagenum_t)(rootstart / mybp->pagesize);
+    else
+        mybp->rootpagenum = (pagenum_t)(rootstart / mybp->pagesize) + 1;
+
+    return;
+}
+
+
+/*
+ * entrybase - the address of the first entry of a page
+ *
+ */
+char *entrybase(mybtree_t *mybp, const void *pageaddr)
+{
+    return (char *)pageaddr + mybp->entryoffset;
+}
+
+
+/*
+ * keypart - the number of key bytes kept in each entry of a page
+ *
+ */
+int32_t keypart(mybtree_t *mybp, const void *pageaddr)
+{
+    const unsigned char *shared = (const unsigned char *)pageaddr + hdrsize;
+    int32_t sharedsize;
+
+    if ((mybp->layout & BTREE_PREFIXKEYS) == 0) 
+        return mybp->keysize;
+
+    sharedsize = shared[0] + shared[1];
+    return (sharedsize < (int32_t)mybp->keysize) ? 
+        (int32_t)mybp->keysize - sharedsize : 0;
+}
+
+
+/*
+ * entrysize - the size of an entry of a page
+ *
+ * - with BTREE_COLUMNS, the entries of a leaf are its keys only
+ *
+ */
+int32_t entrysize(mybtree_t *mybp, const void *pageaddr)
+{
+    hdr_t header;
+    int32_t fullsize;
+
+    if (columnar(mybp, pageaddr)) 
+        return mybp->keysize;
+
+    setheader(&header, pageaddr);
+    fullsize = (*(header.typeptr) == 'l') ? 
+        mybp->leafentrysize : mybp->indexentrysize;
+
+    return fullsize - mybp->keysize + keypart(mybp, pageaddr);
+}
+
+
+/*
+ * entrykey - the key of an entry of a page, in storage format
+ *
+ * - with BTREE_PREFIXKEYS the key is put together in keybuf (keysize 
+ *   bytes) from the template and the entry; otherwise the entry itself
+ *   is returned
+ *
+ */
+const char *entrykey(mybtree_t *mybp, const void *pageaddr, int32_t entry, 
+                     char *keybuf)
+{
+    const unsigned char *shared = (const unsigned char *)pageaddr + hdrsize;
+    const char *entryptr;
+    int32_t part;
+
+    entryptr = entrybase(mybp, pageaddr) + entry * entrysize(mybp, pageaddr);
+    if ((mybp->layout & BTREE_PREFIXKEYS) == 0) 
+        return entryptr;
+
+    memcpy(keybuf, shared + 2, mybp->keysize);
+    if ((part = keypart(mybp, pageaddr)) > 0) 
+        memcpy(keybuf + shared[0], entryptr, part);
+
+    return keybuf;
+}
+
+
+/*
+ * entryvalue - the value (or child page number) of an entry of a page
+ *
+ * - not for the leaves of BTREE_COLUMNS, whose values are split up (see
+ *   valueslot)
+ *
+ */
+char *entryvalue(mybtree_t *mybp, const void *pageaddr, int32_t entry)
+{
+    return entrybase(mybp, pageaddr) + entry * entrysize(mybp, pageaddr) + 
+        keypart(mybp, pageaddr);
+}
+
+
+/*
+ * columnar - whether a page is a leaf laid out by columns 
+ *
+ */
+int columnar(mybtree_t *mybp, const void *pageaddr)
+{
+    hdr_t header;
+
+    if ((mybp->layout & BTREE_COLUMNS) == 0) 
+        return 0;
+
+    setheader(&header, pageaddr);
+    return (*(header.typeptr) == 'l');
+}
+
+
+/*
+ * valueslot - the address of the value bytes [offset, offset + size) of 
+ *             an entry of a leaf, and in *strideptr the distance to the 
+ *             same bytes of the next entry
+ *
+ * - with BTREE_COLUMNS, the bytes must be those of a single field (or
+ *   the whole value if there is no schema); the field of entry i is at 
+ *   i * size in a minipage of leafcapacity * size bytes
+ *
+ */
+char *valueslot(mybtree_t *mybp, const void *pageaddr, int32_t entry, 
+                int32_t offset, int32_t size, int32_t *strideptr)
+{
+    if (columnar(mybp, pageaddr)) {
+        *strideptr = size;
+        return entrybase(mybp, pageaddr) + 
+            mybp->leafcapacity * (mybp->keysize + offset) + entry * size;
+    }
+
+    *strideptr = entrysize(mybp, pageaddr);
+    return entryvalue(mybp, pageaddr, entry) + offset;
+}
+
+
+/*
+ * shiftcolumns - with BTREE_COLUMNS, move the values of count entries of a
+ *                leaf, from entry srcentry on, to entry destentry on of
+ *                another (or the same) leaf
+ *
+ * - the keys move as entries do; the pages may overlap
+ *
+ */
+void shiftcolumns(mybtree_t *mybp, void *destaddr, int32_t destentry,
+                  const void *srcaddr, int32_t srcentry, int32_t count)
+{
+    int32_t fieldind, fieldnum, offset, size, stride;
+
+    if ((count <= 0) || (!columnar(mybp, srcaddr))) 
+        return;
+
+    fieldnum = (mybp->schema == NULL) ? 1 : mybp->schema->fieldnum;
+    for (fieldind = 0; fieldind < fieldnum; fieldind++) {
+        if (mybp->schema == NULL) {
+            offset = 0;
+            size = mybp->valuesize;
+        } else {
+            offset = mybp->schema->field[fieldind].offset;
+            size = mybp->schema->field[fieldind].size;
+        }
+
+        memmove(valueslot(mybp, destaddr, destentry, offset, size, &stride),
+                valueslot(mybp, srcaddr, srcentry, offset, size, &stride),
+                count * size);
+    }
+
+    return;
+}
+
+
+/*
+ * sharebytes - shrink the shared head and tail lengths to the bytes key
+ *              has in common with the template
+ *
+ * - both keys in storage format; the lengths may overlap when every key
+ *   seen so far is the template itself
+ *
+ */
+void sharebytes(mybtree_t *mybp, const char *template, const char *key, 
+                int *headptr, int *tailptr)
+{
+    int keysize = mybp->keysize, i;
+
+    for (i = 0; (i < *headptr) && (template[i] == key[i]); i++);
+    *headptr = i;
+
+    for (i = 0; (i < *tailptr) && 
+             (template[keysize - 1 - i] == key[keysize - 1 - i]); i++);
+    *tailptr = i;
+
+    return;
+}
+
+
+/*
+ * fits - whether newcount keys (in platform format) can be added to a 
+ *        page that holds at most maxcount entries
+ *
+ * - with BTREE_PREFIXKEYS, the entries must also fit in room bytes once
+ *   they keep the key bytes the new keys do not share
+ * - return 1 if they fit, 0 if not
+ *
+ */
+int fits(mybtree_t *mybp, const void *pageaddr, int32_t newcount, 
+         const void *keys[], int32_t maxcount, int32_t room)
+{
+    const unsigned char *shared = (const unsigned char *)pageaddr + hdrsize;
+    char firstkey[MAXSHAREDKEY], key[MAXSHAREDKEY];
+    const char *template;
+    int32_t count, keysize = mybp->keysize, part, index;
+    int head, tail;
+    hdr_t header;
+
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    if ((count + newcount) > maxcount) 
+        return 0;
+
+    if ((mybp->layout & BTREE_PREFIXKEYS) == 0) 
+        return 1;
+
+    if (count > 0) {
+        template = (const char *)shared + 2;
+        head = shared[0];
+        tail = shared[1];
+    } else {
+        /* an empty page takes the first new key as its template */
+        if (mybp->noswapkey)
+            memcpy(firstkey, keys[0], keysize);
+        else
+            xplatform_swapbytes(firstkey, keys[0], keysize);
+        template = firstkey;
+        head = tail = keysize;
+    }
+
+    for (index = 0; index < newcount; index++) {
+        if (mybp->noswapkey)
+            memcpy(key, keys[index], keysize);
+        else
+            xplatform_swapbytes(key, keys[index], keysize);
+        sharebytes(mybp, template, key, &head, &tail);
+    }
+
+    part = (head + tail < keysize) ? keysize - head - tail : 0;
+    return ((count + newcount) * 
+            (entrysize(mybp, pageaddr) - keypart(mybp, pageaddr) + part) 
+            <= room);
+}
+
+
+/*
+ * reshape - re-encode the entries of a page for new shared head and tail
+ *           lengths
+ *
+ * - the template must agree with every key of the page on the bytes that
+ *   are shared after the change
+ * - entries that grow are moved from the last one backwards, entries that
+ *   shrink from the first one forwards, so that none is overwritten 
+ *   before it is moved
+ *
+ */
+void reshape(mybtree_t *mybp, void *pageaddr, int head, int tail)
+{
+    unsigned char *shared = (unsigned char *)pageaddr + hdrsize;
+    char keybuf[MAXSHAREDKEY], *base = entrybase(mybp, pageaddr);
+    int32_t count, keysize = mybp->keysize, oldpart, newpart, valuepart;
+    int32_t index;
+    hdr_t header;
+
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    oldpart = keypart(mybp, pageaddr);
+    valuepart = entrysize(mybp, pageaddr) - oldpart;
+    newpart = (head + tail < keysize) ? keysize - head - tail : 0;
+
+    if (newpart > oldpart) {
+        for (index = count - 1; index >= 0; index--) {
+            char *src = base + index * (oldpart + valuepart);
+            char *dest = base + index * (newpart + valuepart);
+
+            entrykey(mybp, pageaddr, index, keybuf);
+            memmove(dest + newpart, src + oldpart, valuepart);
+            memcpy(dest, keybuf + head, newpart);
+        }
+    } else {
+        for (index = 0; index < count; index++) {
+            char *src = base + index * (oldpart + valuepart);
+            char *dest = base + index * (newpart + valuepart);
+
+            entrykey(mybp, pageaddr, index, keybuf);
+            memcpy(dest, keybuf + head, newpart);
+            memmove(dest + newpart, src + oldpart, valuepart);
+        }
+    }
+
+    shared[0] = (unsigned char)head;
+    shared[1] = (unsigned char)tail;
+
+    return;
+}
+
+
+/*
+ * compact - with BTREE_PREFIXKEYS, share as many key bytes as the entries
+ *           of a page allow
+ *
+ * - done when a split leaves a page with part of its entries
+ * - the first entry becomes the template; it agrees with the old template
+ *   on every byte shared so far
+ *
+ */
+void compact(mybtree_t *mybp, void *pageaddr)
+{
+    char keybuf[MAXSHAREDKEY];
+    char *template = (char *)pageaddr + hdrsize + 2;
+    int32_t count, index;
+    int head, tail;
+    hdr_t header;
+
+    if ((mybp->layout & BTREE_PREFIXKEYS) == 0) 
+        return;
+
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    if (count == 0) {
+        shareall(mybp, pageaddr);
+        return;
+    }
+
+    memcpy(template, entrykey(mybp, pageaddr, 0, keybuf), mybp->keysize);
+    head = tail = mybp->keysize;
+    for (index = 1; index < count; index++) 
+        sharebytes(mybp, template, entrykey(mybp, pageaddr, index, keybuf),
+                   &head, &tail);
+
+    reshape(mybp, pageaddr, head, tail);
+
+    return;
+}
+
+
+/*
+ * shareall - with BTREE_PREFIXKEYS, let an empty page share every byte of
+ *            the zero key
+ *
+ */
+void shareall(mybtree_t *mybp, void *pageaddr)
+{
+    unsigned char *shared = (unsigned char *)pageaddr + hdrsize;
+
+    if ((mybp->layout & BTREE_PREFIXKEYS) == 0) 
+        return;
+
+    shared[0] = shared[1] = (unsigned char)mybp->keysize;
+    memset(shared + 2, 0, mybp->keysize);
+
+    return;
+}
+
+
+/*
+ * moveentries - copy count entries of a page, from entry first on, to an
+ *               empty page of the same type
+ *
+ * - with BTREE_PREFIXKEYS, the new page shares as many key bytes as the
+ *   entries allow
+ *
+ */
+void moveentries(mybtree_t *mybp, void *destaddr, const void *srcaddr, 
+                 int32_t first, int32_t count)
+{
+    unsigned char *shared = (unsigned char *)destaddr + hdrsize;
+    char keybuf[MAXSHAREDKEY], *template = (char *)shared + 2;
+    char *dest = entrybase(mybp, destaddr);
+    const char *src;
+    int32_t srcsize = entrysize(mybp, srcaddr), srcpart, part, index;
+    int head, tail;
+
+    src = entrybase(mybp, srcaddr) + first * srcsize;
+    if ((mybp->layout & BTREE_PREFIXKEYS) == 0) {
+        memcpy(dest, src, count * srcsize);
+        shiftcolumns(mybp, destaddr, 0, srcaddr, first, count);
+        return;
+    }
+
+    shareall(mybp, destaddr);
+    if (count == 0) 
+        return;
+
+    memcpy(template, entrykey(mybp, srcaddr, first, keybuf), mybp->keysize);
+    head = tail = mybp->keysize;
+    for (index = 1; index < count; index++) 
+        sharebytes(mybp, template, 
+                   entrykey(mybp, srcaddr, first + index, keybuf), 
+                   &head, &tail);
+    shared[0] = (unsigned char)head;
+    shared[1] = (unsigned char)tail;
+
+    srcpart = keypart(mybp, srcaddr);
+    part = keypart(mybp, destaddr);
+    for (index = 0; index < count; index++) {
+        memcpy(dest, entrykey(mybp, srcaddr, first + index, keybuf) + head, 
+               part);
+        memcpy(dest + part, src + srcpart, srcsize - srcpart);
+        dest += part + srcsize - srcpart;
+        src += srcsize;
+    }
+
+    return;
+}
+
+
+/*
+ * splitpoint - with BTREE_PREFIXKEYS, choose how many of the entries stay
+ *              on the first page when newcount keys inserted after entry
+ *              split a page
+ *
+ * - count1 is the even split; if either side would not fit, take the
+ *   nearest point at which both do (the first side only grows and the
+ *   second only shrinks as the point moves right)
+ * - return the number of entries for the first page, -1 if no point fits
+ *
+ */
+int32_t splitpoint(mybtree_t *mybp, const void *pageaddr, int32_t entry,
+                   int32_t newcount, const void *keys[], int32_t count1)
+{
+    int32_t count, total, low, high, lowest, highest;
+    hdr_t header;
+
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+    total = count + newcount;
+
+    if (sidefits(mybp, pageaddr, entry, newcount, keys, 0, count1) &&
+        sidefits(mybp, pageaddr, entry, newcount, keys, count1, total))
+        return count1;
+
+    /* the largest first side that fits */
+    low = 1; 
+    high = total - 1;
+    while (low < high) {
+        int32_t middle = (low + high + 1) / 2;
+
+        if (sidefits(mybp, pageaddr, entry, newcount, keys, 0, middle)) 
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    highest = low;
+
+    /* the first point at which the second side fits */
+    low = 1; 
+    high = total - 1;
+    while (low < high) {
+        int32_t middle = (low + high) / 2;
+
+        if (sidefits(mybp, pageaddr, entry, newcount, keys, middle, total)) 
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    lowest = low;
+
+    if ((lowest > highest) || 
+        (!sidefits(mybp, pageaddr, entry, newcount, keys, 0, highest)) ||
+        (!sidefits(mybp, pageaddr, entry, newcount, keys, lowest, total)))
+        return -1;
+
+    return (count1 < lowest) ? lowest : highest;
+}
+
+
+/*
+ * sidefits - whether the entries [from, to) of a page into which newcount
+ *            keys are inserted after entry fit on a page of their own
+ *
+ */
+int sidefits(mybtree_t *mybp, const void *pageaddr, int32_t entry, 
+             int32_t newcount, const void *keys[], int32_t from, int32_t to)
+{
+    char template[MAXSHAREDKEY], keybuf[MAXSHAREDKEY];
+    int32_t keysize = mybp->keysize, maxcount, part, index;
+    int head, tail;
+    hdr_t header;
+
+    setheader(&header, pageaddr);
+    maxcount = (*(header.typeptr) == 'l') ? 
+        mybp->leafcapacity : mybp->indexfanout;
+    if (to - from > maxcount) 
+        return 0;
+    if (to == from) 
+        return 1;
+
+    memcpy(template, 
+           mergedkey(mybp, pageaddr, entry, newcount, keys, from, keybuf),
+           keysize);
+    head = tail = keysize;
+    for (index = from + 1; index < to; index++) 
+        sharebytes(mybp, template, 
+                   mergedkey(mybp, pageaddr, entry, newcount, keys, index, 
+                             keybuf), &head, &tail);
+
+    part = (head + tail < keysize) ? keysize - head - tail : 0;
+    return ((to - from) * 
+            (entrysize(mybp, pageaddr) - keypart(mybp, pageaddr) + part) 
+            <= mybp->pageroom);
+}
+
+
+/*
+ * mergedkey - the key (in storage format) at position index of a page into
+ *             which newcount keys are inserted after entry
+ *
+ */
+const char *mergedkey(mybtree_t *mybp, const void *pageaddr, int32_t entry,
+                      int32_t newcount, const void *keys[], int32_t index,
+                      char *keybuf)
+{
+    if (index <= entry) 
+        return entrykey(mybp, pageaddr, index, keybuf);
+
+    if (index > entry + newcount) 
+        return entrykey(mybp, pageaddr, index - newcount, keybuf);
+
+    if (mybp->noswapkey)
+        memcpy(keybuf, keys[index - entry - 1], mybp->keysize);
+    else
+        xplatform_swapbytes(keybuf, keys[index - entry - 1], mybp->keysize);
+
+    return keybuf;
+}
+
+
+/*
+ * buildstream - drain one input stream of a bulk build into leaves
+ *
+ * - the body of a build thread; the outcome is left in bs->res and a
+ *   failure tells the other streams to stop
+ *
+ */
+void *buildstream(void *arg)
+{
+    buildstream_t *bs = (buildstream_t *)arg;
+    buildctl_t *ctl = bs->ctl;
+
+    if ((bs->res = packleaves(bs)) != 0) {
+        pthread_mutex_lock(&ctl->lock);
+        ctl->failed = 1;
+        pthread_mutex_unlock(&ctl->lock);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * packleaves - pack the records of a stream into leaves of ctl->leafmax
+ *              records (or ctl->leafroom bytes) and write them out 
+ *              buildrun pages at a time
+ *
+ * - record the first key and the page number of each leaf for the index
+ * - return 0 if OK (or stopped because another stream failed), -8 if a 
+ *   key is out of order, -9 if low level IO error occurs, -16 if out of 
+ *   memory, -20 if the stream fails
+ *
+ */
+int packleaves(buildstream_t *bs)
+{
+    buildctl_t *ctl = bs->ctl;
+    mybtree_t *mybp = ctl->mybp;
+    int32_t keysize = mybp->keysize, runpages = 0, count = 0;
+    char *pageaddr = NULL, keybuf[MAXSHAREDKEY];
+    const void *key, *value;
+    hdr_t header;
+    int more, res;
+
+    while ((more = bs->stream(bs->arg, &key, &value)) == 1) {
+        if ((bs->leafcount > 0) && 
+            (mybp->compare(key, bs->lastkey, keysize) < 0)) 
+            return -8;
+
+        if ((pageaddr == NULL) || (count == ctl->leafmax) || 
+            ((count > 0) && 
+             (!fits(mybp, pageaddr, 1, &key, ctl->leafmax, ctl->leafroom)))) {
+            /* start a new leaf */
+            if (runpages == buildrun) {
+                if ((res = flushrun(bs, runpages)) != 0) 
+                    return (res > 0) ? 0 : res;
+                runpages = 0;
+            }
+
+            if (bs->leafcount == bs->leafalloc) {
+                int64_t leafalloc = (bs->leafalloc == 0) ? 
+                    buildrun : 2 * bs->leafalloc;
+                char *firstkeys;
+                pagenum_t *leafnums;
+
+                firstkeys = (char *)realloc(bs->firstkeys, 
+                                            (size_t)leafalloc * keysize);
+                if (firstkeys != NULL) 
+                    bs->firstkeys = firstkeys;
+                leafnums = (pagenum_t *)realloc(bs->leafnums, (size_t)
+                                                leafalloc * sizeof(pagenum_t));
+                if (leafnums != NULL) 
+                    bs->leafnums = leafnums;
+                if ((firstkeys == NULL) || (leafnums == NULL)) 
+                    return -16;
+                bs->leafalloc = leafalloc;
+            }
+            memcpy(bs->firstkeys + bs->leafcount * keysize, key, keysize);
+            bs->leafcount++;
+
+            pageaddr = bs->run + runpages * mybp->pagesize;
+            runpages++;
+            memset(pageaddr, 0, mybp->pagesize);
+            setheader(&header, pageaddr);
+            *(header.typeptr) = 'l';
+            count = 0;
+        }
+
+        /* plugin after the last entry, as append does */
+        plugin(mybp, pageaddr, count - 1, 1, &key, &value);
+        memcpy(bs->lastkey, entrykey(mybp, pageaddr, count, keybuf), keysize);
+        count++;
+        if (mybp->noswap)
+            *(header.countptr) = count;
+        else
+            xplatform_swapbytes(header.countptr, &count, 4);
+    }
+
+    if (more != 0) 
+        return -20;
+
+    if (runpages > 0) {
+        res = flushrun(bs, runpages);
+        return (res > 0) ? 0 : res;
+    }
+
+    return 0;
+}
+
+
+/*
+ * flushrun - write the leaves packed in the run buffer to the next free
+ *            pages of the file
+ *
+ * - chain the leaves in the run and link the last leaf written before
+ *   to the first one; the last leaf points nowhere until the next run or
+ *   stream is known
+ * - return 0 if OK, 1 if another stream has failed, -9 if low level IO
+ *   error occurs
+ *
+ */
+int flushrun(buildstream_t *bs, int32_t runpages)
+{
+    buildctl_t *ctl = bs->ctl;
+    mybtree_t *mybp = ctl->mybp;
+    pagenum_t pagenum, rightsibnum;
+    hdr_t header;
+    int32_t i;
+
+    pthread_mutex_lock(&ctl->lock);
+    if (ctl->failed) {
+        pthread_mutex_unlock(&ctl->lock);
+        return 1;
+    }
+    pagenum = ctl->nextpage;
+    ctl->nextpage += runpages;
+    pthread_mutex_unlock(&ctl->lock);
+
+    for (i = 0; i < runpages; i++) {
+        char *pageaddr = bs->run + i * mybp->pagesize;
+
+        rightsibnum = (i < runpages - 1) ? pagenum + i + 1 : -1;
+        setheader(&header, pageaddr);
+        if (mybp->noswap) 
+            *(header.rightsibnumptr) = rightsibnum;
+        else
+            xplatform_swapbytes(header.rightsibnumptr, &rightsibnum, 8);
+        buildfences(mybp, pageaddr);
+
+        bs->leafnums[bs->leafcount - runpages + i] = pagenum + i;
+    }
+
+    if (writeat(ctl, bs->run, (size_t)runpages * mybp->pagesize, 
+                (off_t)pagenum * mybp->pagesize) != 0) 
+        return -9;
+
+    if ((bs->lastleaf != -1) && (linkleaf(ctl, bs->lastleaf, pagenum) != 0))
+        return -9;
+    bs->lastleaf = pagenum + runpages - 1;
+
+    return 0;
+}
+
+
+/*
+ * packindex - build the index levels over count leaves bottom-up
+ *
+ * - keys[i] is the first key of the i'th node of the level, pagenums[i] 
+ *   its page number; both arrays are overwritten with the next level
+ * - a level of more than indexplain nodes gets index pages of 
+ *   ctl->indexmax entries, written buildrun pages at a time; the level 
+ *   that fits on one page goes to the root page
+ * - entry 0 of the leftmost page of a level has key zero, as splitroot
+ *   leaves it
+ * - a single leaf is moved to the root page
+ * - return 0 if OK, -9 if low level IO error occurs, -16 if out of memory
+ *
+ */
+int packindex(buildctl_t *ctl, int64_t count, char *keys, pagenum_t *pagenums)
+{
+    mybtree_t *mybp = ctl->mybp;
+    int32_t keysize = mybp->keysize;
+    char *run;
+    int res = 0;
+
+    if ((run = (char *)malloc((size_t)buildrun * mybp->pagesize)) == NULL)
+        return -16;
+
+    if (count == 1) {
+        /* the only leaf, at rootpagenum + 1, becomes the root */
+        off_t offset = (off_t)pagenums[0] * mybp->pagesize;
+
+        if ((pread(ctl->fd, run, mybp->pagesize, offset) != 
+             (ssize_t)mybp->pagesize) ||
+            (writeat(ctl, run, mybp->pagesize, 
+                     (off_t)mybp->rootpagenum * mybp->pagesize) != 0) ||
+            (ftruncate(ctl->fd, offset) != 0)) 
+            res = -9;
+        ctl->nextpage = mybp->rootpagenum + 1;
+        free(run);
+        return res;
+    }
+
+    memset(keys, 0, keysize);
+
+    while (count > mybp->indexplain) {
+        int64_t pages = (count + ctl->indexmax - 1) / ctl->indexmax, page;
+        pagenum_t pagenum = ctl->nextpage;
+        int32_t runpages = 0;
+
+        /* the build threads are done, no need to lock */
+        ctl->nextpage += pages;
+
+        for (page = 0; page < pages; page++) {
+            int64_t first = page * ctl->indexmax;
+            int32_t entries = (count - first < ctl->indexmax) ? 
+                (int32_t)(count - first) : ctl->indexmax;
+
+            packnode(mybp, run + runpages * mybp->pagesize, entries,
+                     keys + first * keysize, pagenums + first, 
+                     (page < pages - 1) ? pagenum + page + 1 : -1);
+            runpages++;
+
+            if ((runpages == buildrun) || (page == pages - 1)) {
+                if (writeat(ctl, run, (size_t)runpages * mybp->pagesize, 
+                            (off_t)(pagenum + page + 1 - runpages) * 
+                            mybp->pagesize) != 0) {
+                    free(run);
+                    return -9;
+                }
+                runpages = 0;
+            }
+
+            /* the page is a node of the next level */
+            memmove(keys + page * keysize, keys + first * keysize, keysize);
+            pagenums[page] = pagenum + page;
+        }
+
+        count = pages;
+    }
+
+    packnode(mybp, run, (int32_t)count, keys, pagenums, -1);
+    if (writeat(ctl, run, mybp->pagesize, 
+                (off_t)mybp->rootpagenum * mybp->pagesize) != 0) 
+        res = -9;
+
+    free(run);
+    return res;
+}
+
+
+/*
+ * packnode - fill an index page with count entries 
+ *
+ */
+void packnode(mybtree_t *mybp, void *pageaddr, int32_t count, const char *keys,
+              const pagenum_t *pagenums, pagenum_t rightsibnum)
+{
+    hdr_t header;
+    int32_t entry;
+
+    memset(pageaddr, 0, mybp->pagesize);
+    setheader(&header, pageaddr);
+    *(header.typeptr) = 'i';
+
+    for (entry = 0; entry < count; entry++) {
+        const void *key = keys + entry * mybp->keysize;
+        const void *value = &pagenums[entry];
+
+        plugin(mybp, pageaddr, entry - 1, 1, &key, &value);
+        if (mybp->noswap)
+            *(header.countptr) = entry + 1;
+        else {
+            int32_t newcount = entry + 1;
+
+            xplatform_swapbytes(header.countptr, &newcount, 4);
+        }
+    }
+
+    if (mybp->noswap) 
+        *(header.rightsibnumptr) = rightsibnum;
+    else
+        xplatform_swapbytes(header.rightsibnumptr, &rightsibnum, 8);
+
+    buildfences(mybp, pageaddr);
+
+    return;
+}
+
+
+/*
+ * writeat - write size bytes from src to the file at offset
+ *
+ * - return 0 if OK, -1 on error
+ *
+ */
+int writeat(buildctl_t *ctl, const void *src, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t written;
+
+        written = pwrite(ctl->fd, (const char *)src + done, size - done, 
+                         offset + done);
+        if (written <= 0) {
+            if ((written == -1) && (errno == EINTR)) 
+                continue;
+            perror("btree_bulkbuild: pwrite");
+            return -1;
+        }
+        done += written;
+    }
+
+    return 0;
+}
+
+
+/*
+ * freezestream - hand the next record of the btree being frozen to the
+ *                bulk build
+ *
+ * - the records are fetched a cursor batch at a time, keys and payloads
+ *   in the application's format
+ * - return 1 if a record is returned, 0 at the end, -1 on error
+ *
+ */
+int freezestream(void *arg, const void **keyptr, const void **valueptr)
+{
+    freezestream_t *fs = (freezestream_t *)arg;
+    mybtree_t *mybp = (mybtree_t *)fs->bp;
+
+    if (fs->next == fs->count) {
+        /* the whole payload: "*" with a schema, NULL without one */
+        fs->count = btree_getcursorbatch(fs->bp, fs->max, fs->keys, 
+                                         (mybp->schema != NULL) ? "*" : NULL,
+                                         fs->values);
+        fs->next = 0;
+        if (fs->count <= 0) 
+            return (fs->count == 0) ? 0 : -1;
+    }
+
+    *keyptr = fs->keys + fs->next * mybp->keysize;
+    *valueptr = fs->values[fs->next];
+    fs->next++;
+
+    return 1;
+}
+
+
+/*
+ * appvaluesize - number of bytes of a payload in the application's format
+ *
+ * - with a schema, the platform's structure may be padded beyond the 
+ *   compact size stored in the btree
+ *
+ */
+int32_t appvaluesize(mybtree_t *mybp)
+{
+    int32_t memberind, size = mybp->valuesize;
+
+    if (mybp->scb == NULL) 
+        return size;
+
+    for (memberind = 0; memberind < mybp->scb->membernum; memberind++) {
+        int32_t end = mybp->scb->member[memberind].offset + 
+            mybp->scb->member[memberind].size;
+
+        if (end > size) 
+            size = end;
+    }
+
+    return size;
+}
+
+
+/*
+ * linkleaf - set the right sibling of a leaf already written to the file
+ *
+ * - the right sibling page number leads the page header
+ * - return 0 if OK, -1 on error
+ *
+ */
+int linkleaf(buildctl_t *ctl, pagenum_t pagenum, pagenum_t rightsibnum)
+{
+    char field[sizeof(pagenum_t)];
+
+    if (ctl->mybp->noswap) 
+        memcpy(field, &rightsibnum, sizeof(pagenum_t));
+    else
+        xplatform_swapbytes(field, &rightsibnum, sizeof(pagenum_t));
+
+    return writeat(ctl, field, sizeof(pagenum_t), 
+                   (off_t)pagenum * ctl->mybp->pagesize);
+}
+
+
+/*
+ * cascadeunref - release all the fixes (references) on the path to the root
+ *
+ */
+
+void cascadeunref(mybtree_t *mybp, void *pageaddr)
+{
+    void *addr;
     hdr_t header;
 
     addr = pageaddr;
@@ -1906,6 +4918,7 @@ void cascadeunref(mybtree_t *mybp, void *pageaddr)
         void *ppageaddr;
 
         setheader(&header, addr);
+        setlinks(mybp, &header, addr);
         ppageaddr = *(header.ppageaddrptr);
 
         buffer_unref(mybp->buf, addr);
@@ -1924,29 +4937,65 @@ void cascadeunref(mybtree_t *mybp, void *pageaddr)
  */
 int binarysearch(mybtree_t *mybp, const void *pageaddr, const void *key)
 {
-    int count, start, end, offset, recordsize;
+    int count, start, end, offset, recordsize, head = 0, part = -1;
     hdr_t header;
     const char *base;
+    char keybuf[MAXSHAREDKEY];
+    btree_compare_t *compare = mybp->compare;
+    int keysize = mybp->keysize;
 
     setheader(&header, pageaddr);
     
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
 
-    start = 0;
-    end = count - 1;
-    offset = (start + end) / 2;
-    recordsize = (*(header.typeptr) == 'l') ? 
-        mybp->leafentrysize : mybp->indexentrysize;
+    start = 0;
+    end = count - 1;
+    recordsize = entrysize(mybp, pageaddr);
+
+    if (((mybp->layout & BTREE_SEARCHINDEX) != 0) && (count > fencestep)) {
+        /* find the last fence not above key; its block holds the entry */
+        const char *fence = fencebase(mybp, pageaddr);
+        int lo = 0, hi = (count - 1) / fencestep - 1;
+
+        while (lo <= hi) {
+            int mid = (lo + hi) / 2;
+
+            if (compare(key, fence + mid * keysize, keysize) < 0) 
+                hi = mid - 1;
+            else
+                lo = mid + 1;
+        }
+
+        /* fence lo - 1 is the key of entry lo * fencestep */
+        start = lo * fencestep;
+        if (start + fencestep - 1 < end) 
+            end = start + fencestep - 1;
+    }
+
+    if ((mybp->layout & BTREE_PREFIXKEYS) != 0) {
+        /* the pivots are put together on a copy of the template */
+        memcpy(keybuf, (const char *)pageaddr + hdrsize + 2, keysize);
+        head = ((const unsigned char *)pageaddr)[hdrsize];
+        part = keypart(mybp, pageaddr);
+    }
 
-    base = (char *)pageaddr + hdrsize;
+    offset = (start + end) / 2;
+    base = entrybase(mybp, pageaddr);
     do{
         if (end < start) return end;
         else {
             const void *pivot = base + offset * recordsize;
-            switch (mybp->compare(key, pivot, mybp->keysize)) {
+
+            if (part > 0) {
+                memcpy(keybuf + head, pivot, part);
+                pivot = keybuf;
+            } else if (part == 0) 
+                pivot = keybuf;
+
+            switch (compare(key, pivot, keysize)) {
             case (0) : /* equal */
                 return offset;
             case(1):  /* key larger than the key at pivot */
@@ -1981,7 +5030,7 @@ int insert(mybtree_t *mybp, void *pageaddr, int32_t entry,
     maxcount = (*(header.typeptr) == 'l') ? 
                 mybp->leafcapacity : mybp->indexfanout;
     
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
@@ -1991,7 +5040,8 @@ int insert(mybtree_t *mybp, void *pageaddr, int32_t entry,
         return -10;
     }
 
-    if ((count + newcount) <= maxcount) /* no split */    
+    if (fits(mybp, pageaddr, newcount, keys, maxcount, mybp->pageroom)) 
+        /* no split */    
         return simpleinsert(mybp, pageaddr, entry, newcount, keys, values);
     else 
         return splitinsert(mybp, pageaddr, entry, newcount, keys, values);
@@ -2016,7 +5066,7 @@ int simpleinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
     plugin(mybp, pageaddr, entry, newcount, keys, values);
     
     /* increment the count */
-    if (noswap)
+    if (mybp->noswap)
         *(header.countptr) += newcount;
     else {
         xplatform_swapbytes(&count, header.countptr, 4);
@@ -2025,7 +5075,7 @@ int simpleinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
     }
     
 
-    buffer_mark(mybp->buf, pageaddr);
+    markpage(mybp, pageaddr);
 
     cascadeunref(mybp, pageaddr);
     return 0;
@@ -2043,33 +5093,68 @@ int simpleinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
 void plugin(mybtree_t *mybp, void *pageaddr, int32_t entry, int32_t newcount,
             const void *keys[], const void *values[])
 {
-    int keysize, recordsize, offset, movingcount, count;
-    char *dest, *src;
+    int keysize, part, recordsize, offset, movingcount, count;
+    char *dest, *src, keybuf[MAXSHAREDKEY];
+    unsigned char *shared = (unsigned char *)pageaddr + hdrsize;
+    int prefixkeys = ((mybp->layout & BTREE_PREFIXKEYS) != 0);
     hdr_t header;
-    int index;
+    int index, head = 0, tail;
 
     setheader(&header, pageaddr);
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
 
     keysize = mybp->keysize;
-    recordsize = (*(header.typeptr) == 'l') ? 
-        mybp->leafentrysize : mybp->indexentrysize;
+
+    if (prefixkeys) {
+        /* stop sharing the bytes the new keys do not have in common */
+        if (count == 0) {
+            if (mybp->noswapkey)
+                memcpy(shared + 2, keys[0], keysize);
+            else
+                xplatform_swapbytes(shared + 2, keys[0], keysize);
+            shared[0] = shared[1] = (unsigned char)keysize;
+        }
+
+        head = shared[0];
+        tail = shared[1];
+        for (index = 0; index < newcount; index++) {
+            if (mybp->noswapkey)
+                memcpy(keybuf, keys[index], keysize);
+            else
+                xplatform_swapbytes(keybuf, keys[index], keysize);
+            sharebytes(mybp, (char *)shared + 2, keybuf, &head, &tail);
+        }
+
+        if ((head != shared[0]) || (tail != shared[1])) 
+            reshape(mybp, pageaddr, head, tail);
+    }
+
+    recordsize = entrysize(mybp, pageaddr);
+    part = keypart(mybp, pageaddr);
 
     offset = entry + 1;
     movingcount = count - offset;
 
-    src = (char *)pageaddr + hdrsize + offset * recordsize;
+    src = entrybase(mybp, pageaddr) + offset * recordsize;
     dest = src + newcount * recordsize;
     memmove(dest, src, movingcount * recordsize);
+    shiftcolumns(mybp, pageaddr, offset + newcount, pageaddr, offset, 
+                 movingcount);
 
     dest = src;
 
     for (index = 0; index < newcount; index++) {
-        /* store the key */
-        if (noswapkey)
+        /* store the key, or the part of it the page does not share */
+        if (prefixkeys) {
+            if (mybp->noswapkey)
+                memcpy(keybuf, keys[index], keysize);
+            else
+                xplatform_swapbytes(keybuf, keys[index], keysize);
+            memcpy(dest, keybuf + head, part);
+        } else if (mybp->noswapkey)
             memcpy(dest, keys[index], keysize);
         else
             xplatform_swapbytes(dest, keys[index], keysize);
@@ -2080,24 +5165,16 @@ void plugin(mybtree_t *mybp, void *pageaddr, int32_t entry, int32_t newcount,
             /* treat index page separately, which does not involves schema;
                the values are pagenumbers stored in platform-specific format
             */
-            if (noswap)
-                memcpy(dest + keysize, values[index], sizeof(pagenum_t));
+            if (mybp->noswap)
+                memcpy(dest + part, values[index], sizeof(pagenum_t));
             else
-                xplatform_swapbytes(dest + keysize, values[index], 
+                xplatform_swapbytes(dest + part, values[index], 
                                     sizeof(pagenum_t));
         } 
-        else {
+        else 
             /* leaf page */
+            storevalue(mybp, pageaddr, offset + index, values[index]);
 
-            if (mybp->schema == NULL) 
-                /* no schmea defined , treat values as binary blobs */
-                memcpy(dest + keysize, values[index], mybp->valuesize);
-
-            else 
-                /* use schema to compactly store the value */
-                populatefield(mybp, dest + keysize, values[index], 
-                              mybp->schema->fieldnum);
-        }
         dest = dest + recordsize;
     }
 
@@ -2117,7 +5194,7 @@ int splitinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
                  int32_t newcount, const void *keys[], const void *values[])
 {
     void *newaddr1, *newaddr2;
-    void *newbase1, *newbase2;
+    const void *newkey2;
     void *ppageaddr;
     int32_t pentry, count, count1, count2, c1, c2, totalcount;
     int32_t newcount1, newcount2; 
@@ -2125,9 +5202,10 @@ int splitinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
     hdr_t newhd1, newhd2, header;
     pagenum_t pagenum;
     void *newvalue;
+    char keybuf[MAXSHAREDKEY];
 
     setheader(&header, pageaddr);
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
@@ -2136,6 +5214,14 @@ int splitinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
     count2 = totalcount / 2;          /* final number of entry on page2 */
     count1 = totalcount - count2;     /* final number of entry on page1 */
 
+    if ((mybp->layout & BTREE_PREFIXKEYS) != 0) {
+        /* a side that shares fewer key bytes may need more room */
+        if ((count1 = splitpoint(mybp, pageaddr, entry, newcount, keys, 
+                                 count1)) < 0) 
+            return -10;
+        count2 = totalcount - count1;
+    }
+
     /* calculate how to split */
     if (count1 <= entry + 1) {
         c1 = count1;                  /* split count */
@@ -2165,247 +5251,718 @@ int splitinsert(mybtree_t *mybp, void *pageaddr, int32_t entry,
             return -9;
     }
 
-    newbase1 = (char *)newaddr1 + hdrsize;
-    newbase2 = (char *)newaddr2 + hdrsize;
-
     setheader(&newhd1, newaddr1);
     setheader(&newhd2, newaddr2);
+    setlinks(mybp, &newhd2, newaddr2);
 
     /* find the right position to install the new record */
     if (newcount1 != 0) {
         plugin(mybp, newaddr1, entry1, newcount1, &keys[0], &values[0]);
         
-        if (noswap)
+        if (mybp->noswap)
             *(newhd1.countptr) = count1;
         else
             xplatform_swapbytes(newhd1.countptr, &count1, 4);
 
-        buffer_mark(mybp->buf, newaddr1);
+        markpage(mybp, newaddr1);
     } 
     if (newcount2 != 0) {
         plugin(mybp, newaddr2, entry2, newcount2, &keys[newcount1],
                &values[newcount1]);
 
-        if (noswap)
+        if (mybp->noswap)
             *(newhd2.countptr) = count2;
         else
             xplatform_swapbytes(newhd2.countptr, &count2, 4);
 
-        buffer_mark(mybp->buf, newaddr2);
+        markpage(mybp, newaddr2);
     }
         
+    /* the first key of page2 separates the two pages in the parent */
+    newkey2 = entrykey(mybp, newaddr2, 0, keybuf);
+    pagenum = buffer_pagenum(mybp->buf, newaddr2);
+
     buffer_unref(mybp->buf, newaddr1);
     buffer_unref(mybp->buf, newaddr2);
 
     ppageaddr = *(newhd2.ppageaddrptr);
     pentry = *(newhd2.pentryptr);       
-    pagenum = mybp->nextpage - 1;
     
     /* pass the pagenum in platform format */
     newvalue = &pagenum;
 
-    if (noswapkey)
-        return insert(mybp, ppageaddr, pentry, 1, (const void **)&newbase2, 
+    if (mybp->noswapkey)
+        return insert(mybp, ppageaddr, pentry, 1, &newkey2, 
                       (const void **)&newvalue);
     else {
-        xplatform_swapbytes(platformkey, newbase2, mybp->keysize);
-        return insert(mybp, ppageaddr, pentry, 1, 
-                      (const void **)&platformkeyptr,
+        /* numeral keys are 8 bytes at most */
+        char platformkey[8];
+        const void *platformkeyptr = platformkey;
+
+        xplatform_swapbytes(platformkey, newkey2, mybp->keysize);
+        return insert(mybp, ppageaddr, pentry, 1, &platformkeyptr,
                       (const void **)&newvalue);
     }
-        
+        
+}
+
+
+/*
+ * splitroot - create two new pages and split the content on the root
+ *             page to the two new pages
+ *
+ * - this function works with both the leaf case and index case
+ * - count1 is the number of entries to be assigned to the first page
+ * - return 0 if OK, -9 if low level IO error
+ *
+ */
+int splitroot(mybtree_t *mybp, void *pageaddr, int32_t cnt1, int32_t cnt2,
+              void **newaddr1ptr, void **newaddr2ptr)
+{
+    hdr_t header, header1, header2;
+    void *payload;
+    int dummycount = 1;
+    pagenum_t pagenum1, pagenum2, dummynum = -1;
+    
+    setheader(&header, pageaddr);
+
+    if (((*newaddr1ptr = allocpage(mybp, &pagenum1)) == NULL) ||
+        ((*newaddr2ptr = allocpage(mybp, &pagenum2)) == NULL)){
+        fprintf(stderr, "(DEBUG)splitroot: cannot allocate buffer frame.\n");
+        return -9;
+    }
+
+    setheader(&header1, *newaddr1ptr);
+    setheader(&header2, *newaddr2ptr);
+    setlinks(mybp, &header2, *newaddr2ptr);
+
+    if (mybp->noswap) {
+        *(header1.countptr) = cnt1;
+        *(header2.countptr) = cnt2;
+        *(header1.rightsibnumptr) = pagenum2;
+        *(header2.rightsibnumptr) = dummynum;
+    } else {
+        xplatform_swapbytes(header1.countptr, &cnt1, 4);
+        xplatform_swapbytes(header2.countptr, &cnt2, 4);
+        xplatform_swapbytes(header1.rightsibnumptr, &pagenum2, 8);
+        xplatform_swapbytes(header2.rightsibnumptr, &dummynum, 8);
+    }
+
+    *(header1.typeptr) = *(header2.typeptr) = *(header.typeptr);
+
+    /* let the second child know where to hook */
+    *(header2.ppageaddrptr) = pageaddr;
+    *(header2.pentryptr) = 0;
+
+    /* copy data across to the two pages */
+    moveentries(mybp, *newaddr1ptr, pageaddr, 0, cnt1);
+    moveentries(mybp, *newaddr2ptr, pageaddr, cnt1, cnt2);
+    markpage(mybp, *newaddr1ptr);
+    markpage(mybp, *newaddr2ptr);
+
+    /* update the root page to record the fisrt child */
+    *(header.typeptr) = 'i';
+    shareall(mybp, pageaddr);
+    payload = entrybase(mybp, pageaddr);
+
+    if (mybp->noswap) {
+        *(header.countptr) = dummycount;
+
+        /* init/store key zero */
+        memset(payload, 0, keypart(mybp, pageaddr));
+        /* *(pagenum_t *)((char *)payload + mybp->keysize) = pagenum1; */
+
+        /* install pagenum/value */
+        memcpy((char *)payload + keypart(mybp, pageaddr), &pagenum1, 8);
+
+    } else {
+        xplatform_swapbytes(header.countptr, &dummycount, 4);
+        memset(payload, 0, keypart(mybp, pageaddr));
+        xplatform_swapbytes((char *)payload + keypart(mybp, pageaddr), 
+                            &pagenum1, 8);
+    }
+
+    markpage(mybp, pageaddr);
+
+    return 0;
+}
+
+
+
+/*
+ * splitpage - create a new page, and move the specified number of entries
+ *             to the new page 
+ *
+ * - this function works with both the leaf case and index case
+ * - *newaddr1 is set to be pageaddr
+ * - return 0 if OK, -9 if low level error
+ *
+ */
+int splitpage(mybtree_t *mybp, void *pageaddr, int32_t cnt1, int32_t cnt2,
+              void **newaddr1ptr, void **newaddr2ptr)
+{
+    hdr_t header, header2;
+    pagenum_t pagenum2;
+
+    setheader(&header, pageaddr);
+    setlinks(mybp, &header, pageaddr);
+
+    if ((*newaddr2ptr = allocpage(mybp, &pagenum2)) == NULL) {
+        fprintf(stderr, "(DEBUG)splitpage: cannot allocate buffer frame.\n");
+        return -9;
+    }
+
+
+    setheader(&header2, *newaddr2ptr);
+    setlinks(mybp, &header2, *newaddr2ptr);
+    if (mybp->noswap) {
+        *(header.countptr) = cnt1;
+        *(header2.countptr) = cnt2;
+        *(header2.rightsibnumptr) = *(header.rightsibnumptr);
+        *(header.rightsibnumptr) = pagenum2;
+    } else {
+        xplatform_swapbytes(header.countptr, &cnt1, 4);
+        xplatform_swapbytes(header2.countptr, &cnt2, 4);
+
+        /* *header.rightsibnumptr stores the native format */
+        memcpy(header2.rightsibnumptr, header.rightsibnumptr, 8);
+
+        xplatform_swapbytes(header.rightsibnumptr, &pagenum2, 8);
+    }
+
+    *(header2.typeptr) = *(header.typeptr);
+
+    /* copy data across to the two pages */
+    moveentries(mybp, *newaddr2ptr, pageaddr, cnt1, cnt2);
+    compact(mybp, pageaddr);
+
+    markpage(mybp, pageaddr);
+    markpage(mybp, *newaddr2ptr);
+
+    /* let the second child know where to hook to the parent */
+    *(header2.ppageaddrptr) = *(header.ppageaddrptr);
+    *(header2.pentryptr) = *(header.pentryptr);
+
+    *newaddr1ptr = pageaddr; 
+    return 0;
+}
+
+
+/*
+ * unplug - remove removecount records from offset entry on and pack the 
+ *          remainders
+ *
+ */
+void unplug(mybtree_t *mybp, void *pageaddr, int32_t entry, 
+            int32_t removecount)
+{
+    void *src, *dest, *hitptr;
+    int count, movingsize, recordsize;
+    hdr_t header;
+
+    recordsize = entrysize(mybp, pageaddr);
+    hitptr = entrybase(mybp, pageaddr) + entry * recordsize;
+    
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    movingsize = (count - (entry + removecount)) * recordsize;
+    dest = hitptr;
+    src = (char *)hitptr + removecount * recordsize;
+    memmove(dest, src, movingsize);
+    shiftcolumns(mybp, pageaddr, entry, pageaddr, entry + removecount, 
+                 count - (entry + removecount));
+
+    count -= removecount;
+    if (mybp->noswap)
+        *(header.countptr) = count;
+    else
+        xplatform_swapbytes(header.countptr, &count, 4);
+
+    markpage(mybp, pageaddr);
+    
+    return;
+}
+
+
+
+/*
+ * droprange - remove the records with keys in [lowkey, highkey) from the 
+ *             subtree of a fixed page
+ *
+ * - edges tells whether the page is on the search path of the low key
+ *   (LOWEDGE), of the high key (HIGHEDGE) or both; the page numbers on 
+ *   the paths are recorded by depth
+ * - on a leaf, the records in the range are removed
+ * - on an index page, the child on each path is kept and trimmed 
+ *   recursively, the children in between are dropped whole along with
+ *   their entries
+ * - the page is latched while it is changed, which keeps readers out of
+ *   the subtrees being dropped, and unref'ed
+ * - return 0 if OK, -9 if low level IO error occurs
+ *
+ */
+int droprange(mybtree_t *mybp, rangedel_t *rd, void *pageaddr, int32_t depth,
+              int edges)
+{
+    hdr_t header;
+    int32_t count, first, last, entry;
+    pagenum_t pagenum, lowchild = -1, highchild = -1;
+    int res = 0;
+
+    xlatch(mybp, pageaddr);
+    pagenum = buffer_pagenum(mybp->buf, pageaddr);
+    if (edges & LOWEDGE) 
+        rd->lowpath[depth] = pagenum;
+    if (edges & HIGHEDGE) 
+        rd->highpath[depth] = pagenum;
+
+    setheader(&header, pageaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    if (*(header.typeptr) == 'l') {
+        first = (edges & LOWEDGE) ? lowerbound(mybp, pageaddr, rd->lowkey) : 0;
+        last = (edges & HIGHEDGE) ? 
+            lowerbound(mybp, pageaddr, rd->highkey) : count;
+
+        if (last > first) {
+            visitrange(mybp, rd, pageaddr, first, last - first);
+            unplug(mybp, pageaddr, first, last - first);
+        }
+
+        xrelease(mybp);
+        buffer_unref(mybp->buf, pageaddr);
+        return 0;
+    }
+
+    /* the children holding the low and the high key stay */
+    first = -1;
+    if (edges & LOWEDGE) {
+        first = lowerbound(mybp, pageaddr, rd->lowkey) - 1;
+        if (first < 0) 
+            first = 0;
+        lowchild = entrychild(mybp, pageaddr, first);
+    }
+    last = count;
+    if (edges & HIGHEDGE) {
+        last = lowerbound(mybp, pageaddr, rd->highkey) - 1;
+        if (last < 0) 
+            last = 0;
+        highchild = entrychild(mybp, pageaddr, last);
+    }
+
+    for (entry = first + 1; (entry < last) && (res == 0); entry++) 
+        res = dropsubtree(mybp, rd, entrychild(mybp, pageaddr, entry), 
+                          depth + 1);
+
+    if ((first < 0) && (last > 0)) {
+        /* the first entry stays, its key bounds every key routed here; 
+           it takes over the child of the high key */
+        void *hitptr = entryvalue(mybp, pageaddr, 0);
+
+        if (mybp->noswap)
+            memcpy(hitptr, &highchild, 8);
+        else
+            xplatform_swapbytes(hitptr, &highchild, 8);
+        unplug(mybp, pageaddr, 1, last);
+    } else if (last > first + 1) 
+        unplug(mybp, pageaddr, first + 1, last - (first + 1));
+
+    xrelease(mybp);
+    buffer_unref(mybp->buf, pageaddr);
+    if (res != 0) 
+        return res;
+
+    if (first == last) {
+        /* both paths go through the same child */
+        if ((pageaddr = fixnode(mybp, lowchild)) == NULL) 
+            return -9;
+        return droprange(mybp, rd, pageaddr, depth + 1, LOWEDGE | HIGHEDGE);
+    }
+
+    if (lowchild != -1) {
+        if ((pageaddr = fixnode(mybp, lowchild)) == NULL) 
+            return -9;
+        if ((res = droprange(mybp, rd, pageaddr, depth + 1, LOWEDGE)) != 0)
+            return res;
+    }
+    if (highchild != -1) {
+        if ((pageaddr = fixnode(mybp, highchild)) == NULL) 
+            return -9;
+        res = droprange(mybp, rd, pageaddr, depth + 1, HIGHEDGE);
+    }
+
+    return res;
+}
+
+
+/*
+ * dropsubtree - put the pages of the subtree rooted at pagenum on the free
+ *               list
+ *
+ * - leaves are only read if their keys are to be visited, or if readers
+ *   share the btree: every page is then latched before it is freed, so
+ *   that the readers already inside the subtree have left it
+ * - return 0 if OK, -9 if low level IO error occurs
+ *
+ */
+int dropsubtree(mybtree_t *mybp, rangedel_t *rd, pagenum_t pagenum, 
+                int32_t depth)
+{
+    void *pageaddr;
+    hdr_t header;
+    int32_t count, entry;
+    int res = 0;
+
+    if ((depth < rd->leafdepth) || (rd->visit != NULL) || 
+        (mybp->concurrent)) {
+        if ((pageaddr = fixnode(mybp, pagenum)) == NULL) 
+            return -9;
+        if (mybp->concurrent) 
+            buffer_latch(mybp->buf, pageaddr, 1);
+
+        setheader(&header, pageaddr);
+        if (mybp->noswap)
+            count = *(header.countptr);
+        else
+            xplatform_swapbytes(&count, header.countptr, 4);
+
+        if (depth == rd->leafdepth) 
+            visitrange(mybp, rd, pageaddr, 0, count);
+        else {
+            for (entry = 0; (entry < count) && (res == 0); entry++) 
+                res = dropsubtree(mybp, rd, 
+                                  entrychild(mybp, pageaddr, entry), 
+                                  depth + 1);
+        }
+
+        if (res == 0) 
+            res = freepage(mybp, pagenum);
+        if (mybp->concurrent) 
+            buffer_unlatch(mybp->buf, pageaddr);
+        buffer_unref(mybp->buf, pageaddr);
+        return res;
+    }
+
+    return freepage(mybp, pagenum);
+}
+
+
+/*
+ * relink - after a range delete, link the page on the path of the low key
+ *          to the page on the path of the high key (or to none), level by
+ *          level
+ *
+ * - return 0 if OK, -9 if low level IO error occurs
+ *
+ */
+int relink(mybtree_t *mybp, rangedel_t *rd)
+{
+    int32_t depth;
+
+    for (depth = 1; depth <= rd->leafdepth; depth++) {
+        pagenum_t rightsibnum, oldnum;
+        void *pageaddr;
+        hdr_t header;
+
+        rightsibnum = (rd->highkey == NULL) ? -1 : rd->highpath[depth];
+        if (rightsibnum == rd->lowpath[depth]) 
+            continue;
+
+        if ((pageaddr = fixnode(mybp, rd->lowpath[depth])) == NULL) 
+            return -9;
+        setheader(&header, pageaddr);
+        if (mybp->noswap)
+            oldnum = *(header.rightsibnumptr);
+        else
+            xplatform_swapbytes(&oldnum, header.rightsibnumptr, 8);
+
+        if (oldnum != rightsibnum) {
+            xlatch(mybp, pageaddr);
+            if (mybp->noswap)
+                *(header.rightsibnumptr) = rightsibnum;
+            else
+                xplatform_swapbytes(header.rightsibnumptr, &rightsibnum, 8);
+            buffer_mark(mybp->buf, pageaddr);
+            xrelease(mybp);
+        }
+        buffer_unref(mybp->buf, pageaddr);
+    }
+
+    return 0;
 }
 
 
 /*
- * splitroot - create two new pages and split the content on the root
- *             page to the two new pages
+ * lowerbound - the offset of the first entry of a page whose key is not
+ *              below key (count if there is none, 0 if key is NULL)
  *
- * - this function works with both the leaf case and index case
- * - count1 is the number of entries to be assigned to the first page
- * - return 0 if OK, -9 if low level IO error
+ */
+int32_t lowerbound(mybtree_t *mybp, const void *pageaddr, const void *key)
+{
+    char keybuf[MAXSHAREDKEY];
+    int32_t entry;
+
+    if (key == NULL) 
+        return 0;
+
+    entry = binarysearch(mybp, pageaddr, key);
+    if (entry < 0) 
+        return 0;
+
+    return (mybp->compare(key, entrykey(mybp, pageaddr, entry, keybuf), 
+                          mybp->keysize) == 0) ? entry : entry + 1;
+}
+
+
+/*
+ * visitrange - pass the keys of count entries of a leaf, from entry first
+ *              on, to the visit routine of a range delete
  *
  */
-int splitroot(mybtree_t *mybp, void *pageaddr, int32_t cnt1, int32_t cnt2,
-              void **newaddr1ptr, void **newaddr2ptr)
+void visitrange(mybtree_t *mybp, rangedel_t *rd, const void *pageaddr, 
+                int32_t first, int32_t count)
 {
-    hdr_t header, header1, header2;
-    void *payload, *payload1, *payload2;
-    int recordsize,  movingsize, dummycount = 1;
-    pagenum_t pagenum1, pagenum2, dummynum = -1;
-    
-    setheader(&header, pageaddr);
-    recordsize = (*(header.typeptr) == 'l') ? 
-        mybp->leafentrysize : mybp->indexentrysize;
+    char keybuf[MAXSHAREDKEY], platformkey[MAXSHAREDKEY];
+    int32_t entry;
 
-    pagenum1 = mybp->nextpage;
-    pagenum2 = mybp->nextpage + 1;
-    if (((*newaddr1ptr = buffer_emptyfix(mybp->buf, pagenum1)) == NULL) ||
-        ((*newaddr2ptr = buffer_emptyfix(mybp->buf, pagenum2)) == NULL)){
-        fprintf(stderr, "(DEBUG)splitroot: cannot allocate buffer frame.\n");
-        return -9;
-    }
-    mybp->nextpage += 2;
+    if (rd->visit == NULL) 
+        return;
 
-    setheader(&header1, *newaddr1ptr);
-    setheader(&header2, *newaddr2ptr);
+    for (entry = first; entry < first + count; entry++) {
+        const char *key = entrykey(mybp, pageaddr, entry, keybuf);
 
-    if (noswap) {
-        *(header1.countptr) = cnt1;
-        *(header2.countptr) = cnt2;
-        *(header1.rightsibnumptr) = pagenum2;
-        *(header2.rightsibnumptr) = dummynum;
-    } else {
-        xplatform_swapbytes(header1.countptr, &cnt1, 4);
-        xplatform_swapbytes(header2.countptr, &cnt2, 4);
-        xplatform_swapbytes(header1.rightsibnumptr, &pagenum2, 8);
-        xplatform_swapbytes(header2.rightsibnumptr, &dummynum, 8);
+        if (mybp->noswapkey) 
+            rd->visit(rd->arg, key);
+        else {
+            xplatform_swapbytes(platformkey, key, mybp->keysize);
+            rd->visit(rd->arg, platformkey);
+        }
     }
 
-    *(header1.typeptr) = *(header2.typeptr) = *(header.typeptr);
+    return;
+}
 
-    /* let the second child know where to hook */
-    *(header2.ppageaddrptr) = pageaddr;
-    *(header2.pentryptr) = 0;
 
-    /* copy data across to the two pages */
-    payload = (char *)pageaddr + hdrsize;
-    payload1 = (char *)(*newaddr1ptr) + hdrsize;
-    payload2 = (char *)(*newaddr2ptr) + hdrsize;
+/*
+ * entrychild - the page number held by an entry of an index page
+ *
+ */
+pagenum_t entrychild(mybtree_t *mybp, const void *pageaddr, int32_t entry)
+{
+    pagenum_t pagenum;
 
-    movingsize = recordsize * cnt1;
-    memcpy(payload1, payload, movingsize);
-    memcpy(payload2, (char *)payload + movingsize, recordsize * cnt2);
-    buffer_mark(mybp->buf, *newaddr1ptr);
-    buffer_mark(mybp->buf, *newaddr2ptr);
+    if (mybp->noswap)
+        memcpy(&pagenum, entryvalue(mybp, pageaddr, entry), 8);
+    else
+        xplatform_swapbytes(&pagenum, entryvalue(mybp, pageaddr, entry), 8);
 
-    /* update the root page to record the fisrt child */
-    *(header.typeptr) = 'i';
+    return pagenum;
+}
 
-    if (noswap) {
-        *(header.countptr) = dummycount;
 
-        /* init/store key zero */
-        memset(payload, 0, mybp->keysize);
-        /* *(pagenum_t *)((char *)payload + mybp->keysize) = pagenum1; */
+/*
+ * allocpage - fix an empty page for a split, off the free list if it is
+ *             not empty, past the last page otherwise
+ *
+ * - return the pointer to the page and set *pagenumptr, NULL on error
+ *
+ */
+void *allocpage(mybtree_t *mybp, pagenum_t *pagenumptr)
+{
+    void *trunkaddr;
+    hdr_t header;
+    int32_t count;
 
-        /* install pagenum/value */
-        memcpy((char *)payload + mybp->keysize, &pagenum1, 8);
+    if (mybp->freehead == -1) {
+        void *pageaddr;
 
-    } else {
-        xplatform_swapbytes(header.countptr, &dummycount, 4);
-        memset(payload, 0, mybp->keysize);
-        xplatform_swapbytes((char *)payload + mybp->keysize, &pagenum1, 8);
+        /* concurrent readers load the page count to tell an empty btree */
+        *pagenumptr = mybp->nextpage;
+        if ((pageaddr = buffer_emptyfix(mybp->buf, mybp->nextpage)) != NULL)
+            __atomic_store_n(&mybp->nextpage, mybp->nextpage + 1, 
+                             __ATOMIC_RELAXED);
+        return pageaddr;
     }
 
-    buffer_mark(mybp->buf, pageaddr);
+    if ((trunkaddr = buffer_fix(mybp->buf, mybp->freehead)) == NULL) 
+        return NULL;
 
-    return 0;
-}
+    setheader(&header, trunkaddr);
+    if (mybp->noswap)
+        count = *(header.countptr);
+    else
+        xplatform_swapbytes(&count, header.countptr, 4);
+
+    if (count == 0) {
+        /* the trunk itself is the page, the next trunk heads the list */
+        *pagenumptr = mybp->freehead;
+        if (mybp->noswap)
+            mybp->freehead = *(header.rightsibnumptr);
+        else
+            xplatform_swapbytes(&mybp->freehead, header.rightsibnumptr, 8);
+        return trunkaddr;
+    }
+
+    count--;
+    if (mybp->noswap) {
+        memcpy(pagenumptr, (char *)trunkaddr + hdrsize + count * 8, 8);
+        *(header.countptr) = count;
+    } else {
+        xplatform_swapbytes(pagenumptr, (char *)trunkaddr + hdrsize + 
+                            count * 8, 8);
+        xplatform_swapbytes(header.countptr, &count, 4);
+    }
+    buffer_mark(mybp->buf, trunkaddr);
+    buffer_unref(mybp->buf, trunkaddr);
 
+    return buffer_emptyfix(mybp->buf, *pagenumptr);
+}
 
 
 /*
- * splitpage - create a new page, and move the specified number of entries
- *             to the new page 
+ * freepage - put a page no longer in the btree on the free list
  *
- * - this function works with both the leaf case and index case
- * - *newaddr1 is set to be pageaddr
- * - return 0 if OK, -9 if low level error
+ * - the page number is added to the first trunk, or the page becomes the
+ *   first trunk if that one is full
+ * - the first page freed sets BTREE_FREEPAGES, unless the format flags 
+ *   (and the schema after them) no longer fit before the root page; the
+ *   list then only lasts until the btree is closed
+ * - return 0 if OK, -9 if low level IO error occurs
  *
  */
-int splitpage(mybtree_t *mybp, void *pageaddr, int32_t cnt1, int32_t cnt2,
-              void **newaddr1ptr, void **newaddr2ptr)
+int freepage(mybtree_t *mybp, pagenum_t pagenum)
 {
-    hdr_t header, header2;
-    void *payload, *payload2;
-    int32_t recordsize;
-    pagenum_t pagenum2;
-
-    setheader(&header, pageaddr);
-
-    recordsize = (*(header.typeptr) == 'l') ? 
-        mybp->leafentrysize : mybp->indexentrysize;
+    void *pageaddr;
+    hdr_t header;
+    int32_t count, capacity = (mybp->pagesize - hdrsize) / 8;
+
+    if ((mybp->format & BTREE_FREEPAGES) == 0) {
+        off_t rootstart = mybp->startoffset + metahdrsize + 4;
+        char *asciischema = NULL;
+        uint32_t asciischemasize = 0;
+
+        /* a schema read from the file is rewritten after the flags */
+        if ((mybp->schema != NULL) && (mybp->asciischema == NULL) &&
+            (mybp->format == 0) &&
+            ((asciischema = schema_toascii(mybp->schema, &asciischemasize))
+             == NULL)) 
+            return -9;
 
-    pagenum2 = mybp->nextpage;
-    if ((*newaddr2ptr = buffer_emptyfix(mybp->buf, pagenum2)) == NULL) {
-        fprintf(stderr, "(DEBUG)splitpage: cannot allocate buffer frame.\n");
-        return -9;
+        rootstart += (asciischema != NULL) ? 
+            asciischemasize : mybp->asciischemasize;
+        if (rootstart <= mybp->rootpagenum * (off_t)mybp->pagesize) {
+            mybp->format |= BTREE_FREEPAGES;
+            if (asciischema != NULL) {
+                mybp->asciischema = asciischema;
+                mybp->asciischemasize = asciischemasize;
+            }
+        } else if (asciischema != NULL) 
+            free(asciischema);
     }
-    mybp->nextpage++;
 
+    if (mybp->freehead != -1) {
+        if ((pageaddr = buffer_fix(mybp->buf, mybp->freehead)) == NULL) 
+            return -9;
 
-    setheader(&header2, *newaddr2ptr);
-    if (noswap) {
-        *(header.countptr) = cnt1;
-        *(header2.countptr) = cnt2;
-        *(header2.rightsibnumptr) = *(header.rightsibnumptr);
-        *(header.rightsibnumptr) = pagenum2;
-    } else {
-        xplatform_swapbytes(header.countptr, &cnt1, 4);
-        xplatform_swapbytes(header2.countptr, &cnt2, 4);
+        setheader(&header, pageaddr);
+        if (mybp->noswap)
+            count = *(header.countptr);
+        else
+            xplatform_swapbytes(&count, header.countptr, 4);
 
-        /* *header.rightsibnumptr stores the native format */
-        memcpy(header2.rightsibnumptr, header.rightsibnumptr, 8);
+        if (count < capacity) {
+            char *dest = (char *)pageaddr + hdrsize + count * 8;
 
-        xplatform_swapbytes(header.rightsibnumptr, &pagenum2, 8);
-    }
+            count++;
+            if (mybp->noswap) {
+                memcpy(dest, &pagenum, 8);
+                *(header.countptr) = count;
+            } else {
+                xplatform_swapbytes(dest, &pagenum, 8);
+                xplatform_swapbytes(header.countptr, &count, 4);
+            }
+            buffer_mark(mybp->buf, pageaddr);
+            buffer_unref(mybp->buf, pageaddr);
+            return 0;
+        }
 
-    *(header2.typeptr) = *(header.typeptr);
+        buffer_unref(mybp->buf, pageaddr);
+    }
 
-    /* copy data across to the two pages */
-    payload = (char *)pageaddr + hdrsize;
-    payload2 = (char *)(*newaddr2ptr) + hdrsize;
-    memcpy(payload2, (char *)payload + recordsize * cnt1, recordsize * cnt2);
+    /* the page becomes the first trunk */
+    if ((pageaddr = buffer_emptyfix(mybp->buf, pagenum)) == NULL) 
+        return -9;
 
+    setheader(&header, pageaddr);
+    count = 0;
+    if (mybp->noswap) {
+        *(header.countptr) = count;
+        *(header.rightsibnumptr) = mybp->freehead;
+    } else {
+        xplatform_swapbytes(header.countptr, &count, 4);
+        xplatform_swapbytes(header.rightsibnumptr, &mybp->freehead, 8);
+    }
+    *(header.typeptr) = 'f';
     buffer_mark(mybp->buf, pageaddr);
-    buffer_mark(mybp->buf, *newaddr2ptr);
-
-    /* let the second child know where to hook to the parent */
-    *(header2.ppageaddrptr) = *(header.ppageaddrptr);
-    *(header2.pentryptr) = *(header.pentryptr);
+    buffer_unref(mybp->buf, pageaddr);
 
-    *newaddr1ptr = pageaddr; 
+    mybp->freehead = pagenum;
     return 0;
 }
 
 
 /*
- * unplug - remove the record at offset entry and pack the remainders
+ * loadfreehead, storefreehead - read and write the head of the free list
+ *                               in the root page
+ *
+ * - return 0 if OK, -1 on error
  *
  */
-void unplug(mybtree_t *mybp, void *pageaddr, int32_t entry)
+int loadfreehead(mybtree_t *mybp)
 {
-    void *src, *dest, *hitptr;
-    int count, movingsize;
-    hdr_t header;
+    void *rootaddr;
 
-    hitptr = (char *)pageaddr + hdrsize + entry * mybp->leafentrysize;
-    
-    setheader(&header, pageaddr);
-    if (noswap)
-        count = *(header.countptr);
+    if ((rootaddr = buffer_fix(mybp->buf, mybp->rootpagenum)) == NULL) 
+        return -1;
+
+    if (mybp->noswap)
+        memcpy(&mybp->freehead, (char *)rootaddr + FREEHEADOFFSET, 8);
     else
-        xplatform_swapbytes(&count, header.countptr, 4);
+        xplatform_swapbytes(&mybp->freehead, 
+                            (char *)rootaddr + FREEHEADOFFSET, 8);
 
-    movingsize = (count - (entry + 1)) * mybp->leafentrysize;
-    dest = hitptr;
-    src = (char *)hitptr + mybp->leafentrysize;
-    memmove(dest, src, movingsize);
+    buffer_unref(mybp->buf, rootaddr);
+    return ((mybp->freehead == -1) || 
+            ((mybp->freehead > mybp->rootpagenum) && 
+             (mybp->freehead < mybp->nextpage))) ? 0 : -1;
+}
 
-    count--;
-    if (noswap)
-        *(header.countptr) = count;
+int storefreehead(mybtree_t *mybp)
+{
+    void *rootaddr;
+
+    if ((rootaddr = buffer_fix(mybp->buf, mybp->rootpagenum)) == NULL) 
+        return -1;
+
+    if (mybp->noswap)
+        memcpy((char *)rootaddr + FREEHEADOFFSET, &mybp->freehead, 8);
     else
-        xplatform_swapbytes(header.countptr, &count, 4);
+        xplatform_swapbytes((char *)rootaddr + FREEHEADOFFSET, 
+                            &mybp->freehead, 8);
 
-    buffer_mark(mybp->buf, pageaddr);
-    
-    return;
+    buffer_mark(mybp->buf, rootaddr);
+    buffer_unref(mybp->buf, rootaddr);
+    return 0;
 }
 
 
-
 /*
  * append - append the data object to the right most of the current page
  *
@@ -2422,23 +5979,20 @@ void *append(mybtree_t *mybp, void *pageaddr,
 {
     hdr_t header;
     int32_t maxcount, count;
-    char *base;
+    char keybuf[MAXSHAREDKEY];
     const void *lastkey;
 
     setheader(&header, pageaddr);
 
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
 
-    base = (char *)pageaddr + hdrsize;
     if (*(header.typeptr) == 'l') {
-        int recordsize = mybp->leafentrysize;
-
         maxcount = mybp->appendleafmax;
         if (count > 0) {
-            lastkey = base + recordsize * (count - 1);
+            lastkey = entrykey(mybp, pageaddr, count - 1, keybuf);
             if (mybp->compare(key, lastkey, mybp->keysize) < 0) {
                 *pcode = -8;
                 return NULL;
@@ -2449,18 +6003,18 @@ void *append(mybtree_t *mybp, void *pageaddr,
         maxcount = mybp->appendindexmax;
 
 
-    if (count < maxcount) {
+    if (fits(mybp, pageaddr, 1, &key, maxcount, mybp->appendroom)) {
         /* no split, append to the end, plugin after the last entry */ 
 
         plugin(mybp, pageaddr, count - 1, 1, &key, &value);
 
         count++;
-        if (noswap)
+        if (mybp->noswap)
             *(header.countptr) = count;
         else
             xplatform_swapbytes(header.countptr, &count, 4);
 
-        buffer_mark(mybp->buf, pageaddr);
+        markpage(mybp, pageaddr);
         return pageaddr;
     } 
     else 
@@ -2483,14 +6037,13 @@ void *splitappend(mybtree_t *mybp, void *pageaddr,
 {
     void *newaddr1, *newaddr2;
     hdr_t newhd1, newhd2;
-    void *newbase1, *newbase2;
     void *ppageaddr;
     int32_t count, count1, count2;
     hdr_t header;
     pagenum_t pagenum;
 
     setheader(&header, pageaddr);
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
@@ -2514,30 +6067,27 @@ void *splitappend(mybtree_t *mybp, void *pageaddr,
         }
     }
 
-    newbase1 = (char *)newaddr1 + hdrsize;
-    newbase2 = (char *)newaddr2 + hdrsize;
-
     setheader(&newhd1, newaddr1);
     setheader(&newhd2, newaddr2);
+    setlinks(mybp, &newhd2, newaddr2);
 
     /* plugin the appending object in the first slot of the second page */
     plugin(mybp, newaddr2, -1, 1, &key, &value);
     count2 = 1;
-    if (noswap)
+    if (mybp->noswap)
         *(newhd2.countptr) = count2;
     else
         xplatform_swapbytes(newhd2.countptr, &count2, 4);
-    buffer_mark(mybp->buf, newaddr2);
+    markpage(mybp, newaddr2);
 
     /* unref the passed page */
     buffer_unref(mybp->buf, newaddr1);
 
     /* append an index entry at higer level */
     ppageaddr = *(newhd2.ppageaddrptr);
-    pagenum = mybp->nextpage - 1;
+    pagenum = buffer_pagenum(mybp->buf, newaddr2);
 
-    *(newhd2.ppageaddrptr) = append(mybp, ppageaddr, newbase2, &pagenum, 
-                                    pcode);
+    *(newhd2.ppageaddrptr) = append(mybp, ppageaddr, key, &pagenum, pcode);
     
     return (*(newhd2.ppageaddrptr) == NULL) ? NULL : newaddr2;
 }
@@ -2558,12 +6108,13 @@ int32_t findentrypoint(mybtree_t *mybp, const void *key, void **pageaddrptr)
     hdr_t header;
     int32_t entry;
 
-    if ((ppageaddr = buffer_fix(mybp->buf, mybp->rootpagenum)) == NULL) {
+    if ((ppageaddr = fixnode(mybp, mybp->rootpagenum)) == NULL) {
         fprintf(stderr, "(DEUBG)findentrypoint: cannot fix root page.\n");
         return -9;
     }
 
     setheader(&header, ppageaddr);
+    setlinks(mybp, &header, ppageaddr);
     *(header.ppageaddrptr) = NULL;
 
     pageaddr = locateleaf(mybp, ppageaddr, key);
@@ -2594,10 +6145,11 @@ int inorder(mybtree_t *mybp, void *pageaddr, int32_t entry,
     int i, foundnextkey, count;
     hdr_t header;
     void *nextpage = NULL;
+    char keybuf[MAXSHAREDKEY];
 
     /* check the anchor */
     if (entry != -1) {
-        anchorkey = (char *)pageaddr + hdrsize + entry * mybp->leafentrysize;
+        anchorkey = entrykey(mybp, pageaddr, entry, keybuf);
         if (mybp->compare(anchorkey, keys[0], mybp->keysize) > 0) 
             return -4;
     }
@@ -2610,21 +6162,20 @@ int inorder(mybtree_t *mybp, void *pageaddr, int32_t entry,
     /* check the key after anchor */
     setheader(&header, pageaddr);
     foundnextkey = 0;
-    if (noswap)
+    if (mybp->noswap)
         count = *(header.countptr);
     else
         xplatform_swapbytes(&count, header.countptr, 4);
 
     
     if (entry + 1 < count) { 
-        nextkey = (char *)pageaddr + hdrsize + 
-            (entry + 1) * mybp->leafentrysize;
+        nextkey = entrykey(mybp, pageaddr, entry + 1, keybuf);
         foundnextkey = 1;
         nextpage = NULL;
     } else {
         pagenum_t rightsibnum;
 
-        if (noswap)
+        if (mybp->noswap)
             rightsibnum = *(header.rightsibnumptr);
         else
             xplatform_swapbytes(&rightsibnum, header.rightsibnumptr, 8);
@@ -2636,16 +6187,16 @@ int inorder(mybtree_t *mybp, void *pageaddr, int32_t entry,
             }
 
             setheader(&header, nextpage);
-            if (noswap)
+            if (mybp->noswap)
                 count = *(header.countptr);
             else
                 xplatform_swapbytes(&count, header.countptr, 4);
 
             if (count > 0) {
                 foundnextkey = 1;
-                nextkey = (char *)nextpage + hdrsize;
+                nextkey = entrykey(mybp, nextpage, 0, keybuf);
             } else {
-                if (noswap)
+                if (mybp->noswap)
                     rightsibnum = *(header.rightsibnumptr);
                 else
                     xplatform_swapbytes(&rightsibnum, header.rightsibnumptr,8);
@@ -2677,24 +6228,88 @@ int inorder(mybtree_t *mybp, void *pageaddr, int32_t entry,
 void setheader(hdr_t *hdrptr, const void *pageaddr)
 {
     hdrptr->rightsibnumptr = (pagenum_t *)pageaddr;
-    hdrptr->ppageaddrptr = (void **)((char *)pageaddr + 8);
+    hdrptr->ppageaddrptr = NULL;
     hdrptr->countptr = (int32_t *)((char *)pageaddr + 16);
-    hdrptr->pentryptr = (int32_t *)((char *)pageaddr + 20);
+    hdrptr->pentryptr = NULL;
     hdrptr->typeptr = (char *)((char *)pageaddr + 24);
     return;
 }
+
+
+/*
+ * setlinks - install pointers to the runtime parent link of a fixed page
+ *
+ * - the link lives in the buffer control block so that read-only (mapped)
+ *   pages are never written
+ *
+ */
+void setlinks(mybtree_t *mybp, hdr_t *hdrptr, const void *pageaddr)
+{
+    bcb_t *bcb = buffer_getbcb(mybp->buf, pageaddr);
+
+    hdrptr->ppageaddrptr = &bcb->link;
+    hdrptr->pentryptr = &bcb->linkentry;
+    return;
+}
     
 
 /*
- * extractfield - extract value from a byte string 
+ * extractbatch - extract the payloads (or a field) of count consecutive
+ *                entries of a leaf, from entry first on
+ *
+ * - look up the layout once per field rather than once per entry
+ * - with BTREE_COLUMNS, a field is read from its own minipage
  *
  */
-void extractfield(mybtree_t *mybp, void *value, const void *src, 
-                  int32_t fieldind)
+void extractbatch(mybtree_t *mybp, void *values[], const void *pageaddr, 
+                  int32_t first, int32_t count, int32_t fieldind)
 {
-    xplatform_getfield (mybp->scb, value, src, fieldind, !noswap);
+    int32_t index, memberind, stride;
+    int swapflag = !mybp->noswap;
+
+    if (mybp->schema == NULL) {
+        const char *src;
+
+        src = valueslot(mybp, pageaddr, first, 0, mybp->valuesize, &stride);
+        for (index = 0; index < count; index++) 
+            memcpy(values[index], src + index * stride, mybp->valuesize);
+        return;
+    }
+
+    for (memberind = 0; memberind < mybp->schema->fieldnum; memberind++) {
+        const char *fieldptr;
+        int32_t size, offset;
+
+        if ((fieldind < mybp->schema->fieldnum) && (memberind != fieldind))
+            continue;
+
+        size = mybp->schema->field[memberind].size;
+        fieldptr = valueslot(mybp, pageaddr, first, 
+                             mybp->schema->field[memberind].offset, size,
+                             &stride);
+
+        /* a particular field lands at the start of the value */
+        offset = (fieldind < mybp->schema->fieldnum) ? 
+            0 : mybp->scb->member[memberind].offset;
+
+        if ((size > 1) && swapflag) {
+            for (index = 0; index < count; index++) {
+                xplatform_swapbytes((char *)values[index] + offset, fieldptr,
+                                    size);
+                fieldptr += stride;
+            }
+        } else {
+            for (index = 0; index < count; index++) {
+                memcpy((char *)values[index] + offset, fieldptr, size);
+                fieldptr += stride;
+            }
+        }
+    }
+
+    return;
 }
 
+
 /*
  * whichfield - determine the field index of the "fieldname" 
  *
@@ -2730,97 +6345,124 @@ int whichfield(mybtree_t *mybp, const char *fieldname)
     
 
 /*
- * populatefield - set value to proper position in a byte string 
+ * storevalue - store a payload (in platform format) as the value of an
+ *              entry of a leaf
+ *
+ * - with a schema, each field is stored compactly, in storage format
  *
  */
-void populatefield(mybtree_t *mybp, void *dest, const void *value, 
-                   int32_t fieldind)
+void storevalue(mybtree_t *mybp, void *pageaddr, int32_t entry, 
+                const void *value)
 {
-    xplatform_setfield (mybp->scb, dest, value, fieldind, !noswap);
+    int32_t memberind, stride;
+    int swapflag = !mybp->noswap;
+
+    if (mybp->schema == NULL) {
+        /* no schmea defined , treat values as binary blobs */
+        memcpy(valueslot(mybp, pageaddr, entry, 0, mybp->valuesize, &stride),
+               value, mybp->valuesize);
+        return;
+    }
+
+    for (memberind = 0; memberind < mybp->schema->fieldnum; memberind++) {
+        const char *memberptr;
+        char *fieldptr;
+        int32_t size;
+
+        size = mybp->schema->field[memberind].size;
+        fieldptr = valueslot(mybp, pageaddr, entry, 
+                             mybp->schema->field[memberind].offset, size,
+                             &stride);
+        memberptr = (const char *)value + mybp->scb->member[memberind].offset;
+
+        if ((size > 1) && swapflag) 
+            xplatform_swapbytes(fieldptr, memberptr, size);
+        else
+            memcpy(fieldptr, memberptr, size);
+    }
+
+    return;
 }
 
 
 /*
- * numeral_compare - default numeral comparison function
+ * NUMERALCOMPARE - define the comparison functions of a numeral key type
  *
  * - key1 is in foreign/platform-specfic variable format 
- * - key2 is in native/storage-specific format
+ * - key2 is in native/storage-specific format: name_compare reads it as
+ *   is, name_swapcompare swaps its bytes first
+ * - the keys are memcpy'ed to avoid complaints from platforms that have
+ *   strict alignment requirement
  * - return 1, 0, -1 if key1 >, =, or < key2
  *
  */
-int numeral_compare(const void *key1, const void *key2, int size)
-{
-    unsigned char keybuf1[8], keybuf2[8];
+#define NUMERALCOMPARE(name, type)                                          \
+static int name##_compare(const void *key1, const void *key2, int size)     \
+{                                                                           \
+    type v1, v2;                                                            \
+                                                                            \
+    memcpy(&v1, key1, sizeof(type));                                        \
+    memcpy(&v2, key2, sizeof(type));                                        \
+    return (v1 > v2) ? 1 : ((v1 < v2) ? -1 : 0);                            \
+}                                                                           \
+                                                                            \
+static int name##_swapcompare(const void *key1, const void *key2, int size) \
+{                                                                           \
+    type v1, v2;                                                            \
+                                                                            \
+    memcpy(&v1, key1, sizeof(type));                                        \
+    xplatform_swapbytes(&v2, key2, sizeof(type));                           \
+    return (v1 > v2) ? 1 : ((v1 < v2) ? -1 : 0);                            \
+}
 
-    /* this excessive memcpy is to avoid complaints from platforms that
-       have strict alignment requirement, type casting is not enough to 
-       subdue the warnings */
-    memcpy(keybuf1, key1, size);
-    if (noswapkey) 
-        memcpy(keybuf2, key2, size);
-    else
-        xplatform_swapbytes(keybuf2, key2, size);
+NUMERALCOMPARE(int32, int32_t)
+NUMERALCOMPARE(int64, int64_t)
+NUMERALCOMPARE(uint32, uint32_t)
+NUMERALCOMPARE(uint64, uint64_t)
+NUMERALCOMPARE(float32, float)
+NUMERALCOMPARE(float64, double)
 
-    /* now cast the key buffers to proper data type for comparison */
-    if (strcmp(keytype, "int32_t") == 0) {
-        if (*(int32_t *)keybuf1 > (*(int32_t *)keybuf2)) 
-            return 1;
-        else if (*(int32_t *)keybuf1 < (*(int32_t *)keybuf2)) 
-            return -1;
-        else
-            return 0;
-    }
 
-    if (strcmp(keytype, "int64_t") == 0) {
-        if (*(int64_t *)keybuf1 > (*(int64_t *)keybuf2)) 
-            return 1;
-        else if (*(int64_t *)keybuf1 < (*(int64_t *)keybuf2)) 
-            return -1;
-        else
-            return 0;
-    }
+/*
+ * numeraltable - the numeral key types and their comparison functions
+ *
+ */
+static const struct {
+    const char *keytype;
+    uint32_t keysize;
+    btree_compare_t *compare, *swapcompare;
+} numeraltable[] = {
+    {"int32_t",   4, int32_compare,   int32_swapcompare},
+    {"int64_t",   8, int64_compare,   int64_swapcompare},
+    {"uint32_t",  4, uint32_compare,  uint32_swapcompare},
+    {"uint64_t",  8, uint64_compare,  uint64_swapcompare},
+    {"float",     4, float32_compare, float32_swapcompare},
+    {"float32_t", 4, float32_compare, float32_swapcompare},
+    {"double",    8, float64_compare, float64_swapcompare},
+    {"float64_t", 8, float64_compare, float64_swapcompare}
+};
 
-    
-    if (strcmp(keytype, "uint32_t") == 0) {
-        if (*(uint32_t *)keybuf1 > (*(uint32_t *)keybuf2)) 
-            return 1;
-        else if (*(uint32_t *)keybuf1 < (*(uint32_t *)keybuf2)) 
-            return -1;
-        else
-            return 0;
-    }
- 
-    if (strcmp(keytype, "uint64_t") == 0) {
-        if (*(uint64_t *)keybuf1 > (*(uint64_t *)keybuf2)) 
-            return 1;
-        else if (*(uint64_t *)keybuf1 < (*(uint64_t *)keybuf2)) 
-            return -1;
-        else
-            return 0;
-    }
-   
-    if ((strcmp(keytype, "float") == 0) || 
-        (strcmp(keytype, "float32_t") == 0)) {
-        if (*(float *)keybuf1 > (*(float *)keybuf2)) 
-            return 1;
-        else if (*(float *)keybuf1 < (*(float *)keybuf2)) 
-            return -1;
-        else
-            return 0;
-    } 
 
-    if ((strcmp(keytype, "double") == 0) || 
-        (strcmp(keytype, "float64_t") == 0)) {
-        if (*(double *)keybuf1 > (*(double *)keybuf2)) 
-            return 1;
-        else if (*(double *)keybuf1 < (*(double *)keybuf2)) 
-            return -1;
-        else
-            return 0;
+/*
+ * numeral_compare - look up the comparison function of a numeral key type
+ *
+ * - called once at open, so comparisons never look at the type name
+ * - return NULL if the type is unknown or the size does not match it
+ *
+ */
+btree_compare_t *numeral_compare(const char *ktype, uint32_t ksize, int swap)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(numeraltable) / sizeof(numeraltable[0])); 
+         i++) {
+        if ((strcmp(ktype, numeraltable[i].keytype) == 0) &&
+            (ksize == numeraltable[i].keysize)) 
+            return (swap) ? numeraltable[i].swapcompare : 
+                numeraltable[i].compare;
     }
-    
-    /* this point should never be reached */
-    exit(-1);
+
+    return NULL;
 }
 
 /*
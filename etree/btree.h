@@ -30,6 +30,8 @@ typedef off_t pagenum_t;
 #define PAGENUM_T
 #endif
 
+#include "bufstat.h"
+
 
 /*
  * btree_t - runtime btree handler; a stub handler to the underlying
@@ -39,6 +41,37 @@ typedef off_t pagenum_t;
 typedef struct btree_t {} btree_t;
 
 
+/*
+ * page format flags of a new btree (btree_setformat)
+ *
+ * - BTREE_SEARCHINDEX: each page keeps a dense array of every 16th key at
+ *   its end, so a search touches a couple of cache lines before it 
+ *   probes one block of entries; costs about 1/30 of the page capacity
+ * - BTREE_PREFIXKEYS: the leading and trailing key bytes shared by all the
+ *   entries of a page are stored once in the page; each entry keeps the
+ *   bytes in between only.  Keys of at most 255 bytes; cannot be combined
+ *   with BTREE_SEARCHINDEX
+ * - BTREE_FROZEN: the btree was written by btree_freeze, with full leaves
+ *   in key order and each index level contiguous; it is never modified, 
+ *   so it can only be opened O_RDONLY and its pages are mapped.  Set by
+ *   btree_freeze only
+ * - BTREE_FREEPAGES: the root page keeps the head of the list of pages
+ *   freed by btree_deleterange, which later splits reuse.  Set by 
+ *   btree_deleterange only
+ * - BTREE_COLUMNS: a leaf keeps its keys back to back, then each field of
+ *   the schema (or the whole value, without one) in a minipage of its 
+ *   own, so that reading one field of many records touches that field
+ *   only.  Same capacity as the original format; cannot be combined with
+ *   BTREE_PREFIXKEYS
+ *
+ */
+#define BTREE_SEARCHINDEX  0x1
+#define BTREE_PREFIXKEYS   0x2
+#define BTREE_FROZEN       0x4
+#define BTREE_FREEPAGES    0x8
+#define BTREE_COLUMNS      0x10
+
+
 /*
  * admin routines
  *
@@ -64,6 +97,8 @@ btree_t *btree_open(const char *pathname, int flags, uint32_t ksize,
                     off_t startoffset);
 
 int btree_registerschema(btree_t *bp, const char *defstring);
+int btree_setformat(btree_t *bp, uint32_t format);
+uint32_t btree_getformat(btree_t *bp);
 int btree_printschema(btree_t *bp, FILE *fp);
 char *btree_getschema(btree_t *bp);
 int btree_close(btree_t *bp);
@@ -78,6 +113,27 @@ int btree_search(btree_t *bp, const void  *key, void *hitkey,
                  const char *fieldname, void *value);
 int btree_update(btree_t *bp, const void *key, const void *value);
 int btree_delete(btree_t *bp, const void *key);
+int btree_searchbatch(btree_t *bp, int count, const void *keys[], 
+                      void *hitkeys[], const char *fieldname, void *values[]);
+
+
+/*
+ * remove the records with keys in [lowkey, highkey); the visit routine,
+ * if not NULL, is called with the key of each record removed
+ *
+ */
+typedef void btree_visit_t(void *arg, const void *key);
+int btree_deleterange(btree_t *bp, const void *lowkey, const void *highkey,
+                      btree_visit_t *visit, void *arg);
+
+
+/*
+ * search on behalf of one of several reader threads, while one writer
+ * thread updates the btree (opened with O_CONCURRENT)
+ *
+ */
+int btree_concurrentsearch(btree_t *bp, const void *key, void *hitkey, 
+                           const char *fieldname, void *value);
 
 
 
@@ -91,6 +147,17 @@ int btree_stopcursor(btree_t *bp);
 int btree_getcursor(btree_t *bp, void *key, const char *fieldname, 
                     void *value);
 int btree_advcursor(btree_t *bp);
+int btree_getcursorbatch(btree_t *bp, int max, void *keys, 
+                         const char *fieldname, void *values[]);
+
+/*
+ * split the key space into balanced ranges, each scanned by a range 
+ * cursor (on a btree handle of its own)
+ *
+ */
+int btree_partition(btree_t *bp, int nparts, void *bounds);
+int btree_initrangecursor(btree_t *bp, const void *startkey, 
+                          const void *stopkey);
 
 
 /*
@@ -103,12 +170,42 @@ int btree_append(btree_t *bp, const void *key, const void *value);
 int btree_endappend(btree_t *bp);
 
 
+/*
+ * build an empty btree from sorted streams of records, one thread per
+ * stream; a stream routine stores pointers to the next record (valid 
+ * until its next call) and returns 1, 0 at the end, -1 on error
+ *
+ */
+typedef int btree_stream_t(void *arg, const void **keyptr, 
+                           const void **valueptr);
+int btree_bulkbuild(btree_t *bp, int nstreams, btree_stream_t *streams[],
+                    void *args[], double fillratio);
+
+
 /*
  * output usage statistics to a file
  *
  */
 int btree_printstat(btree_t *bp, FILE *fp);
 
+/*
+ * read the bytes of the file that lie outside the btree pages; write a 
+ * compressed copy of the btree file; rebuild the btree into an empty one
+ * in the frozen format
+ *
+ */
+int btree_readbytes(btree_t *bp, void *dest, size_t size, off_t offset);
+int btree_compress(btree_t *bp, const char *destpath);
+int btree_freeze(btree_t *bp, btree_t *destbp);
+
+
+/*
+ * buffer pool and I/O statistics, as a struct or printed as JSON
+ *
+ */
+int btree_getbufstat(btree_t *bp, bufstat_t *stat);
+int btree_printbufstat(btree_t *bp, FILE *fp);
+
 
 /*
  * support for bulk operations 
@@ -1,5 +1,6 @@
 /**
- * buffer.c - single-thread buffer manager implementing LRU replacement policy
+ * buffer.c - buffer manager implementing LRU replacement policy, with 
+ *            latched entry points for threads sharing a sharded pool
  *
  * Copyright (c) 2003 Tiankai Tu  
  * All rights reserved.  May not be used, modified, or copied 
@@ -14,6 +15,11 @@
  *
  */
 
+/* O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,33 +27,250 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <errno.h>
 
 #include "buffer.h"
+#include "zpage.h"
 
-/* various offsets for quick pointer manipulation */
-static int lruln_offset, hashln_offset;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * MAXSHARDS, MINSHARDFRAMES - an O_CONCURRENT pool is split into the 
+ * largest power of two of shards (up to MAXSHARDS) that leaves every shard
+ * with at least MINSHARDFRAMES frames
+ *
+ */
+#define MAXSHARDS 64
+#define MINSHARDFRAMES 32
+
+/*
+ * HUGEPAGESIZE - frames are mapped in multiples of the (default) huge 
+ * page size so that the kernel can back them with huge pages
+ *
+ */
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+
+/*
+ * SHMMAGIC, SHMWAIT - a shared pool segment starts with a shmhdr_t 
+ * tagged SHMMAGIC; a process that finds the segment being initialized 
+ * by another waits for it up to SHMWAIT seconds, then keeps to a 
+ * private pool
+ *
+ */
+#define SHMMAGIC 0x65427546
+#define SHMWAIT 10
+
+#define ALIGNUP(size, align) (((size) + (align) - 1) / (align) * (align))
+
+/*
+ * shmhdr_t - header of a pool shared by processes through POSIX shared 
+ *            memory
+ *
+ * - the segment holds the header, the shards, the bcb table, the hash 
+ *   tables and the frames, at the offsets recorded here; it is mapped at
+ *   the same address (base) in every process so that the lists and page
+ *   addresses inside it hold for all of them
+ * - the header is valid once ready is set by the creating process
+ * - the modification time and size of the file the pages were read from;
+ *   a segment left by an older version of the file is stale
+ * - retired is set once a process died holding a shard latch: the 
+ *   segment is still used by the processes attached to it, but the next
+ *   process to open the file replaces it
+ *
+ */
+typedef struct shmhdr_t {
+    uint32_t magic;
+    volatile uint32_t ready;
+    struct timespec mtime;
+    off_t filesize;
+    volatile uint32_t retired;
+    void *base;
+    size_t size;
+    uint32_t pagesize;
+    uint32_t bcbsize;
+    uint32_t shardcount;
+    size_t framecount;
+    size_t shardoffset, bcboffset, htoffset, pooloffset;
+    volatile int32_t attached;
+} shmhdr_t;
+
+/*
+ * ZMAGIC, ZTRAILERSIZE - a compressed page file ends with a trailer of 
+ * ZTRAILERSIZE bytes that starts with ZMAGIC:
+ *
+ *   magic[8] pagesize[4] unused[4] rawpages[8] pagecount[8] 
+ *   tableoffset[8] suffixoffset[8] suffixsize[8] unused[8]
+ *
+ * - the file starts with its first rawpages pages stored as they are 
+ *   (the headers and schema of the btree and the etree), so they are 
+ *   found at the same offsets as in the uncompressed file
+ * - pages rawpages .. pagecount - 1 follow as compressed extents; the 
+ *   page-location table at tableoffset holds the offsets of the extents,
+ *   plus that of the end of the last one; an extent of a whole page is a
+ *   page stored uncompressed
+ * - the suffixsize bytes that followed the last page (application meta
+ *   data) are stored at suffixoffset
+ * - all the numbers are little-endian
+ *
+ */
+#define ZMAGIC "ETREEZ01"
+#define ZTRAILERSIZE 64
+
+/*
+ * DIRECTALIGN - alignment of the frames, file offsets and transfer sizes
+ * of O_DIRECTIO reads and writes; pages must be a multiple of it
+ *
+ */
+#define DIRECTALIGN 4096
 
-static bcb_t *findvictimbcb(buffer_t *buf);
-static bcb_t *findbcb(buffer_t *buf, pagenum_t pagenum);
+/*
+ * PREFETCHDEPTH - maximum number of prefetch reads in flight; no more 
+ * than half of the pool is ever being read into
+ *
+ */
+#define PREFETCHDEPTH 64
+
+/*
+ * REFINC, REFDEC, REFGET - refcounts are updated atomically so that a 
+ * thread can release (or add a reference to) a page it has fixed without
+ * taking the shard latch; victims are only chosen under the latch, and a
+ * fix always holds it, so a refcount cannot rise from zero behind the 
+ * victim search.  REFGET reads one that other threads may be releasing;
+ * a frame seen unfixed is then reused after its last reader is done
+ *
+ */
+#ifdef __GNUC__
+#define REFINC(bcb) __sync_add_and_fetch(&(bcb)->refcount, 1)
+#define REFDEC(bcb) __sync_sub_and_fetch(&(bcb)->refcount, 1)
+#define REFGET(bcb) __atomic_load_n(&(bcb)->refcount, __ATOMIC_ACQUIRE)
+#else
+#define REFINC(bcb) (++(bcb)->refcount)
+#define REFDEC(bcb) (--(bcb)->refcount)
+#define REFGET(bcb) ((bcb)->refcount)
+#endif
+
+/* various offsets for quick pointer manipulation */
+static const int lruln_offset = offsetof(bcb_t, lruln);
+static const int hashln_offset = offsetof(bcb_t, hashln);
+
+static bufshard_t *pageshard(buffer_t *buf, pagenum_t pagenum);
+static dlink_t *hashchain(buffer_t *buf, bufshard_t *shard, 
+                          pagenum_t pagenum);
+static void *fixpage(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum);
+static void *emptypage(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum);
+static bcb_t *findvictimbcb(dlink_t *lru);
+static bcb_t *grabbcb(buffer_t *buf, bufshard_t *shard);
+static bcb_t *findbcb(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum);
+static bcb_t *lookupbcb(buffer_t *buf, pagenum_t pagenum);
 static uint32_t hash(uint32_t htsize, pagenum_t pagenum);
 static uint32_t safebcbnum(buffer_t *buf, void *pageaddr, const char *fnname);
-
-static int io_write(int fd, pagenum_t pageid, const void *src, size_t size);
-static int io_read(void *dest, int fd, pagenum_t pageid, size_t size);
+static bcb_t *fixedbcb(buffer_t *buf, void *pageaddr, const char *funcname);
+static bcb_t *concurrentbcb(buffer_t *buf, void *pageaddr, 
+                            const char *fnname);
+
+static int reapprefetch(buffer_t *buf);
+
+static int initshards(buffer_t *buf, dlink_t *hashspace, 
+                      const pthread_mutexattr_t *latchattr);
+static void lockshard(buffer_t *buf, bufshard_t *shard);
+static void resetshard(buffer_t *buf, bufshard_t *shard);
+static int attachshm(buffer_t *buf, size_t framecount);
+static int openshm(buffer_t *buf, const char *shmname, 
+                   const struct stat *filestat, size_t framecount);
+static int createshm(buffer_t *buf, int shmfd, const struct stat *filestat,
+                     size_t framecount);
+
+static int io_write(int fd, pagenum_t pageid, const void *src, size_t size,
+                    bufstat_t *stat);
+static int io_read(void *dest, int fd, pagenum_t pageid, size_t size,
+                   bufstat_t *stat);
+static int io_writev(int fd, pagenum_t pageid, const struct iovec *iov, 
+                     int count, size_t size, bufstat_t *stat);
+static int io_readv(struct iovec *iov, int count, int fd, pagenum_t pageid,
+                    size_t size, bufstat_t *stat);
+
+static uint64_t usecnow();
+static void recordio(uint64_t latency[], uint64_t usecs);
+static void sumstat(bufstat_t *total, const bufstat_t *stat);
+static void printjsonstring(FILE *fp, const char *str);
+static void printjsonarray(FILE *fp, const uint64_t array[], int count);
+
+static int comparebcb(const void *ptr1, const void *ptr2);
+static int flushbcbs(buffer_t *buf, bcb_t **bcbs, size_t count);
+
+static void *allocframes(size_t size, size_t *mapsizeptr);
+static void freeframes(void *base, size_t mapsize);
+static int mapfile(buffer_t *buf);
+static int loadpage(buffer_t *buf, bcb_t *bcb);
+
+static int opendirect(buffer_t *buf, const char *filename, int openflags);
+static int closefile(buffer_t *buf);
+
+static int loadztable(buffer_t *buf);
+static int loadzpage(buffer_t *buf, bcb_t *bcb);
+static void put64(unsigned char *ptr, uint64_t value);
+static uint64_t get64(const unsigned char *ptr);
+
+/* 
+ * replacement policies
+ *
+ */
+static void lru_admit(buffer_t *buf, bufshard_t *shard, bcb_t *bcb);
+static void lru_touch(buffer_t *buf, bufshard_t *shard, bcb_t *bcb);
+static void lru_forget(buffer_t *buf, bufshard_t *shard, bcb_t *bcb);
+static bcb_t *lru_victim(buffer_t *buf, bufshard_t *shard);
+
+static int twoq_init(buffer_t *buf, bufshard_t *shard);
+static void twoq_destroy(buffer_t *buf, bufshard_t *shard);
+static void twoq_admit(buffer_t *buf, bufshard_t *shard, bcb_t *bcb);
+static void twoq_touch(buffer_t *buf, bufshard_t *shard, bcb_t *bcb);
+static void twoq_forget(buffer_t *buf, bufshard_t *shard, bcb_t *bcb);
+static bcb_t *twoq_victim(buffer_t *buf, bufshard_t *shard);
+
+static const bufpolicy_t lrupolicy = {
+    "LRU", NULL, NULL, lru_admit, lru_touch, lru_forget, lru_victim
+};
+
+static const bufpolicy_t twoqpolicy = {
+    "2Q", twoq_init, twoq_destroy, twoq_admit, twoq_touch, twoq_forget, 
+    twoq_victim
+};
 
 /*
- * buffer_init - create a buffer of size framecount * pagesize
+ * buffer_init - create a buffer of size framecount * pagesize, plus a 
+ *               pinned region of pincount pages
  *
  * - open the file as specified by the flags 
+ * - if O_MMAP is or'd with O_RDONLY, map the file and let the bcb's describe
+ *   the mapped pages; fall back to a private pool if the map fails
+ * - if O_CONCURRENT is set, partition the frames into shards
+ * - a compressed page file (see ZMAGIC) is recognized by its trailer; it
+ *   can only be opened O_RDONLY, and its pages are decompressed into the
+ *   frames as they are read (O_MMAP then has no effect)
+ * - if O_DIRECTIO is set and the file system allows it, pages are read 
+ *   and written with O_DIRECT, bypassing the kernel page cache
+ * - if O_SHMPOOL is or'd with O_RDONLY, use (or create) the pool that 
+ *   the processes reading the same file share in POSIX shared memory; 
+ *   fall back to a private pool if it cannot be mapped
+ * - if O_2Q is set, replace pages with 2Q instead of LRU
+ * - the pinned region is only reserved address space until pages are 
+ *   pinned in it (large allocations are mapped on demand); there is none
+ *   in mmap mode
  * - return a pointer to the buffer if OK, NULL on error;
  *
  */
 buffer_t *buffer_init(const char *filename, int flags, size_t framecount, 
-                      uint32_t pagesize)
+                      size_t pincount, uint32_t pagesize)
 {
     buffer_t *buf;
     int i;
-    void *baseptr, *memberptr, *curbcbptr;
 
     /* initialize the file related field */
     if ((buf = (buffer_t *)malloc(sizeof(buffer_t))) == NULL) {
@@ -59,66 +282,512 @@ buffer_t *buffer_init(const char *filename, int flags, size_t framecount,
         return NULL;
     }
     strcpy(buf->filename, filename);
-    if ((buf->fd = open(filename, flags & (~O_INCORE), 
+    buf->pagesize = pagesize;
+    buf->flags = flags;        
+    buf->direct = 0;
+    if ((buf->fd = open(filename, 
+                        flags & (~(O_INCORE | O_MMAP | O_CONCURRENT | O_2Q |
+                                   O_PININDEX | O_SHMPOOL | O_DIRECTIO)),
                         S_IRUSR|S_IWUSR|S_IRGRP)) == -1){
         /* file open error, application should invoke perror() */
         return NULL;
     }
-    buf->flags = flags;        
+    buf->plainfd = buf->fd;
     
     /* initialize the buffer pool and control blocks */
-    buf->pagesize = pagesize;
     buf->framecount = framecount;
-    if ((buf->pool = malloc(framecount * (size_t)pagesize)) == NULL) {
+    buf->mapbase = NULL;
+    buf->mapsize = 0;
+    buf->pool = NULL;
+    buf->poolmapsize = 0;
+    buf->shm = NULL;
+    buf->shmsize = 0;
+    buf->aio = NULL;
+    dlink_init(&buf->readylist);
+    buf->pageclass = NULL;
+    buf->zextents = NULL;
+
+    /* the trailer is read through the plain descriptor: only an 
+       uncompressed file, whose pages are aligned, may do O_DIRECT I/O */
+    switch (loadztable(buf)) {
+    case 0: 
+        opendirect(buf, filename, 
+                   flags & (~(O_INCORE | O_MMAP | O_CONCURRENT | O_2Q |
+                              O_PININDEX | O_SHMPOOL | O_DIRECTIO |
+                              O_CREAT | O_EXCL | O_TRUNC)));
+        break;
+    case 1: 
+        if ((flags & O_ACCMODE) == O_RDONLY) {
+            /* pages are decompressed into frames, not mapped, and the 
+               extents are not aligned */
+            flags &= ~O_MMAP;
+            break;
+        }
+        errno = EROFS;
+        /* fall through */
+    default: 
+        /* not a valid compressed page file, or opened for write */
+        return NULL;
+    }
+
+    if (((flags & O_SHMPOOL) != 0) && ((flags & O_MMAP) == 0) &&
+        ((flags & O_ACCMODE) == O_RDONLY) && 
+        (attachshm(buf, framecount) == 0)) {
+        /* the frames, bcb's and shards are in the shared segment */
+        buf->pinpool = NULL;
+        buf->pinmapsize = 0;
+        buf->pincount = buf->pinfreecount = 0;
+        dlink_init(&buf->pinfreelist);
+        return buf;
+    }
+
+    if (((flags & O_MMAP) == 0) || ((flags & O_ACCMODE) != O_RDONLY) ||
+        (mapfile(buf) != 0)) {
+        if ((buf->pool = allocframes(framecount * (size_t)pagesize, 
+                                     &buf->poolmapsize)) == NULL) {
+            /* out of memory */
+            return NULL;
+        }
+    }
+    buf->pinpool = NULL;
+    buf->pinmapsize = 0;
+    buf->pincount = (buf->pool == NULL) ? 0 : pincount;
+    if ((buf->pincount > 0) && 
+        ((buf->pinpool = allocframes(buf->pincount * (size_t)pagesize, 
+                                     &buf->pinmapsize)) == NULL)) {
         /* out of memory */
         return NULL;
     }
-    if ((buf->bcbtable = (bcb_t *)malloc(framecount * sizeof(bcb_t))) == NULL){
+    if ((buf->bcbtable = (bcb_t *)
+         malloc((framecount + buf->pincount) * sizeof(bcb_t))) == NULL){
         /* out of memory */
         return NULL;
     }
 
-    /* initialize free bcb list and set bcb-related pointer offsets*/
-    buf->freecount = framecount;
-    dlink_init(&buf->freebcblist);
-    
-    curbcbptr = (char *)buf->pool - (size_t)pagesize;
-    for (i = 0; i < framecount; i++) {
-        curbcbptr = (char *)curbcbptr + (size_t)pagesize;
-
-        buf->bcbtable[i].pagenum = -1;
-        buf->bcbtable[i].pageaddr = curbcbptr;
-        buf->bcbtable[i].lruln.next = buf->bcbtable[i].lruln.prev = NULL;
-        /* link free list */
-        dlink_insert(&buf->freebcblist, &buf->bcbtable[i].hashln); 
-        buf->bcbtable[i].refcount = 0;
-        buf->bcbtable[i].modified = 0; /* not fixed, not dirty */
-    }
-
-    baseptr = &buf->bcbtable[0];
-    memberptr = &(buf->bcbtable[0].lruln);
-    lruln_offset = (char *)memberptr - (char *)baseptr;
-    memberptr = &(buf->bcbtable[0].hashln);
-    hashln_offset = (char *)memberptr - (char *)baseptr;
-    
-    /* initialize current LRU list to contain nothing */
-    dlink_init(&buf->bcblru);
+    buf->policy = ((flags & O_2Q) != 0) ? &twoqpolicy : &lrupolicy;
 
-    /* initialize bcb hash table */
-    buf->bcbhtsize = framecount;
-    if ((buf->bcbhashtable = (dlink_t *)
-         malloc(buf->bcbhtsize * sizeof(dlink_t))) == NULL) {
+    /* decide how many shards the frames are partitioned into */
+    buf->shardcount = 1;
+    if ((flags & O_CONCURRENT) != 0) {
+        while ((buf->shardcount * 2 <= MAXSHARDS) &&
+               (framecount / (buf->shardcount * 2) >= MINSHARDFRAMES))
+            buf->shardcount *= 2;
+    }
+    if ((buf->shards = (bufshard_t *)
+         malloc(buf->shardcount * sizeof(bufshard_t))) == NULL) {
+        /* out of memory */
+        return NULL;
+    }
+    if (initshards(buf, NULL, NULL) != 0) {
         /* out of memory */
         return NULL;
     }
-    for (i = 0; i < buf->bcbhtsize; i++) dlink_init(&buf->bcbhashtable[i]);
 
-    buf->reqs = buf->hits = buf->hitlookups = buf->misslookups = 0;
-    
+    /* the pinned frames follow the pool frames in the bcb table */
+    buf->pinfreecount = buf->pincount;
+    dlink_init(&buf->pinfreelist);
+    for (i = 0; i < buf->pincount; i++) {
+        bcb_t *bcb = &buf->bcbtable[framecount + i];
+
+        bcb->pagenum = -1;
+        bcb->pageaddr = (char *)buf->pinpool + i * (size_t)pagesize;
+        bcb->lruln.next = bcb->lruln.prev = NULL;
+        dlink_insert(buf->pinfreelist.prev, &bcb->hashln);
+        bcb->refcount = 0;
+        bcb->modified = 0;
+        bcb->queue = 0;
+        bcb->pinned = 1;
+        bcb->loading = 0;
+        bcb->readyln.next = NULL;
+        bcb->link = NULL;
+        bcb->linkentry = -1;
+        pthread_rwlock_init(&bcb->latch, NULL);
+    }
+
     return buf;
 }
 
 
+/*
+ * initshards - initialize the free bcb list, the (empty) replacement 
+ *              lists and the bcb hash table of each shard
+ *
+ * - each shard owns a contiguous range of the buf->framecount frames
+ * - the hash tables are carved out of hashspace (framecount + shardcount
+ *   entries) if it is given, malloc'ed otherwise
+ * - the latches are created with latchattr (NULL for the defaults), the
+ *   page latches of the frames shared by processes if latchattr is; a 
+ *   writer waiting for a page latch goes before readers that come later
+ * - return 0 if OK, -1 if out of memory
+ *
+ */
+int initshards(buffer_t *buf, dlink_t *hashspace, 
+               const pthread_mutexattr_t *latchattr)
+{
+    uint32_t shardnum;
+    size_t i = 0;
+    void *curbcbptr = (char *)buf->pool - (size_t)buf->pagesize;
+    pthread_rwlockattr_t pageattr;
+    int pshared = PTHREAD_PROCESS_PRIVATE;
+
+    if (latchattr != NULL) 
+        pthread_mutexattr_getpshared(latchattr, &pshared);
+    pthread_rwlockattr_init(&pageattr);
+    pthread_rwlockattr_setpshared(&pageattr, pshared);
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+    /* the kinds are enumerated, test for the initializer that goes along */
+    pthread_rwlockattr_setkind_np(&pageattr, 
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+    for (shardnum = 0; shardnum < buf->shardcount; shardnum++) {
+        bufshard_t *shard = &buf->shards[shardnum];
+        size_t frame;
+
+        pthread_mutex_init(&shard->latch, latchattr);
+
+        shard->framecount = buf->framecount / buf->shardcount + 
+            ((shardnum < buf->framecount % buf->shardcount) ? 1 : 0);
+        shard->freecount = shard->framecount;
+        dlink_init(&shard->freebcblist);
+        dlink_init(&shard->bcblru);
+
+        for (frame = 0; frame < shard->framecount; frame++, i++) {
+            curbcbptr = (char *)curbcbptr + (size_t)buf->pagesize;
+
+            buf->bcbtable[i].pagenum = -1;
+            buf->bcbtable[i].pageaddr = (buf->pool == NULL) ? NULL : curbcbptr;
+            buf->bcbtable[i].lruln.next = buf->bcbtable[i].lruln.prev = NULL;
+            /* link free list */
+            dlink_insert(&shard->freebcblist, &buf->bcbtable[i].hashln); 
+            buf->bcbtable[i].refcount = 0;
+            buf->bcbtable[i].modified = 0; /* not fixed, not dirty */
+            buf->bcbtable[i].queue = 0;
+            buf->bcbtable[i].pinned = 0;
+            buf->bcbtable[i].loading = 0;
+            buf->bcbtable[i].readyln.next = NULL;
+            buf->bcbtable[i].link = NULL;
+            buf->bcbtable[i].linkentry = -1;
+            pthread_rwlock_init(&buf->bcbtable[i].latch, &pageattr);
+        }
+
+        shard->bcbhtsize = (shard->framecount > 0) ? shard->framecount : 1;
+        if (hashspace != NULL) {
+            shard->bcbhashtable = hashspace;
+            hashspace += shard->bcbhtsize;
+        } else if ((shard->bcbhashtable = (dlink_t *)
+                    malloc(shard->bcbhtsize * sizeof(dlink_t))) == NULL) {
+            /* out of memory */
+            pthread_rwlockattr_destroy(&pageattr);
+            return -1;
+        }
+        for (frame = 0; frame < shard->bcbhtsize; frame++) 
+            dlink_init(&shard->bcbhashtable[frame]);
+
+        memset(&shard->stat, 0, sizeof(bufstat_t));
+
+        shard->policydata = NULL;
+        if ((buf->policy->init != NULL) && 
+            (buf->policy->init(buf, shard) != 0)) {
+            /* out of memory */
+            pthread_rwlockattr_destroy(&pageattr);
+            return -1;
+        }
+    }
+
+    pthread_rwlockattr_destroy(&pageattr);
+    return 0;
+}
+
+
+/*
+ * attachshm - map the pool shared by the processes reading buf->filename
+ *
+ * - the segment is named after the device and inode of the file; a 
+ *   segment left by an older version of the file (its modification time
+ *   or size differ), or retired, is unlinked and replaced by a fresh one
+ * - the first process creates the segment with framecount frames; the 
+ *   others map it as it is, whatever their own framecount
+ * - the segment is never unlinked otherwise: it keeps the pages warm for
+ *   the processes to come (remove /dev/shm/etree-* to release it)
+ * - return 0 if OK, -1 if the caller should use a private pool
+ *
+ */
+int attachshm(buffer_t *buf, size_t framecount)
+{
+    struct stat filestat;
+    char shmname[128];
+    int res;
+
+    if (fstat(buf->plainfd, &filestat) != 0) 
+        return -1;
+    sprintf(shmname, "/etree-%lx-%lx-%x", 
+            (unsigned long)filestat.st_dev, (unsigned long)filestat.st_ino,
+            (unsigned)buf->pagesize);
+
+    if ((res = openshm(buf, shmname, &filestat, framecount)) == 1) {
+        /* the processes still attached to it keep their mapping */
+        shm_unlink(shmname);
+        res = openshm(buf, shmname, &filestat, framecount);
+    }
+
+    return (res == 0) ? 0 : -1;
+}
+
+
+/*
+ * openshm - create the segment shmname, or map it if it exists
+ *
+ * - return 0 if OK, 1 if the segment is stale, -1 if the caller should 
+ *   use a private pool
+ *
+ */
+int openshm(buffer_t *buf, const char *shmname, const struct stat *filestat,
+            size_t framecount)
+{
+    struct stat shmstat;
+    int shmfd, waited;
+    shmhdr_t *hdr, hdrcopy;
+    void *base;
+
+    if ((shmfd = shm_open(shmname, O_RDWR | O_CREAT | O_EXCL, 
+                          S_IRUSR | S_IWUSR)) != -1) {
+        if (createshm(buf, shmfd, filestat, framecount) != 0) {
+            close(shmfd);
+            shm_unlink(shmname);
+            return -1;
+        }
+        close(shmfd);
+        return 0;
+    }
+    if ((errno != EEXIST) || 
+        ((shmfd = shm_open(shmname, O_RDWR, 0)) == -1))
+        return -1;
+
+    /* wait for the creator to size and initialize the segment */
+    hdr = MAP_FAILED;
+    for (waited = 0; waited < SHMWAIT * 100; waited++) {
+        if ((hdr == MAP_FAILED) && 
+            (fstat(shmfd, &shmstat) == 0) && 
+            (shmstat.st_size >= (off_t)sizeof(shmhdr_t))) 
+            hdr = (shmhdr_t *)mmap(NULL, sizeof(shmhdr_t), PROT_READ, 
+                                   MAP_SHARED, shmfd, 0);
+        if ((hdr != MAP_FAILED) && (hdr->ready)) 
+            break;
+        usleep(10000);
+    }
+    if (hdr == MAP_FAILED) {
+        close(shmfd);
+        return -1;
+    }
+    __sync_synchronize();
+    hdrcopy = *hdr;
+    munmap(hdr, sizeof(shmhdr_t));
+
+    if ((!hdrcopy.ready) || (hdrcopy.magic != SHMMAGIC) || 
+        (hdrcopy.pagesize != buf->pagesize) || 
+        (hdrcopy.bcbsize != sizeof(bcb_t))) {
+        close(shmfd);
+        return -1;
+    }
+    if ((hdrcopy.retired) ||
+        (hdrcopy.mtime.tv_sec != filestat->st_mtim.tv_sec) ||
+        (hdrcopy.mtime.tv_nsec != filestat->st_mtim.tv_nsec) ||
+        (hdrcopy.filesize != filestat->st_size)) {
+        /* the pages are those of an older version of the file */
+        close(shmfd);
+        return 1;
+    }
+
+    /* the lists inside the segment only hold at the creator's address */
+#ifdef MAP_FIXED_NOREPLACE
+    base = mmap(hdrcopy.base, hdrcopy.size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED_NOREPLACE, shmfd, 0);
+#else
+    base = mmap(hdrcopy.base, hdrcopy.size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, shmfd, 0);
+#endif
+    close(shmfd);
+    if (base != hdrcopy.base) {
+        if (base != MAP_FAILED) 
+            munmap(base, hdrcopy.size);
+        return -1;
+    }
+
+    hdr = (shmhdr_t *)base;
+    buf->shm = base;
+    buf->shmsize = hdr->size;
+    buf->framecount = hdr->framecount;
+    buf->shardcount = hdr->shardcount;
+    buf->shards = (bufshard_t *)((char *)base + hdr->shardoffset);
+    buf->bcbtable = (bcb_t *)((char *)base + hdr->bcboffset);
+    buf->pool = (char *)base + hdr->pooloffset;
+    buf->policy = &lrupolicy;
+    __sync_add_and_fetch(&hdr->attached, 1);
+
+    return 0;
+}
+
+
+/*
+ * createshm - size, map and initialize a new shared pool segment
+ *
+ * - the pool is sharded as with O_CONCURRENT, the latches are robust and
+ *   shared by processes, and pages are replaced by LRU (the 2Q lists are
+ *   private to a process)
+ * - the segment is sparse: frames cost memory once pages are read in
+ * - return 0 if OK, -1 on error
+ *
+ */
+int createshm(buffer_t *buf, int shmfd, const struct stat *filestat,
+              size_t framecount)
+{
+    size_t shardoffset, bcboffset, htoffset, pooloffset, size;
+    pthread_mutexattr_t latchattr;
+    shmhdr_t *hdr;
+    void *base;
+
+    buf->framecount = framecount;
+    buf->shardcount = 1;
+    while ((buf->shardcount * 2 <= MAXSHARDS) &&
+           (framecount / (buf->shardcount * 2) >= MINSHARDFRAMES))
+        buf->shardcount *= 2;
+
+    shardoffset = ALIGNUP(sizeof(shmhdr_t), 64);
+    bcboffset = ALIGNUP(shardoffset + buf->shardcount * sizeof(bufshard_t),
+                        64);
+    htoffset = ALIGNUP(bcboffset + framecount * sizeof(bcb_t), 64);
+    pooloffset = ALIGNUP(htoffset + 
+                         (framecount + buf->shardcount) * sizeof(dlink_t),
+                         HUGEPAGESIZE);
+    size = pooloffset + ALIGNUP(framecount * (size_t)buf->pagesize, 
+                                HUGEPAGESIZE);
+
+    if (ftruncate(shmfd, (off_t)size) != 0) 
+        return -1;
+    if ((base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+                     shmfd, 0)) == MAP_FAILED) 
+        return -1;
+#ifdef MADV_HUGEPAGE
+    madvise((char *)base + pooloffset, size - pooloffset, MADV_HUGEPAGE);
+#endif
+
+    buf->shards = (bufshard_t *)((char *)base + shardoffset);
+    buf->bcbtable = (bcb_t *)((char *)base + bcboffset);
+    buf->pool = (char *)base + pooloffset;
+    buf->policy = &lrupolicy;
+
+    pthread_mutexattr_init(&latchattr);
+    pthread_mutexattr_setpshared(&latchattr, PTHREAD_PROCESS_SHARED);
+#ifdef EOWNERDEAD
+    /* PTHREAD_MUTEX_ROBUST is enumerated, test for the error that goes 
+       along */
+    pthread_mutexattr_setrobust(&latchattr, PTHREAD_MUTEX_ROBUST);
+#endif
+    if (initshards(buf, (dlink_t *)((char *)base + htoffset), 
+                   &latchattr) != 0) {
+        pthread_mutexattr_destroy(&latchattr);
+        munmap(base, size);
+        return -1;
+    }
+    pthread_mutexattr_destroy(&latchattr);
+
+    hdr = (shmhdr_t *)base;
+    hdr->magic = SHMMAGIC;
+    hdr->mtime = filestat->st_mtim;
+    hdr->filesize = filestat->st_size;
+    hdr->retired = 0;
+    hdr->base = base;
+    hdr->size = size;
+    hdr->pagesize = buf->pagesize;
+    hdr->bcbsize = sizeof(bcb_t);
+    hdr->shardcount = buf->shardcount;
+    hdr->framecount = framecount;
+    hdr->shardoffset = shardoffset;
+    hdr->bcboffset = bcboffset;
+    hdr->htoffset = htoffset;
+    hdr->pooloffset = pooloffset;
+    hdr->attached = 1;
+
+    /* publish the segment only once it is complete */
+    __sync_synchronize();
+    hdr->ready = 1;
+
+    buf->shm = base;
+    buf->shmsize = size;
+    return 0;
+}
+
+
+/*
+ * lockshard - take the latch of a shard
+ *
+ * - the latch of a shared pool survives the death of a process holding
+ *   it; the next process to take it rebuilds the lists of the shard, 
+ *   which the dead process may have left half updated, and retires the 
+ *   segment so that the processes to come start from a fresh one
+ *
+ */
+void lockshard(buffer_t *buf, bufshard_t *shard)
+{
+#ifdef EOWNERDEAD
+    if (pthread_mutex_lock(&shard->latch) == EOWNERDEAD) {
+        resetshard(buf, shard);
+        ((shmhdr_t *)buf->shm)->retired = 1;
+        pthread_mutex_consistent(&shard->latch);
+    }
+#else
+    pthread_mutex_lock(&shard->latch);
+#endif
+    return;
+}
+
+
+/*
+ * resetshard - rebuild the free list, LRU list and hash table of a shard
+ *              of a shared pool from its bcb's
+ *
+ * - the frames nobody has fixed are freed; a fixed frame may be one the 
+ *   dead process was loading, or hold a fix of its own that nobody will
+ *   release, so it is left off every list: its holders still unref it,
+ *   and the page is read again into another frame if it is fixed anew
+ * - pages fixed by the dead process in other shards stay fixed; they only
+ *   cost frames until the segment is replaced
+ *
+ */
+void resetshard(buffer_t *buf, bufshard_t *shard)
+{
+    size_t first = 0, i, bucket;
+    uint32_t shardnum;
+
+    for (shardnum = 0; &buf->shards[shardnum] != shard; shardnum++) 
+        first += buf->shards[shardnum].framecount;
+
+    dlink_init(&shard->freebcblist);
+    dlink_init(&shard->bcblru);
+    for (bucket = 0; bucket < shard->bcbhtsize; bucket++) 
+        dlink_init(&shard->bcbhashtable[bucket]);
+    shard->freecount = 0;
+
+    for (i = first; i < first + shard->framecount; i++) {
+        bcb_t *bcb = &buf->bcbtable[i];
+
+        bcb->lruln.next = bcb->lruln.prev = NULL;
+        bcb->queue = 0;
+        if (REFGET(bcb) != 0) {
+            bcb->hashln.next = bcb->hashln.prev = NULL;
+            continue;
+        }
+        bcb->pagenum = -1;
+        bcb->modified = 0;
+        dlink_insert(&shard->freebcblist, &bcb->hashln);
+        shard->freecount++;
+    }
+
+    return;
+}
+
+
 /*
  * buffer_destroy - destroy the buffer
  *
@@ -131,24 +800,60 @@ int buffer_destroy(buffer_t *buf)
 {
     int res = 0;
 
-    if ((buf->flags & O_RDONLY) != 0) {
-        if (close(buf->fd) != 0) {
+    if (buf->aio != NULL) {
+        /* no read may land in a released frame */
+        while (aio_inflight(buf->aio) > 0) 
+            if (reapprefetch(buf) != 0) 
+                break;
+        aio_destroy(buf->aio);
+    }
+
+    if (buf->shm != NULL) {
+        /* a shared pool is only read; leave it to the other processes */
+        __sync_sub_and_fetch(&((shmhdr_t *)buf->shm)->attached, 1);
+        if (munmap(buf->shm, buf->shmsize) != 0) {
+            perror("buffer_destroy: munmap");
+        }
+        if (closefile(buf) != 0) {
+            perror("buffer_destroy: close");
+        }
+        free(buf->zextents);
+        free(buf->filename);
+        free(buf);
+        return 0;
+    }
+
+    if (buf->mapbase != NULL) {
+        /* mapped pages are never modified */
+        if (munmap(buf->mapbase, (size_t)buf->mapsize) != 0) {
+            perror("buffer_destroy: munmap");
+        }
+        if (closefile(buf) != 0) {
+            perror("buffer_destroy: close");
+        }
+    }
+    else if ((buf->flags & O_RDONLY) != 0) {
+        if (closefile(buf) != 0) {
             perror("buffer_destroy: close");
         }
     }
     else if ((buf->flags & O_INCORE) != 0) {
-        if (close(buf->fd) != 0) {
+        if (closefile(buf) != 0) {
             perror("buffer_destroy: close");
         }
         unlink(buf->filename);
     } else { 
-        dlink_t *curlink;
+        bcb_t **dirtybcbs;
+        size_t dirtycount = 0, i;
 
-        curlink = buf->bcblru.next;
+        /* dirty pages are collected and written in runs of adjacent
+           page numbers, falling back to one write per page if we have no
+           memory to sort them; free frames are never fixed or dirty */
+        dirtybcbs = (bcb_t **)
+            malloc((buf->framecount + buf->pincount) * sizeof(bcb_t *));
 
-        while (curlink != &buf->bcblru) {
-            bcb_t *curbcb;
-            curbcb = (bcb_t *)((char *)curlink - lruln_offset);
+        for (i = 0; i < buf->framecount + buf->pincount; i++) {
+            bcb_t *curbcb = &buf->bcbtable[i];
 
             if (curbcb->refcount != 0) {
                 fprintf(stderr, "buffer_destory warning (%s) : ", 
@@ -162,16 +867,30 @@ int buffer_destroy(buffer_t *buf)
             }
 
 
-            if (curbcb->modified != 0) 
-                if (io_write(buf->fd, curbcb->pagenum,
-                             curbcb->pageaddr, (size_t)buf->pagesize) != 0) {
+            if (curbcb->modified != 0) {
+                if (dirtybcbs != NULL) 
+                    dirtybcbs[dirtycount++] = curbcb;
+                else if (io_write(buf->fd, curbcb->pagenum, curbcb->pageaddr,
+                                  (size_t)buf->pagesize, 
+                                  &pageshard(buf, curbcb->pagenum)->stat)
+                         != 0) {
                     fprintf(stderr, "buffer_destroy (%s) : io_write failed\n",
                             buf->filename);
                     res = -1;
                 }
-            curlink = curlink->next;
+            }
+        }
+
+        if (dirtybcbs != NULL) {
+            if (flushbcbs(buf, dirtybcbs, dirtycount) != 0) {
+                fprintf(stderr, "buffer_destroy (%s) : io_writev failed\n",
+                        buf->filename);
+                res = -1;
+            }
+            free(dirtybcbs);
         }
-        if (close(buf->fd) != 0) {
+
+        if (closefile(buf) != 0) {
             fprintf(stderr, "buffer_destory (%s): close file fail\n",
                     buf->filename);
             perror("close");
@@ -179,11 +898,27 @@ int buffer_destroy(buffer_t *buf)
         }
     }
 
-    /* release the hash table , bcbtable and the bufferpool*/
+    /* release the hash tables, shards, bcbtable and the bufferpool*/
+    {
+        uint32_t shardnum;
+        size_t i;
+
+        for (i = 0; i < buf->framecount + buf->pincount; i++) 
+            pthread_rwlock_destroy(&buf->bcbtable[i].latch);
+
+        for (shardnum = 0; shardnum < buf->shardcount; shardnum++) {
+            if (buf->policy->destroy != NULL) 
+                buf->policy->destroy(buf, &buf->shards[shardnum]);
+            pthread_mutex_destroy(&buf->shards[shardnum].latch);
+            free(buf->shards[shardnum].bcbhashtable);
+        }
+    }
     free(buf->filename);
-    free(buf->pool);
+    freeframes(buf->pool, buf->poolmapsize);
+    freeframes(buf->pinpool, buf->pinmapsize);
     free(buf->bcbtable);
-    free(buf->bcbhashtable);
+    free(buf->shards);
+    free(buf->zextents);
     free(buf);
 
     return res;
@@ -194,49 +929,59 @@ int buffer_destroy(buffer_t *buf)
  * buffer_emptyfix - allocate an empty slot for pagenum
  *
  * - LFS in RH Linux kernel 2.4 limits the size of the file to 18TB
+ * - a read-only mapping cannot grow, so this fails in mmap mode; nor 
+ *   may a pool shared with other processes take new pages
+ * - a page the client freed and allocates again may still be cached; 
+ *   its frame is fixed and handed out, the content to be overwritten
+ * - with O_CONCURRENT, under the latch of the page's shard
  * - return the pointer to the page if OK, NULL on error
  *
  */
 void *buffer_emptyfix(buffer_t *buf, pagenum_t pagenum)
+{
+    bufshard_t *shard;
+    void *pageaddr;
+
+    if ((buf->mapbase != NULL) || (buf->shm != NULL)) 
+        return NULL;
+
+    shard = pageshard(buf, pagenum);
+    if ((buf->flags & O_CONCURRENT) == 0) 
+        return emptypage(buf, shard, pagenum);
+
+    lockshard(buf, shard);
+    pageaddr = emptypage(buf, shard, pagenum);
+    pthread_mutex_unlock(&shard->latch);
+
+    return pageaddr;
+}
+
+
+/*
+ * emptypage - fix a frame for pagenum without reading the page
+ *
+ * - return the pointer to the page if OK, NULL on error
+ *
+ */
+void *emptypage(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum)
 {
     bcb_t *hitbcb;
-    uint32_t hashnum;
 
-    if (buf->freecount > 0) { 
-        dlink_t *nextfree;
+    if (lookupbcb(buf, pagenum) != NULL) 
+        return fixpage(buf, shard, pagenum);
 
-        nextfree = buf->freebcblist.next;
-        dlink_delete(nextfree);
-        buf->freecount--;
-        hitbcb = (bcb_t *)((char *)nextfree - hashln_offset);
-    } else {
-        /* find a frame by victiming an unfixed page */
-        if ((hitbcb = findvictimbcb(buf)) == NULL) {
-            /* no available frame */
-            return NULL;
-        }
-        if (hitbcb->modified == 1) {
-            if (io_write(buf->fd, hitbcb->pagenum, 
-                         hitbcb->pageaddr, (size_t)buf->pagesize) != 0) {
-                /* io_write failed */
-                return NULL;
-            };      
-        }
-        /* remove the this to-use bcb from its hash list and the LRU list*/
-        dlink_delete(&hitbcb->hashln);
-        dlink_delete(&hitbcb->lruln);
-    }
+    if ((hitbcb = grabbcb(buf, shard)) == NULL) 
+        /* no available frame or io_write failed */
+        return NULL;
 
     hitbcb->pagenum = pagenum;
     hitbcb->modified = 0;
     hitbcb->refcount = 1;
 
     /* add the new page to the right hashtable entry */
-    hashnum = hash(buf->bcbhtsize, pagenum);
-    dlink_insert(&buf->bcbhashtable[hashnum], &hitbcb->hashln);
+    dlink_insert(hashchain(buf, shard, pagenum), &hitbcb->hashln);
 
-    /* put to the end of the LRU list*/
-    dlink_insert(buf->bcblru.prev, &hitbcb->lruln); 
+    buf->policy->admit(buf, shard, hitbcb);
     
     return hitbcb->pageaddr;
 }
@@ -246,268 +991,1608 @@ void *buffer_emptyfix(buffer_t *buf, pagenum_t pagenum)
  * buffer_fix - fix the page with pagenum in the buffer pool
  *
  * - try to locate the page in buffer pool
- * - if no hit, read in the page
+ * - if no hit, read in the page (or point the bcb into the file mapping)
  * - possibly evict others
  * - LFS in RH Linux kernel 2.4 limits the size of the file to 18TB
+ * - with O_CONCURRENT (or a pool shared by processes), the page is fixed
+ *   under the shard latch as by buffer_concurrentfix
  * - return pointer to the cached page if OK, NULL on error
  *
  */
 void * buffer_fix(buffer_t *buf, pagenum_t pagenum)
 {
-    bcb_t *hitbcb;
-    int hit = 0;  /* indicate whether there is a hit or not */
+    if ((buf->shm != NULL) || ((buf->flags & O_CONCURRENT) != 0))
+        /* other processes or threads share the pool */
+        return buffer_concurrentfix(buf, pagenum);
 
-    buf->reqs++;
+    return fixpage(buf, pageshard(buf, pagenum), pagenum);
+}
 
-    if ((hitbcb = findbcb(buf, pagenum)) != NULL) { 
-        /* hit in cache */
-        hit = 1;
-        buf->hits++;
 
-        hitbcb->refcount++;
-        dlink_delete(&hitbcb->lruln);
-    }  
-    else if (buf->freecount > 0) { 
-        /* miss but there are free frames*/
-        dlink_t *nextfree;
+/*
+ * buffer_concurrentfix - fix the page with pagenum on behalf of one of 
+ *                        several threads sharing the buffer
+ *
+ * - same as buffer_fix, but under the latch of the page's shard; a miss
+ *   holds the latch across the read, which only stalls the threads that
+ *   want a page of the same shard
+ * - return pointer to the cached page if OK, NULL on error
+ *
+ */
+void *buffer_concurrentfix(buffer_t *buf, pagenum_t pagenum)
+{
+    bufshard_t *shard = pageshard(buf, pagenum);
+    void *pageaddr;
 
-        nextfree = buf->freebcblist.next;
-        dlink_delete(nextfree);
-        buf->freecount--;
-        hitbcb = (bcb_t *)((char *)nextfree - hashln_offset);
-    } 
-    else { 
-        /* find a frame by victiming an unfixed page */
-        if ((hitbcb = findvictimbcb(buf)) == NULL) {
+    lockshard(buf, shard);
+    pageaddr = fixpage(buf, shard, pagenum);
+    pthread_mutex_unlock(&shard->latch);
+
+    return pageaddr;
+}
+
+
+/*
+ * buffer_readrun - stage the pages [pagenum, pagenum + count) in the pool
+ *
+ * - pages already cached are left alone; every sub-run of missing pages
+ *   is read with a single vectored read
+ * - staged pages are not fixed, they are admitted by the replacement 
+ *   policy as if they had just been fixed and released
+ * - the run is clipped to a quarter of the pool so that it cannot evict
+ *   the pages it is staging, and at the end of the file
+ * - nothing to do in mmap mode, if other processes or threads 
+ *   (O_CONCURRENT) share the pool or if the pages are compressed
+ * - single-threaded; not to be called while threads share the buffer
+ * - return the number of pages read, -1 on error
+ *
+ */
+int buffer_readrun(buffer_t *buf, pagenum_t pagenum, int count)
+{
+    bcb_t *runbcbs[IOV_MAX];
+    struct iovec iov[IOV_MAX];
+    pagenum_t curpagenum, runstart;
+    int maxcount, runcount, readcount, i;
+
+    if ((buf->mapbase != NULL) || (buf->shm != NULL) || 
+        (buf->zextents != NULL) || ((buf->flags & O_CONCURRENT) != 0)) 
+        return 0;
+
+    maxcount = (int)(buf->framecount / 4);
+    maxcount = (maxcount > IOV_MAX) ? IOV_MAX : maxcount;
+    count = (count > maxcount) ? maxcount : count;
+
+    readcount = 0;
+    curpagenum = pagenum;
+    while (curpagenum < pagenum + count) {
+
+        /* skip the cached pages */
+        if (lookupbcb(buf, curpagenum) != NULL) {
+            curpagenum++;
+            continue;
+        }
+
+        /* collect frames for the sub-run of missing pages */
+        runstart = curpagenum;
+        runcount = 0;
+        while ((curpagenum < pagenum + count) &&
+               (lookupbcb(buf, curpagenum) == NULL)) {
+            runbcbs[runcount] = grabbcb(buf, pageshard(buf, curpagenum));
+            if (runbcbs[runcount] == NULL) 
+                break;
+
+            iov[runcount].iov_base = runbcbs[runcount]->pageaddr;
+            iov[runcount].iov_len = (size_t)buf->pagesize;
+            runcount++;
+            curpagenum++;
+        }
+        if (runcount == 0) 
             /* no available frame */
-            return NULL;
+            return readcount;
+
+        if ((i = io_readv(iov, runcount, buf->fd, runstart, 
+                          (size_t)buf->pagesize, 
+                          &pageshard(buf, runstart)->stat)) < 0) 
+            i = 0;
+
+        /* install the pages read, return the rest to the free list */
+        for (runcount--; runcount >= i; runcount--) {
+            bufshard_t *shard = pageshard(buf, runstart + runcount);
+
+            dlink_insert(&shard->freebcblist, &runbcbs[runcount]->hashln);
+            shard->freecount++;
         }
-        if (hitbcb->modified == 1) {
-            if (io_write(buf->fd, hitbcb->pagenum, 
-                         hitbcb->pageaddr, (size_t)buf->pagesize) != 0) {
-                /* io_write failed */
-                return NULL;
-            };      
+        for (runcount = 0; runcount < i; runcount++) {
+            bcb_t *bcb = runbcbs[runcount];
+            bufshard_t *shard = pageshard(buf, runstart + runcount);
+
+            bcb->pagenum = runstart + runcount;
+            bcb->modified = 0;
+            bcb->refcount = 0;
+
+            dlink_insert(hashchain(buf, shard, bcb->pagenum), &bcb->hashln);
+            buf->policy->admit(buf, shard, bcb);
         }
-        /* remove the this to-use bcb from its hash list and LRU list*/
-        dlink_delete(&hitbcb->hashln);
-        dlink_delete(&hitbcb->lruln);
+        readcount += i;
+
+        if (runstart + i < curpagenum) 
+            /* short read, end of file */
+            break;
     }
-        
-    if (!hit) {  /* initialize the bcb structure */
-        uint32_t hashnum;
 
-        hitbcb->pagenum = pagenum;
-        hitbcb->modified = 0;
-        hitbcb->refcount = 1;
-        if (io_read(hitbcb->pageaddr, buf->fd, hitbcb->pagenum, 
-                    (size_t)buf->pagesize)!= 0) {
-            /* io_read failed */
+    return readcount;
+}
+
+
+/*
+ * buffer_readahead - tell the kernel we are about to read the pages 
+ *                    [pagenum, pagenum + count)
+ *
+ * - the reads are issued asynchronously by the kernel; nothing is 
+ *   staged in the pool, so the hint costs no frames
+ * - uses madvise on the mapping in mmap mode, posix_fadvise otherwise
+ * - return 0 if OK, -1 on error (the hint is advisory, callers may
+ *   ignore it)
+ *
+ */
+int buffer_readahead(buffer_t *buf, pagenum_t pagenum, int count)
+{
+    off_t offset, length;
+
+    if (count <= 0) 
+        return 0;
+
+    offset = (off_t)pagenum * buf->pagesize;
+    length = (off_t)count * buf->pagesize;
+
+    if ((buf->zextents != NULL) && (pagenum + count > buf->zrawpages)) {
+        /* the compressed extents of the pages are adjacent in the file */
+        pagenum_t first = (pagenum > buf->zrawpages) ? pagenum : 
+            buf->zrawpages;
+        pagenum_t last = (pagenum + count < buf->zpagecount) ? 
+            pagenum + count : buf->zpagecount;
+
+        if (first >= last) 
+            return 0;
+        if (pagenum >= buf->zrawpages) 
+            offset = (off_t)buf->zextents[first - buf->zrawpages];
+        length = (off_t)buf->zextents[last - buf->zrawpages] - offset;
+    }
+
+    if ((buf->direct) && (buf->mapbase == NULL)) 
+        /* the page cache is bypassed: stage the pages in the pool */
+        return (buffer_readrun(buf, pagenum, count) < 0) ? -1 : 0;
+
+    if (buf->mapbase != NULL) {
+        off_t syspagesize = (off_t)sysconf(_SC_PAGESIZE);
+        off_t alignedoffset;
+
+        if (offset >= buf->mapsize) 
+            return 0;
+        if (offset + length > buf->mapsize) 
+            length = buf->mapsize - offset;
+
+        /* madvise wants a system page aligned address */
+        alignedoffset = offset - offset % syspagesize;
+        length += offset - alignedoffset;
+
+        return (madvise((char *)buf->mapbase + alignedoffset, 
+                        (size_t)length, MADV_WILLNEED) == 0) ? 0 : -1;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    return (posix_fadvise(buf->fd, offset, length, POSIX_FADV_WILLNEED) == 0)
+        ? 0 : -1;
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * buffer_prefetch - start reading the pages pagenums[0..count-1] 
+ *
+ * - the reads of the pages not cached are submitted at once (through 
+ *   io_uring, or handed to reader threads) and complete in any order
+ * - a page being read is in the hash table but on no replacement list;
+ *   buffer_fix of such a page waits for its read, buffer_fixnext fixes
+ *   the prefetched pages in the order their reads complete
+ * - at most PREFETCHDEPTH reads (and half the pool) are in flight; 
+ *   prefetching more waits for earlier reads to complete
+ * - in mmap mode, if other processes share the pool or if the pages are
+ *   compressed, the kernel is asked to read the pages ahead instead
+ * - single-threaded; not to be called while threads share the buffer
+ * - return the number of reads started, -1 on error
+ *
+ */
+int buffer_prefetch(buffer_t *buf, const pagenum_t pagenums[], int count)
+{
+    int i, started = 0;
+
+    if ((buf->mapbase != NULL) || (buf->shm != NULL) || 
+        (buf->zextents != NULL)) {
+        for (i = 0; i < count; i++) 
+            buffer_readahead(buf, pagenums[i], 1);
+        return 0;
+    }
+
+    if (buf->aio == NULL) {
+        unsigned depth = (unsigned)(buf->framecount / 2);
+
+        depth = (depth > PREFETCHDEPTH) ? PREFETCHDEPTH : depth;
+        if ((buf->aio = aio_init(buf->fd, depth)) == NULL) 
+            return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        bufshard_t *shard = pageshard(buf, pagenums[i]);
+        bcb_t *bcb;
+
+        if (lookupbcb(buf, pagenums[i]) != NULL) 
+            continue;
+
+        while (aio_inflight(buf->aio) >= aio_depth(buf->aio)) 
+            if (reapprefetch(buf) != 0) 
+                return -1;
+
+        if ((bcb = grabbcb(buf, shard)) == NULL) 
+            /* no available frame */
+            break;
+
+        bcb->pagenum = pagenums[i];
+        bcb->modified = 0;
+        bcb->refcount = 0;
+        bcb->loading = 1;
+        dlink_insert(hashchain(buf, shard, bcb->pagenum), &bcb->hashln);
+
+        if (aio_submit(buf->aio, bcb->pageaddr, (size_t)buf->pagesize,
+                       (off_t)bcb->pagenum * buf->pagesize, bcb) != 0) {
+            bcb->loading = 0;
+            dlink_delete(&bcb->hashln);
+            dlink_insert(&shard->freebcblist, &bcb->hashln);
+            shard->freecount++;
+            break;
+        }
+        started++;
+    }
+
+    if (aio_flush(buf->aio) != 0) 
+        return -1;
+
+    return started;
+}
+
+
+/*
+ * buffer_fixnext - fix the next prefetched page whose read has completed
+ *
+ * - wait for a read if none has completed yet; a prefetched page is 
+ *   delivered once, by buffer_fixnext or buffer_fix, whichever comes 
+ *   first; pages that failed to read, or were evicted before they were
+ *   asked for, are skipped
+ * - store the page number in *pagenumptr
+ * - return the pointer to the page, NULL when there is no prefetched 
+ *   page left to deliver or on error
+ *
+ */
+void *buffer_fixnext(buffer_t *buf, pagenum_t *pagenumptr)
+{
+    bcb_t *bcb;
+
+    while (buf->readylist.next == &buf->readylist) {
+        if ((buf->aio == NULL) || (aio_inflight(buf->aio) == 0)) 
+            return NULL;
+        if (reapprefetch(buf) != 0) 
+            return NULL;
+    }
+
+    bcb = (bcb_t *)((char *)buf->readylist.next - offsetof(bcb_t, readyln));
+    *pagenumptr = bcb->pagenum;
+
+    /* the hit takes the page off the ready list */
+    return fixpage(buf, pageshard(buf, bcb->pagenum), bcb->pagenum);
+}
+
+
+/*
+ * buffer_pin - move a fixed page into the pinned region
+ *
+ * - the page content (and the client's back link) is copied into a 
+ *   pinned frame, which takes over the page in the hash table; the old 
+ *   frame goes back to the free list, so the caller must continue with 
+ *   the address returned 
+ * - nothing is done if the page is already pinned, the pinned region is 
+ *   full (or absent), or the page is fixed more than once (other fixes
+ *   hold the old address), nor with O_CONCURRENT, since other threads 
+ *   may fix the page at any time
+ * - single-threaded; not to be called while threads share the buffer
+ * - return the address of the page, pinned or not
+ *
+ */
+void *buffer_pin(buffer_t *buf, void *pageaddr)
+{
+    bcb_t *bcb, *pinbcb;
+    bufshard_t *shard;
+
+    if ((buf->pinfreecount == 0) || ((buf->flags & O_CONCURRENT) != 0))
+        return pageaddr;
+
+    bcb = &buf->bcbtable[safebcbnum(buf, pageaddr, "buffer_pin")];
+    if ((bcb->pinned) || (bcb->refcount != 1)) 
+        return pageaddr;
+
+    pinbcb = (bcb_t *)((char *)buf->pinfreelist.next - hashln_offset);
+    dlink_delete(&pinbcb->hashln);
+    buf->pinfreecount--;
+
+    memcpy(pinbcb->pageaddr, bcb->pageaddr, (size_t)buf->pagesize);
+    pinbcb->pagenum = bcb->pagenum;
+    pinbcb->modified = bcb->modified;
+    pinbcb->refcount = 1;
+    pinbcb->link = bcb->link;
+    pinbcb->linkentry = bcb->linkentry;
+
+    /* swap the frames in the hash table, release the old one */
+    shard = pageshard(buf, bcb->pagenum);
+    dlink_delete(&bcb->hashln);
+    buf->policy->forget(buf, shard, bcb);
+    dlink_insert(hashchain(buf, shard, pinbcb->pagenum), &pinbcb->hashln);
+
+    bcb->refcount = 0;
+    bcb->modified = 0;
+    dlink_insert(&shard->freebcblist, &bcb->hashln);
+    shard->freecount++;
+
+    return pinbcb->pageaddr;
+}
+
+
+/*
+ * buffer_ref - increment buffer pool page refcount by 1 and return 
+ *              the new refcount
+ *
+ * safety checking and referece count checking
+ *
+ */
+int buffer_ref(buffer_t *buf, void *pageaddr)
+{
+    return (int)REFINC(fixedbcb(buf, pageaddr, "buffer_ref"));
+}
+
+
+/*
+ * buffer_unref - decrement refcount by 1 and  return the new ref count  
+ *
+ * safety checking and referece count checking
+ *  
+ */
+int buffer_unref(buffer_t *buf, void *pageaddr)
+{
+    return (int)REFDEC(fixedbcb(buf, pageaddr, "buffer_unref"));
+}
+
+
+/*
+ * buffer_concurrentref - buffer_ref for threads sharing the buffer
+ *
+ * - the page is fixed by the caller, so the shard latch is not needed 
+ *   except to look up the bcb of a mapped page
+ *
+ */
+int buffer_concurrentref(buffer_t *buf, void *pageaddr)
+{
+    return (int)REFINC(concurrentbcb(buf, pageaddr, "buffer_concurrentref"));
+}
+
+
+/*
+ * buffer_concurrentunref - buffer_unref for threads sharing the buffer
+ *
+ * - an unfixed page simply becomes eligible as a victim; its position in
+ *   the LRU list was set when it was fixed, so no latch is needed except
+ *   to look up the bcb of a mapped page
+ *
+ */
+int buffer_concurrentunref(buffer_t *buf, void *pageaddr)
+{
+    return (int)REFDEC(concurrentbcb(buf, pageaddr, 
+                                     "buffer_concurrentunref"));
+}
+
+
+/*
+ * buffer_latch - latch a page fixed by the calling thread, shared or 
+ *                exclusive
+ *
+ * - any number of threads may hold the shared latch of a page and read 
+ *   it; the exclusive latch waits for them to release it and keeps them
+ *   out while its holder changes the page
+ * - the latch belongs to the frame: the page must stay fixed until it is
+ *   unlatched
+ *
+ */
+void buffer_latch(buffer_t *buf, void *pageaddr, int exclusive)
+{
+    bcb_t *bcb = concurrentbcb(buf, pageaddr, "buffer_latch");
+
+    if (exclusive) 
+        pthread_rwlock_wrlock(&bcb->latch);
+    else
+        pthread_rwlock_rdlock(&bcb->latch);
+    return;
+}
+
+
+/*
+ * buffer_unlatch - release the latch the calling thread holds on a page
+ *
+ */
+void buffer_unlatch(buffer_t *buf, void *pageaddr)
+{
+    pthread_rwlock_unlock(&concurrentbcb(buf, pageaddr, 
+                                         "buffer_unlatch")->latch);
+    return;
+}
+
+
+
+/*
+ * buffer_pagenum - return the page number correpsonding to pageaddr
+ *
+ * safety checking and referece count checking
+ * 
+ */
+pagenum_t buffer_pagenum(buffer_t *buf, void *pageaddr)
+{
+    return fixedbcb(buf, pageaddr, "buffer_pagenum")->pagenum;
+}
+
+
+/*
+ * buffer_getbcb - return the buffer control block of a fixed page
+ *
+ * - the caller may use the link/linkentry fields of the bcb for its own
+ *   bookkeeping while the page remains fixed
+ *
+ */
+bcb_t *buffer_getbcb(buffer_t *buf, const void *pageaddr)
+{
+    return fixedbcb(buf, (void *)pageaddr, "buffer_getbcb");
+}
+
+
+/*
+ * buffer_mark - mark the current page as modified
+ *
+ * safety checking and referece count checking 
+ *
+ */
+void buffer_mark(buffer_t *buf, void *pageaddr)
+{
+    fixedbcb(buf, pageaddr, "buffer_mark")->modified = 1;
+    return;
+}    
+
+
+/*
+ * buffer_isdirty - return the "modified" field of the page
+ *
+ * safety checking and referece count checking 
+ *
+ */
+int buffer_isdirty(buffer_t *buf, void *pageaddr)
+{
+    return (int)fixedbcb(buf, pageaddr, "buffer_isdirty")->modified;
+}    
+
+
+/*
+ * hash - map a pagenum to a hash table entry 
+ *
+ * - division/remainder hashing function
+ * - TODO: a good hash function
+ * - return integer hash value
+ *
+ */
+uint32_t hash(uint32_t htsize, pagenum_t pagenum)
+{
+    return (uint32_t)(pagenum % htsize);
+}
+
+
+/*
+ * pageshard - return the shard page pagenum belongs to
+ *
+ */
+bufshard_t *pageshard(buffer_t *buf, pagenum_t pagenum)
+{
+    return &buf->shards[(uint32_t)(pagenum % buf->shardcount)];
+}
+
+
+/*
+ * hashchain - return the hash list of the shard that page pagenum is on
+ *
+ * - pages of a shard are shardcount apart, so hash pagenum / shardcount
+ *   to use all the entries of the shard's table
+ *
+ */
+dlink_t *hashchain(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum)
+{
+    return &shard->bcbhashtable[hash(shard->bcbhtsize, 
+                                     pagenum / buf->shardcount)];
+}
+
+
+/*
+ * fixpage - fix the page with pagenum in its shard of the buffer pool
+ *
+ * - the caller holds the shard latch if the buffer is shared by threads
+ * - return pointer to the cached page if OK, NULL on error
+ *
+ */
+void *fixpage(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum)
+{
+    bcb_t *hitbcb;
+    int hit = 0;  /* indicate whether there is a hit or not */
+    int pageclass;
+
+    shard->stat.reqs++;
+
+    if (((hitbcb = findbcb(buf, shard, pagenum)) != NULL) && 
+        (hitbcb->loading)) {
+        /* a prefetch is under way, wait for it (it may fail) */
+        while (hitbcb->loading) 
+            if (reapprefetch(buf) != 0) 
+                return NULL;
+        hitbcb = lookupbcb(buf, pagenum);
+    }
+
+    if (hitbcb != NULL) { 
+        /* hit in cache */
+        hit = 1;
+        shard->stat.hits++;
+
+        REFINC(hitbcb);
+        if (!hitbcb->pinned) 
+            buf->policy->touch(buf, shard, hitbcb);
+        if (hitbcb->readyln.next != NULL) {
+            /* a prefetched page is delivered once */
+            dlink_delete(&hitbcb->readyln);
+            hitbcb->readyln.next = NULL;
+        }
+    }  
+    else if ((hitbcb = grabbcb(buf, shard)) == NULL) {
+        /* no available frame or io_write failed */
+        return NULL;
+    }
+        
+    if (!hit) {  /* initialize the bcb structure */
+        hitbcb->pagenum = pagenum;
+        hitbcb->modified = 0;
+        hitbcb->refcount = 1;
+        if (loadpage(buf, hitbcb) != 0) {
+            /* io_read failed or page beyond the mapping */
             
             /* return the bcb to free list */
-            dlink_insert(&buf->freebcblist, &hitbcb->hashln);
-            buf->freecount++;
+            hitbcb->refcount = 0;
+            dlink_insert(&shard->freebcblist, &hitbcb->hashln);
+            shard->freecount++;
             return NULL;
         }
         
         /* add the new page to the right hashtable entry */
-        hashnum = hash(buf->bcbhtsize, pagenum);
-        dlink_insert(&buf->bcbhashtable[hashnum], &hitbcb->hashln);
+        dlink_insert(hashchain(buf, shard, pagenum), &hitbcb->hashln);
+        buf->policy->admit(buf, shard, hitbcb);
+    }
+
+    pageclass = (buf->pageclass != NULL) ? 
+        buf->pageclass(hitbcb->pageaddr) : BUF_OTHERPAGE;
+    if (hit) 
+        shard->stat.classhits[pageclass]++;
+    else 
+        shard->stat.classmisses[pageclass]++;
+
+    return hitbcb->pageaddr;
+}
+
+
+/*
+ * findbcb - find the buffer control block for page "pagenum"
+ *
+ * - search the hash list 
+ * - return pointer to bcb if found , NULL if not
+ *
+ */
+bcb_t *findbcb(buffer_t *buf, bufshard_t *shard, pagenum_t pagenum)
+{
+    dlink_t *chain, *curlink ;
+    bcb_t *curbcb = NULL;
+    int lookups = 0; 
+
+    chain = hashchain(buf, shard, pagenum);
+    curlink = chain->next;
+    while (curlink != chain) {
+        lookups++;
+        curbcb = (bcb_t *)((char *)curlink - hashln_offset);
+        if (curbcb->pagenum == pagenum) {
+            shard->stat.hitlookups += lookups;
+            break;
+        }
+        else curlink = curlink->next;
+    }
+
+    if (curlink == chain) {
+        /* it's a miss */
+        shard->stat.misslookups += lookups;
+        curbcb = NULL;
     }
+    return curbcb;
+}
+
 
-    /* put to the end of the LRU list*/
-    dlink_insert(buf->bcblru.prev, &hitbcb->lruln); 
+/*
+ * lookupbcb - find the bcb for page "pagenum" without touching the stats
+ *
+ * - return pointer to bcb if found , NULL if not
+ *
+ */
+bcb_t *lookupbcb(buffer_t *buf, pagenum_t pagenum)
+{
+    dlink_t *chain, *curlink;
+
+    chain = hashchain(buf, pageshard(buf, pagenum), pagenum);
+    curlink = chain->next;
+    while (curlink != chain) {
+        bcb_t *curbcb = (bcb_t *)((char *)curlink - hashln_offset);
+
+        if (curbcb->pagenum == pagenum) 
+            return curbcb;
+        curlink = curlink->next;
+    }
+    return NULL;
+}
+
+
+/*
+ * findvictimbcb - find the least recently queued unfixed page of a list
+ *
+ * return the pointer to the victim bcb if found, NULL on error
+ *
+ */
+bcb_t *findvictimbcb(dlink_t *lru)
+{
+    dlink_t *curlink;
+
+    curlink = lru->next;
+    while (curlink != lru) {
+        bcb_t *curbcb;
+        curbcb = (bcb_t *)((char *)curlink - lruln_offset);
+        if (REFGET(curbcb) == 0) return curbcb;
+        else curlink = curlink->next;
+    }
+
+    /* well, if reaches this point, all bcb's are being actively used */
+    return NULL;
+}
+
+
+/*
+ * grabbcb - take a frame off the shard's free list, or evict an unfixed 
+ *           page of the shard
+ *
+ * - the victim is chosen by the replacement policy
+ * - a dirty victim is written back first
+ * - the bcb returned is on neither the hash list nor the LRU list
+ * - return the pointer to the bcb, NULL if no frame is available or the
+ *   write back fails
+ *
+ */
+bcb_t *grabbcb(buffer_t *buf, bufshard_t *shard)
+{
+    bcb_t *bcb;
+
+    if (shard->freecount > 0) { 
+        dlink_t *nextfree;
+
+        nextfree = shard->freebcblist.next;
+        dlink_delete(nextfree);
+        shard->freecount--;
+        return (bcb_t *)((char *)nextfree - hashln_offset);
+    }
+
+    /* find a frame by victiming an unfixed page */
+    if ((bcb = buf->policy->victim(buf, shard)) == NULL) 
+        return NULL;
+
+    if (bcb->readyln.next != NULL) {
+        /* a prefetched page evicted before it was asked for */
+        dlink_delete(&bcb->readyln);
+        bcb->readyln.next = NULL;
+    }
+
+    if (bcb->modified == 1) {
+        if (io_write(buf->fd, bcb->pagenum, bcb->pageaddr, 
+                     (size_t)buf->pagesize, &shard->stat) != 0) {
+            /* keep the page cached */
+            buf->policy->admit(buf, shard, bcb);
+            return NULL;
+        }
+        bcb->modified = 0;
+        shard->stat.writebacks++;
+    }
+    shard->stat.evictions++;
+
+    /* remove the this to-use bcb from its hash list */
+    dlink_delete(&bcb->hashln);
+    return bcb;
+}
+
+
+/*
+ * lru_admit, lru_touch, lru_victim - least recently used replacement
+ *
+ * - every cached page is on the shard's LRU list; a fix moves the page
+ *   to the end, the victim is the first unfixed page from the front
+ *
+ */
+void lru_admit(buffer_t *buf, bufshard_t *shard, bcb_t *bcb)
+{
+    dlink_insert(shard->bcblru.prev, &bcb->lruln); 
+}
+
+void lru_touch(buffer_t *buf, bufshard_t *shard, bcb_t *bcb)
+{
+    dlink_delete(&bcb->lruln);
+    dlink_insert(shard->bcblru.prev, &bcb->lruln); 
+}
+
+void lru_forget(buffer_t *buf, bufshard_t *shard, bcb_t *bcb)
+{
+    dlink_delete(&bcb->lruln);
+}
+
+bcb_t *lru_victim(buffer_t *buf, bufshard_t *shard)
+{
+    bcb_t *bcb;
+
+    if ((bcb = findvictimbcb(&shard->bcblru)) != NULL) 
+        dlink_delete(&bcb->lruln);
+    return bcb;
+}
+
+
+/*
+ * 2Q replacement (Johnson and Shasha, VLDB 1994)
+ *
+ * - A1in: FIFO of pages referenced once, at most a quarter of the frames;
+ *   hits in A1in do not change its order
+ * - A1out: FIFO of the page numbers (not the pages) recently evicted from
+ *   A1in, at most half as many entries as there are frames
+ * - Am: LRU list (shard->bcblru) of the pages that were referenced again
+ *   after they left A1in, i.e. while their number sat in A1out
+ * - a sequential scan runs through A1in and A1out only, so the pages in 
+ *   Am (the index pages and the hot leaves of point lookups) survive it
+ *
+ */
+#define TWOQ_AM 0
+#define TWOQ_A1IN 1
+
+typedef struct twoqghost_t {
+    pagenum_t pagenum;
+    dlink_t hashln;
+    dlink_t fifoln; /* overload fifoln for free list use */
+} twoqghost_t;
+
+typedef struct twoq_t {
+    dlink_t a1in;
+    size_t a1incount, a1inmax;
+
+    dlink_t a1out;
+    dlink_t ghostfree;
+    twoqghost_t *ghosts;
+    uint32_t ghosthtsize;
+    dlink_t *ghosthashtable;
+} twoq_t;
+
+#define GHOST_OF(link, member) \
+    ((twoqghost_t *)((char *)(link) - offsetof(twoqghost_t, member)))
+
+static dlink_t *ghostchain(buffer_t *buf, twoq_t *twoq, pagenum_t pagenum)
+{
+    return &twoq->ghosthashtable[hash(twoq->ghosthtsize, 
+                                      pagenum / buf->shardcount)];
+}
+
+int twoq_init(buffer_t *buf, bufshard_t *shard)
+{
+    twoq_t *twoq;
+    uint32_t ghostcount, i;
+
+    if ((twoq = (twoq_t *)malloc(sizeof(twoq_t))) == NULL) 
+        return -1;
+
+    dlink_init(&twoq->a1in);
+    twoq->a1incount = 0;
+    twoq->a1inmax = (shard->framecount / 4 > 0) ? shard->framecount / 4 : 1;
+
+    ghostcount = (shard->framecount / 2 > 0) ? shard->framecount / 2 : 1;
+    twoq->ghosthtsize = ghostcount;
+    twoq->ghosts = (twoqghost_t *)malloc(ghostcount * sizeof(twoqghost_t));
+    twoq->ghosthashtable = (dlink_t *)malloc(ghostcount * sizeof(dlink_t));
+    if ((twoq->ghosts == NULL) || (twoq->ghosthashtable == NULL)) {
+        free(twoq->ghosts);
+        free(twoq->ghosthashtable);
+        free(twoq);
+        return -1;
+    }
+
+    dlink_init(&twoq->a1out);
+    dlink_init(&twoq->ghostfree);
+    for (i = 0; i < ghostcount; i++) {
+        dlink_init(&twoq->ghosthashtable[i]);
+        dlink_insert(&twoq->ghostfree, &twoq->ghosts[i].fifoln);
+    }
+
+    shard->policydata = twoq;
+    return 0;
+}
+
+void twoq_destroy(buffer_t *buf, bufshard_t *shard)
+{
+    twoq_t *twoq = (twoq_t *)shard->policydata;
+
+    free(twoq->ghosts);
+    free(twoq->ghosthashtable);
+    free(twoq);
+    shard->policydata = NULL;
+}
+
+void twoq_admit(buffer_t *buf, bufshard_t *shard, bcb_t *bcb)
+{
+    twoq_t *twoq = (twoq_t *)shard->policydata;
+    dlink_t *chain, *curlink;
+
+    /* a page remembered in A1out has proven it is worth keeping */
+    chain = ghostchain(buf, twoq, bcb->pagenum);
+    for (curlink = chain->next; curlink != chain; curlink = curlink->next) {
+        twoqghost_t *ghost = GHOST_OF(curlink, hashln);
+
+        if (ghost->pagenum == bcb->pagenum) {
+            dlink_delete(&ghost->hashln);
+            dlink_delete(&ghost->fifoln);
+            dlink_insert(&twoq->ghostfree, &ghost->fifoln);
+
+            bcb->queue = TWOQ_AM;
+            dlink_insert(shard->bcblru.prev, &bcb->lruln);
+            return;
+        }
+    }
+
+    bcb->queue = TWOQ_A1IN;
+    dlink_insert(twoq->a1in.prev, &bcb->lruln);
+    twoq->a1incount++;
+}
+
+void twoq_touch(buffer_t *buf, bufshard_t *shard, bcb_t *bcb)
+{
+    if (bcb->queue == TWOQ_AM) {
+        dlink_delete(&bcb->lruln);
+        dlink_insert(shard->bcblru.prev, &bcb->lruln);
+    }
+}
+
+void twoq_forget(buffer_t *buf, bufshard_t *shard, bcb_t *bcb)
+{
+    twoq_t *twoq = (twoq_t *)shard->policydata;
+
+    dlink_delete(&bcb->lruln);
+    if (bcb->queue == TWOQ_A1IN) 
+        twoq->a1incount--;
+}
+
+bcb_t *twoq_victim(buffer_t *buf, bufshard_t *shard)
+{
+    twoq_t *twoq = (twoq_t *)shard->policydata;
+    bcb_t *bcb = NULL;
+    twoqghost_t *ghost;
+
+    /* reclaim from A1in while it is over its share, otherwise from Am;
+       fall back to the other list if all pages of one are fixed */
+    if (twoq->a1incount > twoq->a1inmax) 
+        bcb = findvictimbcb(&twoq->a1in);
+    if (bcb == NULL) 
+        bcb = findvictimbcb(&shard->bcblru);
+    if (bcb == NULL) 
+        bcb = findvictimbcb(&twoq->a1in);
+    if (bcb == NULL) 
+        return NULL;
+
+    dlink_delete(&bcb->lruln);
+    if (bcb->queue == TWOQ_AM) 
+        return bcb;
+
+    /* remember the page number of a page leaving A1in in A1out */
+    twoq->a1incount--;
+
+    if (twoq->ghostfree.next != &twoq->ghostfree) {
+        ghost = GHOST_OF(twoq->ghostfree.next, fifoln);
+    } else {
+        ghost = GHOST_OF(twoq->a1out.next, fifoln);
+        dlink_delete(&ghost->hashln);
+    }
+    dlink_delete(&ghost->fifoln);
+
+    ghost->pagenum = bcb->pagenum;
+    dlink_insert(ghostchain(buf, twoq, bcb->pagenum), &ghost->hashln);
+    dlink_insert(twoq->a1out.prev, &ghost->fifoln);
+
+    return bcb;
+}
+
+
+/*
+ * comparebcb - order bcb pointers by page number (for qsort)
+ *
+ */
+int comparebcb(const void *ptr1, const void *ptr2)
+{
+    pagenum_t pagenum1 = (*(bcb_t * const *)ptr1)->pagenum;
+    pagenum_t pagenum2 = (*(bcb_t * const *)ptr2)->pagenum;
+
+    return (pagenum1 > pagenum2) - (pagenum1 < pagenum2);
+}
+
+
+/*
+ * flushbcbs - write the pages of an array of bcb's back to the file
+ *
+ * - sort the bcb's by page number and write every run of adjacent pages
+ *   with one vectored write
+ * - return 0 if OK, -1 on error
+ *
+ */
+int flushbcbs(buffer_t *buf, bcb_t **bcbs, size_t count)
+{
+    struct iovec iov[IOV_MAX];
+    size_t start, end;
+    int res = 0;
+
+    qsort(bcbs, count, sizeof(bcb_t *), comparebcb);
+
+    for (start = 0; start < count; start = end) {
+        int runcount = 0;
+
+        end = start;
+        do {
+            iov[runcount].iov_base = bcbs[end]->pageaddr;
+            iov[runcount].iov_len = (size_t)buf->pagesize;
+            runcount++;
+            end++;
+        } while ((end < count) && (runcount < IOV_MAX) &&
+                 (bcbs[end]->pagenum == bcbs[end - 1]->pagenum + 1));
+
+        if (io_writev(buf->fd, bcbs[start]->pagenum, iov, runcount,
+                      (size_t)buf->pagesize, 
+                      &pageshard(buf, bcbs[start]->pagenum)->stat) != 0) 
+            res = -1;
+        else {
+            size_t i;
+
+            for (i = start; i < end; i++) {
+                bcbs[i]->modified = 0;
+                pageshard(buf, bcbs[i]->pagenum)->stat.writebacks++;
+            }
+        }
+    }
+
+    return res;
+}
+
+
+/*
+ * allocframes - allocate memory for size bytes worth of frames
+ *
+ * - anonymous memory is mapped, so that a frame costs nothing until it is
+ *   first used and a large pool does not slow down the start
+ * - the mapping is rounded up to whole huge pages; if ETREE_HUGETLB is
+ *   set in the environment, explicit (reserved) huge pages are tried 
+ *   first, otherwise the mapping is advised to use transparent ones 
+ * - fall back to malloc if nothing can be mapped (*mapsizeptr is 0 then)
+ * - return the pointer to the memory, NULL if out of memory
+ *
+ */
+void *allocframes(size_t size, size_t *mapsizeptr)
+{
+    size_t mapsize;
+    void *base = MAP_FAILED;
+
+    *mapsizeptr = 0;
+    if (size == 0) 
+        return malloc(1);
+
+    mapsize = (size + HUGEPAGESIZE - 1) / HUGEPAGESIZE * HUGEPAGESIZE;
+
+#ifdef MAP_HUGETLB
+    if (getenv("ETREE_HUGETLB") != NULL) 
+        base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, 
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, 
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            /* aligned for O_DIRECTIO */
+            void *frames;
+
+            return (posix_memalign(&frames, DIRECTALIGN, size) == 0) ? 
+                frames : NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(base, mapsize, MADV_HUGEPAGE);
+#endif
+    }
+
+    *mapsizeptr = mapsize;
+    return base;
+}
+
+
+/*
+ * freeframes - release the memory obtained by allocframes
+ *
+ */
+void freeframes(void *base, size_t mapsize)
+{
+    if (mapsize == 0) 
+        free(base);
+    else
+        munmap(base, mapsize);
+}
+
+
+/*
+ * mapfile - map the whole (read-only) file into memory
+ *
+ * - the mapping is shared so that the kernel page cache, not a private 
+ *   copy, holds the pages of every process reading the same file
+ * - return 0 if OK, -1 if the file is empty or cannot be mapped
+ *
+ */
+int mapfile(buffer_t *buf)
+{
+    struct stat statbuf;
+    void *base;
+
+    if ((fstat(buf->fd, &statbuf) != 0) || (statbuf.st_size == 0)) 
+        return -1;
+
+    if ((off_t)(size_t)statbuf.st_size != statbuf.st_size) 
+        /* the file does not fit in the address space */
+        return -1;
+
+    base = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_SHARED, 
+                buf->fd, 0);
+    if (base == MAP_FAILED) 
+        return -1;
+
+    buf->mapbase = base;
+    buf->mapsize = statbuf.st_size;
+    return 0;
+}
+
+
+/*
+ * loadpage - make the content of bcb->pagenum available at bcb->pageaddr
+ *
+ * - read the page into the frame, or point the bcb into the mapping
+ * - return 0 if OK, -1 on error
+ *
+ */
+int loadpage(buffer_t *buf, bcb_t *bcb)
+{
+    off_t offset;
+
+    if ((buf->zextents != NULL) && (bcb->pagenum >= buf->zrawpages)) 
+        return loadzpage(buf, bcb);
+
+    if (buf->mapbase == NULL) 
+        return io_read(bcb->pageaddr, buf->fd, bcb->pagenum, 
+                       (size_t)buf->pagesize, 
+                       &pageshard(buf, bcb->pagenum)->stat);
+
+    offset = bcb->pagenum * (off_t)buf->pagesize;
+    if ((offset < 0) || (offset + buf->pagesize > buf->mapsize)) 
+        return -1;
+
+    bcb->pageaddr = (char *)buf->mapbase + offset;
+    return 0;
+}
+
+
+/*
+ * loadztable - recognize a compressed page file and load its page-location
+ *              table
+ *
+ * - return 1 if the file is compressed, 0 if not, -1 on error
+ *
+ */
+int loadztable(buffer_t *buf)
+{
+    struct stat statbuf;
+    unsigned char trailer[ZTRAILERSIZE], *table;
+    uint64_t tableoffset, extentcount, i;
+
+    if ((fstat(buf->plainfd, &statbuf) != 0) || 
+        (statbuf.st_size < ZTRAILERSIZE) ||
+        (pread(buf->plainfd, trailer, ZTRAILERSIZE, 
+               statbuf.st_size - ZTRAILERSIZE) != ZTRAILERSIZE) ||
+        (memcmp(trailer, ZMAGIC, 8) != 0)) 
+        return 0;
+
+    if ((uint32_t)get64(trailer + 8) != buf->pagesize) {
+        fprintf(stderr, "buffer_init (%s): compressed with %u-byte pages\n",
+                buf->filename, (uint32_t)get64(trailer + 8));
+        return -1;
+    }
+    buf->zrawpages = (pagenum_t)get64(trailer + 16);
+    buf->zpagecount = (pagenum_t)get64(trailer + 24);
+    tableoffset = get64(trailer + 32);
+    buf->zsuffixoffset = (off_t)get64(trailer + 40);
+    buf->zsuffixsize = (off_t)get64(trailer + 48);
+    if (buf->zpagecount < buf->zrawpages) 
+        return -1;
+
+    extentcount = buf->zpagecount - buf->zrawpages;
+    if (((buf->zextents = (uint64_t *)
+          malloc((extentcount + 1) * sizeof(uint64_t))) == NULL) ||
+        ((table = (unsigned char *)malloc((extentcount + 1) * 8)) == NULL))
+        /* out of memory */
+        return -1;
+
+    if (pread(buf->plainfd, table, (extentcount + 1) * 8, (off_t)tableoffset) 
+        != (ssize_t)((extentcount + 1) * 8)) {
+        free(table);
+        return -1;
+    }
+    for (i = 0; i <= extentcount; i++) 
+        buf->zextents[i] = get64(table + i * 8);
+    free(table);
+
+    return 1;
+}
+
+
+/*
+ * loadzpage - read the compressed extent of bcb->pagenum and decompress
+ *             it into the frame
+ *
+ * - the bytes read are those of the extent, so the statistics show the
+ *   I/O saved
+ * - return 0 if OK, -1 on error
+ *
+ */
+int loadzpage(buffer_t *buf, bcb_t *bcb)
+{
+    bufstat_t *stat = &pageshard(buf, bcb->pagenum)->stat;
+    uint64_t start, extentoffset;
+    size_t extentsize;
+    unsigned char *extent;
+    ssize_t bytes;
+    int res;
+
+    if (bcb->pagenum >= buf->zpagecount) 
+        return -1;
+
+    extentoffset = buf->zextents[bcb->pagenum - buf->zrawpages];
+    extentsize = (size_t)(buf->zextents[bcb->pagenum - buf->zrawpages + 1] -
+                          extentoffset);
+    if (extentsize > buf->pagesize) 
+        return -1;
+
+    /* a page that did not compress is read straight into the frame */
+    extent = (extentsize == buf->pagesize) ? 
+        (unsigned char *)bcb->pageaddr : (unsigned char *)malloc(extentsize);
+    if (extent == NULL) 
+        return -1;
+
+    start = usecnow();
+    bytes = pread(buf->fd, extent, extentsize, (off_t)extentoffset);
+    stat->reads++;
+    stat->bytesread += (bytes > 0) ? bytes : 0;
+    recordio(stat->readlatency, usecnow() - start);
+
+    if (bytes != (ssize_t)extentsize) 
+        res = -1;
+    else if (extent == (unsigned char *)bcb->pageaddr) 
+        res = 0;
+    else 
+        res = zpage_decompress(extent, extentsize, bcb->pageaddr, 
+                               (size_t)buf->pagesize);
+
+    if (extent != (unsigned char *)bcb->pageaddr) 
+        free(extent);
+    return res;
+}
+
+
+/*
+ * buffer_readbytes - read size bytes of the file at offset, outside of 
+ *                    the pages managed by the buffer
+ *
+ * - for the client's own metadata; in a compressed page file only the 
+ *   leading raw pages and the bytes past the last page can be read
+ * - return 0 if OK, -1 on error
+ *
+ */
+int buffer_readbytes(buffer_t *buf, void *dest, size_t size, off_t offset)
+{
+    if (buf->zextents != NULL) {
+        off_t endoffset = (off_t)buf->zpagecount * buf->pagesize;
+
+        if (offset >= endoffset) {
+            if (offset + (off_t)size > endoffset + buf->zsuffixsize) 
+                return -1;
+            offset = buf->zsuffixoffset + (offset - endoffset);
+        } else if (offset + (off_t)size > 
+                   (off_t)buf->zrawpages * buf->pagesize) 
+            return -1;
+    }
+
+    /* the bytes need not be aligned: read them through the cache */
+    return (pread(buf->plainfd, dest, size, offset) == (ssize_t)size) ? 
+        0 : -1;
+}
+
+
+/*
+ * opendirect - open the file again for O_DIRECT page I/O if O_DIRECTIO 
+ *              is set
+ *
+ * - the plain descriptor opened first is kept for buffer_readbytes
+ * - pages must be a multiple of DIRECTALIGN; the file system may refuse
+ *   O_DIRECT (tmpfs does), the pages are then read through the plain
+ *   descriptor
+ * - return 0 if the pages do O_DIRECT I/O, -1 if not
+ *
+ */
+int opendirect(buffer_t *buf, const char *filename, int openflags)
+{
+#ifdef O_DIRECT
+    int fd;
+
+    if (((buf->flags & O_DIRECTIO) == 0) || 
+        (buf->pagesize % DIRECTALIGN != 0)) 
+        return -1;
+
+    if ((fd = open(filename, openflags | O_DIRECT)) == -1) 
+        return -1;
 
-    return hitbcb->pageaddr;
+    buf->fd = fd;
+    buf->direct = 1;
+    return 0;
+#else
+    return -1;
+#endif
 }
 
 
 /*
- * buffer_ref - increment buffer pool page refcount by 1 and return 
- *              the new refcount
+ * closefile - close the descriptor of the pages, and the plain one if 
+ *             it is another
  *
- * safety checking and referece count checking
+ * - return 0 if OK, -1 if either close failed
  *
  */
-int buffer_ref(buffer_t *buf, void *pageaddr)
+int closefile(buffer_t *buf)
 {
-    uint32_t bcbnum = safebcbnum(buf, pageaddr, "buffer_ref");
-    
-    buf->bcbtable[bcbnum].refcount++;
-    return buf->bcbtable[bcbnum].refcount;
+    int res = 0;
+
+    if ((buf->plainfd != buf->fd) && (close(buf->plainfd) != 0)) 
+        res = -1;
+    if (close(buf->fd) != 0) 
+        res = -1;
+
+    return res;
 }
 
 
 /*
- * buffer_unref - decrement refcount by 1 and  return the new ref count  
+ * buffer_compress - write a compressed page file of the (uncompressed)
+ *                   file cached by buf
+ *
+ * - pages 0 .. rawpages - 1 are copied as they are; pages rawpages .. 
+ *   pagecount - 1 are compressed one by one with the zpage codec; the 
+ *   bytes past the last page are copied after the page-location table
+ * - pages are read from the file, so modified pages must be flushed 
+ *   first (open the source O_RDONLY)
+ * - return 0 if OK, -1 on error
  *
- * safety checking and referece count checking
- *  
  */
-int buffer_unref(buffer_t *buf, void *pageaddr)
+int buffer_compress(buffer_t *buf, const char *destpath, pagenum_t rawpages,
+                    pagenum_t pagecount)
 {
-    uint32_t bcbnum = safebcbnum(buf, pageaddr, "buffer_unref");
-    
-    buf->bcbtable[bcbnum].refcount--;
-    return buf->bcbtable[bcbnum].refcount;
-}
+    struct stat statbuf;
+    unsigned char *page, *zpage, *table, trailer[ZTRAILERSIZE];
+    uint64_t extentoffset, tableoffset, suffixoffset, suffixsize;
+    pagenum_t pagenum;
+    int destfd, res = -1;
+    off_t offset;
+
+    if ((buf->zextents != NULL) || (rawpages > pagecount) ||
+        (fstat(buf->plainfd, &statbuf) != 0) ||
+        ((off_t)pagecount * buf->pagesize > statbuf.st_size)) 
+        return -1;
 
+    page = (unsigned char *)malloc(buf->pagesize);
+    zpage = (unsigned char *)malloc(buf->pagesize);
+    table = (unsigned char *)malloc((pagecount - rawpages + 1) * 8);
+    if ((page == NULL) || (zpage == NULL) || (table == NULL) ||
+        ((destfd = open(destpath, O_WRONLY | O_CREAT | O_TRUNC, 
+                        S_IRUSR | S_IWUSR | S_IRGRP)) == -1)) {
+        free(page); free(zpage); free(table);
+        return -1;
+    }
 
+    /* the raw pages, then the extents */
+    extentoffset = 0;
+    for (pagenum = 0; pagenum < pagecount; pagenum++) {
+        const unsigned char *out = page;
+        int outsize = (int)buf->pagesize;
 
-/*
- * buffer_pagenum - return the page number correpsonding to pageaddr
- *
- * safety checking and referece count checking
- * 
- */
-pagenum_t buffer_pagenum(buffer_t *buf, void *pageaddr)
-{
-    uint32_t bcbnum = safebcbnum(buf, pageaddr, "buffer_pagenum");
-    
-    return buf->bcbtable[bcbnum].pagenum;
+        if (pread(buf->plainfd, page, buf->pagesize, 
+                  (off_t)pagenum * buf->pagesize) != buf->pagesize) 
+            goto done;
+
+        if (pagenum >= rawpages) {
+            int zsize = zpage_compress(page, buf->pagesize, zpage, 
+                                       buf->pagesize - 1);
+
+            if (zsize > 0) {
+                out = zpage;
+                outsize = zsize;
+            }
+            put64(table + (pagenum - rawpages) * 8, extentoffset);
+        }
+        if (write(destfd, out, outsize) != outsize) 
+            goto done;
+        extentoffset += outsize;
+    }
+    put64(table + (pagecount - rawpages) * 8, extentoffset);
+
+    /* the page-location table and the bytes past the last page */
+    tableoffset = extentoffset;
+    if (write(destfd, table, (pagecount - rawpages + 1) * 8) != 
+        (ssize_t)((pagecount - rawpages + 1) * 8)) 
+        goto done;
+    suffixoffset = tableoffset + (pagecount - rawpages + 1) * 8;
+    suffixsize = 0;
+    for (offset = (off_t)pagecount * buf->pagesize; 
+         offset < statbuf.st_size; offset += buf->pagesize) {
+        ssize_t bytes = pread(buf->plainfd, page, buf->pagesize, offset);
+
+        if ((bytes <= 0) || (write(destfd, page, bytes) != bytes)) 
+            goto done;
+        suffixsize += bytes;
+    }
+
+    memset(trailer, 0, ZTRAILERSIZE);
+    memcpy(trailer, ZMAGIC, 8);
+    put64(trailer + 8, buf->pagesize);
+    put64(trailer + 16, (uint64_t)rawpages);
+    put64(trailer + 24, (uint64_t)pagecount);
+    put64(trailer + 32, tableoffset);
+    put64(trailer + 40, suffixoffset);
+    put64(trailer + 48, suffixsize);
+    if (write(destfd, trailer, ZTRAILERSIZE) != ZTRAILERSIZE) 
+        goto done;
+
+    res = 0;
+
+ done:
+    if (close(destfd) != 0) 
+        res = -1;
+    free(page);
+    free(zpage);
+    free(table);
+    return res;
 }
 
 
 /*
- * buffer_mark - mark the current page as modified
- *
- * safety checking and referece count checking 
+ * put64, get64 - store and load a little-endian 64-bit number
  *
  */
-void buffer_mark(buffer_t *buf, void *pageaddr)
+void put64(unsigned char *ptr, uint64_t value)
 {
-    uint32_t bcbnum = safebcbnum(buf, pageaddr, "buffer_mark");
+    int i;
 
-    buf->bcbtable[bcbnum].modified = 1;
+    for (i = 0; i < 8; i++, value >>= 8) 
+        ptr[i] = (unsigned char)(value & 0xff);
     return;
-}    
+}
+
+uint64_t get64(const unsigned char *ptr)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) 
+        value = (value << 8) | ptr[i];
+    return value;
+}
 
 
 /*
- * buffer_isdirty - return the "modified" field of the page
- *
- * safety checking and referece count checking 
+ * io_read - read the buffer page from the filesystem
  *
+ * - the read is accounted in *stat
+ * - return 0 if OK , -1 on error
  */
-int buffer_isdirty(buffer_t *buf, void *pageaddr)
+int io_read(void *dest, int fd, pagenum_t pageid, size_t size, 
+            bufstat_t *stat)
 {
-    uint32_t bcbnum = safebcbnum(buf, pageaddr, "buffer_isdirty");
+    pagenum_t offset = pageid * size;
+    uint64_t start = usecnow();
+    ssize_t bytes;
 
-    return (int)buf->bcbtable[bcbnum].modified;
-}    
+    /* positional read: no seek, and the file offset is left alone */
+    bytes = pread(fd, dest, size, offset);
+
+    stat->reads++;
+    stat->bytesread += (bytes > 0) ? bytes : 0;
+    recordio(stat->readlatency, usecnow() - start);
+
+    if (bytes != size) {
+        /* perror("io_read() : pread");*/
+        return -1;
+    }
+    return 0;
+}   
 
 
 /*
- * hash - map a pagenum to a hash table entry 
+ * io_write - write the buffer page to the filesystem
  *
- * - division/remainder hashing function
- * - TODO: a good hash function
- * - return integer hash value
+ * - the write is accounted in *stat
  *
  */
-uint32_t hash(uint32_t htsize, pagenum_t pagenum)
+int io_write(int fd, pagenum_t pageid, const void *src, size_t size,
+             bufstat_t *stat)
 {
-    return (uint32_t)(pagenum % htsize);
+    pagenum_t offset = pageid * size;
+    uint64_t start = usecnow();
+    ssize_t bytes;
+
+    bytes = pwrite(fd, src, size, offset);
+
+    stat->writes++;
+    stat->byteswritten += (bytes > 0) ? bytes : 0;
+    recordio(stat->writelatency, usecnow() - start);
+
+    if (bytes != size) {
+        /*  perror("io_write() : pwrite"); */
+        return -1;
+    }
+    return 0;
 }
 
 
 /*
- * findbcb - find the buffer control block for page "pagenum"
+ * io_readv - read count adjacent pages starting at pageid into the 
+ *            (non-contiguous) frames described by iov
  *
- * - search the hash list 
- * - return pointer to bcb if found , NULL if not
+ * - count must not exceed IOV_MAX
+ * - a short read at the end of the file is not an error
+ * - return the number of whole pages read, -1 on error
  *
  */
-bcb_t *findbcb(buffer_t *buf, pagenum_t pagenum)
+int io_readv(struct iovec *iov, int count, int fd, pagenum_t pageid, 
+             size_t size, bufstat_t *stat)
 {
-    uint32_t hashnum;
-    dlink_t *curlink ;
-    bcb_t *curbcb = NULL;
-    int lookups = 0; 
+    pagenum_t offset = pageid * size;
+    uint64_t start = usecnow();
+    ssize_t bytes;
 
-    hashnum = hash(buf->bcbhtsize, pagenum);
-    curlink = buf->bcbhashtable[hashnum].next;
-    while (curlink != &buf->bcbhashtable[hashnum]) {
-        lookups++;
-        curbcb = (bcb_t *)((char *)curlink - hashln_offset);
-        if (curbcb->pagenum == pagenum) {
-            buf->hitlookups += lookups;
+#ifdef NOPREADV
+    int i;
+
+    for (bytes = 0, i = 0; i < count; i++) {
+        ssize_t res = pread(fd, iov[i].iov_base, size, offset + bytes);
+
+        if (res < 0) {
+            bytes = -1;
             break;
         }
-        else curlink = curlink->next;
+        bytes += res;
+        if (res != size) 
+            break;
     }
+#else
+    bytes = preadv(fd, iov, count, offset);
+#endif
 
-    if (curlink == &buf->bcbhashtable[hashnum]) {
-        /* it's a miss */
-        buf->misslookups += lookups;
-        curbcb = NULL;
+    stat->reads++;
+    stat->bytesread += (bytes > 0) ? bytes : 0;
+    recordio(stat->readlatency, usecnow() - start);
+
+    if (bytes < 0) {
+        /* perror("io_readv() : preadv"); */
+        return -1;
     }
-    return curbcb;
+
+    return (int)(bytes / size);
 }
 
 
 /*
- * findvictimbcb - find a victim page to evict
+ * io_writev - write count adjacent pages starting at pageid from the
+ *             frames described by iov
  *
- * return the pointer to the victim bcb if found, NULL on error
+ * - count must not exceed IOV_MAX
+ * - return 0 if OK, -1 on error
  *
  */
-bcb_t *findvictimbcb(buffer_t *buf)
+int io_writev(int fd, pagenum_t pageid, const struct iovec *iov, int count,
+              size_t size, bufstat_t *stat)
 {
-    dlink_t *curlink;
+    pagenum_t offset = pageid * size;
+    uint64_t start = usecnow();
+    ssize_t bytes;
 
-    curlink = buf->bcblru.next;
-    while (curlink != &buf->bcblru) {
-        bcb_t *curbcb;
-        curbcb = (bcb_t *)((char *)curlink - lruln_offset);
-        if (curbcb->refcount == 0) return curbcb;
-        else curlink = curlink->next;
+#ifdef NOPREADV
+    int i;
+
+    for (bytes = 0, i = 0; i < count; i++) {
+        if (pwrite(fd, iov[i].iov_base, size, offset + i * size) != size) 
+            break;
+        bytes += size;
     }
+#else
+    bytes = pwritev(fd, iov, count, offset);
+#endif
 
-    /* well, if reaches this point, all bcb's are being actively used */
-    return NULL;
+    stat->writes++;
+    stat->byteswritten += (bytes > 0) ? bytes : 0;
+    recordio(stat->writelatency, usecnow() - start);
+
+    if (bytes != (ssize_t)(count * size)) {
+        /*  perror("io_writev() : pwritev"); */
+        return -1;
+    }
+
+    return 0;
 }
 
 
 /*
- * io_read - read the buffer page from the filesystem
+ * usecnow - return the current time in microseconds
  *
- * return 0 if OK , -1 on error
  */
-int io_read(void *dest, int fd, pagenum_t pageid, size_t size)
+uint64_t usecnow()
 {
-    pagenum_t offset = pageid * size;
+    struct timeval now;
 
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        /* perror("io_read() : lseek"); */
-        return -1;
-    }
-    if (read(fd, dest, size) != size) {
-        /* perror("io_read() : read");*/
-        return -1;
-    }
-    return 0;
-}   
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
 
 
 /*
- * io_write - write the buffer page to the filesystem
+ * recordio - count an I/O that took usecs microseconds in the latency
+ *            histogram
  *
  */
-int io_write(int fd, pagenum_t pageid, const void *src, size_t size)
+void recordio(uint64_t latency[], uint64_t usecs)
 {
-    pagenum_t offset = pageid * size;
+    int bucket = 0;
 
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        /* fprintf(stderr, "io_write() lseek fd of %d\n", fd);
-           perror("io_write() : lseek"); */
-        return -1;
-    }
-    if (write(fd, src, size) != size) {
-        /*  perror("io_write() : write"); */
-        return -1;
+    while ((usecs >= 2) && (bucket < BUF_LATENCYBUCKETS - 1)) {
+        usecs >>= 1;
+        bucket++;
     }
-    return 0;
+    latency[bucket]++;
 }
 
 
@@ -517,57 +2602,91 @@ int io_write(int fd, pagenum_t pageid, const void *src, size_t size)
  */
 void buffer_showusage(buffer_t *buf, FILE *fp)
 {
-    int i, usedcount, maxlen, minlen, totallen;
+    int i, usedcount, maxlen, minlen, totallen, htsize;
     float htpercentile, avglen, avghitlen, avgmisslen, hitpercentile;
+    uint64_t reqs, hits, hitlookups, misslookups;
+    uint32_t shardnum;
+    bufstat_t stat;
+
+    buffer_getstat(buf, &stat);
+    reqs = stat.reqs;
+    hits = stat.hits;
+    hitlookups = stat.hitlookups;
+    misslookups = stat.misslookups;
 
     usedcount = 0;
     maxlen = 0; minlen = 100; 
     totallen = 0;
-    for (i = 0; i < buf->bcbhtsize; i++) {
+    htsize = 0;
+    for (shardnum = 0; shardnum < buf->shardcount; shardnum++) {
+      bufshard_t *shard = &buf->shards[shardnum];
+
+      htsize += shard->bcbhtsize;
+
+      for (i = 0; i < shard->bcbhtsize; i++) {
         int curlen = 0;
-        dlink_t *curlink = buf->bcbhashtable[i].next;
+        dlink_t *curlink = shard->bcbhashtable[i].next;
 
-        if (curlink !=  &buf->bcbhashtable[i]) 
+        if (curlink !=  &shard->bcbhashtable[i]) 
             usedcount++;
         else 
             continue; /* ignore empty hash entry */
-        while (curlink != &buf->bcbhashtable[i]) {
-            bcb_t *curbcb;
-
+        while (curlink != &shard->bcbhashtable[i]) {
             curlen++;
-            curbcb = (bcb_t *)((char *)curlink - hashln_offset);
-
-
             curlink = curlink->next;
         }
         maxlen = (maxlen > curlen) ? maxlen : curlen;
         minlen = (minlen < curlen) ? minlen : curlen;
         totallen += curlen;
+      }
     }
-    htpercentile = usedcount * 100.0 / buf->bcbhtsize;
-    hitpercentile = buf->hits * 100.0 / buf->reqs;
+    htpercentile = usedcount * 100.0 / htsize;
+    hitpercentile = hits * 100.0 / reqs;
 
     avglen = totallen * 1.0 / usedcount;
-    avghitlen = buf->hitlookups * 1.0 / buf->hits;
-    avgmisslen = buf->misslookups * 1.0 / (buf->reqs  - buf->hits);
+    avghitlen = hitlookups * 1.0 / hits;
+    avgmisslen = misslookups * 1.0 / (reqs  - hits);
 
     fprintf(fp, "Bufer usage statistics:\n\n");
 
-    fprintf(fp, "File name:\t\t\t%s\n\n", buf->filename);
+    fprintf(fp, "File name:\t\t\t%s\n", buf->filename);
+    fprintf(fp, "Shards:\t\t\t\t%u\n", buf->shardcount);
+    fprintf(fp, "Replacement policy:\t\t%s\n", buf->policy->name);
+    fprintf(fp, "Pinned pages:\t\t\t%lu of %lu\n", 
+            (unsigned long)(buf->pincount - buf->pinfreecount),
+            (unsigned long)buf->pincount);
+    fprintf(fp, "Direct I/O:\t\t\t%s\n", buf->direct ? "yes" : "no");
+    fprintf(fp, "Prefetch engine:\t\t%s\n", 
+            (buf->aio != NULL) ? aio_engine(buf->aio) : "none");
+    if (buf->shm != NULL) 
+        fprintf(fp, "Shared by processes:\t\t%d\n\n", 
+                (int)((shmhdr_t *)buf->shm)->attached);
+    else 
+        fprintf(fp, "Shared by processes:\t\tno\n\n");
     if (sizeof(long int) == 8) {
-        fprintf(fp, "Requests:\t\t\t%lu\n", (unsigned long int)buf->reqs);
-        fprintf(fp, "Hits:\t\t\t\t%lu\n", (unsigned long int)buf->hits);
+        fprintf(fp, "Requests:\t\t\t%lu\n", (unsigned long int)reqs);
+        fprintf(fp, "Hits:\t\t\t\t%lu\n", (unsigned long int)hits);
     } else {
 #ifdef ALPHA
-        fprintf(fp, "Requests:\t\t\t%lu\n", (unsigned long)buf->reqs);
-        fprintf(fp, "Hits:\t\t\t\t%lu\n", (unsigned long)buf->hits);
+        fprintf(fp, "Requests:\t\t\t%lu\n", (unsigned long)reqs);
+        fprintf(fp, "Hits:\t\t\t\t%lu\n", (unsigned long)hits);
 #else
-        fprintf(fp, "Requests:\t\t\t%qu\n", (unsigned long long)buf->reqs);
-        fprintf(fp, "Hits:\t\t\t\t%qu\n", (unsigned long long)buf->hits);
+        fprintf(fp, "Requests:\t\t\t%qu\n", (unsigned long long)reqs);
+        fprintf(fp, "Hits:\t\t\t\t%qu\n", (unsigned long long)hits);
 #endif
     }
 
-    fprintf(fp, "Hit ratio:\t\t\t%.2f%%\n\n", hitpercentile);
+    fprintf(fp, "Hit ratio:\t\t\t%.2f%%\n", hitpercentile);
+    fprintf(fp, "Index page hits/misses:\t\t%.0f/%.0f\n", 
+            (double)stat.classhits[BUF_INDEXPAGE], 
+            (double)stat.classmisses[BUF_INDEXPAGE]);
+    fprintf(fp, "Leaf page hits/misses:\t\t%.0f/%.0f\n", 
+            (double)stat.classhits[BUF_LEAFPAGE], 
+            (double)stat.classmisses[BUF_LEAFPAGE]);
+    fprintf(fp, "Evictions:\t\t\t%.0f\n", (double)stat.evictions);
+    fprintf(fp, "Dirty writebacks:\t\t%.0f\n", (double)stat.writebacks);
+    fprintf(fp, "Bytes read/written:\t\t%.0f/%.0f\n\n", 
+            (double)stat.bytesread, (double)stat.byteswritten);
     fprintf(fp, "Average hit lookups:\t\t%.2f\n", avghitlen);
     fprintf(fp, "Average miss lookups:\t\t%.2f\n\n", avgmisslen);
     
@@ -579,18 +2698,246 @@ void buffer_showusage(buffer_t *buf, FILE *fp)
     return;
 }
 
+/*
+ * buffer_getstat - copy the usage statistics, summed over the shards,
+ *                  into *stat
+ *
+ * - the shard latches are taken if the buffer is shared by threads, so
+ *   the statistics can be sampled while it is in use
+ *
+ */
+void buffer_getstat(buffer_t *buf, bufstat_t *stat)
+{
+    uint32_t shardnum;
+
+    memset(stat, 0, sizeof(bufstat_t));
+    for (shardnum = 0; shardnum < buf->shardcount; shardnum++) {
+        bufshard_t *shard = &buf->shards[shardnum];
+
+        if (((buf->flags & O_CONCURRENT) != 0) || (buf->shm != NULL)) 
+            lockshard(buf, shard);
+        sumstat(stat, &shard->stat);
+        if (((buf->flags & O_CONCURRENT) != 0) || (buf->shm != NULL)) 
+            pthread_mutex_unlock(&shard->latch);
+    }
+
+    return;
+}
+
+
+/*
+ * buffer_printstat - print the usage statistics as a JSON object
+ *
+ * - latency histograms are arrays of BUF_LATENCYBUCKETS counts, bucket
+ *   i holding the I/Os that took [2^i, 2^(i+1)) microseconds
+ *
+ */
+void buffer_printstat(buffer_t *buf, FILE *fp)
+{
+    static const char *classname[BUF_PAGECLASSES] = 
+        {"index", "leaf", "other"};
+    bufstat_t stat;
+    int class;
+
+    buffer_getstat(buf, &stat);
+
+    fprintf(fp, "{\"file\": ");
+    printjsonstring(fp, buf->filename);
+    fprintf(fp, ", \"pagesize\": %u, \"frames\": %llu, \"shards\": %u, ",
+            buf->pagesize, (unsigned long long)buf->framecount, 
+            buf->shardcount);
+    fprintf(fp, "\"policy\": \"%s\", \"pinned\": %llu, \"pinframes\": %llu,"
+            " \"mmap\": %s, \"direct\": %s, \"shared\": %s,"
+            " \"prefetch\": \"%s\",\n", 
+            buf->policy->name, 
+            (unsigned long long)(buf->pincount - buf->pinfreecount),
+            (unsigned long long)buf->pincount,
+            (buf->mapbase != NULL) ? "true" : "false",
+            buf->direct ? "true" : "false",
+            (buf->shm != NULL) ? "true" : "false",
+            (buf->aio != NULL) ? aio_engine(buf->aio) : "none");
+
+    fprintf(fp, " \"requests\": %llu, \"hits\": %llu, "
+            "\"hitlookups\": %llu, \"misslookups\": %llu,\n",
+            (unsigned long long)stat.reqs, (unsigned long long)stat.hits,
+            (unsigned long long)stat.hitlookups, 
+            (unsigned long long)stat.misslookups);
+    for (class = 0; class < BUF_PAGECLASSES; class++) 
+        fprintf(fp, " \"%s\": {\"hits\": %llu, \"misses\": %llu},\n",
+                classname[class], 
+                (unsigned long long)stat.classhits[class],
+                (unsigned long long)stat.classmisses[class]);
+    fprintf(fp, " \"evictions\": %llu, \"writebacks\": %llu, "
+            "\"prefetches\": %llu,\n",
+            (unsigned long long)stat.evictions, 
+            (unsigned long long)stat.writebacks,
+            (unsigned long long)stat.prefetches);
+
+    fprintf(fp, " \"reads\": {\"count\": %llu, \"bytes\": %llu, "
+            "\"latency_us\": ", 
+            (unsigned long long)stat.reads, 
+            (unsigned long long)stat.bytesread);
+    printjsonarray(fp, stat.readlatency, BUF_LATENCYBUCKETS);
+    fprintf(fp, "},\n \"writes\": {\"count\": %llu, \"bytes\": %llu, "
+            "\"latency_us\": ", 
+            (unsigned long long)stat.writes, 
+            (unsigned long long)stat.byteswritten);
+    printjsonarray(fp, stat.writelatency, BUF_LATENCYBUCKETS);
+    fprintf(fp, "}}\n");
+
+    return;
+}
+
+
+/*
+ * buffer_setpageclass - install the routine that tells the class 
+ *                       (BUF_INDEXPAGE, ...) of a fixed page
+ *
+ */
+void buffer_setpageclass(buffer_t *buf, int (*pageclass)(const void *))
+{
+    buf->pageclass = pageclass;
+    return;
+}
+
+
+/*
+ * sumstat - add the counters of stat to total
+ *
+ */
+void sumstat(bufstat_t *total, const bufstat_t *stat)
+{
+    int i;
+
+    total->reqs += stat->reqs;
+    total->hits += stat->hits;
+    total->hitlookups += stat->hitlookups;
+    total->misslookups += stat->misslookups;
+
+    for (i = 0; i < BUF_PAGECLASSES; i++) {
+        total->classhits[i] += stat->classhits[i];
+        total->classmisses[i] += stat->classmisses[i];
+    }
+
+    total->evictions += stat->evictions;
+    total->writebacks += stat->writebacks;
+    total->prefetches += stat->prefetches;
+
+    total->reads += stat->reads;
+    total->bytesread += stat->bytesread;
+    total->writes += stat->writes;
+    total->byteswritten += stat->byteswritten;
+    for (i = 0; i < BUF_LATENCYBUCKETS; i++) {
+        total->readlatency[i] += stat->readlatency[i];
+        total->writelatency[i] += stat->writelatency[i];
+    }
+
+    return;
+}
+
+
+/*
+ * printjsonstring - print str as a quoted JSON string
+ *
+ */
+void printjsonstring(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        if ((*str == '"') || (*str == '\\')) 
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) 
+            fprintf(fp, "\\u%04x", (unsigned char)*str);
+        else 
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+    return;
+}
+
+
+/*
+ * printjsonarray - print count counters as a JSON array
+ *
+ */
+void printjsonarray(FILE *fp, const uint64_t array[], int count)
+{
+    int i;
+
+    fputc('[', fp);
+    for (i = 0; i < count; i++) 
+        fprintf(fp, (i == 0) ? "%llu" : ", %llu", 
+                (unsigned long long)array[i]);
+    fputc(']', fp);
+    return;
+}
+
+
 /*
  * safebcbnum - return the bcb number of pageaddr
  *
  *  - check boundary (avoid segmentation fault)
  *  - check alignment (protect other page frames)
  *  - check reference count (don't touch a page that's not "fixed")
+ *  - in mmap mode, the bcb is found through the page number, in the hash
+ *    table of its shard; the caller latches the shard if other threads
+ *    share the buffer (see fixedbcb)
  *  - return the bcb num if ok , exit -1 on error
  */
 uint32_t safebcbnum(buffer_t *buf, void *pageaddr, const char *funcname)
 {
-    int64_t offset = (int64_t)((char *)pageaddr - (char *)buf->pool);
-    uint32_t bcbnum = (uint32_t)(offset / buf->pagesize);
+    int64_t offset;
+    uint32_t bcbnum;
+
+    if (buf->mapbase != NULL) {
+        bcb_t *bcb;
+
+        offset = (int64_t)((char *)pageaddr - (char *)buf->mapbase);
+        if ((offset < 0) || (offset >= buf->mapsize)) {
+            fprintf(stderr, "%s: pageaddr %p is out of of file mapping.\n",
+                    funcname, pageaddr);
+            exit(-1);
+        }
+        if (offset % buf->pagesize != 0) {
+            fprintf(stderr, "%s: pageaddr %p is not aligned properly.\n",
+                    funcname, pageaddr);
+            exit(-1);
+        }
+        bcb = lookupbcb(buf, (pagenum_t)(offset / buf->pagesize));
+        if ((bcb == NULL) || (REFGET(bcb) == 0)) {
+            fprintf(stderr, "%s: pageaddr %p is not allocated.\n",
+                    funcname, pageaddr);
+            exit(-1);
+        }
+        return (uint32_t)(bcb - buf->bcbtable);
+    }
+
+    offset = (int64_t)((char *)pageaddr - (char *)buf->pool);
+    bcbnum = (uint32_t)(offset / buf->pagesize);
+
+    if (((offset < 0) || (bcbnum >= buf->framecount)) && 
+        (buf->pinpool != NULL)) {
+        /* maybe a frame of the pinned region */
+        int64_t pinoffset = (int64_t)((char *)pageaddr - (char *)buf->pinpool);
+
+        if ((pinoffset >= 0) && 
+            (pinoffset / buf->pagesize < (int64_t)buf->pincount)) {
+            offset = pinoffset;
+            bcbnum = (uint32_t)(offset / buf->pagesize);
+            if ((int64_t)bcbnum * buf->pagesize != offset) {
+                fprintf(stderr, "%s: pageaddr %p is not aligned properly.\n",
+                        funcname, pageaddr);
+                exit(-1);
+            }
+            bcbnum += (uint32_t)buf->framecount;
+            if (REFGET(&buf->bcbtable[bcbnum]) == 0) {
+                fprintf(stderr, "%s: pageaddr %p is not allocated.\n",
+                        funcname, pageaddr);
+                exit(-1);
+            }
+            return bcbnum;
+        }
+    }
 
     if ((offset < 0) || (bcbnum >= buf->framecount)) {
         fprintf(stderr, "%s: pageaddr %p is out of of buffer pool.\n",
@@ -604,7 +2951,7 @@ uint32_t safebcbnum(buffer_t *buf, void *pageaddr, const char *funcname)
         exit(-1);
     }
     
-    if (buf->bcbtable[bcbnum].refcount == 0) {
+    if (REFGET(&buf->bcbtable[bcbnum]) == 0) {
         fprintf(stderr, "%s: pageaddr %p is not allocated.\n",
                 funcname, pageaddr);
         exit(-1);
@@ -612,3 +2959,87 @@ uint32_t safebcbnum(buffer_t *buf, void *pageaddr, const char *funcname)
 
     return bcbnum;
 }
+
+
+/*
+ * reapprefetch - wait for the completion of one prefetch read
+ *
+ * - a page read in full is admitted by the replacement policy and put at
+ *   the end of the ready list; otherwise its frame returns to the free 
+ *   list
+ * - return 0 if OK, -1 if no read is in flight or on error
+ *
+ */
+int reapprefetch(buffer_t *buf)
+{
+    void *tag;
+    ssize_t res;
+    bcb_t *bcb;
+    bufshard_t *shard;
+
+    if (aio_wait(buf->aio, &tag, &res) != 0) 
+        return -1;
+
+    bcb = (bcb_t *)tag;
+    bcb->loading = 0;
+    shard = pageshard(buf, bcb->pagenum);
+
+    if (res == (ssize_t)buf->pagesize) {
+        shard->stat.prefetches++;
+        shard->stat.bytesread += (uint64_t)res;
+        buf->policy->admit(buf, shard, bcb);
+        dlink_insert(buf->readylist.prev, &bcb->readyln);
+    } else {
+        dlink_delete(&bcb->hashln);
+        dlink_insert(&shard->freebcblist, &bcb->hashln);
+        shard->freecount++;
+    }
+
+    return 0;
+}
+
+
+/*
+ * fixedbcb - return the bcb of a page fixed by the caller
+ *
+ * - with O_CONCURRENT, the hash chains a mapped page is looked up in may
+ *   be relinked by other threads, so the lookup takes the shard latch
+ *
+ */
+bcb_t *fixedbcb(buffer_t *buf, void *pageaddr, const char *funcname)
+{
+    if ((buf->flags & O_CONCURRENT) != 0) 
+        return concurrentbcb(buf, pageaddr, funcname);
+
+    return &buf->bcbtable[safebcbnum(buf, pageaddr, funcname)];
+}
+
+
+/*
+ * concurrentbcb - return the bcb of a page fixed by the calling thread
+ *
+ * - pool frames map to their bcb by address alone; a mapped page has to
+ *   be looked up in its shard's hash table, under the shard latch
+ *
+ */
+bcb_t *concurrentbcb(buffer_t *buf, void *pageaddr, const char *funcname)
+{
+    int64_t offset;
+    bufshard_t *shard;
+    uint32_t bcbnum;
+
+    if (buf->mapbase == NULL) 
+        return &buf->bcbtable[safebcbnum(buf, pageaddr, funcname)];
+
+    offset = (int64_t)((char *)pageaddr - (char *)buf->mapbase);
+    if ((offset < 0) || (offset >= buf->mapsize)) 
+        /* let safebcbnum report it */
+        return &buf->bcbtable[safebcbnum(buf, pageaddr, funcname)];
+
+    shard = pageshard(buf, (pagenum_t)(offset / buf->pagesize));
+    lockshard(buf, shard);
+    bcbnum = safebcbnum(buf, pageaddr, funcname);
+    pthread_mutex_unlock(&shard->latch);
+
+    return &buf->bcbtable[bcbnum];
+}
@@ -1,5 +1,6 @@
 /**
- * buffer.h: single-threaded buffer manager implementing LRU replacement policy
+ * buffer.h: buffer manager implementing LRU replacement policy; the pool
+ *           may be shared by threads through the concurrent entry points
  *
  * Copyright (c) 2003 Tiankai Tu  
  * All rights reserved.  May not be used, modified, or copied 
@@ -22,6 +23,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifdef ALPHA
 #include "etree_inttypes.h"
@@ -31,9 +33,74 @@
 
 
 #include "dlink.h"
+#include "aio.h"
+#include "bufstat.h"
 
 #define O_INCORE 020000000000
 
+/*
+ * O_MMAP - serve pages of an O_RDONLY file straight out of a shared,
+ *          read-only memory mapping instead of copying them into the pool
+ *
+ */
+#ifndef O_MMAP
+#define O_MMAP 010000000000
+#endif
+
+/*
+ * O_CONCURRENT - partition the pool into hash-sharded segments, each with
+ *                its own latch, so that threads calling the concurrent 
+ *                entry points rarely contend; buffer_fix and 
+ *                buffer_emptyfix then take the latch too, so that one 
+ *                thread may modify pages while the others read them 
+ *                (see buffer_latch)
+ *
+ */
+#ifndef O_CONCURRENT
+#define O_CONCURRENT 04000000000
+#endif
+
+/*
+ * O_2Q - replace pages with the scan-resistant 2Q policy instead of LRU:
+ *        a page referenced once waits in a small FIFO and only enters the
+ *        LRU list if it is referenced again after leaving the FIFO, so a
+ *        sequential scan cannot flush the pages that are used repeatedly
+ *
+ */
+#ifndef O_2Q
+#define O_2Q 02000000000
+#endif
+
+/*
+ * O_PININDEX - let the client pin pages (the btree pins its index pages)
+ *              in a separate region of frames that are never evicted
+ *
+ */
+#ifndef O_PININDEX
+#define O_PININDEX 01000000000
+#endif
+
+/*
+ * O_SHMPOOL - or'd with O_RDONLY, share the pool with the other processes
+ *             reading the same file: frames, bcb's and hash tables live in
+ *             a POSIX shared memory segment, latched by process-shared 
+ *             mutexes, so one process warms the pages for all of them
+ *
+ */
+#ifndef O_SHMPOOL
+#define O_SHMPOOL 0400000000
+#endif
+
+/*
+ * O_DIRECTIO - read and write pages with O_DIRECT, around the kernel page
+ *              cache, when the page size is a multiple of 4096 and the 
+ *              file system allows it; frames are aligned to match
+ *
+ */
+#ifndef O_DIRECTIO
+#define O_DIRECTIO 0200000000
+#endif
+
 #ifndef PAGENUM_T
 typedef off_t pagenum_t;
 #define PAGENUM_T
@@ -48,60 +115,195 @@ typedef struct bcb_t {
     void *pageaddr;
     dlink_t lruln; 
     dlink_t hashln; /* overload hashln for free list use */
-    uint32_t refcount;
+    volatile uint32_t refcount; /* updated atomically */
     char modified;
+    char queue;     /* which list of the replacement policy holds the bcb */
+    char pinned;    /* frame of the pinned region, never a victim */
+    char loading;   /* prefetch read in flight; hashed but on no list */
+    dlink_t readyln;/* on the ready list while a prefetched page waits to
+                       be delivered by buffer_fixnext; next is NULL if not */
+
+    /* runtime back link maintained by the client while the page is fixed;
+       kept here so that the page image itself is never written */
+    void *link;
+    int32_t linkentry;
+
+    /* page latch of the threads sharing the buffer (see buffer_latch) */
+    pthread_rwlock_t latch;
 } bcb_t;
 
 
+struct buffer_t;
+struct bufshard_t;
+
+/*
+ * bufpolicy_t - a page replacement policy
+ *
+ * - init/destroy set up and release the per-shard state of the policy 
+ *   (shard->policydata); either may be NULL
+ * - admit places a page that has just been brought into the shard on the
+ *   policy's lists, touch records a hit on a cached page, forget takes a
+ *   cached page off the lists for good
+ * - victim picks an unfixed page to evict and takes it off the policy's
+ *   lists; NULL if every page of the shard is fixed
+ * - all of them are called under the shard latch
+ *
+ */
+typedef struct bufpolicy_t {
+    const char *name;
+    int (*init)(struct buffer_t *buf, struct bufshard_t *shard);
+    void (*destroy)(struct buffer_t *buf, struct bufshard_t *shard);
+    void (*admit)(struct buffer_t *buf, struct bufshard_t *shard, bcb_t *bcb);
+    void (*touch)(struct buffer_t *buf, struct bufshard_t *shard, bcb_t *bcb);
+    void (*forget)(struct buffer_t *buf, struct bufshard_t *shard, bcb_t *bcb);
+    bcb_t *(*victim)(struct buffer_t *buf, struct bufshard_t *shard);
+} bufpolicy_t;
+
+
+/*
+ * bufshard_t - a segment of the buffer pool
+ *
+ * - page pagenum belongs to shard (pagenum % shardcount) and only ever 
+ *   occupies one of the shard's frames
+ * - the latch protects the free list, the replacement lists, the hash 
+ *   table and the statistics of the shard; it is only taken by the 
+ *   concurrent entry points
+ * - bcblru is the LRU list of the replacement policy; whatever else the 
+ *   policy needs hangs off policydata
+ *
+ */
+typedef struct bufshard_t {
+    pthread_mutex_t latch;
+
+    size_t framecount;
+    size_t freecount;
+
+    dlink_t freebcblist;
+    
+    dlink_t bcblru;
+    void *policydata;
+
+    uint32_t bcbhtsize;
+    dlink_t *bcbhashtable;
+
+    bufstat_t stat;
+
+} bufshard_t;
+
+
 /*
  * buffer_t -buffer pool manager that contains the following information
  *
- * - the file name being cached and the file desciptor
+ * - the file name being cached and the file desciptor, and whether the
+ *   descriptor does O_DIRECT page I/O; the bytes that are not whole 
+ *   pages (metadata, page-location table) are then read through a plain
+ *   descriptor of their own, the same descriptor otherwise
  * - the pointer to the buffer pool, the bcb for each frame
- *   and the number of frames allocated
- * - the current free available frames in the buffer pool
- * - the LRU links list to find victim (cached) pages 
- * - the hash tabel to locate a cached page 
+ *   and the number of frames allocated; the pool is anonymous memory 
+ *   (backed by huge pages where possible) mapped on first touch
+ * - the shards the frames are partitioned into; each keeps its own free 
+ *   frames, LRU list and hash table (a single shard unless O_CONCURRENT)
+ * - the replacement policy, LRU unless O_2Q
+ * - the pinned region: pincount extra frames (bcbtable[framecount...]) 
+ *   whose pages are hashed in their shards but never evicted
+ * - the asynchronous reader of prefetched pages (created on first use) 
+ *   and the list of prefetched pages not delivered by buffer_fixnext yet
+ * - the shared memory segment holding the pool (and its length) if the 
+ *   pool is shared by processes; the shards, bcb table and frames then 
+ *   point into it
+ * - the page-location table of a compressed page file (NULL if the file
+ *   is not compressed): the offsets of the extents of pages zrawpages .. 
+ *   zpagecount - 1, and where the bytes past the last page are kept
+ * - the routine, installed by the client, that tells the class of a 
+ *   fixed page for the statistics (all pages are BUF_OTHERPAGE if NULL)
+ * - the base and length of the file mapping if pages are served by mmap;
+ *   bcb's then describe mapped pages and no pool is allocated
  *
  */
 typedef struct buffer_t {
     char *filename;
     int fd;
+    int direct;
+    int plainfd;
     int flags;
 
     void *pool;
+    size_t poolmapsize;
+    void *mapbase;
+    off_t mapsize;
     bcb_t *bcbtable;
     size_t framecount;
     uint32_t pagesize;
-    size_t freecount;
 
-    dlink_t freebcblist;
-    
-    dlink_t bcblru;
+    uint32_t shardcount;
+    bufshard_t *shards;
+    const bufpolicy_t *policy;
 
-    uint32_t bcbhtsize;
-    dlink_t *bcbhashtable;
+    void *pinpool;
+    size_t pinmapsize;
+    size_t pincount;
+    size_t pinfreecount;
+    dlink_t pinfreelist;
+
+    aio_t *aio;
+    dlink_t readylist;
+
+    void *shm;
+    size_t shmsize;
 
-    uint64_t reqs, hits, hitlookups, misslookups;
+    uint64_t *zextents;
+    pagenum_t zrawpages, zpagecount;
+    off_t zsuffixoffset, zsuffixsize;
+
+    int (*pageclass)(const void *pageaddr);
 
 } buffer_t;
 
     
 buffer_t *buffer_init(const char *filename, int flags, size_t framecount, 
-                      uint32_t pagesize);
+                      size_t pincount, uint32_t pagesize);
 int buffer_destroy(buffer_t *buf);
 
 void *buffer_emptyfix(buffer_t *buf, pagenum_t pagenum);
 void *buffer_fix(buffer_t *buf, pagenum_t pagenum);
+int buffer_readrun(buffer_t *buf, pagenum_t pagenum, int count);
+int buffer_readahead(buffer_t *buf, pagenum_t pagenum, int count);
+void *buffer_pin(buffer_t *buf, void *pageaddr);
+
+int buffer_prefetch(buffer_t *buf, const pagenum_t pagenums[], int count);
+void *buffer_fixnext(buffer_t *buf, pagenum_t *pagenumptr);
 
 int buffer_ref(buffer_t *buf, void *pageaddr);
 int buffer_unref(buffer_t *buf, void *pageaddr);
+
+/*
+ * concurrent entry points: may be called by any number of threads 
+ * sharing one buffer; the single-threaded routines above must not be 
+ * mixed with them while other threads are active, except buffer_fix, 
+ * buffer_emptyfix, buffer_ref and buffer_unref with O_CONCURRENT
+ *
+ */
+void *buffer_concurrentfix(buffer_t *buf, pagenum_t pagenum);
+int buffer_concurrentref(buffer_t *buf, void *pageaddr);
+int buffer_concurrentunref(buffer_t *buf, void *pageaddr);
+
+void buffer_latch(buffer_t *buf, void *pageaddr, int exclusive);
+void buffer_unlatch(buffer_t *buf, void *pageaddr);
+
 void buffer_mark(buffer_t *buf, void *pageaddr);
 pagenum_t buffer_pagenum(buffer_t *buf, void *pageaddr);
+bcb_t *buffer_getbcb(buffer_t *buf, const void *pageaddr);
 
 int buffer_isdirty(buffer_t *buf, void *pageaddr);
 
+int buffer_readbytes(buffer_t *buf, void *dest, size_t size, off_t offset);
+int buffer_compress(buffer_t *buf, const char *destpath, pagenum_t rawpages,
+                    pagenum_t pagecount);
+
 void buffer_showusage(buffer_t *buf, FILE *fp);
+void buffer_getstat(buffer_t *buf, bufstat_t *stat);
+void buffer_printstat(buffer_t *buf, FILE *fp);
+void buffer_setpageclass(buffer_t *buf, int (*pageclass)(const void *));
 
 #endif /* BUFFER_H */
 
@@ -0,0 +1,73 @@
+/*
+ * bufstat.h - buffer pool and I/O statistics
+ *
+ * Copyright (c) 2003 Tiankai Tu
+ * All rights reserved.  May not be used, modified, or copied
+ * without permission.
+ *
+ * Tiankai Tu
+ * Computer Science Department
+ * Carnegie Mellon University
+ * 5000 Forbes Avenue
+ * Pittsburgh, PA 15213
+ * tutk@cs.cmu.edu
+ *
+ */
+
+#ifndef BUFSTAT_H
+#define BUFSTAT_H
+
+#ifdef ALPHA
+#include "etree_inttypes.h"
+#else
+#include <inttypes.h>
+#endif
+
+/*
+ * page classes: the client of the buffer tells what a page holds; pages
+ * it does not classify are counted as BUF_OTHERPAGE
+ *
+ */
+#define BUF_INDEXPAGE    0
+#define BUF_LEAFPAGE     1
+#define BUF_OTHERPAGE    2
+#define BUF_PAGECLASSES  3
+
+/*
+ * BUF_LATENCYBUCKETS - an I/O that takes t microseconds is counted in
+ * bucket floor(log2(t)), in bucket 0 if t < 2 and in the last bucket if
+ * it takes longer than that
+ *
+ */
+#define BUF_LATENCYBUCKETS 24
+
+/*
+ * bufstat_t - usage statistics of a buffer
+ *
+ * - reqs and hits count the fix requests and those served from the pool
+ *   (or the mapping); the hash chain lengths walked are in hitlookups
+ *   and misslookups
+ * - classhits and classmisses split the fix requests by page class
+ * - evictions counts the pages replaced to make room, writebacks the
+ *   dirty pages written to the file (on eviction or at close)
+ * - prefetches counts the pages brought in by buffer_prefetch
+ * - reads and writes count the read and write system calls, with the
+ *   bytes transferred and a latency histogram for each direction;
+ *   asynchronous prefetch reads count bytes only
+ *
+ */
+typedef struct bufstat_t {
+    uint64_t reqs, hits, hitlookups, misslookups;
+
+    uint64_t classhits[BUF_PAGECLASSES];
+    uint64_t classmisses[BUF_PAGECLASSES];
+
+    uint64_t evictions, writebacks, prefetches;
+
+    uint64_t reads, bytesread;
+    uint64_t writes, byteswritten;
+    uint64_t readlatency[BUF_LATENCYBUCKETS];
+    uint64_t writelatency[BUF_LATENCYBUCKETS];
+} bufstat_t;
+
+#endif /* BUFSTAT_H */
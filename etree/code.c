@@ -29,6 +29,10 @@ static const int theMortonBytes = (ETREE_MAXLEVEL + 1) / 8 * 3;
 static const int theMaxOffsetP1 = (ETREE_MAXLEVEL + 1) * 3;
 static endian_t  theEndianness  = unknown_endianness;
 
+static int comparekey13(const void *key1, const void *key2, int size);
+static int comparekey17(const void *key1, const void *key2, int size);
+static uint64_t load64(const void *ptr);
+
 static void setprefix(etree_t *ep, unsigned int time, void *toptr);
 static void getprefix(etree_t *ep, void *fromptr, unsigned int *ptimestep);
 
@@ -118,6 +122,43 @@ int code_key2addr(etree_t *ep, void *key, etree_addr_t *paddr)
     return 0;
 }
 
+/*
+ * code_keys2addrs - convert count locational codes stored back to back in 
+ *                   keys to octant addresses
+ *
+ * - same as code_key2addr on each key, with the checks of the etree 
+ *   hoisted out of the loop
+ * - return 0 if OK, -1 if a level is out of bound
+ *
+ */
+int code_keys2addrs(etree_t *ep, int count, const void *keys, 
+                    etree_addr_t addrs[])
+{
+    const unsigned char *key = (const unsigned char *)keys;
+    int index, keysize = ep->keysize, fourd = (ep->dimensions == 4);
+
+    for (index = 0; index < count; index++) {
+        unsigned char LSB = *key;
+        int level = LSB & 0x7F;
+
+        if (level >= theMaxLevelP1) 
+            return -1;
+
+        addrs[index].level = level;
+        addrs[index].type = (LSB & 0x80) ? ETREE_LEAF : ETREE_INTERIOR;
+        code_morton2coord(theMaxLevelP1, (char *)key + 1, 
+                          &addrs[index].x, &addrs[index].y, &addrs[index].z);
+
+        if (fourd) 
+            getprefix(ep, (char *)key + theTimeStepOffset, &addrs[index].t);
+
+        key += keysize;
+    }
+
+    return 0;
+}
+
+
 /**
  * code_setlevel 
  *
@@ -348,6 +389,93 @@ int code_comparekey(const void *key1, const void *key2, int size)
 }
 
 
+/*
+ * code_getcomparekey - pick the key comparison routine once, at open
+ *
+ * - the 13-byte keys of 3D etrees and the 17-byte keys of 4D ones are 
+ *   compared with 64-bit loads on little-endian hosts, where that gives 
+ *   the order of code_comparekey
+ * - return code_comparekey for other sizes and hosts
+ *
+ */
+btree_compare_t *code_getcomparekey(int size)
+{
+    if (xplatform_testendian() != little) 
+        return code_comparekey;
+
+    switch (size) {
+    case 13: return comparekey13;
+    case 17: return comparekey17;
+    default: return code_comparekey;
+    }
+}
+
+
+/*
+ * comparekey13 - code_comparekey for 13-byte keys on little-endian hosts
+ *
+ * - bytes 5..12 hold the most significant Morton bits; bytes 0..7, with
+ *   bytes 5..7 and the type bit of byte 0 masked out, hold the rest
+ *
+ */
+int comparekey13(const void *key1, const void *key2, int size)
+{
+    uint64_t v1, v2;
+
+    v1 = load64((const char *)key1 + 5);
+    v2 = load64((const char *)key2 + 5);
+    if (v1 != v2) 
+        return (v1 > v2) ? 1 : -1;
+
+    v1 = load64(key1) & 0xFFFFFFFF7FULL;
+    v2 = load64(key2) & 0xFFFFFFFF7FULL;
+    if (v1 != v2) 
+        return (v1 > v2) ? 1 : -1;
+
+    return 0;
+}
+
+
+/*
+ * comparekey17 - code_comparekey for 17-byte keys on little-endian hosts
+ *
+ */
+int comparekey17(const void *key1, const void *key2, int size)
+{
+    uint64_t v1, v2;
+
+    v1 = load64((const char *)key1 + 9);
+    v2 = load64((const char *)key2 + 9);
+    if (v1 != v2) 
+        return (v1 > v2) ? 1 : -1;
+
+    v1 = load64((const char *)key1 + 1);
+    v2 = load64((const char *)key2 + 1);
+    if (v1 != v2) 
+        return (v1 > v2) ? 1 : -1;
+
+    v1 = *(const unsigned char *)key1 & 0x7F;
+    v2 = *(const unsigned char *)key2 & 0x7F;
+    if (v1 != v2) 
+        return (v1 > v2) ? 1 : -1;
+
+    return 0;
+}
+
+
+/*
+ * load64 - load 8 (possibly unaligned) bytes in host order
+ *
+ */
+uint64_t load64(const void *ptr)
+{
+    uint64_t word;
+
+    memcpy(&word, ptr, 8);
+    return word;
+}
+
+
 static void code_coord2morton_port(int bits, etree_tick_t x, etree_tick_t y, 
 				   etree_tick_t	z, void* morton);
 
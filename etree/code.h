@@ -28,6 +28,8 @@
 
 int code_addr2key(etree_t *ep, etree_addr_t addr, void *key);
 int code_key2addr(etree_t *ep, void *key, etree_addr_t *paddr);
+int code_keys2addrs(etree_t *ep, int count, const void *keys, 
+                    etree_addr_t addrs[]);
 
 int code_isancestorkey(const void *ancestorkey, const void *childkey);
 int code_derivechildkey(const void *key, void *childkey, int branch);
@@ -36,6 +38,7 @@ void code_setbranch(void *morton, int level, int branch);
 void code_setlevel(void *key, int level, etree_type_t type);
 
 int code_comparekey(const void *key1, const void *key2, int size);
+btree_compare_t *code_getcomparekey(int size);
 
 void code_morton2coord(int bits, void *morton, etree_tick_t *px, 
                        etree_tick_t *py, etree_tick_t *pz);
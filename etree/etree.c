@@ -41,6 +41,9 @@
 #define PATH_MAX 2048
 #endif
 
+/* the locational key of a 4D etree, the largest there is */
+#define MAXKEYSIZE (4 * sizeof(etree_tick_t) + 1)
+
 const static 
 int HEADERSIZE = 1 + 4 * 4 + 2 * sizeof(BIGINT) * (ETREE_MAXLEVEL + 1);
 
@@ -77,9 +80,12 @@ const static char msg_CREATE_SCHEMA[] = "Attempt to register a schema failed";
 /* const static char msg_CONTAIN_INTERIOR[] = "Contain interior nodes"; */
 const static char msg_TOO_BIG[] = "Domain larger than the etree address space";
 const static char msg_NOT_ALIGNED[] = "Left-lower corner not aligned";
+const static char msg_DISALLOW_FORMAT[] = "The format must be set after an etree is newly created or truncated and before any insertion/appending operation";
+const static char msg_UNKNOWN_FORMAT[] = "Unknown etree page format";
 
 /* Statistics routine */
 static void updatestat(etree_t * ep, etree_addr_t addr, int mode);
+static void uncount(void *arg, const void *key);
 int writemeta(etree_t *ep, off_t endoffset);
 
 static int writeheader(etree_t *ep);
@@ -87,6 +93,21 @@ static int readheader(etree_t *ep);
 static int storeappmeta(etree_t *ep, off_t endoffset);
 static int loadappmeta(etree_t *ep);
 
+/* Bulk build stream adapter */
+typedef struct buildstream_t {
+    etree_t *ep;             /* the etree being built                 */
+    etree_stream_t *stream;  /* the application's octant stream       */
+    void *arg;               /* ... and its argument                  */
+    void *key;               /* locational key of the last octant     */
+    etree_error_t error;     /* why the stream stopped, if it failed  */
+
+    uint64_t count;          /* octants drained from the stream       */
+    BIGINT leafcount[ETREE_MAXLEVEL + 1];
+    BIGINT indexcount[ETREE_MAXLEVEL + 1];
+} buildstream_t;
+
+static int buildstream(void *arg, const void **keyptr, const void **valueptr);
+
 /*
  * etree_straddr - Format a string representation of an octant address
  */
@@ -214,6 +235,12 @@ const char * etree_strerror(etree_error_t error)
     case (ET_NOT_ALIGNED):
         return msg_NOT_ALIGNED;
 
+    case (ET_DISALLOW_FORMAT):
+        return msg_DISALLOW_FORMAT;
+
+    case (ET_UNKNOWN_FORMAT):
+        return msg_UNKNOWN_FORMAT;
+
     default:
         return msg_UNKNOWN;
     }
@@ -361,7 +388,8 @@ etree_t *etree_open(const char *pathname, int32_t flags, int32_t bufsize,
     pagesize = getpagesize();
     bufsize = (bufsize <= 0) ? DEFAULTBUFSIZE : bufsize;
     ep->bp = btree_open(fullpathname, flags, ep->keysize, "byte string",
-                        payloadsize, pagesize, bufsize, code_comparekey,
+                        payloadsize, pagesize, bufsize, 
+                        code_getcomparekey(ep->keysize),
                         HEADERSIZE);
 
     if (ep->bp == NULL) {
@@ -416,6 +444,27 @@ int etree_registerschema(etree_t *ep, const char *defstring)
 }
 
 
+/*
+ * etree_setformat - select the page format of the underlying Btree
+ *
+ * - return 0 if OK, -1 on error
+ *
+ */
+int etree_setformat(etree_t *ep, uint32_t format)
+{
+    switch (btree_setformat(ep->bp, format)) {
+    case(-17) :
+        ep->error = ET_DISALLOW_FORMAT;
+        return -1;
+    case(-18) :
+        ep->error = ET_UNKNOWN_FORMAT;
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+
 /* 
  * etree_getschema - return the original ASCII schema definition string
  *
@@ -558,7 +607,8 @@ int etree_search(etree_t *ep, etree_addr_t addr, etree_addr_t *hitaddr,
     etree_addr_t probeaddr, leafaddr;
     int res;
 
-    ep->searchcount++;
+    /* concurrent readers count their searches here too */
+    __sync_fetch_and_add(&ep->searchcount, 1);
 
     leafaddr = addr;
     leafaddr.type = ETREE_LEAF;
@@ -607,6 +657,57 @@ int etree_search(etree_t *ep, etree_addr_t addr, etree_addr_t *hitaddr,
 
 
 
+/*
+ * etree_concurrentsearch - etree_search for the reader threads of an 
+ *                          etree opened with O_CONCURRENT
+ *
+ * - the keys are kept on the stack and the error is returned in 
+ *   *errorptr: the scratch keys and the error of the handle belong to 
+ *   the writer thread
+ * - Return 0 if found, -1 otherwise
+ *
+ */
+int etree_concurrentsearch(etree_t *ep, etree_addr_t addr, 
+                           etree_addr_t *hitaddr, const char *fieldname,
+                           void *payload, etree_error_t *errorptr)
+{
+    etree_addr_t probeaddr, leafaddr;
+    char key[MAXKEYSIZE], hitkey[MAXKEYSIZE];
+    etree_error_t error = ET_NOERROR;
+    int res;
+
+    __sync_fetch_and_add(&ep->searchcount, 1);
+
+    leafaddr = addr;
+    leafaddr.type = ETREE_LEAF;
+
+    if (code_addr2key(ep, leafaddr, key) != 0) 
+        error = ET_LEVEL_OOB;
+    else if ((res = btree_concurrentsearch(ep->bp, key, hitkey, fieldname, 
+                                           payload)) != 0) {
+        switch (res) {
+        case(-2) : error = ET_EMPTY_TREE; break;
+        case(-3) : error = ET_NOT_FOUND; break;
+        case(-13) : error = ET_NO_SCHEMA; break;
+        case(-14) : error = ET_NO_FIELD; break;
+        default : error = ET_IO_ERROR; break;
+        }
+    } else if ((ep->dimensions == 3) ? !code_isancestorkey(hitkey, key) : 
+               (memcmp(hitkey, key, ep->keysize) != 0)) 
+        error = ET_NOT_FOUND;
+    else if (code_key2addr(ep, hitkey, &probeaddr) != 0) 
+        error = ET_LEVEL_OOB2;
+    else if (hitaddr != NULL) 
+        *hitaddr = probeaddr;
+
+    if (errorptr != NULL) 
+        *errorptr = error;
+
+    return (error == ET_NOERROR) ? 0 : -1;
+}
+
+
+
 /*
  * etree_findneighbor - Search for a neighbor in the etree database
  *
@@ -934,6 +1035,78 @@ int etree_delete(etree_t *ep, etree_addr_t addr)
 }
 
 
+/*
+ * etree_deleterange - Delete the octants from start up to but excluding 
+ *                     stop
+ *
+ * - NULL start/stop leave the range open at that end
+ * - the B-tree pages emptied are reused by later insertions
+ * - Lazy method: the pages at either end of the range are not merged
+ * - Return 0 if OK, -1 otherwise
+ * - ERRORS:
+ *
+ *    ET_LEVEL_OOB
+ *    ET_OP_CONFLICT
+ *    ET_EMPTY_TREE
+ *    ET_IO_ERROR
+ *    ET_NOT_WRITABLE
+ *
+ */
+int etree_deleterange(etree_t *ep, const etree_addr_t *start, 
+                      const etree_addr_t *stop)
+{
+    int res;
+
+    if (((ep->flags & O_RDWR) == 0) &&
+        ((ep->flags & O_WRONLY) == 0)) {
+        ep->error = ET_NOT_WRITABLE;
+        return -1;
+    }
+
+    if (((start != NULL) && (code_addr2key(ep, *start, ep->key) != 0)) ||
+        ((stop != NULL) && (code_addr2key(ep, *stop, ep->hitkey) != 0))) {
+        ep->error = ET_LEVEL_OOB;
+        return -1;
+    }
+
+    /* the statistics need the address of each octant deleted */
+    res = btree_deleterange(ep->bp, (start != NULL) ? ep->key : NULL,
+                            (stop != NULL) ? ep->hitkey : NULL, uncount, ep);
+
+    if (res != 0) {
+        switch(res){
+        case(-1): ep->error = ET_OP_CONFLICT; break;
+        case(-2): ep->error = ET_EMPTY_TREE; break;
+        case(-9): ep->error = ET_IO_ERROR; break;
+        }
+        return -1;
+    }
+
+    ep->error = ET_NOERROR;
+    return 0;
+}
+
+
+/*
+ * uncount - count an octant removed by etree_deleterange out of the 
+ *           statistics
+ *
+ */
+void uncount(void *arg, const void *key)
+{
+    etree_t *ep = (etree_t *)arg;
+    etree_addr_t addr;
+
+    if (code_key2addr(ep, (void *)key, &addr) != 0) 
+        return;
+
+    updatestat(ep, addr, -1);
+    ep->deletecount++;
+
+    return;
+}
+
+
 /*
  * etree_update - Modify the content/payload of an octant in the etree
  *
@@ -1019,6 +1192,106 @@ int etree_initcursor(etree_t *ep, etree_addr_t addr)
 }
 
 
+/*
+ * etree_initrangecursor - Set a cursor on the octants from start up to 
+ *                         but excluding stop
+ *
+ * - NULL start/stop leave the range open at that end
+ * - return 0 if OK, -1 otherwise
+ * - ERROR:
+ *
+ *    ET_LEVEL_OOB
+ *    ET_EMPTY_TREE
+ *    ET_END_OF_TREE
+ *    ET_OP_CONFLICT
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ *
+ */
+int etree_initrangecursor(etree_t *ep, const etree_addr_t *start, 
+                          const etree_addr_t *stop)
+{
+    int res;
+
+    if (((start != NULL) && (code_addr2key(ep, *start, ep->key) != 0)) ||
+        ((stop != NULL) && (code_addr2key(ep, *stop, ep->hitkey) != 0))) {
+        ep->error = ET_LEVEL_OOB;
+        return -1;
+    }
+
+    res = btree_initrangecursor(ep->bp, (start != NULL) ? ep->key : NULL,
+                                (stop != NULL) ? ep->hitkey : NULL);
+
+    if (res != 0) {
+        switch (res) {
+        case(1) :  ep->error = ET_END_OF_TREE; break;
+        case(-1) :  ep->error = ET_OP_CONFLICT; break;
+        case(-2) :  ep->error = ET_EMPTY_TREE; break;
+        case(-9) :  ep->error = ET_IO_ERROR; break;
+        case(-16) :  ep->error = ET_NO_MEMORY; break;
+        }
+        return -1;
+    }
+
+    ep->error = ET_NOERROR;
+    return 0;
+}
+
+
+/*
+ * etree_partition - Split the etree into at most nparts ranges of about 
+ *                   the same number of octants
+ *
+ * - the range boundaries come from the separator keys of the root or 
+ *   second-level index pages of the B-tree
+ * - store the first octant of ranges 1 .. n - 1 in bounds
+ * - return the number of ranges n, -1 otherwise
+ * - ERROR:
+ *
+ *    ET_EMPTY_TREE
+ *    ET_LEVEL_OOB2
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ *
+ */
+int etree_partition(etree_t *ep, int nparts, etree_addr_t bounds[])
+{
+    char *keys;
+    int res, part;
+
+    if ((keys = malloc((nparts > 1 ? nparts - 1 : 1) * ep->keysize)) 
+        == NULL) {
+        ep->error = ET_NO_MEMORY;
+        return -1;
+    }
+
+    res = btree_partition(ep->bp, nparts, keys);
+
+    if (res < 0) {
+        switch (res) {
+        case(-2) :  ep->error = ET_EMPTY_TREE; break;
+        case(-9) :  ep->error = ET_IO_ERROR; break;
+        case(-16) :  ep->error = ET_NO_MEMORY; break;
+        }
+        free(keys);
+        return -1;
+    }
+
+    for (part = 0; part < res - 1; part++) {
+        if (code_key2addr(ep, keys + part * ep->keysize, &bounds[part]) 
+            != 0) {
+            free(keys);
+            ep->error = ET_LEVEL_OOB2;
+            return -1;
+        }
+    }
+    free(keys);
+
+    ep->error = ET_NOERROR;
+    return res;
+}
+
+
 /*
  * etree_getcursor - Obtain the content of the octant currently pointed to
  *                   by the cursor
@@ -1095,6 +1368,71 @@ int etree_advcursor(etree_t *ep)
 }
 
 
+/*
+ * etree_getcursorbatch - Obtain the octants from the cursor to the end of
+ *                        the cursor page, at most max of them
+ *
+ * - retrieve the keys and payloads from B-tree in one call
+ * - convert the locational keys in one pass
+ * - return the number of octants, 0 at the end of the etree, -1 otherwise
+ * - ERROR:
+ *
+ *    ET_NO_CURSOR
+ *    ET_END_OF_TREE
+ *    ET_LEVEL_OOB2
+ *    ET_NO_SCHEMA
+ *    ET_NO_FIELD
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ *
+ */
+int etree_getcursorbatch(etree_t *ep, int max, etree_addr_t addrs[], 
+                         const char *fieldname, void *payloads[])
+{
+    void *keys;
+    int res;
+
+    if (max <= 0) {
+        ep->error = ET_NOERROR;
+        return 0;
+    }
+
+    /* a batch never extends past the cursor page */
+    if (max > btree_leafcapacity(ep->bp)) 
+        max = btree_leafcapacity(ep->bp);
+
+    if ((keys = malloc(max * ep->keysize)) == NULL) {
+        ep->error = ET_NO_MEMORY;
+        return -1;
+    }
+
+    res = btree_getcursorbatch(ep->bp, max, keys, fieldname, payloads);
+
+    if (res <= 0) {
+        switch (res) {
+        case(0) : ep->error = ET_END_OF_TREE; break;
+        case(-5) : ep->error = ET_NO_CURSOR; break;
+        case(-9) : ep->error = ET_IO_ERROR; break;
+        case(-13) : ep->error = ET_NO_SCHEMA; break;
+        case(-14) : ep->error = ET_NO_FIELD; break;
+        }
+        free(keys);
+        return (res == 0) ? 0 : -1;
+    }
+
+    if (code_keys2addrs(ep, res, keys, addrs) != 0) {
+        free(keys);
+        ep->error = ET_LEVEL_OOB2;
+        return -1;
+    }
+    free(keys);
+
+    ep->error = ET_NOERROR;
+    ep->cursorcount += res;
+    return res;
+}
+
+
 /*
  * etree_stopcursor - Stop the cursor operation
  *
@@ -1215,6 +1553,137 @@ int etree_endappend(etree_t *ep)
 }
 
 
+/*
+ * etree_bulkbuild - Build an empty etree from sorted streams of octants
+ *
+ * - wrapper function; each octant stream is adapted to a btree record 
+ *   stream that converts the addresses to locational keys and counts the
+ *   octants of each level, summed into the etree statistics at the end
+ * - return 0 if OK, -1 otherwise
+ * - ERROR:
+ *
+ *    ET_NOT_WRITABLE
+ *    ET_NOT_NEWTREE
+ *    ET_OP_CONFLICT
+ *    ET_ILLEGAL_FILL
+ *    ET_LEVEL_OOB
+ *    ET_APPEND_OOO
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ *
+ */
+int etree_bulkbuild(etree_t *ep, int nstreams, etree_stream_t *streams[],
+                    void *args[], double fillratio)
+{
+    buildstream_t *bs;
+    btree_stream_t **bstreams;
+    void **bargs;
+    int s, level, res;
+
+    if (((ep->flags & O_RDWR) == 0) &&
+        ((ep->flags & O_WRONLY) == 0)) {
+        ep->error = ET_NOT_WRITABLE;
+        return -1;
+    }
+
+    bs = (buildstream_t *)calloc(nstreams, sizeof(buildstream_t));
+    bstreams = (btree_stream_t **)malloc(nstreams * sizeof(btree_stream_t *));
+    bargs = (void **)malloc(nstreams * sizeof(void *));
+    res = ((bs == NULL) || (bstreams == NULL) || (bargs == NULL)) ? -16 : 0;
+
+    for (s = 0; (s < nstreams) && (res == 0); s++) {
+        bs[s].ep = ep;
+        bs[s].stream = streams[s];
+        bs[s].arg = args[s];
+        bs[s].error = ET_NOERROR;
+        if ((bs[s].key = malloc(ep->keysize)) == NULL) 
+            res = -16;
+
+        bstreams[s] = buildstream;
+        bargs[s] = &bs[s];
+    }
+
+    if (res == 0) 
+        res = btree_bulkbuild(ep->bp, nstreams, bstreams, bargs, fillratio);
+
+    if (res == 0) {
+        for (s = 0; s < nstreams; s++) {
+            for (level = 0; level <= ETREE_MAXLEVEL; level++) {
+                ep->leafcount[level] += bs[s].leafcount[level];
+                ep->indexcount[level] += bs[s].indexcount[level];
+            }
+            ep->appendcount += bs[s].count;
+        }
+        ep->error = ET_NOERROR;
+    } else {
+        switch (res) {
+        case(-1) : ep->error = ET_OP_CONFLICT; break;
+        case(-6) : ep->error = ET_ILLEGAL_FILL; break;
+        case(-8) : ep->error = ET_APPEND_OOO; break;
+        case(-9) : ep->error = ET_IO_ERROR; break;
+        case(-16) : ep->error = ET_NO_MEMORY; break;
+        case(-19) : ep->error = ET_NOT_NEWTREE; break;
+        case(-20) : 
+            /* the first stream that failed tells why */
+            ep->error = ET_IO_ERROR;
+            for (s = 0; s < nstreams; s++) {
+                if (bs[s].error != ET_NOERROR) {
+                    ep->error = bs[s].error;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    if (bs != NULL) {
+        for (s = 0; s < nstreams; s++) 
+            free(bs[s].key);
+    }
+    free(bs);
+    free(bstreams);
+    free(bargs);
+
+    return (res == 0) ? 0 : -1;
+}
+
+
+/*
+ * buildstream - Pass the next octant of an etree stream to the btree
+ *
+ * - called by the build thread of the stream; only touches the stream's 
+ *   own state
+ * - return 1 if an octant is returned, 0 at the end, -1 on error
+ *
+ */
+int buildstream(void *arg, const void **keyptr, const void **valueptr)
+{
+    buildstream_t *bs = (buildstream_t *)arg;
+    etree_addr_t addr;
+    int res;
+
+    if ((res = bs->stream(bs->arg, &addr, valueptr)) != 1) {
+        if (res != 0) 
+            bs->error = ET_IO_ERROR;
+        return (res == 0) ? 0 : -1;
+    }
+
+    if (code_addr2key(bs->ep, addr, bs->key) != 0) {
+        bs->error = ET_LEVEL_OOB;
+        return -1;
+    }
+    *keyptr = bs->key;
+
+    if (addr.type == ETREE_INTERIOR) 
+        bs->indexcount[addr.level]++;
+    else 
+        bs->leafcount[addr.level]++;
+    bs->count++;
+
+    return 1;
+}
+
+
 /*
  * etree_getmaxleaflevel - Return the max leaf level in the etree
  *
@@ -1336,6 +1805,98 @@ int etree_getkeysize(etree_t *ep)
     return ep->keysize;
 }
 
+
+/*
+ * etree_compress - write a compressed copy of an etree file
+ *
+ * - the copy can only be opened O_RDONLY; its pages are decompressed as
+ *   they are read
+ * - return 0 if OK, -1 on error
+ *
+ */
+int etree_compress(const char *srcpath, const char *destpath)
+{
+    etree_t *ep;
+    int res;
+
+    if ((ep = etree_open(srcpath, O_RDONLY, 1, 0, 0)) == NULL) 
+        return -1;
+
+    res = btree_compress(ep->bp, destpath);
+
+    if (etree_close(ep) != 0) 
+        res = -1;
+
+    return res;
+}
+
+
+/*
+ * etree_freeze - write a frozen copy of an etree file
+ *
+ * - the copy keeps the schema, page format, application meta data and 
+ *   octant statistics of the etree; its leaves are full and in key order
+ *   and each index level is contiguous
+ * - the copy can only be opened O_RDONLY; its pages are mapped
+ * - return 0 if OK, -1 on error
+ *
+ */
+int etree_freeze(const char *srcpath, const char *destpath)
+{
+    etree_t *ep, *destep;
+    int level, res;
+
+    if ((ep = etree_open(srcpath, O_RDONLY, 0, 0, 0)) == NULL) 
+        return -1;
+
+    if ((destep = etree_open(destpath, O_CREAT | O_TRUNC | O_RDWR, 0, 
+                             etree_getpayloadsize(ep), ep->dimensions)) 
+        == NULL) {
+        etree_close(ep);
+        return -1;
+    }
+
+    res = (btree_freeze(ep->bp, destep->bp) == 0) ? 0 : -1;
+
+    if (res == 0) {
+        destep->rootlevel = ep->rootlevel;
+        for (level = 0; level <= ETREE_MAXLEVEL; level++) {
+            destep->leafcount[level] = ep->leafcount[level];
+            destep->indexcount[level] = ep->indexcount[level];
+        }
+        if ((ep->appmetasize > 0) && 
+            (etree_setappmeta(destep, ep->appmetadata) != 0)) 
+            res = -1;
+    }
+
+    if (etree_close(destep) != 0) 
+        res = -1;
+    if (etree_close(ep) != 0) 
+        res = -1;
+
+    return res;
+}
+
+
+/*
+ * etree_getbufstat - get the buffer pool and I/O statistics
+ *
+ */
+int etree_getbufstat(etree_t *ep, bufstat_t *stat)
+{
+    return btree_getbufstat(ep->bp, stat);
+}
+
+
+/*
+ * etree_printbufstat - print the buffer pool and I/O statistics as JSON
+ *
+ */
+int etree_printbufstat(etree_t *ep, FILE *fp)
+{
+    return btree_printbufstat(ep->bp, fp);
+}
+
    
 
 
@@ -1705,7 +2266,6 @@ int storeappmeta(etree_t *ep, off_t endoffset)
  */
 int loadappmeta(etree_t *ep)
 {
-    int etreefd;
     off_t endoffset;
 
     ep->appmetadata = (char *)malloc(ep->appmetasize);
@@ -1714,27 +2274,14 @@ int loadappmeta(etree_t *ep)
         return -1;
     }
 
-    etreefd = open(ep->pathname, O_RDONLY);
-    if (etreefd == -1) {
-        fprintf(stderr, "loadappmeta: open etree file\n");
-        return -1;
-    }
-
+    /* read through the btree, which knows where a compressed file keeps 
+       the bytes past its pages */
     endoffset = btree_getendoffset(ep->bp);
-    if (lseek(etreefd, endoffset, SEEK_SET) != endoffset) {
-        fprintf(stderr, "loadappmeta: lseek etree file\n");
-        return -1;
-    }
-
-    if (read(etreefd, ep->appmetadata, ep->appmetasize) != ep->appmetasize) {
+    if (btree_readbytes(ep->bp, ep->appmetadata, ep->appmetasize, 
+                        endoffset) != 0) {
         fprintf(stderr, "loadappmeta: read application meta data\n");
         return -1;
     }
-    
-    if (close(etreefd) != 0) {
-        fprintf(stderr, "loadappmeta: close etree file\n");
-        return -1;
-    }
 
     return 0;
 }
@@ -35,6 +35,87 @@
 #define ETREE_MAXLEVEL	(sizeof(etree_tick_t) * 8 - 1)
 
 
+/**
+ * O_MMAP - Open flag, or'd with O_RDONLY, to serve etree pages directly
+ * out of a shared read-only memory mapping of the etree file rather than
+ * copying them into a private buffer.  The page cache then acts as the
+ * buffer for all the processes reading the same etree.  Ignored for 
+ * writable etrees; falls back to the private buffer if the file cannot be
+ * mapped.
+ */
+#ifndef O_MMAP
+#define O_MMAP 010000000000
+#endif
+
+
+/**
+ * O_2Q - Open flag to have the buffer replace pages with the scan-resistant
+ * 2Q policy instead of LRU.  Pages read only once (such as the leaves
+ * passed over by a cursor scan) are evicted before the pages that are
+ * used repeatedly (the index pages and the hot leaves of point lookups),
+ * so a scan can share the etree handle with queries without flushing
+ * their working set.
+ */
+#ifndef O_2Q
+#define O_2Q 02000000000
+#endif
+
+
+/**
+ * O_PININDEX - Open flag to keep the root and index pages of the etree in
+ * a region of the buffer of its own, as large again as bufsize, whose
+ * pages are never evicted.  The environment variable ETREE_PININDEXSIZE,
+ * if set, sizes the region on its own with a budget in bytes (a K, M or
+ * G suffix is accepted).  A point query then misses on the leaf page at
+ * most.  Memory of the region is only committed as index pages are read.
+ * Has no effect with O_MMAP.
+ */
+#ifndef O_PININDEX
+#define O_PININDEX 01000000000
+#endif
+
+
+/**
+ * O_SHMPOOL - Open flag, or'd with O_RDONLY, to share the buffer with the
+ * other processes of the node that read the same etree file.  The pool is
+ * kept in POSIX shared memory (/dev/shm/etree-*) and outlives the
+ * processes, so the first one warms the pages for all of them; its size
+ * is set by the process that creates it.  A pool left by an older
+ * version of the file (or by a process that died while updating it) is
+ * replaced.  Falls back to a private buffer if the pool cannot be mapped.
+ * Has no effect with O_MMAP.
+ */
+#ifndef O_SHMPOOL
+#define O_SHMPOOL 0400000000
+#endif
+
+
+/**
+ * O_DIRECTIO - Open flag to read and write the pages of the etree with
+ * O_DIRECT, bypassing the kernel page cache.  Meant for scans and builds
+ * that touch each page once and would otherwise evict the cached pages
+ * of other programs.  Reads ahead go straight into the buffer.  Ignored
+ * where the file system refuses O_DIRECT (e.g. tmpfs) and on compressed
+ * etrees.  Has no effect with O_MMAP.
+ */
+#ifndef O_DIRECTIO
+#define O_DIRECTIO 0200000000
+#endif
+
+
+/**
+ * O_CONCURRENT - Open flag to let reader threads query the etree with
+ * etree_concurrentsearch while one thread updates it (etree_insert,
+ * etree_update, etree_sprout, etree_delete, etree_deleterange ...).
+ * Readers latch the B-tree pages shared from the root down and only wait
+ * for the writer where it is changing the pages they pass through.  The
+ * buffer is split into latched shards; O_PININDEX is ignored.
+ */
+#ifndef O_CONCURRENT
+#define O_CONCURRENT 04000000000
+#endif
+
+
 /**
  * ETREE_MAXBUF - Maximum size (in bytes) for a buffer
  * passed to the etree_straddr function.
@@ -159,6 +240,8 @@ typedef enum {
     ET_CONTAIN_INTERIOR,     /* Contain interior nodes               */
     ET_TOO_BIG,              /* Larger than etree address space      */
     ET_NOT_ALIGNED,          /* Left-lower corner not aligned        */
+    ET_DISALLOW_FORMAT,      /* Cannot set the format of this etree  */
+    ET_UNKNOWN_FORMAT,       /* Unknown etree page format            */
 
 } etree_error_t;
 
@@ -255,9 +338,20 @@ const char* etree_strerror(etree_error_t error);
  * @param flags specifies the mode in which to open an etree file.
  *     It is one of O_RDONLY or O_RDWR.
  *     Flags may also be bitwise-or'd with O_CREAT or O_TRUNC. The
- *     semantics are the same as that in UNIX
+ *     semantics are the same as that in UNIX.  O_RDONLY may be or'd with
+ *     O_MMAP to map the etree file instead of reading its pages. O_2Q
+ *     selects the 2Q page replacement policy for the buffer; O_PININDEX
+ *     keeps the index pages resident; O_SHMPOOL shares the buffer of an
+ *     O_RDONLY etree with other processes; O_DIRECTIO bypasses the
+ *     kernel page cache; O_CONCURRENT lets reader threads search the 
+ *     etree while it is updated.
  * @param bufsize specifies the size of the internal buffer allocated to cache
- *     etree pages.  The size is specified in megabytes.
+ *     etree pages.  The size is specified in megabytes.  The environment
+ *     variable ETREE_BUFFERSIZE, if set, overrides it with a budget in
+ *     bytes (a K, M or G suffix is accepted, e.g. ETREE_BUFFERSIZE=8G).
+ *     Buffer memory is committed as pages are cached and is backed by
+ *     transparent huge pages where available (explicit ones if
+ *     ETREE_HUGETLB is set).
  * @param payloadsize: The size of the associated octant data (i.e.,
  *     record).  This parameter is only used to created a new etree
  *     database (i.e., O_CREAT, O_TRUNC was specified), otherwise it is
@@ -288,6 +382,61 @@ etree_t *etree_open(const char *path, int32_t flags, int32_t bufsize,
 int etree_registerschema(etree_t *ep, const char *defstring);
 
 
+/**
+ * ETREE_SEARCHINDEX - Page format flag: every page keeps a dense array of
+ * every 16th key at its end, so a search reads a couple of cache lines
+ * before it probes a block of 16 entries.  Costs about 3% of the page
+ * capacity.  Etrees in this format cannot be read by older libraries.
+ */
+#define ETREE_SEARCHINDEX BTREE_SEARCHINDEX
+
+/**
+ * ETREE_PREFIXKEYS - Page format flag: the key bytes shared by all the
+ * entries of a page (the level and the high order coordinate bits of
+ * neighboring octants) are stored once per page, so that a page holds
+ * more entries and the index is shallower.  Cannot be combined with
+ * ETREE_SEARCHINDEX.  Etrees in this format cannot be read by older
+ * libraries.
+ */
+#define ETREE_PREFIXKEYS BTREE_PREFIXKEYS
+
+/**
+ * ETREE_FROZEN - Page format flag recorded by etree_freeze: the leaves
+ * are full and in key order, each index level is contiguous, and the
+ * etree can only be opened O_RDONLY.  Cannot be selected with 
+ * etree_setformat.
+ */
+#define ETREE_FROZEN BTREE_FROZEN
+
+/**
+ * ETREE_COLUMNS - Page format flag: a leaf page keeps its keys together 
+ * and each field of the schema in a contiguous run of its own, so that
+ * searches and scans that ask for one field (say "Vs") read that field 
+ * and the keys only.  Cannot be combined with ETREE_PREFIXKEYS.  Etrees
+ * in this format cannot be read by older libraries.
+ */
+#define ETREE_COLUMNS BTREE_COLUMNS
+
+/**
+ * etree_setformat - select the page format of a new etree
+ *
+ * The format can only be set when the etree is either newly created or
+ * truncated, before any insertion/appending operation
+ *
+ * @param format 0 for the original format, ETREE_SEARCHINDEX,
+ *               ETREE_PREFIXKEYS or ETREE_COLUMNS (alone or with 
+ *               ETREE_SEARCHINDEX)
+ *
+ * return 0 if OK, -1 on error
+ *
+ * - ERROR:
+ *   ET_DISALLOW_FORMAT
+ *   ET_UNKNOWN_FORMAT
+ * 
+ */
+int etree_setformat(etree_t *ep, uint32_t format);
+
+
 /**
  * etree_getschema - get the ASCII schema definition string
  *
@@ -364,6 +513,32 @@ int etree_insert(etree_t *ep, etree_addr_t addr, const void *payload);
  */
 int etree_delete(etree_t *ep, etree_addr_t addr);
 
+/**
+ * etree_deleterange - Delete the octants from start up to but excluding
+ * stop.  The B-tree pages between the two ends are dropped in one pass
+ * and reused by later insertions, rather than emptied octant by octant.
+ *
+ * - Lazy method: the pages at either end of the range are not merged
+ *
+ * @param ep handle to the etree from where the octants are to be deleted.
+ * @param start the first octant to delete; NULL for the first octant of
+ *     the etree.
+ * @param stop the first octant past the range, which is kept; NULL to 
+ *     delete to the end of the etree.
+ *
+ * @return 0 if OK (including an empty range), -1 otherwise.
+ *
+ * - ERRORS:
+ *
+ *    ET_LEVEL_OOB
+ *    ET_OP_CONFLICT
+ *    ET_EMPTY_TREE
+ *    ET_IO_ERROR
+ *    ET_NOT_WRITABLE
+ */
+int etree_deleterange(etree_t *ep, const etree_addr_t *start,
+                      const etree_addr_t *stop);
+
 /**
  * etree_update - Modify the content/payload of an octant in the etree
  *
@@ -488,6 +663,49 @@ int etree_append(etree_t *ep, etree_addr_t addr, const void *payload);
  */
 int etree_endappend(etree_t *ep);
 
+/**
+ * etree_stream_t - a sorted stream of octants for etree_bulkbuild.  The
+ * routine stores the address of the next octant in *addr and a pointer
+ * to its payload (valid until the next call) in *payloadptr.
+ *
+ * @return 1 if an octant is returned, 0 at the end of the stream, -1 on
+ *     error.
+ */
+typedef int etree_stream_t(void *arg, etree_addr_t *addr, 
+                           const void **payloadptr);
+
+/**
+ * etree_bulkbuild - Build an empty etree from one or more streams of
+ * octants in locational code order.  The streams partition the octants
+ * in order: every octant of stream i precedes the octants of stream 
+ * i + 1.  Each stream is packed into leaf pages by its own thread and 
+ * the pages are written with large sequential writes; the index levels 
+ * are then built bottom-up.  This is much faster than appending the 
+ * octants one by one.  On failure the etree is left empty.
+ *
+ * @param ep handle of a newly created or truncated etree.
+ * @param nstreams number of streams.
+ * @param streams the stream routine of each stream.
+ * @param args the argument passed to the routine of each stream.
+ * @param fillratio the fraction of each page to fill, as in 
+ *      etree_beginappend.
+ *
+ * @return 0 if OK, -1 on error.
+ *
+ * - ERROR:
+ *
+ *    ET_NOT_WRITABLE
+ *    ET_NOT_NEWTREE
+ *    ET_OP_CONFLICT
+ *    ET_ILLEGAL_FILL
+ *    ET_LEVEL_OOB
+ *    ET_APPEND_OOO
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ */
+int etree_bulkbuild(etree_t *ep, int nstreams, etree_stream_t *streams[],
+                    void *args[], double fillratio);
+
 
 /*
  * Searching for octants
@@ -537,6 +755,34 @@ int etree_endappend(etree_t *ep);
 int etree_search(etree_t *ep, etree_addr_t addr, etree_addr_t *hitaddr, 
                  const char *fieldname, void *payload);
 
+/**
+ * etree_concurrentsearch - Search for an octant on behalf of one of the
+ * reader threads of an etree opened with O_CONCURRENT.
+ *
+ * Same as etree_search, but may be called by any number of threads while
+ * one thread updates the etree through the other routines of the handle.
+ * Each search sees every B-tree page either before or after a change of
+ * the writer.  The error is not recorded in the handle, which the
+ * threads share, but in *errorptr.
+ *
+ * @param ep handle to the etree opened with O_CONCURRENT.
+ * @param addr address of the octant for which to search.
+ * @param hitaddr output parameter receiving the address of the found
+ *      octant, with its type.
+ * @param fieldname name of the field of interest.
+ * @param payload output parameter receiving the data of the found octant.
+ * @param errorptr output parameter receiving the error code of a failed
+ *      search (ET_NOERROR on success); may be NULL.
+ *
+ * @return 0 if found, -1 if not found.
+ *
+ * - ERROR: as etree_search
+ *
+ */
+int etree_concurrentsearch(etree_t *ep, etree_addr_t addr, 
+                           etree_addr_t *hitaddr, const char *fieldname,
+                           void *payload, etree_error_t *errorptr);
+
 /**
  * etree_findneigbhor - Search for a neighbor in the etree database
  *
@@ -600,6 +846,58 @@ int etree_findneighbor(etree_t *ep, etree_addr_t addr, etree_dir_t dir,
 int etree_initcursor(etree_t *ep, etree_addr_t addr);
 
 
+/**
+ * etree_partition - Split the etree into at most nparts ranges holding
+ * about the same number of octants, for scans that run in parallel.
+ * Range i runs from octant bounds[i - 1] up to but excluding octant 
+ * bounds[i]; the first range starts at the first octant and the last 
+ * one runs to the end of the etree.  The boundaries are taken from the 
+ * index pages near the root, so the call costs a few page reads.
+ *
+ * @param ep handle to the etree to partition.
+ * @param nparts the number of ranges wanted.
+ * @param bounds array of at least nparts - 1 octant addresses; output
+ *     parameter.
+ *
+ * @return the number of ranges (possibly fewer than nparts for a small
+ *     etree), -1 on error.
+ *
+ * - ERRORS:
+ *
+ *    ET_EMPTY_TREE
+ *    ET_LEVEL_OOB2
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ */
+int etree_partition(etree_t *ep, int nparts, etree_addr_t bounds[]);
+
+/**
+ * etree_initrangecursor - Set the cursor on the first octant not before
+ * start, for a preorder traversal that ends before octant stop.  Each
+ * range of etree_partition can be scanned by its own thread, with a
+ * range cursor on an etree handle of its own.
+ *
+ * @param ep handle to the etree where the traversal is to be performed.
+ * @param start the first octant of the range; NULL for the first octant
+ *     of the etree.
+ * @param stop the first octant past the range; NULL to run to the end
+ *     of the etree.
+ *
+ * @return 0 if OK, -1 on error.
+ *
+ * - ERRORS:
+ *
+ *    ET_LEVEL_OOB
+ *    ET_EMPTY_TREE
+ *    ET_END_OF_TREE (no octant in the range)
+ *    ET_OP_CONFLICT
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ */
+int etree_initrangecursor(etree_t *ep, const etree_addr_t *start, 
+                          const etree_addr_t *stop);
+
+
 /**
  * etree_getcursor - Obtain the content of the octant currently pointed to
  *                   by the cursor
@@ -644,6 +942,34 @@ int etree_getcursor(etree_t *ep, etree_addr_t *addr, const char *fieldname,
  */
 int etree_advcursor(etree_t *ep);
 
+/**
+ * etree_getcursorbatch - Obtain up to max octants starting at the cursor,
+ * as far as the end of the current leaf page, and move the cursor past 
+ * them.  Replaces a loop of etree_getcursor and etree_advcursor calls.
+ *
+ * @param ep handle to the etree where the traversal is performed.
+ * @param max maximum number of octants to return.
+ * @param addrs array of at least max octant addresses; output parameter.
+ * @param fieldname name of the field of interest, "*" or NULL for all.
+ * @param payloads array of at least max pointers to where each octant's 
+ *     payload (or field) is stored; NULL to skip the payloads.
+ *
+ * @return the number of octants returned, 0 once the cursor has passed 
+ *     the last octant (ET_END_OF_TREE), -1 on error.
+ *
+ * - ERROR:
+ *
+ *    ET_NO_CURSOR
+ *    ET_END_OF_TREE
+ *    ET_LEVEL_OOB2
+ *    ET_NO_SCHEMA
+ *    ET_NO_FIELD
+ *    ET_NO_MEMORY
+ *    ET_IO_ERROR
+ */
+int etree_getcursorbatch(etree_t *ep, int max, etree_addr_t addrs[], 
+                         const char *fieldname, void *payloads[]);
+
 /**
  * etree_stopcursor - Stop the cursor operation
  *
@@ -776,5 +1102,65 @@ int etree_getkeysize(etree_t *ep);
 uint64_t etree_gettotalcount(etree_t *ep);
 
 
+/**
+ * Write a compressed copy of an etree file.
+ *
+ * Every page of the etree is compressed on its own with a codec built
+ * into libetree, and a page-location table maps the pages to their
+ * compressed extents.  etree_open recognizes a compressed file; it can
+ * only be opened O_RDONLY, and its pages are decompressed into the buffer
+ * as they are read.
+ *
+ * @param srcpath   the etree file to compress.
+ * @param destpath  the compressed etree file to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int etree_compress(const char *srcpath, const char *destpath);
+
+
+/**
+ * Write a frozen copy of an etree file.
+ *
+ * The octants are rebuilt bottom-up into full leaves laid out in key
+ * order, followed by the index pages, level by level.  The copy keeps
+ * the schema, page format and application meta data of the etree.
+ * etree_open recognizes a frozen file; it can only be opened O_RDONLY,
+ * and its pages are served from a read-only map of the file (as with
+ * O_MMAP) rather than copied into the buffer.
+ *
+ * @param srcpath   the etree file to freeze.
+ * @param destpath  the frozen etree file to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int etree_freeze(const char *srcpath, const char *destpath);
+
+
+/**
+ * Get the buffer pool and I/O statistics of the etree handle.
+ *
+ * Counts fix requests, hits and misses per page type (index, leaf),
+ * evictions, dirty writebacks, bytes read and written and the latency
+ * histograms of the reads and writes, since the etree was opened.
+ *
+ * @param ep    etree handle.
+ * @param stat  where to store the statistics (see bufstat.h).
+ *
+ * @return 0 on success.
+ */
+int etree_getbufstat(etree_t *ep, bufstat_t *stat);
+
+/**
+ * Print the buffer pool and I/O statistics as a JSON object.
+ *
+ * @param ep    etree handle.
+ * @param fp    output stream.
+ *
+ * @return 0 on success.
+ */
+int etree_printbufstat(etree_t *ep, FILE *fp);
+
+
 #endif /* ETREE_H */
 
@@ -0,0 +1,246 @@
+/*
+ * zpage.c - self-contained LZ77 codec for compressed etree pages
+ *
+ * Copyright (c) 2003 Tiankai Tu
+ * All rights reserved.  May not be used, modified, or copied
+ * without permission.
+ *
+ * Tiankai Tu
+ * Computer Science Department
+ * Carnegie Mellon University
+ * 5000 Forbes Avenue
+ * Pittsburgh, PA 15213
+ * tutk@cs.cmu.edu
+ *
+ */
+
+#include <string.h>
+
+#ifdef ALPHA
+#include "etree_inttypes.h"
+#else
+#include <inttypes.h>
+#endif
+
+#include "zpage.h"
+
+/*
+ * The compressed stream is a sequence of (literals, match) pairs, each
+ * introduced by a token byte:
+ *
+ * - the high nibble is the literal count, the low nibble the match length
+ *   minus MINMATCH; a nibble of 15 is followed by bytes of 255 and a last
+ *   byte below 255 that are added to it
+ * - the literals follow the literal count, then the match offset (2
+ *   bytes, little-endian, 1 to MAXOFFSET back in the output), then the
+ *   extra bytes of the match length
+ * - the last pair has literals only: the stream ends after them
+ *
+ * Sorted keys that share long prefixes and payloads repeated by
+ * neighboring octants show up as matches one or a few entries back.
+ *
+ */
+#define MINMATCH    4
+#define MAXOFFSET   65535
+#define HASHBITS    12
+
+static uint32_t read32(const unsigned char *ptr);
+static uint32_t hashof(uint32_t word);
+static unsigned char *putcount(unsigned char *op, unsigned char *oend,
+                               size_t count);
+
+
+/*
+ * zpage_compress - compress srcsize bytes at src into dest
+ *
+ * - return the compressed size, -1 if it would exceed destcapacity (the
+ *   caller then keeps the data uncompressed)
+ *
+ */
+int zpage_compress(const void *src, size_t srcsize, void *dest,
+                   size_t destcapacity)
+{
+    const unsigned char *ibase = (const unsigned char *)src;
+    const unsigned char *ip = ibase, *anchor = ibase;
+    const unsigned char *iend = ibase + srcsize;
+    unsigned char *op = (unsigned char *)dest;
+    unsigned char *oend = op + destcapacity;
+    uint32_t table[1 << HASHBITS];     /* position + 1, 0 if empty */
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + MINMATCH <= iend) {
+        uint32_t h = hashof(read32(ip)), slot = table[h];
+        const unsigned char *ref = ibase + ((slot > 0) ? slot - 1 : 0);
+        size_t litcount, matchlen;
+        unsigned char *token;
+
+        table[h] = (uint32_t)(ip - ibase) + 1;
+        if ((slot == 0) || (ip - ref > MAXOFFSET) ||
+            (read32(ref) != read32(ip))) {
+            ip++;
+            continue;
+        }
+
+        matchlen = MINMATCH;
+        while ((ip + matchlen < iend) && (ref[matchlen] == ip[matchlen]))
+            matchlen++;
+
+        /* emit the pending literals and the match */
+        litcount = ip - anchor;
+        if ((token = op++) >= oend)
+            return -1;
+        *token = (unsigned char)(((litcount < 15) ? litcount : 15) << 4);
+        *token |= (unsigned char)((matchlen - MINMATCH < 15) ?
+                                  matchlen - MINMATCH : 15);
+        if ((litcount >= 15) &&
+            ((op = putcount(op, oend, litcount - 15)) == NULL))
+            return -1;
+        if (op + litcount + 2 > oend)
+            return -1;
+        memcpy(op, anchor, litcount);
+        op += litcount;
+        *op++ = (unsigned char)((ip - ref) & 0xff);
+        *op++ = (unsigned char)((ip - ref) >> 8);
+        if ((matchlen - MINMATCH >= 15) &&
+            ((op = putcount(op, oend, matchlen - MINMATCH - 15)) == NULL))
+            return -1;
+
+        ip += matchlen;
+        anchor = ip;
+    }
+
+    /* the trailing literals */
+    {
+        size_t litcount = iend - anchor;
+
+        if (op >= oend)
+            return -1;
+        *op++ = (unsigned char)(((litcount < 15) ? litcount : 15) << 4);
+        if ((litcount >= 15) &&
+            ((op = putcount(op, oend, litcount - 15)) == NULL))
+            return -1;
+        if (op + litcount > oend)
+            return -1;
+        memcpy(op, anchor, litcount);
+        op += litcount;
+    }
+
+    return (int)(op - (unsigned char *)dest);
+}
+
+
+/*
+ * zpage_decompress - decompress srcsize bytes at src into exactly
+ *                    destsize bytes at dest
+ *
+ * - every count and offset is checked against the buffers, so a damaged
+ *   extent cannot write outside dest
+ * - return 0 if OK, -1 if the stream is damaged
+ *
+ */
+int zpage_decompress(const void *src, size_t srcsize, void *dest,
+                     size_t destsize)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + srcsize;
+    unsigned char *obase = (unsigned char *)dest, *op = obase;
+    unsigned char *oend = obase + destsize;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t litcount = token >> 4, matchlen = token & 15, offset;
+
+        if (litcount == 15) {
+            unsigned char more;
+
+            do {
+                if (ip >= iend)
+                    return -1;
+                more = *ip++;
+                litcount += more;
+            } while (more == 255);
+        }
+        if ((litcount > (size_t)(iend - ip)) ||
+            (litcount > (size_t)(oend - op)))
+            return -1;
+        memcpy(op, ip, litcount);
+        op += litcount;
+        ip += litcount;
+
+        if (ip == iend)
+            /* the last pair has no match */
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (matchlen == 15) {
+            unsigned char more;
+
+            do {
+                if (ip >= iend)
+                    return -1;
+                more = *ip++;
+                matchlen += more;
+            } while (more == 255);
+        }
+        matchlen += MINMATCH;
+        if ((offset == 0) || (offset > (size_t)(op - obase)) ||
+            (matchlen > (size_t)(oend - op)))
+            return -1;
+
+        /* the match may overlap the bytes it produces */
+        while (matchlen-- > 0) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+
+    return (op == oend) ? 0 : -1;
+}
+
+
+/*
+ * read32 - load 4 (possibly unaligned) bytes
+ *
+ */
+uint32_t read32(const unsigned char *ptr)
+{
+    uint32_t word;
+
+    memcpy(&word, ptr, 4);
+    return word;
+}
+
+
+/*
+ * hashof - multiplicative hash of 4 bytes into HASHBITS bits
+ *
+ */
+uint32_t hashof(uint32_t word)
+{
+    return (word * 2654435761U) >> (32 - HASHBITS);
+}
+
+
+/*
+ * putcount - write the extra bytes of a literal count or match length
+ *
+ * - return the new output position, NULL if out of room
+ *
+ */
+unsigned char *putcount(unsigned char *op, unsigned char *oend, size_t count)
+{
+    while (count >= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+        count -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (unsigned char)count;
+    return op;
+}
@@ -0,0 +1,27 @@
+/*
+ * zpage.h - self-contained LZ77 codec for compressed etree pages
+ *
+ * Copyright (c) 2003 Tiankai Tu
+ * All rights reserved.  May not be used, modified, or copied
+ * without permission.
+ *
+ * Tiankai Tu
+ * Computer Science Department
+ * Carnegie Mellon University
+ * 5000 Forbes Avenue
+ * Pittsburgh, PA 15213
+ * tutk@cs.cmu.edu
+ *
+ */
+
+#ifndef ZPAGE_H
+#define ZPAGE_H
+
+#include <sys/types.h>
+
+int zpage_compress(const void *src, size_t srcsize, void *dest,
+                   size_t destcapacity);
+int zpage_decompress(const void *src, size_t srcsize, void *dest,
+                     size_t destsize);
+
+#endif /* ZPAGE_H */
@@ -95,7 +95,7 @@ int main(int argc, char **argv)
 
     /* Openning files */
 
-    meshEp = etree_open(meshetree, O_RDONLY, CVMBUFFERSIZE, 0, 0);
+    meshEp = etree_open(meshetree, O_RDONLY | O_MMAP, CVMBUFFERSIZE, 0, 0);
     if (!meshEp) {
         fprintf(stderr, "Cannot open mesh etree %s\n", meshetree);
         exit(1);
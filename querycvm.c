@@ -16,6 +16,7 @@
  */
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 
 #include "etree.h"
 #include "cvm.h"
@@ -29,9 +30,18 @@ int main(int argc, char **argv)
     double east_m, north_m, depth_m;
     cvmpayload_t rawElem;
     int res;
+    int printstat = 0;
+
+    if ((argc > 1) && (strcmp(argv[1], "-s") == 0)) {
+        /* print the buffer statistics (JSON) to stderr on exit */
+        printstat = 1;
+        argc--;
+        argv++;
+    }
 
     if (argc != 4) {
-        printf("\nusage: querycvm east_m north_m depth_m\n\n");
+        printf("\nusage: querycvm [-s] east_m north_m depth_m\n");
+        printf("-s: print buffer and I/O statistics (JSON) to stderr\n\n");
         exit(1);
     }
     sscanf(argv[1], "%lf", &east_m);
@@ -45,7 +55,7 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    cvmEp = etree_open(cvmetree, O_RDONLY, CVMBUFFERSIZE, 0, 0);
+    cvmEp = etree_open(cvmetree, O_RDONLY | O_MMAP, CVMBUFFERSIZE, 0, 0);
     if (!cvmEp) {
         fprintf(stderr, "Cannot open CVM material database %s\n", cvmetree);
         exit(1);
@@ -66,6 +76,8 @@ int main(int argc, char **argv)
         printf("\n"); */
     }
 
+    if (printstat) 
+        etree_printbufstat(cvmEp, stderr);
     etree_close(cvmEp);
 
     return 0;
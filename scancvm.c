@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "etree.h"
 #include "cvm.h"
@@ -25,53 +26,122 @@
 
 #define KEYSIZE 13
 
+/* buffer size (MB) of a -d scan */
+#define DIRECTBUFSIZE 64
+
+/* most threads of a -p scan */
+#define MAXSCANNERS 256
+
+/*
+ * scanner_t - one range of the database, scanned with a handle of its own
+ *
+ */
+typedef struct scanner_t {
+    etree_t *ep;
+    const void *startkey, *stopkey;   /* NULL for an open end */
+    int64_t count;
+    int res;
+} scanner_t;
+
+static void *scanrange(void *arg);
+
+
 int main(int argc, char **argv)
 {
     char * cvmetree;
-    etree_t *cvmEp;
-    cvmpayload_t rawElem;
     int64_t totalcount;
-    int32_t mycount;
     struct timeval starttime, endtime;
     int scantime;
+    int printstat = 0;
+    int openflags = O_RDONLY | O_MMAP, bufsize = 0;
+    int nscanners = 1, nparts, part;
+    scanner_t scanners[MAXSCANNERS];
+    pthread_t threads[MAXSCANNERS];
+    char bounds[(MAXSCANNERS - 1) * KEYSIZE];
+
+    while (argc > 1) {
+        if (strcmp(argv[1], "-s") == 0) {
+            /* print the buffer statistics (JSON) to stderr on exit */
+            printstat = 1;
+        } else if (strcmp(argv[1], "-d") == 0) {
+            /* read around the page cache through a buffer of our own */
+            openflags = O_RDONLY | O_DIRECTIO;
+            bufsize = DIRECTBUFSIZE;
+        } else if ((strcmp(argv[1], "-p") == 0) && (argc > 2)) {
+            /* scan key ranges in parallel */
+            nscanners = atoi(argv[2]);
+            if ((nscanners < 1) || (nscanners > MAXSCANNERS)) {
+                fprintf(stderr, "-p takes 1 to %d threads\n", MAXSCANNERS);
+                exit(1);
+            }
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
 
     if (argc != 2) {
-        printf("\nusage: scancvm cvmetree\n");
+        printf("\nusage: scancvm [-s] [-d] [-p threads] cvmetree\n");
+        printf("-s: print buffer and I/O statistics (JSON) to stderr\n");
+        printf("-d: bypass the kernel page cache (O_DIRECT) instead of mmap\n");
+        printf("-p: scan that many key ranges in parallel\n");
         exit(1);
     }
 
+    /* every thread gets a handle of its own */
     cvmetree = argv[1];
-    cvmEp = etree_open(cvmetree, O_RDONLY, 0, 0, 0);
-    if (!cvmEp) {
-        fprintf(stderr, "Cannot open CVM material database %s\n", cvmetree);
-        exit(1);
+    for (part = 0; part < nscanners; part++) {
+        scanners[part].ep = etree_open(cvmetree, openflags, bufsize, 0, 0);
+        if (!scanners[part].ep) {
+            fprintf(stderr, "Cannot open CVM material database %s\n", 
+                    cvmetree);
+            exit(1);
+        }
     }
 
     /* go through all the records stored in the underlying btree */
     totalcount = 0;
-    mycount = 0;
-    memset(cvmEp->key, 0, KEYSIZE);
 
     gettimeofday(&starttime, NULL);
 
-    if (btree_initcursor(cvmEp->bp, cvmEp->key) != 0) {
-        fprintf(stderr, "Cannot set cursor in the underlying database\n");
+    nparts = btree_partition(scanners[0].ep->bp, nscanners, bounds);
+    if (nparts < 0) {
+        fprintf(stderr, "Cannot partition the underlying database\n");
         exit(1);
     }
 
-    do {
-        if (btree_getcursor(cvmEp->bp, cvmEp->hitkey, "*", &rawElem) != 0) {
+    for (part = 0; part < nparts; part++) {
+        scanners[part].startkey = 
+            (part == 0) ? NULL : bounds + (part - 1) * KEYSIZE;
+        scanners[part].stopkey = 
+            (part == nparts - 1) ? NULL : bounds + part * KEYSIZE;
+        scanners[part].count = 0;
+    }
+
+    if (nparts == 1) 
+        scanrange(&scanners[0]);
+    else {
+        for (part = 0; part < nparts; part++) {
+            if (pthread_create(&threads[part], NULL, scanrange, 
+                               &scanners[part]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (part = 0; part < nparts; part++) 
+            pthread_join(threads[part], NULL);
+    }
+
+    for (part = 0; part < nparts; part++) {
+        if (scanners[part].res != 0) {
             fprintf(stderr, "Read cursor error\n");
             exit(1);
-        } 
-        
-        totalcount++;
-        mycount++;
-        if (mycount == 1000000) {
-            fprintf(stderr, "1 million records scanned\n");
-            mycount = 0;
         }
-    } while (btree_advcursor(cvmEp->bp) == 0);
+        totalcount += scanners[part].count;
+    }
     
     gettimeofday(&endtime, NULL);
 
@@ -79,11 +149,54 @@ int main(int argc, char **argv)
     printf("Scanned the CVM database in %d seconds\n", scantime);
     printf("Scanned %qd octants\n", totalcount);
  
-    etree_close(cvmEp);
+    for (part = 0; part < nscanners; part++) {
+        if (printstat) 
+            etree_printbufstat(scanners[part].ep, stderr);
+        etree_close(scanners[part].ep);
+    }
 
     return 0;
 }
 
-            
-    
 
+/*
+ * scanrange - go through the records of one key range
+ *
+ */
+void *scanrange(void *arg)
+{
+    scanner_t *scanner = (scanner_t *)arg;
+    etree_t *cvmEp = scanner->ep;
+    cvmpayload_t rawElem;
+    int32_t mycount = 0;
+    int res;
+
+    scanner->res = 0;
+
+    res = btree_initrangecursor(cvmEp->bp, scanner->startkey, 
+                                scanner->stopkey);
+    if (res == 1) 
+        /* no record in the range */
+        return NULL;
+    if (res != 0) {
+        fprintf(stderr, "Cannot set cursor in the underlying database\n");
+        scanner->res = -1;
+        return NULL;
+    }
+
+    do {
+        if (btree_getcursor(cvmEp->bp, cvmEp->hitkey, "*", &rawElem) != 0) {
+            scanner->res = -1;
+            return NULL;
+        } 
+        
+        scanner->count++;
+        mycount++;
+        if (mycount == 1000000) {
+            fprintf(stderr, "1 million records scanned\n");
+            mycount = 0;
+        }
+    } while (btree_advcursor(cvmEp->bp) == 0);
+
+    return NULL;
+}